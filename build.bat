@@ -7,8 +7,41 @@ SET OPENCL_ROOT=C:\CUDA_v10.0
 cl /nologo /utf-8 /Zi ^
     /I%SDL_ROOT%\include /DSDL_MAIN_HANDLED ^
     /I%OPENCL_ROOT%\include ^
-    .\ray_trace.c .\soft_render.c .\cl_render.c .\common.c ^
+    .\ray_trace.c .\soft_render.c .\soft_render_simd.c .\cl_render.c .\cl_program_cache.c .\common.c .\scene.c .\scene_file.c .\dirty_region.c .\tile_bin.c .\profiler.c .\hybrid_render.c .\cl_multi_render.c .\thread_pool.c ^
     /link ^
     /LIBPATH:%SDL_ROOT%\lib\x64 SDL2.lib ^
     /LIBPATH:%OPENCL_ROOT%\lib\x64 OpenCL.lib ^
     /OUT:ray_trace.exe
+
+cl /nologo /utf-8 /Zi ^
+    /I%OPENCL_ROOT%\include ^
+    .\ray_bench.c .\soft_render.c .\soft_render_simd.c .\cl_render.c .\cl_program_cache.c .\common.c .\scene.c .\scene_file.c .\dirty_region.c .\tile_bin.c .\profiler.c .\hybrid_render.c .\cl_multi_render.c .\thread_pool.c ^
+    /link ^
+    /LIBPATH:%OPENCL_ROOT%\lib\x64 OpenCL.lib ^
+    /OUT:ray_bench.exe
+
+cl /nologo /utf-8 /Zi ^
+    /I%OPENCL_ROOT%\include ^
+    .\ray_farm.c .\soft_render.c .\soft_render_simd.c .\cl_render.c .\cl_program_cache.c .\common.c .\scene.c .\scene_file.c .\dirty_region.c .\tile_bin.c .\profiler.c .\thread_pool.c ^
+    /link ^
+    /LIBPATH:%OPENCL_ROOT%\lib\x64 OpenCL.lib ws2_32.lib ^
+    /OUT:ray_farm.exe
+
+cl /nologo /utf-8 /Zi ^
+    /I%OPENCL_ROOT%\include ^
+    .\ray_tile.c .\soft_render.c .\soft_render_simd.c .\cl_render.c .\cl_program_cache.c .\common.c .\scene.c .\scene_file.c .\dirty_region.c .\tile_bin.c .\profiler.c .\thread_pool.c ^
+    /link ^
+    /LIBPATH:%OPENCL_ROOT%\lib\x64 OpenCL.lib ^
+    /OUT:ray_tile.exe
+
+cl /nologo /utf-8 /Zi ^
+    /I%OPENCL_ROOT%\include ^
+    .\ray_anim.c .\soft_render.c .\soft_render_simd.c .\cl_render.c .\cl_program_cache.c .\common.c .\scene.c .\scene_file.c .\dirty_region.c .\tile_bin.c .\profiler.c .\hybrid_render.c .\cl_multi_render.c .\thread_pool.c ^
+    /link ^
+    /LIBPATH:%OPENCL_ROOT%\lib\x64 OpenCL.lib ^
+    /OUT:ray_anim.exe
+
+cl /nologo /utf-8 /Zi ^
+    .\scene_convert.c .\common.c .\scene.c .\scene_file.c ^
+    /link ^
+    /OUT:scene_convert.exe
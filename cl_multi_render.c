@@ -0,0 +1,839 @@
+#include "common.h"
+#include "render.h"
+#include "cl_program_cache.h"
+#include "profiler.h"
+#include "thread_compat.h"
+
+#include <CL/cl.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* 多设备渲染: 每个可用的 OpenCL 设备 (不限类型) 各有独立的 context、队列、program 和场景数据，
+ * 每帧把画面切成 CL_MULTI_TILE_SIZE 的 tile，各设备由一个 host 线程驱动，从共享的计数器领取下一个 tile，
+ * 快的设备自然领到更多 tile。每个设备保持两个 tile 在途: 等待上一个 tile 读回时下一个 tile 已经入队
+ */
+
+/* tile 边长为 RENDER_MAX_PIXEL_STEP 的整数倍，预览的像素块不会跨过 tile */
+#define CL_MULTI_TILE_SIZE 128
+
+typedef struct cl_multi_device
+{
+    cl_platform_id platform;
+    cl_device_id device;
+    char name[128];
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel;
+
+    cl_mem camera_buffer;
+    cl_mem spheres_buffer;
+    cl_mem nodes_buffer;
+    cl_mem canvas_image;
+    int canvas_width;
+    int canvas_height;
+    /* 由各设备的线程在帧开始时处理 */
+    unsigned int dirty_flags;
+    int args_dirty;
+
+    /* 最近一帧的统计 */
+    int tile_count;
+    uint64_t busy_ns;
+    int failed;
+} cl_multi_device_t;
+
+typedef struct cl_multi_job
+{
+    uint8_t *pixel;
+    int w;
+    int h;
+    int pitch;
+    int tile_cols;
+    int tile_count;
+    int next_tile;
+    /* 失败的设备交还的 tile，优先领取; 每个设备每帧最多失败一次 */
+    int retry_tiles[RENDER_MAX_CL_DEVICES];
+    int retry_count;
+    /* 仍在领取 tile 的设备数，以及其中没有 tile 可领、正在等待的设备数 */
+    int working_count;
+    int idle_count;
+} cl_multi_job_t;
+
+struct cl_multi_global
+{
+    cl_multi_device_t devices[RENDER_MAX_CL_DEVICES];
+    int device_count;
+    /* 只有前 active_count 个设备参与渲染，用于测量随设备数的扩展 */
+    int active_count;
+
+    char *ocl_source;
+    size_t ocl_source_len;
+    render_options_t options;
+
+    const scene_t *scene;
+    project_camera_t camera;
+    int pixel_step;
+
+    /* 0 号设备由调用者的线程驱动，其余设备各有一个线程 */
+    thread_handle_t threads[RENDER_MAX_CL_DEVICES];
+    thread_mutex_t mutex;
+    thread_cond_t start_cond;
+    thread_cond_t done_cond;
+    thread_cond_t tile_cond;
+    unsigned frame_id;
+    int running_workers;
+    int quit;
+    cl_multi_job_t job;
+
+    uint64_t frame_ns;
+} g_cl_multi;
+
+/********************************************************************************/
+
+static
+void release_device(cl_multi_device_t *dev)
+{
+    if (dev->canvas_image != NULL)
+    {
+        clReleaseMemObject(dev->canvas_image);
+    }
+    if (dev->nodes_buffer != NULL)
+    {
+        clReleaseMemObject(dev->nodes_buffer);
+    }
+    if (dev->spheres_buffer != NULL)
+    {
+        clReleaseMemObject(dev->spheres_buffer);
+    }
+    if (dev->camera_buffer != NULL)
+    {
+        clReleaseMemObject(dev->camera_buffer);
+    }
+    if (dev->kernel != NULL)
+    {
+        clReleaseKernel(dev->kernel);
+    }
+    if (dev->program != NULL)
+    {
+        clReleaseProgram(dev->program);
+    }
+    if (dev->queue != NULL)
+    {
+        clReleaseCommandQueue(dev->queue);
+    }
+    if (dev->context != NULL)
+    {
+        clReleaseContext(dev->context);
+    }
+    memset(dev, 0, sizeof(*dev));
+}
+
+static
+int build_device_program(cl_multi_device_t *dev, const render_options_t *options)
+{
+    char build_options[CL_RENDER_BUILD_OPTIONS_SIZE];
+    cl_render_build_options(build_options, sizeof(build_options), options);
+
+    cl_program program = cl_program_cache_build(dev->context, dev->platform, dev->device,
+        g_cl_multi.ocl_source, g_cl_multi.ocl_source_len, build_options, NULL);
+    if (program == NULL)
+    {
+        printf("build_device_program, build failed on %s\n", dev->name);
+        return -1;
+    }
+
+    cl_int cl_ret;
+    cl_kernel kernel = clCreateKernel(program, "render_project_depth", &cl_ret);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("build_device_program, no render_project_depth kernel was found\n");
+        clReleaseProgram(program);
+        return -1;
+    }
+
+    if (dev->kernel != NULL)
+    {
+        clReleaseKernel(dev->kernel);
+    }
+    if (dev->program != NULL)
+    {
+        clReleaseProgram(dev->program);
+    }
+    dev->program = program;
+    dev->kernel = kernel;
+    dev->args_dirty = 1;
+
+    return 0;
+}
+
+static
+int supports_rgba8(cl_context context)
+{
+    cl_uint image_format_count = 0;
+    cl_int cl_ret = clGetSupportedImageFormats(context, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D, 0, NULL, &image_format_count);
+    if (cl_ret != CL_SUCCESS || image_format_count == 0)
+    {
+        return 0;
+    }
+    cl_image_format *image_formats = (cl_image_format*)malloc(sizeof(*image_formats) * image_format_count);
+    clGetSupportedImageFormats(context, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D, image_format_count, image_formats, NULL);
+    int found = 0;
+    for (cl_uint i = 0; i < image_format_count; ++i)
+    {
+        if (image_formats[i].image_channel_order == CL_RGBA &&
+            image_formats[i].image_channel_data_type == CL_UNSIGNED_INT8)
+        {
+            found = 1;
+            break;
+        }
+    }
+    free(image_formats);
+
+    return found;
+}
+
+static
+int init_device(cl_multi_device_t *dev, cl_platform_id platform, cl_device_id device)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->platform = platform;
+    dev->device = device;
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(dev->name) - 1, dev->name, NULL);
+
+    cl_int cl_ret;
+    cl_context_properties cps[3] = {CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0};
+    dev->context = clCreateContext(cps, 1, &device, NULL, NULL, &cl_ret);
+    if (cl_ret != CL_SUCCESS || dev->context == NULL)
+    {
+        dev->context = NULL;
+        return -1;
+    }
+    if (!supports_rgba8(dev->context))
+    {
+        printf("init_device, %s does not support RGBA 8bit color format\n", dev->name);
+        return -1;
+    }
+
+    dev->queue = clCreateCommandQueue(dev->context, device, 0, &cl_ret);
+    if (cl_ret != CL_SUCCESS)
+    {
+        dev->queue = NULL;
+        return -1;
+    }
+    dev->camera_buffer = clCreateBuffer(dev->context, CL_MEM_READ_ONLY, sizeof(project_camera_t), NULL, &cl_ret);
+    if (cl_ret != CL_SUCCESS)
+    {
+        dev->camera_buffer = NULL;
+        return -1;
+    }
+    if (build_device_program(dev, &g_cl_multi.options) != 0)
+    {
+        return -1;
+    }
+    dev->dirty_flags = RENDER_DIRTY_CAMERA | RENDER_DIRTY_SCENE;
+
+    return 0;
+}
+
+/* 与 cl_render.c 相同，RAY_TRACE_CL_DEVICE=gpu 或 cpu 时只使用该类型的设备 */
+static
+cl_device_type requested_device_type(void)
+{
+    const char *request = getenv("RAY_TRACE_CL_DEVICE");
+    if (request != NULL && strcmp(request, "gpu") == 0)
+    {
+        return CL_DEVICE_TYPE_GPU;
+    }
+    if (request != NULL && strcmp(request, "cpu") == 0)
+    {
+        return CL_DEVICE_TYPE_CPU;
+    }
+    return CL_DEVICE_TYPE_ALL;
+}
+
+static
+int init_devices(void)
+{
+    cl_uint platform_count;
+    cl_int cl_ret = clGetPlatformIDs(0, NULL, &platform_count);
+    if (cl_ret != CL_SUCCESS || platform_count == 0)
+    {
+        return -1;
+    }
+    cl_platform_id *platform_ids = (cl_platform_id*)malloc(sizeof(cl_platform_id) * platform_count);
+    clGetPlatformIDs(platform_count, platform_ids, NULL);
+
+    cl_device_type device_type = requested_device_type();
+    for (cl_uint plat_idx = 0; plat_idx < platform_count; ++plat_idx)
+    {
+        cl_uint device_count;
+        cl_ret = clGetDeviceIDs(platform_ids[plat_idx], device_type, 0, NULL, &device_count);
+        if (cl_ret != CL_SUCCESS || device_count == 0)
+        {
+            continue;
+        }
+        cl_device_id *device_ids = (cl_device_id*)malloc(sizeof(cl_device_id) * device_count);
+        clGetDeviceIDs(platform_ids[plat_idx], device_type, device_count, device_ids, NULL);
+
+        for (cl_uint device_idx = 0; device_idx < device_count && g_cl_multi.device_count < RENDER_MAX_CL_DEVICES; ++device_idx)
+        {
+            cl_multi_device_t *dev = &g_cl_multi.devices[g_cl_multi.device_count];
+            if (init_device(dev, platform_ids[plat_idx], device_ids[device_idx]) != 0)
+            {
+                printf("init_devices, skipped device %s\n", dev->name);
+                release_device(dev);
+                continue;
+            }
+            printf("init_devices, device %d: %s\n", g_cl_multi.device_count, dev->name);
+            g_cl_multi.device_count++;
+        }
+        free(device_ids);
+    }
+    free(platform_ids);
+
+    return g_cl_multi.device_count > 0 ? 0 : -1;
+}
+
+/********************************************************************************/
+
+static
+int upload_device_data(cl_multi_device_t *dev)
+{
+    const scene_t *scene = g_cl_multi.scene;
+    cl_int cl_ret;
+
+    if (dev->dirty_flags & RENDER_DIRTY_SCENE)
+    {
+        /* 各设备的 context 独立，场景数据各自拷贝一份 */
+        cl_mem *buffers[2] = {&dev->spheres_buffer, &dev->nodes_buffer};
+        void *host_ptrs[2] = {scene->spheres, scene->nodes};
+        size_t sizes[2] = {sizeof(sphere_t) * scene->sphere_count, sizeof(bvh_node_t) * scene->node_count};
+        for (int i = 0; i < 2; ++i)
+        {
+            if (*buffers[i] != NULL)
+            {
+                clReleaseMemObject(*buffers[i]);
+                *buffers[i] = NULL;
+            }
+            cl_mem mem = sizes[i] > 0 ?
+                clCreateBuffer(dev->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizes[i], host_ptrs[i], &cl_ret) :
+                clCreateBuffer(dev->context, CL_MEM_READ_ONLY, 64, NULL, &cl_ret);
+            if (cl_ret != CL_SUCCESS || mem == NULL)
+            {
+                printf("upload_device_data, clCreateBuffer() for scene failed on %s, size: %zu, ret: %d\n", dev->name, sizes[i], cl_ret);
+                return -1;
+            }
+            *buffers[i] = mem;
+        }
+        dev->args_dirty = 1;
+    }
+
+    if (dev->dirty_flags & RENDER_DIRTY_CAMERA)
+    {
+        /* 同一个 in-order 队列中的 kernel 在写入完成之后才执行，摄像机在帧结束之前不会被修改 */
+        cl_ret = clEnqueueWriteBuffer(dev->queue, dev->camera_buffer, CL_FALSE, 0, sizeof(project_camera_t),
+            &g_cl_multi.camera, 0, NULL, NULL);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("upload_device_data, clEnqueueWriteBuffer() for project_camera failed on %s, ret: %d\n", dev->name, cl_ret);
+            return -1;
+        }
+    }
+    dev->dirty_flags = 0;
+
+    return 0;
+}
+
+static
+int prepare_device(cl_multi_device_t *dev, int w, int h)
+{
+    cl_int cl_ret;
+    if (dev->canvas_image == NULL || dev->canvas_width != w || dev->canvas_height != h)
+    {
+        if (dev->canvas_image != NULL)
+        {
+            clReleaseMemObject(dev->canvas_image);
+        }
+        cl_image_format image_format = {CL_RGBA, CL_UNSIGNED_INT8};
+        dev->canvas_image = clCreateImage2D(dev->context, CL_MEM_WRITE_ONLY, &image_format, w, h, 0, NULL, &cl_ret);
+        if (cl_ret != CL_SUCCESS || dev->canvas_image == NULL)
+        {
+            printf("prepare_device, clCreateImage2D() failed on %s, ret: %d\n", dev->name, cl_ret);
+            dev->canvas_image = NULL;
+            return -1;
+        }
+        dev->canvas_width = w;
+        dev->canvas_height = h;
+        dev->args_dirty = 1;
+    }
+
+    if (upload_device_data(dev) != 0)
+    {
+        return -1;
+    }
+
+    if (dev->args_dirty)
+    {
+        cl_ret = clSetKernelArg(dev->kernel, 0, sizeof(cl_mem), &dev->camera_buffer);
+        cl_ret |= clSetKernelArg(dev->kernel, 1, sizeof(cl_mem), &dev->spheres_buffer);
+        cl_ret |= clSetKernelArg(dev->kernel, 2, sizeof(cl_mem), &dev->nodes_buffer);
+        cl_ret |= clSetKernelArg(dev->kernel, 3, sizeof(cl_mem), &dev->canvas_image);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("prepare_device, clSetKernelArg() failed on %s\n", dev->name);
+            return -1;
+        }
+        dev->args_dirty = 0;
+    }
+    int pixel_step = g_cl_multi.pixel_step;
+    cl_ret = clSetKernelArg(dev->kernel, 4, sizeof(pixel_step), &pixel_step);
+    cl_ret |= clSetKernelArg(dev->kernel, 5, sizeof(cl_mem), NULL);
+    /* 不做屏幕空间分箱，各 tile 遍历整个场景 */
+    cl_ret |= clSetKernelArg(dev->kernel, 6, sizeof(cl_mem), NULL);
+    cl_ret |= clSetKernelArg(dev->kernel, 7, sizeof(cl_mem), NULL);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("prepare_device, clSetKernelArg(pixel_step) failed on %s\n", dev->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* 先领取交还的 tile，再按顺序领取。没有 tile 可领而其他设备仍在渲染时等待，它们失败时交还的 tile 由等待的设备完成;
+ * 仍在领取的设备全都在等待时不会再有 tile，返回 -1，调用者不再领取
+ */
+static
+int take_tile(void)
+{
+    cl_multi_job_t *job = &g_cl_multi.job;
+    int tile = -1;
+    mutex_lock(&g_cl_multi.mutex);
+    job->idle_count++;
+    for (;;)
+    {
+        if (job->retry_count > 0)
+        {
+            tile = job->retry_tiles[--job->retry_count];
+            break;
+        }
+        if (job->next_tile < job->tile_count)
+        {
+            tile = job->next_tile++;
+            break;
+        }
+        if (job->idle_count == job->working_count)
+        {
+            job->working_count--;
+            cond_broadcast(&g_cl_multi.tile_cond);
+            break;
+        }
+        cond_wait(&g_cl_multi.tile_cond, &g_cl_multi.mutex);
+    }
+    job->idle_count--;
+    mutex_unlock(&g_cl_multi.mutex);
+    return tile;
+}
+
+/* 设备失败后不再领取，tile >= 0 时为领取了但没有完成的 tile */
+static
+void give_back_tile(int tile)
+{
+    cl_multi_job_t *job = &g_cl_multi.job;
+    mutex_lock(&g_cl_multi.mutex);
+    if (tile >= 0)
+    {
+        job->retry_tiles[job->retry_count++] = tile;
+    }
+    job->working_count--;
+    cond_broadcast(&g_cl_multi.tile_cond);
+    mutex_unlock(&g_cl_multi.mutex);
+}
+
+/* 入队一个 tile 的 kernel 和非阻塞的读回，返回读回的 event */
+static
+int enqueue_tile(cl_multi_device_t *dev, int tile, cl_event *read_event)
+{
+    const cl_multi_job_t *job = &g_cl_multi.job;
+    int pixel_step = g_cl_multi.pixel_step;
+    int x0 = (tile % job->tile_cols) * CL_MULTI_TILE_SIZE;
+    int y0 = (tile / job->tile_cols) * CL_MULTI_TILE_SIZE;
+    int x1 = x0 + CL_MULTI_TILE_SIZE < job->w ? x0 + CL_MULTI_TILE_SIZE : job->w;
+    int y1 = y0 + CL_MULTI_TILE_SIZE < job->h ? y0 + CL_MULTI_TILE_SIZE : job->h;
+
+    size_t global_work_offset[2] = {x0 / pixel_step, y0 / pixel_step};
+    size_t global_work_size[2] = {(x1 - x0 + pixel_step - 1) / pixel_step, (y1 - y0 + pixel_step - 1) / pixel_step};
+    cl_int cl_ret = clEnqueueNDRangeKernel(dev->queue, dev->kernel, 2, global_work_offset, global_work_size, NULL, 0, NULL, NULL);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("enqueue_tile, clEnqueueNDRangeKernel() failed on %s, ret: %d\n", dev->name, cl_ret);
+        return -1;
+    }
+
+    size_t origin[3] = {x0, y0, 0};
+    size_t region[3] = {x1 - x0, y1 - y0, 1};
+    cl_ret = clEnqueueReadImage(dev->queue, dev->canvas_image, CL_FALSE, origin, region, job->pitch, 0,
+        job->pixel + (size_t)y0 * job->pitch + (size_t)x0 * 4, 0, NULL, read_event);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("enqueue_tile, clEnqueueReadImage() failed on %s, ret: %d\n", dev->name, cl_ret);
+        return -1;
+    }
+    clFlush(dev->queue);
+
+    return 0;
+}
+
+static
+void render_device_tiles(int idx)
+{
+    cl_multi_device_t *dev = &g_cl_multi.devices[idx];
+    uint64_t ts1 = now_ns();
+    uint64_t span = profiler_begin();
+
+    dev->tile_count = 0;
+    dev->failed = prepare_device(dev, g_cl_multi.job.w, g_cl_multi.job.h) != 0;
+    if (dev->failed)
+    {
+        give_back_tile(-1);
+    }
+
+    cl_event pending = NULL;
+    int tile;
+    while (!dev->failed && (tile = take_tile()) >= 0)
+    {
+        cl_event read_event = NULL;
+        if (enqueue_tile(dev, tile, &read_event) != 0)
+        {
+            /* 领取的 tile 交还给其他设备 */
+            give_back_tile(tile);
+            dev->failed = 1;
+            break;
+        }
+        dev->tile_count++;
+        if (pending != NULL)
+        {
+            clWaitForEvents(1, &pending);
+            clReleaseEvent(pending);
+        }
+        pending = read_event;
+    }
+    if (pending != NULL)
+    {
+        clWaitForEvents(1, &pending);
+        clReleaseEvent(pending);
+    }
+
+    profiler_end(dev->name, "opencl multi", span);
+    dev->busy_ns = now_ns() - ts1;
+}
+
+#ifdef _WIN32
+static
+DWORD WINAPI device_routine(LPVOID param)
+#else
+static
+void* device_routine(void *param)
+#endif
+{
+    int self = (int)(intptr_t)param;
+    unsigned seen_frame = 0;
+
+    mutex_lock(&g_cl_multi.mutex);
+    for (;;)
+    {
+        while (!g_cl_multi.quit && g_cl_multi.frame_id == seen_frame)
+        {
+            cond_wait(&g_cl_multi.start_cond, &g_cl_multi.mutex);
+        }
+        if (g_cl_multi.quit)
+        {
+            break;
+        }
+        seen_frame = g_cl_multi.frame_id;
+        mutex_unlock(&g_cl_multi.mutex);
+
+        if (self < g_cl_multi.active_count)
+        {
+            render_device_tiles(self);
+        }
+
+        mutex_lock(&g_cl_multi.mutex);
+        g_cl_multi.running_workers--;
+        if (g_cl_multi.running_workers == 0)
+        {
+            cond_broadcast(&g_cl_multi.done_cond);
+        }
+    }
+    mutex_unlock(&g_cl_multi.mutex);
+
+    return 0;
+}
+
+/********************************************************************************/
+
+static
+int load_source(const char *ocl_source_file)
+{
+    FILE *fp = fopen(ocl_source_file, "rb");
+    if (fp == NULL)
+    {
+        printf("cl_multi_render, failed to open %s\n", ocl_source_file);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size_t ocl_source_len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *ocl_source = (char*)malloc(ocl_source_len + 1);
+    fread(ocl_source, 1, ocl_source_len, fp);
+    ocl_source[ocl_source_len] = '\0';
+    fclose(fp);
+
+    g_cl_multi.ocl_source = ocl_source;
+    g_cl_multi.ocl_source_len = ocl_source_len;
+
+    return 0;
+}
+
+int init_cl_multi_render(const char *ocl_source_file)
+{
+    memset(&g_cl_multi, 0, sizeof(g_cl_multi));
+    setup_render_options(&g_cl_multi.options);
+    setup_project_camera(&g_cl_multi.camera);
+    g_cl_multi.pixel_step = 1;
+
+    if (load_source(ocl_source_file) != 0)
+    {
+        return -1;
+    }
+    if (init_devices() != 0)
+    {
+        printf("init_cl_multi_render, no usable OpenCL device\n");
+        uninit_cl_multi_render();
+        return -1;
+    }
+    g_cl_multi.active_count = g_cl_multi.device_count;
+
+    mutex_init(&g_cl_multi.mutex);
+    cond_init(&g_cl_multi.start_cond);
+    cond_init(&g_cl_multi.done_cond);
+    cond_init(&g_cl_multi.tile_cond);
+    for (int i = 1; i < g_cl_multi.device_count; ++i)
+    {
+    #ifdef _WIN32
+        g_cl_multi.threads[i] = CreateThread(NULL, 0, device_routine, (LPVOID)(intptr_t)i, 0, NULL);
+        if (g_cl_multi.threads[i] == NULL)
+    #else
+        if (pthread_create(&g_cl_multi.threads[i], NULL, device_routine, (void*)(intptr_t)i) != 0)
+    #endif
+        {
+            printf("init_cl_multi_render, failed to create the thread of device %d\n", i);
+            /* 之后的设备没有线程，不再使用 */
+            for (int j = i; j < g_cl_multi.device_count; ++j)
+            {
+                release_device(&g_cl_multi.devices[j]);
+            }
+            g_cl_multi.device_count = i;
+            g_cl_multi.active_count = i;
+            break;
+        }
+    }
+
+    printf("init_cl_multi_render, devices: %d\n", g_cl_multi.device_count);
+
+    return 0;
+}
+
+void uninit_cl_multi_render(void)
+{
+    if (g_cl_multi.device_count > 0)
+    {
+        mutex_lock(&g_cl_multi.mutex);
+        g_cl_multi.quit = 1;
+        cond_broadcast(&g_cl_multi.start_cond);
+        mutex_unlock(&g_cl_multi.mutex);
+
+        for (int i = 1; i < g_cl_multi.device_count; ++i)
+        {
+        #ifdef _WIN32
+            WaitForSingleObject(g_cl_multi.threads[i], INFINITE);
+            CloseHandle(g_cl_multi.threads[i]);
+        #else
+            pthread_join(g_cl_multi.threads[i], NULL);
+        #endif
+        }
+
+        cond_destroy(&g_cl_multi.tile_cond);
+        cond_destroy(&g_cl_multi.done_cond);
+        cond_destroy(&g_cl_multi.start_cond);
+        mutex_destroy(&g_cl_multi.mutex);
+    }
+
+    for (int i = 0; i < g_cl_multi.device_count; ++i)
+    {
+        release_device(&g_cl_multi.devices[i]);
+    }
+    free(g_cl_multi.ocl_source);
+    memset(&g_cl_multi, 0, sizeof(g_cl_multi));
+}
+
+int cl_multi_render_device_count(void)
+{
+    return g_cl_multi.device_count;
+}
+
+int cl_multi_render_set_active_devices(int count)
+{
+    if (count < 1 || count > g_cl_multi.device_count)
+    {
+        printf("cl_multi_render_set_active_devices, invalid device count: %d, available: %d\n", count, g_cl_multi.device_count);
+        return -1;
+    }
+    g_cl_multi.active_count = count;
+
+    return 0;
+}
+
+void cl_multi_render_set_scene(const scene_t *scene)
+{
+    g_cl_multi.scene = scene;
+    for (int i = 0; i < g_cl_multi.device_count; ++i)
+    {
+        g_cl_multi.devices[i].dirty_flags |= RENDER_DIRTY_SCENE;
+    }
+}
+
+void cl_multi_render_scene_changed(void)
+{
+    for (int i = 0; i < g_cl_multi.device_count; ++i)
+    {
+        g_cl_multi.devices[i].dirty_flags |= RENDER_DIRTY_SCENE;
+    }
+}
+
+void cl_multi_render_set_camera(const project_camera_t *camera)
+{
+    g_cl_multi.camera = *camera;
+    for (int i = 0; i < g_cl_multi.device_count; ++i)
+    {
+        g_cl_multi.devices[i].dirty_flags |= RENDER_DIRTY_CAMERA;
+    }
+}
+
+int cl_multi_render_set_options(const render_options_t *options)
+{
+    if (options->shade_mode == g_cl_multi.options.shade_mode &&
+        options->checker_size == g_cl_multi.options.checker_size &&
+        options->depth_scale == g_cl_multi.options.depth_scale)
+    {
+        return 0;
+    }
+    for (int i = 0; i < g_cl_multi.device_count; ++i)
+    {
+        if (build_device_program(&g_cl_multi.devices[i], options) != 0)
+        {
+            return -1;
+        }
+    }
+    g_cl_multi.options = *options;
+
+    return 0;
+}
+
+int cl_multi_render_set_pixel_step(int pixel_step)
+{
+    if (pixel_step < 1 || pixel_step > RENDER_MAX_PIXEL_STEP || (pixel_step & (pixel_step - 1)) != 0)
+    {
+        printf("cl_multi_render_set_pixel_step, invalid pixel step: %d\n", pixel_step);
+        return -1;
+    }
+    g_cl_multi.pixel_step = pixel_step;
+
+    return 0;
+}
+
+void cl_multi_render_stats(render_multi_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->device_count = g_cl_multi.active_count;
+    stats->tile_count = g_cl_multi.job.tile_count;
+    stats->frame_ms = g_cl_multi.frame_ns / 1e6;
+    for (int i = 0; i < g_cl_multi.active_count; ++i)
+    {
+        const cl_multi_device_t *dev = &g_cl_multi.devices[i];
+        snprintf(stats->devices[i].name, sizeof(stats->devices[i].name), "%s", dev->name);
+        stats->devices[i].tile_count = dev->tile_count;
+        stats->devices[i].busy_ms = dev->busy_ns / 1e6;
+    }
+}
+
+int render_project_depth_opencl_multi(uint8_t* pixel, int w, int h, int pitch)
+{
+    if (g_cl_multi.scene == NULL)
+    {
+        printf("render_project_depth_opencl_multi, no scene was set\n");
+        return -1;
+    }
+    if (g_cl_multi.device_count == 0)
+    {
+        printf("render_project_depth_opencl_multi, not initialized\n");
+        return -1;
+    }
+    if (g_cl_multi.camera.width != w || g_cl_multi.camera.height != h)
+    {
+        /* 画面尺寸变化时重新计算像素光线的增量，各设备在本帧开始时重新上传 */
+        project_camera_t camera = g_cl_multi.camera;
+        project_camera_set_resolution(&camera, w, h);
+        cl_multi_render_set_camera(&camera);
+    }
+
+    uint64_t ts1 = now_ns();
+    cl_multi_job_t *job = &g_cl_multi.job;
+    job->pixel = pixel;
+    job->w = w;
+    job->h = h;
+    job->pitch = pitch;
+    job->tile_cols = (w + CL_MULTI_TILE_SIZE - 1) / CL_MULTI_TILE_SIZE;
+    job->tile_count = job->tile_cols * ((h + CL_MULTI_TILE_SIZE - 1) / CL_MULTI_TILE_SIZE);
+    job->next_tile = 0;
+    job->retry_count = 0;
+    job->working_count = g_cl_multi.active_count;
+    job->idle_count = 0;
+
+    mutex_lock(&g_cl_multi.mutex);
+    g_cl_multi.running_workers = g_cl_multi.device_count - 1;
+    g_cl_multi.frame_id++;
+    cond_broadcast(&g_cl_multi.start_cond);
+    mutex_unlock(&g_cl_multi.mutex);
+
+    render_device_tiles(0);
+
+    mutex_lock(&g_cl_multi.mutex);
+    while (g_cl_multi.running_workers > 0)
+    {
+        cond_wait(&g_cl_multi.done_cond, &g_cl_multi.mutex);
+    }
+    mutex_unlock(&g_cl_multi.mutex);
+
+    /* 失败的设备交还的 tile 由仍在领取的设备完成，全部设备都失败时才有 tile 剩下 */
+    int ret = job->next_tile < job->tile_count || job->retry_count > 0 ? -1 : 0;
+    g_cl_multi.frame_ns = now_ns() - ts1;
+
+    if (g_render_verbose)
+    {
+        printf("render_project_depth_opencl_multi, width: %d, height: %d, devices: %d, tiles: %d, time elapsed: %.3fms\n",
+            w, h, g_cl_multi.active_count, job->tile_count, g_cl_multi.frame_ns / 1e6);
+        for (int i = 0; i < g_cl_multi.active_count; ++i)
+        {
+            const cl_multi_device_t *dev = &g_cl_multi.devices[i];
+            printf("    device %d %s, tiles: %d, busy: %.3fms%s\n", i, dev->name, dev->tile_count, dev->busy_ns / 1e6,
+                dev->failed ? ", failed" : "");
+        }
+    }
+
+    return ret;
+}
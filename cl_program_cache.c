@@ -0,0 +1,413 @@
+
+#include "cl_program_cache.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define make_dir(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#define make_dir(path) mkdir((path), 0755)
+#endif
+
+#define CL_CACHE_DEFAULT_DIR "cl_cache"
+#define CL_CACHE_MAGIC 0x42435452u /* "RTCB" */
+#define CL_CACHE_VERSION 1
+
+/* 缓存文件: header, key 字符串, program 二进制 */
+typedef struct cl_cache_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key_hash;
+    uint64_t key_size;
+    uint64_t binary_hash;
+    uint64_t binary_size;
+} cl_cache_header_t;
+
+/* 64 位 FNV-1a */
+static
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= p[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+#define HASH_INIT 14695981039346656037ull
+
+static
+const char* cache_dir(void)
+{
+    const char *dir = getenv("RAY_TRACE_CL_CACHE");
+    if (dir == NULL || dir[0] == '\0')
+    {
+        return CL_CACHE_DEFAULT_DIR;
+    }
+    if (strcmp(dir, "0") == 0)
+    {
+        return NULL;
+    }
+    return dir;
+}
+
+/* 描述编译环境的字符串，各字段以换行分隔，源码只参与哈希 */
+static
+char* make_cache_key(cl_platform_id platform, cl_device_id device, const char *options)
+{
+    char plat_name[128], plat_version[128], dev_name[128], dev_version[128], driver_version[128];
+    memset(plat_name, 0, sizeof(plat_name));
+    memset(plat_version, 0, sizeof(plat_version));
+    memset(dev_name, 0, sizeof(dev_name));
+    memset(dev_version, 0, sizeof(dev_version));
+    memset(driver_version, 0, sizeof(driver_version));
+    clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(plat_name) - 1, plat_name, NULL);
+    clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(plat_version) - 1, plat_version, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(dev_name) - 1, dev_name, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(dev_version) - 1, dev_version, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver_version) - 1, driver_version, NULL);
+
+    if (options == NULL)
+    {
+        options = "";
+    }
+    size_t key_size = strlen(plat_name) + strlen(plat_version) + strlen(dev_name) + strlen(dev_version) +
+        strlen(driver_version) + strlen(options) + 64;
+    char *key = (char*)malloc(key_size);
+    if (key != NULL)
+    {
+        snprintf(key, key_size, "%s\n%s\n%s\n%s\n%s\n%s\n",
+            plat_name, plat_version, dev_name, dev_version, driver_version, options);
+    }
+    return key;
+}
+
+static
+cl_program build_from_source(cl_context context, cl_device_id device, const char *source, size_t source_len, const char *options)
+{
+    cl_int cl_ret;
+    cl_program program = clCreateProgramWithSource(context, 1, (const char**)&source, &source_len, &cl_ret);
+    if (cl_ret != CL_SUCCESS || program == NULL)
+    {
+        printf("cl_program_cache_build, clCreateProgramWithSource() failed, ret: %d\n", cl_ret);
+        return NULL;
+    }
+
+    cl_ret = clBuildProgram(program, 1, &device, options, NULL, NULL);
+    if (cl_ret != CL_SUCCESS)
+    {
+        char build_log[4096];
+        memset(build_log, 0, sizeof(build_log));
+        size_t log_len;
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(build_log) - 1, build_log, &log_len);
+        printf("cl_program_cache_build, clBuildProgram() failed, options: %s, build log:\n%s\n", options ? options : "", build_log);
+
+        clReleaseProgram(program);
+        return NULL;
+    }
+
+    return program;
+}
+
+static
+cl_program load_from_cache(const char *path, const char *key, uint64_t key_hash,
+    cl_context context, cl_device_id device, const char *options)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return NULL;
+    }
+
+    cl_program program = NULL;
+    char *stored_key = NULL;
+    unsigned char *binary = NULL;
+    size_t key_size = strlen(key);
+    do
+    {
+        cl_cache_header_t header;
+        if (fread(&header, sizeof(header), 1, fp) != 1 ||
+            header.magic != CL_CACHE_MAGIC || header.version != CL_CACHE_VERSION ||
+            header.key_hash != key_hash || header.key_size != key_size || header.binary_size == 0)
+        {
+            printf("cl_program_cache_build, stale cache file: %s\n", path);
+            break;
+        }
+
+        stored_key = (char*)malloc(key_size);
+        binary = (unsigned char*)malloc((size_t)header.binary_size);
+        if (stored_key == NULL || binary == NULL)
+        {
+            break;
+        }
+        if (fread(stored_key, 1, key_size, fp) != key_size || memcmp(stored_key, key, key_size) != 0 ||
+            fread(binary, 1, (size_t)header.binary_size, fp) != header.binary_size ||
+            hash_bytes(HASH_INIT, binary, (size_t)header.binary_size) != header.binary_hash)
+        {
+            printf("cl_program_cache_build, corrupt cache file: %s\n", path);
+            break;
+        }
+
+        cl_int cl_ret, binary_status;
+        size_t binary_size = (size_t)header.binary_size;
+        program = clCreateProgramWithBinary(context, 1, &device, &binary_size, (const unsigned char**)&binary, &binary_status, &cl_ret);
+        if (cl_ret != CL_SUCCESS || binary_status != CL_SUCCESS || program == NULL)
+        {
+            printf("cl_program_cache_build, clCreateProgramWithBinary() failed, ret: %d, status: %d\n", cl_ret, binary_status);
+            if (program != NULL)
+            {
+                clReleaseProgram(program);
+                program = NULL;
+            }
+            break;
+        }
+        cl_ret = clBuildProgram(program, 1, &device, options, NULL, NULL);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("cl_program_cache_build, clBuildProgram() for cached binary failed, ret: %d\n", cl_ret);
+            clReleaseProgram(program);
+            program = NULL;
+            break;
+        }
+    } while(0);
+
+    free(binary);
+    free(stored_key);
+    fclose(fp);
+
+    return program;
+}
+
+static
+void save_to_cache(const char *dir, const char *path, const char *key, uint64_t key_hash, cl_program program)
+{
+    size_t binary_size = 0;
+    cl_int cl_ret = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binary_size), &binary_size, NULL);
+    if (cl_ret != CL_SUCCESS || binary_size == 0)
+    {
+        printf("cl_program_cache_build, no program binary available, ret: %d\n", cl_ret);
+        return;
+    }
+    unsigned char *binary = (unsigned char*)malloc(binary_size);
+    if (binary == NULL)
+    {
+        return;
+    }
+    cl_ret = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("cl_program_cache_build, clGetProgramInfo(CL_PROGRAM_BINARIES) failed, ret: %d\n", cl_ret);
+        free(binary);
+        return;
+    }
+
+    cl_cache_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CL_CACHE_MAGIC;
+    header.version = CL_CACHE_VERSION;
+    header.key_hash = key_hash;
+    header.key_size = strlen(key);
+    header.binary_hash = hash_bytes(HASH_INIT, binary, binary_size);
+    header.binary_size = binary_size;
+
+    /* 先写临时文件再改名，多个进程同时启动时不会读到写了一半的文件 */
+    make_dir(dir);
+    char tmp_path[1024];
+    int len = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if (len < 0 || (size_t)len >= sizeof(tmp_path))
+    {
+        /* 截断的文件名可能改名覆盖其他文件 */
+        printf("cl_program_cache_build, cache path too long: %s\n", path);
+        free(binary);
+        return;
+    }
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL)
+    {
+        printf("cl_program_cache_build, failed to open %s\n", tmp_path);
+        free(binary);
+        return;
+    }
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+        fwrite(key, 1, (size_t)header.key_size, fp) == header.key_size &&
+        fwrite(binary, 1, binary_size, fp) == binary_size;
+    ok = fclose(fp) == 0 && ok;
+    free(binary);
+
+    remove(path);
+    if (!ok || rename(tmp_path, path) != 0)
+    {
+        printf("cl_program_cache_build, failed to write cache file: %s\n", path);
+        remove(tmp_path);
+    }
+}
+
+cl_program cl_program_cache_build(cl_context context, cl_platform_id platform, cl_device_id device,
+    const char *source, size_t source_len, const char *options, int *from_cache)
+{
+    if (from_cache != NULL)
+    {
+        *from_cache = 0;
+    }
+
+    const char *dir = cache_dir();
+    char *key = dir != NULL ? make_cache_key(platform, device, options) : NULL;
+    if (key == NULL)
+    {
+        return build_from_source(context, device, source, source_len, options);
+    }
+
+    uint64_t key_hash = hash_bytes(HASH_INIT, key, strlen(key));
+    key_hash = hash_bytes(key_hash, source, source_len);
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%016" PRIx64 ".bin", dir, key_hash);
+
+    cl_program program = load_from_cache(path, key, key_hash, context, device, options);
+    if (program != NULL)
+    {
+        if (from_cache != NULL)
+        {
+            *from_cache = 1;
+        }
+        free(key);
+        return program;
+    }
+
+    program = build_from_source(context, device, source, source_len, options);
+    if (program != NULL)
+    {
+        save_to_cache(dir, path, key, key_hash, program);
+    }
+    free(key);
+
+    return program;
+}
+
+/********************************************************************************/
+
+#define WORK_GROUP_FILE "work_group.txt"
+#define WORK_GROUP_MAX_ENTRIES 256
+
+/* 每行: key 哈希 宽 高 */
+typedef struct work_group_entry
+{
+    uint64_t key_hash;
+    unsigned long size[2];
+} work_group_entry_t;
+
+static
+int load_work_group_entries(const char *path, work_group_entry_t *entries, int max_count)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        return 0;
+    }
+
+    int count = 0;
+    char line[128];
+    while (count < max_count && fgets(line, sizeof(line), fp) != NULL)
+    {
+        work_group_entry_t *entry = &entries[count];
+        if (sscanf(line, "%" SCNx64 " %lu %lu", &entry->key_hash, &entry->size[0], &entry->size[1]) == 3)
+        {
+            count++;
+        }
+    }
+    fclose(fp);
+
+    return count;
+}
+
+int cl_cache_load_work_group(const char *key, size_t size[2])
+{
+    const char *dir = cache_dir();
+    if (dir == NULL)
+    {
+        return -1;
+    }
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/" WORK_GROUP_FILE, dir);
+    work_group_entry_t entries[WORK_GROUP_MAX_ENTRIES];
+    int count = load_work_group_entries(path, entries, WORK_GROUP_MAX_ENTRIES);
+
+    uint64_t key_hash = hash_bytes(HASH_INIT, key, strlen(key));
+    for (int i = 0; i < count; ++i)
+    {
+        if (entries[i].key_hash == key_hash)
+        {
+            size[0] = entries[i].size[0];
+            size[1] = entries[i].size[1];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void cl_cache_store_work_group(const char *key, const size_t size[2])
+{
+    const char *dir = cache_dir();
+    if (dir == NULL)
+    {
+        return;
+    }
+
+    char path[1024];
+    char tmp_path[sizeof(path) + 8];
+    snprintf(path, sizeof(path), "%s/" WORK_GROUP_FILE, dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    work_group_entry_t entries[WORK_GROUP_MAX_ENTRIES];
+    int count = load_work_group_entries(path, entries, WORK_GROUP_MAX_ENTRIES);
+
+    uint64_t key_hash = hash_bytes(HASH_INIT, key, strlen(key));
+    int idx = 0;
+    while (idx < count && entries[idx].key_hash != key_hash)
+    {
+        idx++;
+    }
+    if (idx == WORK_GROUP_MAX_ENTRIES)
+    {
+        /* 表满时丢弃最早的记录 */
+        memmove(entries, entries + 1, sizeof(entries[0]) * (WORK_GROUP_MAX_ENTRIES - 1));
+        idx = WORK_GROUP_MAX_ENTRIES - 1;
+    }
+    else if (idx == count)
+    {
+        count++;
+    }
+    entries[idx].key_hash = key_hash;
+    entries[idx].size[0] = (unsigned long)size[0];
+    entries[idx].size[1] = (unsigned long)size[1];
+
+    make_dir(dir);
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL)
+    {
+        printf("cl_cache_store_work_group, failed to open %s\n", tmp_path);
+        return;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        fprintf(fp, "%016" PRIx64 " %lu %lu\n", entries[i].key_hash, entries[i].size[0], entries[i].size[1]);
+    }
+    int ok = fclose(fp) == 0;
+
+    remove(path);
+    if (!ok || rename(tmp_path, path) != 0)
+    {
+        printf("cl_cache_store_work_group, failed to write %s\n", path);
+        remove(tmp_path);
+    }
+}
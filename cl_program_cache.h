@@ -0,0 +1,24 @@
+
+#ifndef CL_PROGRAM_CACHE_H
+#define CL_PROGRAM_CACHE_H
+
+#include <CL/cl.h>
+
+#include <stddef.h>
+
+/* 编译 OpenCL program，优先从磁盘缓存加载编译好的二进制。
+ * 缓存以 platform、device、驱动版本、编译选项和源码的哈希为键，任何一项变化或缓存文件损坏时
+ * 从源码重新编译并覆盖缓存。缓存目录默认为 cl_cache，可用环境变量 RAY_TRACE_CL_CACHE 指定，
+ * 设为 0 时不使用缓存。from_cache 非 NULL 时返回是否命中缓存
+ */
+extern cl_program cl_program_cache_build(cl_context context, cl_platform_id platform, cl_device_id device,
+    const char *source, size_t source_len, const char *options, int *from_cache);
+
+/* 自动调优得到的 work-group 大小，按 key (设备、驱动、kernel 及编译选项) 保存在缓存目录的 work_group.txt 中
+ * 找到时返回 0
+ */
+extern int cl_cache_load_work_group(const char *key, size_t size[2]);
+
+extern void cl_cache_store_work_group(const char *key, const size_t size[2]);
+
+#endif
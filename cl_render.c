@@ -1,5 +1,11 @@
 
 #include "common.h"
+#include "render.h"
+#include "cl_program_cache.h"
+#include "dirty_region.h"
+#include "tile_bin.h"
+#include "profiler.h"
+#include "thread_compat.h"
 
 #include <CL/cl.h>
 
@@ -11,20 +17,257 @@
 
 extern uint64_t now_ms(void);
 
+/* 流水线渲染: 多个 canvas 轮流使用，kernel 在 command_queue 上执行，读回在独立的 read_queue 上
+ * 进行并等待 kernel 的 event，读回的目标为 CL_MEM_ALLOC_HOST_PTR 分配、常驻映射的 pinned 内存。
+ * 第 N+1 帧计算的同时第 N 帧在读回和拷贝
+ */
+#define CL_PIPELINE_MAX_DEPTH 3
+#define CL_PIPELINE_DEFAULT_DEPTH 2
+
+typedef struct cl_frame_slot
+{
+    /* 每个 slot 使用独立的 kernel 对象，参数绑定一次后不再修改 */
+    cl_kernel kernel;
+    int bound_generation;
+    cl_mem canvas_image;
+    cl_mem host_buffer;
+    uint8_t *host_pixel;
+    cl_event read_event;
+    /* 该帧的 pixel_step、抗锯齿 grid 和边缘像素个数，取回时更新采样统计 */
+    int pixel_step;
+    int aa_grid;
+    cl_int aa_edge_count;
+    cl_event aa_count_event;
+} cl_frame_slot_t;
+
+typedef struct cl_pipeline
+{
+    cl_frame_slot_t slots[CL_PIPELINE_MAX_DEPTH];
+    int depth;
+    int width;
+    int height;
+    int ready;
+    /* 下一帧使用的 slot, 最早提交且尚未取回的 slot */
+    int submit_slot;
+    int retire_slot;
+    int in_flight_count;
+} cl_pipeline_t;
+
+/* kernel 的 work-group 大小，首次使用时自动调优并保存，size 为 0 表示交由 OpenCL 实现选择 */
+typedef struct cl_work_group
+{
+    size_t size[2];
+    int tuned;
+} cl_work_group_t;
+
+/* 按 render_options_t 以 -D 编译选项编译出的 kernel 变体，每种组合只编译一次 */
+#define CL_MAX_VARIANTS 8
+
+/* wavefront 渲染各阶段的 kernel，与 g_wavefront_kernel_names 一一对应 */
+enum
+{
+    CL_WAVEFRONT_RAYGEN,
+    CL_WAVEFRONT_INTERSECT,
+    CL_WAVEFRONT_SHADE,
+    CL_WAVEFRONT_RESOLVE,
+    CL_WAVEFRONT_KERNEL_COUNT
+};
+
+static const char *g_wavefront_kernel_names[CL_WAVEFRONT_KERNEL_COUNT] =
+{
+    "wavefront_raygen", "wavefront_intersect", "wavefront_shade", "wavefront_resolve",
+};
+
+/* 屏幕空间分箱的 kernel，与 g_tile_bin_kernel_names 一一对应 */
+enum
+{
+    CL_TILE_BIN_COUNT,
+    CL_TILE_BIN_SCAN,
+    CL_TILE_BIN_FILL,
+    CL_TILE_BIN_KERNEL_COUNT
+};
+
+static const char *g_tile_bin_kernel_names[CL_TILE_BIN_KERNEL_COUNT] =
+{
+    "tile_bin_count", "tile_bin_scan", "tile_bin_fill",
+};
+
+/* 开启性能分析时尚未取回时间戳的命令，host_ns 为入队之后的主机时刻，用于把设备时钟换算为 now_ns() 的时间基准 */
+#define CL_PROFILE_MAX_PENDING 1024
+
+typedef struct cl_profiled_event
+{
+    cl_event event;
+    int id;
+    int track;
+    uint64_t host_ns;
+} cl_profiled_event_t;
+
+typedef struct cl_variant
+{
+    render_options_t options;
+    char build_options[128];
+    cl_program program;
+    cl_kernel render_project_depth_kernel;
+    cl_kernel render_aa_edges_kernel;
+    cl_kernel render_aa_resample_kernel;
+    cl_kernel wavefront_kernels[CL_WAVEFRONT_KERNEL_COUNT];
+    cl_kernel tile_bin_kernels[CL_TILE_BIN_KERNEL_COUNT];
+    cl_kernel render_batch_kernel;
+    cl_work_group_t work_group;
+    int from_cache;
+} cl_variant_t;
+
 struct opencl_global
 {
     cl_platform_id opencl_platform;
     cl_device_id opencl_device;
+    /* 设备名、驱动和平台版本，作为 work-group 调优结果的键 */
+    char device_key[400];
     cl_context opencl_device_context;
     cl_command_queue command_queue;
+    /* 流水线渲染中读回画面使用的队列 */
+    cl_command_queue read_queue;
 
+    char *ocl_source;
+    size_t ocl_source_len;
+    cl_variant_t variants[CL_MAX_VARIANTS];
+    int variant_count;
+    /* 当前使用的变体的 program 和 kernel，由 variants 持有 */
+    int current_variant;
     cl_program program;
-    cl_kernel render_gradient_kernel;
     cl_kernel render_project_depth_kernel;
+    /* 缺省变体是否来自磁盘缓存及加载耗时，用于比较冷启动和热启动 */
+    int program_from_cache;
+    uint64_t program_load_ns;
+    cl_kernel render_gradient_kernel;
+    cl_work_group_t gradient_work_group;
     
     cl_mem canvas_image;
+    int canvas_width;
+    int canvas_height;
+
+    /* 由 cl_render_set_scene() 设置 */
+    const scene_t *scene;
+
+    /* 摄像机和场景数据常驻设备内存，只有 dirty_flags 中标记的部分会在下一帧之前重新上传 */
+    project_camera_t camera;
+    cl_mem camera_buffer;
+    cl_mem spheres_buffer;
+    size_t spheres_buffer_size;
+    cl_mem nodes_buffer;
+    size_t nodes_buffer_size;
+    unsigned int dirty_flags;
+    /* 最近一次摄像机上传的 event, 完成之前不能修改 camera */
+    cl_event camera_upload_event;
+    /* 场景 buffer 每次重建后加一，用于判断各 kernel 绑定的参数是否过期 */
+    int scene_buffer_generation;
+
+    /* buffer 或 canvas 重建之后需要重新绑定 kernel 参数 */
+    int gradient_args_dirty;
+    int depth_args_dirty;
+
+    /* 由 cl_render_set_pixel_step() 设置，每帧作为 kernel 参数传入 */
+    int pixel_step;
+
+    /* 自适应抗锯齿，grid 由 cl_render_set_antialias() 设置。各帧的 kernel 在同一个 in-order 队列中依次执行，
+     * 流水线的各 slot 共用同一组缓冲区
+     */
+    int aa_grid;
+    cl_mem aa_ids_buffer;
+    cl_mem aa_edge_buffer;
+    cl_mem aa_count_buffer;
+    int aa_capacity;
+    render_aa_stats_t aa_stats;
+
+    /* wavefront 渲染，bounces 由 cl_render_set_bounces() 设置。光线队列两个一组交替作为当前和下一轮的队列，
+     * 各自的计数在独立的 buffer 中，容量均按像素个数分配
+     */
+    int bounces;
+    cl_mem wf_ray_buffers[2];
+    cl_mem wf_count_buffers[2];
+    cl_mem wf_hit_buffer;
+    cl_mem wf_accum_buffer;
+    int wf_capacity;
+    render_wavefront_stats_t wf_stats;
+
+    /* 屏幕空间分箱: 各 tile 节点列表的起始位置和列表本身，由 tile_bin_* kernel 建立，
+     * 摄像机、BVH 和画面尺寸都不变时沿用。列表的容量按上一次读回的总长度增长
+     */
+    cl_mem bin_offsets_buffer;
+    int bin_offsets_capacity;
+    cl_mem bin_nodes_buffer;
+    int bin_nodes_capacity;
+    int bin_width;
+    int bin_height;
+    int bin_valid;
+    cl_int bin_total;
+    cl_event bin_total_event;
+
+    /* 多视角批量渲染: 各视角的摄像机在 host 和设备上各一份; 输出 buffer 两个一组交替使用，
+     * 一个由 kernel 写入时另一个在 read_queue 上读回，batch_out_size 为每个的字节数
+     */
+    project_camera_t *batch_cameras;
+    int batch_camera_capacity;
+    cl_mem batch_camera_buffer;
+    cl_mem batch_out_buffers[2];
+    size_t batch_out_size;
+
+    /* 增量渲染: cl_render_scene_changed() 提交的变化和上一帧的参数，上一帧保留在 canvas_image 中，
+     * 其他渲染覆盖之后作废
+     */
+    render_dirty_region_t dirty;
+
+    cl_profiled_event_t profiled[CL_PROFILE_MAX_PENDING];
+    int profiled_count;
+
+    /* render_backend_t 接口: 尚未等待的读回及其提交时刻，region_callback 为是否设置了记录完成时刻的回调 */
+    cl_event region_event;
+    uint64_t region_submit_ns;
+    int region_callback;
+
+    cl_pipeline_t pipeline;
 } g_opencl_global;
 
+/* event 回调在驱动的线程中写入完成时刻。回调可能晚于等待超时甚至 uninit_cl_render() 才执行，
+ * 因此不放在 g_opencl_global 中随之清零，互斥锁和条件变量只创建一次
+ */
+struct cl_region_sync
+{
+    int initialized;
+    thread_mutex_t mutex;
+    thread_cond_t cond;
+    /* 每次设置回调时递增，回调只记录与之相同的一次，超时之后才执行的回调被忽略 */
+    unsigned sequence;
+    uint64_t done_ns;
+} g_cl_region_sync;
+
+/* 设备类型的选择顺序。缺省优先使用 GPU，没有可用的 GPU 时使用其他设备 (例如 POCL 的 CPU 设备)，
+ * 环境变量 RAY_TRACE_CL_DEVICE=gpu 或 cpu 时只使用该类型
+ */
+static
+int device_type_order(cl_device_type types[2])
+{
+    const char *request = getenv("RAY_TRACE_CL_DEVICE");
+    if (request != NULL && strcmp(request, "gpu") == 0)
+    {
+        types[0] = CL_DEVICE_TYPE_GPU;
+        return 1;
+    }
+    if (request != NULL && strcmp(request, "cpu") == 0)
+    {
+        types[0] = CL_DEVICE_TYPE_CPU;
+        return 1;
+    }
+    if (request != NULL && request[0] != '\0')
+    {
+        printf("device_type_order, unknown RAY_TRACE_CL_DEVICE: %s, expected gpu or cpu\n", request);
+    }
+    types[0] = CL_DEVICE_TYPE_GPU;
+    types[1] = CL_DEVICE_TYPE_ALL & ~CL_DEVICE_TYPE_GPU;
+    return 2;
+}
+
 static
 int init_opencl_device(void)
 {
@@ -39,97 +282,124 @@ int init_opencl_device(void)
     cl_platform_id *platform_ids = (cl_platform_id*)malloc(sizeof(cl_platform_id) * platform_count);
     clGetPlatformIDs(platform_count, platform_ids, NULL);
 
+    cl_device_type device_types[2];
+    int device_type_count = device_type_order(device_types);
+
     int device_ready = 0;
-    for (cl_uint plat_idx = 0; plat_idx < platform_count; ++plat_idx)
+    for (int type_idx = 0; type_idx < device_type_count && !device_ready; ++type_idx)
     {
-        cl_platform_id plat_id = platform_ids[plat_idx];
-
-        cl_uint device_count;
-        cl_ret = clGetDeviceIDs(plat_id, CL_DEVICE_TYPE_GPU, 0, NULL, &device_count);
-        if (cl_ret != CL_SUCCESS || device_count == 0)
-        {
-            continue;
-        }
-        cl_device_id *device_ids = (cl_device_id*)malloc(sizeof(cl_device_id) * device_count);
-        clGetDeviceIDs(plat_id, CL_DEVICE_TYPE_GPU, device_count, device_ids, NULL);
-
-        for (cl_uint device_idx = 0; device_idx < device_count; ++device_idx)
+        for (cl_uint plat_idx = 0; plat_idx < platform_count; ++plat_idx)
         {
-            cl_device_id device_id = device_ids[device_idx];
+            cl_platform_id plat_id = platform_ids[plat_idx];
 
-            cl_context_properties cps[3] = {CL_CONTEXT_PLATFORM, (cl_context_properties)plat_id, 0};
-            cl_context device_ctx = clCreateContext(cps, 1, &device_id, NULL, NULL, &cl_ret);
-            if (cl_ret != CL_SUCCESS || device_ctx == NULL)
-            {
-                continue;
-            }
-            cl_uint image_format_count = 0;
-            cl_ret = clGetSupportedImageFormats(device_ctx, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D, 0, NULL, &image_format_count);
-            if (cl_ret != CL_SUCCESS || image_format_count == 0)
+            cl_uint device_count;
+            cl_ret = clGetDeviceIDs(plat_id, device_types[type_idx], 0, NULL, &device_count);
+            if (cl_ret != CL_SUCCESS || device_count == 0)
             {
-                clReleaseContext(device_ctx);
                 continue;
             }
-            cl_image_format *image_formats = (cl_image_format*)malloc(sizeof(*image_formats) * image_format_count);
-            clGetSupportedImageFormats(device_ctx, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D, image_format_count, image_formats, NULL);
-            for (cl_uint i = 0; i < image_format_count; ++i)
+            cl_device_id *device_ids = (cl_device_id*)malloc(sizeof(cl_device_id) * device_count);
+            clGetDeviceIDs(plat_id, device_types[type_idx], device_count, device_ids, NULL);
+
+            for (cl_uint device_idx = 0; device_idx < device_count; ++device_idx)
             {
-                cl_image_format *image_format = &image_formats[i];
-                if (image_format->image_channel_order == CL_RGBA && 
-                    image_format->image_channel_data_type == CL_UNSIGNED_INT8)
+                cl_device_id device_id = device_ids[device_idx];
+
+                cl_context_properties cps[3] = {CL_CONTEXT_PLATFORM, (cl_context_properties)plat_id, 0};
+                cl_context device_ctx = clCreateContext(cps, 1, &device_id, NULL, NULL, &cl_ret);
+                if (cl_ret != CL_SUCCESS || device_ctx == NULL)
                 {
-                    g_opencl_global.opencl_platform = plat_id;
-                    g_opencl_global.opencl_device = device_id;
-                    g_opencl_global.opencl_device_context = device_ctx;
-                    device_ready = 1;
-                    break;
+                    continue;
                 }
-            }
-            free(image_formats);
-
-            if (device_ready)
-            {
-                char dev_name[128];
-                char dev_vendor[128];
-                char dev_version[128];
-                memset(dev_name, 0, sizeof(dev_name));
-                memset(dev_vendor, 0, sizeof(dev_vendor));
-                memset(dev_version, 0, sizeof(dev_version));
-                cl_ret = clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(dev_name), dev_name, NULL);
-                cl_ret |= clGetDeviceInfo(device_id, CL_DEVICE_VENDOR, sizeof(dev_vendor), dev_vendor, NULL);
-                cl_ret |= clGetDeviceInfo(device_id, CL_DEVICE_VERSION, sizeof(dev_version), dev_version, NULL);
-                if (cl_ret == CL_SUCCESS)
+                cl_uint image_format_count = 0;
+                cl_ret = clGetSupportedImageFormats(device_ctx, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D, 0, NULL, &image_format_count);
+                if (cl_ret != CL_SUCCESS || image_format_count == 0)
+                {
+                    clReleaseContext(device_ctx);
+                    continue;
+                }
+                cl_image_format *image_formats = (cl_image_format*)malloc(sizeof(*image_formats) * image_format_count);
+                clGetSupportedImageFormats(device_ctx, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D, image_format_count, image_formats, NULL);
+                for (cl_uint i = 0; i < image_format_count; ++i)
                 {
-                    printf("init_opencl_device, seleted device, name: %s, vendor: %s, version: %s\n", dev_name, dev_vendor, dev_version);
+                    cl_image_format *image_format = &image_formats[i];
+                    if (image_format->image_channel_order == CL_RGBA && 
+                        image_format->image_channel_data_type == CL_UNSIGNED_INT8)
+                    {
+                        g_opencl_global.opencl_platform = plat_id;
+                        g_opencl_global.opencl_device = device_id;
+                        g_opencl_global.opencl_device_context = device_ctx;
+                        device_ready = 1;
+                        break;
+                    }
                 }
+                free(image_formats);
 
-                break;
+                if (device_ready)
+                {
+                    char dev_name[128];
+                    char dev_vendor[128];
+                    char dev_version[128];
+                    memset(dev_name, 0, sizeof(dev_name));
+                    memset(dev_vendor, 0, sizeof(dev_vendor));
+                    memset(dev_version, 0, sizeof(dev_version));
+                    cl_ret = clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(dev_name), dev_name, NULL);
+                    cl_ret |= clGetDeviceInfo(device_id, CL_DEVICE_VENDOR, sizeof(dev_vendor), dev_vendor, NULL);
+                    cl_ret |= clGetDeviceInfo(device_id, CL_DEVICE_VERSION, sizeof(dev_version), dev_version, NULL);
+                    if (cl_ret == CL_SUCCESS)
+                    {
+                        printf("init_opencl_device, seleted device, name: %s, vendor: %s, version: %s\n", dev_name, dev_vendor, dev_version);
+                    }
+
+                    char driver_version[128];
+                    memset(driver_version, 0, sizeof(driver_version));
+                    clGetDeviceInfo(device_id, CL_DRIVER_VERSION, sizeof(driver_version) - 1, driver_version, NULL);
+                    snprintf(g_opencl_global.device_key, sizeof(g_opencl_global.device_key), "%s\n%s\n%s",
+                        dev_name, dev_version, driver_version);
+
+                    break;
+                }
+                else
+                {
+                    printf("init_opencl_device, device does not support RGBA 8bit color format\n");
+                    clReleaseContext(device_ctx);
+                }
             }
-            else
+            free(device_ids);
+        
+            if (device_ready)
             {
-                printf("init_opencl_device, no GPU device supporting RGBA 8bit color format\n");
-                clReleaseContext(device_ctx);
+                break;
             }
         }
-        free(device_ids);
-        
-        if (device_ready)
-        {
-            break;
-        }
     }
     free(platform_ids);
 
     if (device_ready)
     {
+        /* 带 profiling 属性的队列在部分实现上有额外开销，只在开启性能分析时使用 */
+        cl_command_queue_properties queue_properties = g_profiler_enabled ? CL_QUEUE_PROFILING_ENABLE : 0;
         cl_command_queue command_queue = clCreateCommandQueue(
             g_opencl_global.opencl_device_context, 
             g_opencl_global.opencl_device, 
-            0, &cl_ret);
+            queue_properties, &cl_ret);
         if (cl_ret == CL_SUCCESS)
         {
             g_opencl_global.command_queue = command_queue;
-            return 0;
+
+            cl_command_queue read_queue = clCreateCommandQueue(
+                g_opencl_global.opencl_device_context, 
+                g_opencl_global.opencl_device, 
+                queue_properties, &cl_ret);
+            if (cl_ret == CL_SUCCESS)
+            {
+                g_opencl_global.read_queue = read_queue;
+                profiler_name_track(PROFILER_TRACK_DEVICE, "opencl command queue");
+                profiler_name_track(PROFILER_TRACK_DEVICE + 1, "opencl read queue");
+                return 0;
+            }
+            clReleaseCommandQueue(command_queue);
+            g_opencl_global.command_queue = NULL;
         }
     }
 
@@ -143,8 +413,20 @@ static
 int init_opencl_image(int w, int h)
 {
     cl_int cl_ret;
+    size_t max_width = 0;
+    size_t max_height = 0;
+    clGetDeviceInfo(g_opencl_global.opencl_device, CL_DEVICE_IMAGE2D_MAX_WIDTH, sizeof(max_width), &max_width, NULL);
+    clGetDeviceInfo(g_opencl_global.opencl_device, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof(max_height), &max_height, NULL);
+    if (max_width > 0 && max_height > 0 && ((size_t)w > max_width || (size_t)h > max_height))
+    {
+        /* 更大的画面可以用 ray_tile 分块渲染 */
+        printf("init_opencl_image: %dx%d exceeds the device image limit %zux%zu\n", w, h, max_width, max_height);
+        return -1;
+    }
+
     cl_image_format image_format = {CL_RGBA, CL_UNSIGNED_INT8};
-    cl_mem image = clCreateImage2D(g_opencl_global.opencl_device_context, CL_MEM_WRITE_ONLY, &image_format, 
+    /* 抗锯齿的边缘检测需要读取第一遍渲染的结果 */
+    cl_mem image = clCreateImage2D(g_opencl_global.opencl_device_context, CL_MEM_READ_WRITE, &image_format, 
         w, h, 0, NULL, &cl_ret);
     if (cl_ret != CL_SUCCESS || image == NULL)
     {
@@ -153,48 +435,218 @@ int init_opencl_image(int w, int h)
     }
 
     g_opencl_global.canvas_image = image;
+    g_opencl_global.canvas_width = w;
+    g_opencl_global.canvas_height = h;
+    g_opencl_global.gradient_args_dirty = 1;
+    g_opencl_global.depth_args_dirty = 1;
 
     return 0;
 }
 
+void cl_render_build_options(char *build_options, int size, const render_options_t *options)
+{
+    snprintf(build_options, size, "-DSHADE_MODE=%d -DCHECKER_SIZE=%d -DDEPTH_SCALE=%.9ef",
+        options->shade_mode, options->checker_size, options->depth_scale);
+}
+
+/* 以 -D 编译选项特化 options 并加入变体表，返回变体下标 */
+static
+int build_variant(const render_options_t *options)
+{
+    if (g_opencl_global.variant_count >= CL_MAX_VARIANTS)
+    {
+        printf("build_variant, variant table is full\n");
+        return -1;
+    }
+
+    char build_options[CL_RENDER_BUILD_OPTIONS_SIZE];
+    cl_render_build_options(build_options, sizeof(build_options), options);
+
+    int from_cache = 0;
+    cl_program program = cl_program_cache_build(g_opencl_global.opencl_device_context, g_opencl_global.opencl_platform,
+        g_opencl_global.opencl_device, g_opencl_global.ocl_source, g_opencl_global.ocl_source_len, build_options, &from_cache);
+    if (program == NULL)
+    {
+        return -1;
+    }
+
+    cl_int cl_ret;
+    cl_kernel kernel = clCreateKernel(program, "render_project_depth", &cl_ret);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("build_variant, no render_project_depth kernel was found\n");
+        clReleaseProgram(program);
+        return -1;
+    }
+
+    cl_kernel aa_edges_kernel = clCreateKernel(program, "render_aa_edges", &cl_ret);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("build_variant, no render_aa_edges kernel was found\n");
+        clReleaseKernel(kernel);
+        clReleaseProgram(program);
+        return -1;
+    }
+    cl_kernel aa_resample_kernel = clCreateKernel(program, "render_aa_resample", &cl_ret);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("build_variant, no render_aa_resample kernel was found\n");
+        clReleaseKernel(aa_edges_kernel);
+        clReleaseKernel(kernel);
+        clReleaseProgram(program);
+        return -1;
+    }
+    cl_kernel wavefront_kernels[CL_WAVEFRONT_KERNEL_COUNT];
+    for (int i = 0; i < CL_WAVEFRONT_KERNEL_COUNT; ++i)
+    {
+        wavefront_kernels[i] = clCreateKernel(program, g_wavefront_kernel_names[i], &cl_ret);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("build_variant, no %s kernel was found\n", g_wavefront_kernel_names[i]);
+            while (i-- > 0)
+            {
+                clReleaseKernel(wavefront_kernels[i]);
+            }
+            clReleaseKernel(aa_resample_kernel);
+            clReleaseKernel(aa_edges_kernel);
+            clReleaseKernel(kernel);
+            clReleaseProgram(program);
+            return -1;
+        }
+    }
+    cl_kernel tile_bin_kernels[CL_TILE_BIN_KERNEL_COUNT];
+    for (int i = 0; i < CL_TILE_BIN_KERNEL_COUNT; ++i)
+    {
+        tile_bin_kernels[i] = clCreateKernel(program, g_tile_bin_kernel_names[i], &cl_ret);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("build_variant, no %s kernel was found\n", g_tile_bin_kernel_names[i]);
+            while (i-- > 0)
+            {
+                clReleaseKernel(tile_bin_kernels[i]);
+            }
+            for (int k = 0; k < CL_WAVEFRONT_KERNEL_COUNT; ++k)
+            {
+                clReleaseKernel(wavefront_kernels[k]);
+            }
+            clReleaseKernel(aa_resample_kernel);
+            clReleaseKernel(aa_edges_kernel);
+            clReleaseKernel(kernel);
+            clReleaseProgram(program);
+            return -1;
+        }
+    }
+    cl_kernel batch_kernel = clCreateKernel(program, "render_project_depth_batch", &cl_ret);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("build_variant, no render_project_depth_batch kernel was found\n");
+        for (int k = 0; k < CL_TILE_BIN_KERNEL_COUNT; ++k)
+        {
+            clReleaseKernel(tile_bin_kernels[k]);
+        }
+        for (int k = 0; k < CL_WAVEFRONT_KERNEL_COUNT; ++k)
+        {
+            clReleaseKernel(wavefront_kernels[k]);
+        }
+        clReleaseKernel(aa_resample_kernel);
+        clReleaseKernel(aa_edges_kernel);
+        clReleaseKernel(kernel);
+        clReleaseProgram(program);
+        return -1;
+    }
+
+    int idx = g_opencl_global.variant_count++;
+    cl_variant_t *variant = &g_opencl_global.variants[idx];
+    memset(variant, 0, sizeof(*variant));
+    variant->options = *options;
+    strcpy(variant->build_options, build_options);
+    variant->program = program;
+    variant->render_project_depth_kernel = kernel;
+    variant->render_aa_edges_kernel = aa_edges_kernel;
+    variant->render_aa_resample_kernel = aa_resample_kernel;
+    memcpy(variant->wavefront_kernels, wavefront_kernels, sizeof(wavefront_kernels));
+    memcpy(variant->tile_bin_kernels, tile_bin_kernels, sizeof(tile_bin_kernels));
+    variant->render_batch_kernel = batch_kernel;
+    variant->from_cache = from_cache;
+
+    return idx;
+}
+
+static
+int find_variant(const render_options_t *options)
+{
+    for (int i = 0; i < g_opencl_global.variant_count; ++i)
+    {
+        const render_options_t *variant_options = &g_opencl_global.variants[i].options;
+        if (variant_options->shade_mode == options->shade_mode &&
+            variant_options->checker_size == options->checker_size &&
+            variant_options->depth_scale == options->depth_scale)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void release_frame_slots(void);
+
+static
+void select_variant(int idx)
+{
+    cl_variant_t *variant = &g_opencl_global.variants[idx];
+    if (g_opencl_global.render_project_depth_kernel == variant->render_project_depth_kernel)
+    {
+        return;
+    }
+
+    g_opencl_global.current_variant = idx;
+    g_opencl_global.program = variant->program;
+    g_opencl_global.render_project_depth_kernel = variant->render_project_depth_kernel;
+    g_opencl_global.depth_args_dirty = 1;
+    /* 流水线各 slot 的 kernel 由当前 program 创建，需要重建 */
+    release_frame_slots();
+}
+
 static
 int load_opencl_program(const char *ocl_source_file)
 {
     char *ocl_source;
     size_t ocl_source_len;
 
+    uint64_t ts1 = now_ns();
     FILE *fp = fopen(ocl_source_file, "rb");
+    if (fp == NULL)
+    {
+        printf("load_opencl_program, failed to open %s\n", ocl_source_file);
+        return -1;
+    }
     fseek(fp, 0, SEEK_END);
     ocl_source_len = ftell(fp);
     fseek(fp, 0, SEEK_SET);
     ocl_source = (char*)malloc(ocl_source_len+1);
     fread(ocl_source, 1, ocl_source_len, fp);
-    ocl_source[ocl_source_len] = '0'; 
+    ocl_source[ocl_source_len] = '\0'; 
     fclose(fp);
 
-    cl_int cl_ret;
-    cl_program program = clCreateProgramWithSource(g_opencl_global.opencl_device_context, 1, &ocl_source, &ocl_source_len, &cl_ret);
-    if (cl_ret != CL_SUCCESS || program == NULL)
-    {
-        printf("load_opencl_program, clCreateProgramWithSource() failed, ret: %d\n", cl_ret);
-        free(ocl_source);
-        return -1;
-    }
-    free(ocl_source);
+    /* 源码保留到 uninit，供之后编译其他变体 */
+    g_opencl_global.ocl_source = ocl_source;
+    g_opencl_global.ocl_source_len = ocl_source_len;
 
-    cl_ret = clBuildProgram(program, 1, &g_opencl_global.opencl_device, NULL, NULL, NULL);
-    if (cl_ret != CL_SUCCESS)
+    render_options_t options;
+    setup_render_options(&options);
+    int idx = build_variant(&options);
+    if (idx < 0)
     {
-        char build_log[4096];
-        memset(build_log, 0, sizeof(build_log));
-        size_t log_len;
-        clGetProgramBuildInfo(program, g_opencl_global.opencl_device, CL_PROGRAM_BUILD_LOG, sizeof(build_log), build_log, &log_len);
-        printf("load_opencl_program, clBuildProgram() failed, build log:\n%s\n", build_log);
-
-        clReleaseProgram(program);
         return -1;
     }
-    cl_kernel kernel = clCreateKernel(program, "render_gradient", &cl_ret);
+    uint64_t ts2 = now_ns();
+    g_opencl_global.program_from_cache = g_opencl_global.variants[idx].from_cache;
+    g_opencl_global.program_load_ns = ts2 - ts1;
+    printf("load_opencl_program, program %s, time elapsed: %.3fms\n",
+        g_opencl_global.program_from_cache ? "loaded from cache" : "built from source", (ts2 - ts1) / 1e6);
+
+    cl_int cl_ret;
+    cl_kernel kernel = clCreateKernel(g_opencl_global.variants[idx].program, "render_gradient", &cl_ret);
     if (cl_ret == CL_SUCCESS)
     {
         g_opencl_global.render_gradient_kernel = kernel;
@@ -203,233 +655,2367 @@ int load_opencl_program(const char *ocl_source_file)
     {
         printf("load_opencl_program, no render_gradient kernel was found\n");
     }
-    kernel = clCreateKernel(program, "render_project_depth", &cl_ret);
-    if (cl_ret == CL_SUCCESS)
-    {
-        g_opencl_global.render_project_depth_kernel = kernel;
-    }
-    else
-    {
-        printf("load_opencl_program, no render_project_depth kernel was found\n");
-    }
-    g_opencl_global.program = program;
+    select_variant(idx);
 
     return 0; 
 }
 
 void uninit_cl_render(void);
 
-int init_cl_rendler(const char *ocl_source_file, int w, int h)
-{
-    memset(&g_opencl_global, 0, sizeof(g_opencl_global));
+/********************************************************************************/
 
-    do
+/* 性能分析: 各命令入队时保留 event，完成之后取回 queued、submit、start、end 四个时间戳交给 profiler。
+ * 未开启时各 profiled_* 直接入队，不创建额外的 event
+ */
+
+/* 取回已完成的命令的时间戳，wait 不为 0 时先等待全部命令完成 */
+static
+void profile_collect(int wait)
+{
+    int kept = 0;
+    for (int i = 0; i < g_opencl_global.profiled_count; ++i)
     {
-        if (init_opencl_device() != 0)
+        cl_profiled_event_t *profiled = &g_opencl_global.profiled[i];
+        if (wait)
         {
-            printf("init_opencl_device() failed\n");
-            break;
+            clWaitForEvents(1, &profiled->event);
         }
-
-        if (load_opencl_program(ocl_source_file) != 0)
+        cl_int status = CL_QUEUED;
+        clGetEventInfo(profiled->event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+        if (status > CL_COMPLETE)
         {
-            printf("load_opencl_program() failed\n");
-            break;
+            g_opencl_global.profiled[kept++] = *profiled;
+            continue;
         }
 
-        if (init_opencl_image(w, h))
+        cl_ulong queued = 0, submit = 0, start = 0, end = 0;
+        cl_int cl_ret = CL_SUCCESS;
+        cl_ret |= clGetEventProfilingInfo(profiled->event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL);
+        cl_ret |= clGetEventProfilingInfo(profiled->event, CL_PROFILING_COMMAND_SUBMIT, sizeof(submit), &submit, NULL);
+        cl_ret |= clGetEventProfilingInfo(profiled->event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+        cl_ret |= clGetEventProfilingInfo(profiled->event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+        /* 出错的命令 status 为负数，没有有效的时间戳 */
+        if (status == CL_COMPLETE && cl_ret == CL_SUCCESS && queued > 0 && end >= start)
         {
-            printf("init_opencl_image() failed\n");
-            break;
+            /* 设备时钟与主机时钟的零点不同，以入队时刻对齐 */
+            uint64_t offset = profiled->host_ns - queued;
+            profiler_record_device(profiled->id, profiled->track, queued + offset, submit + offset, start + offset, end + offset);
         }
+        clReleaseEvent(profiled->event);
+    }
+    g_opencl_global.profiled_count = kept;
+}
 
-        return 0;
-    } while(0);
-
-    uninit_cl_render();
-
-    return -1;
+static
+void profile_release_pending(void)
+{
+    for (int i = 0; i < g_opencl_global.profiled_count; ++i)
+    {
+        clReleaseEvent(g_opencl_global.profiled[i].event);
+    }
+    g_opencl_global.profiled_count = 0;
 }
 
-void uninit_cl_render(void)
+/* 记录入队成功的命令。event 为调用者的 event 时另外保留一次引用，owned 为 1 时由此处接管 */
+static
+void profile_track(cl_command_queue queue, cl_event event, int owned, const char *name)
 {
-    if (g_opencl_global.canvas_image != NULL)
+    if (g_opencl_global.profiled_count == CL_PROFILE_MAX_PENDING)
     {
-        clReleaseMemObject(g_opencl_global.canvas_image);
-        g_opencl_global.canvas_image = NULL;
+        profile_collect(0);
     }
-    if (g_opencl_global.render_gradient_kernel != NULL)
+    int id = profiler_register(name, "opencl");
+    if (g_opencl_global.profiled_count == CL_PROFILE_MAX_PENDING || id < 0)
     {
-        clReleaseKernel(g_opencl_global.render_gradient_kernel);
-        g_opencl_global.render_gradient_kernel = NULL;
+        if (owned)
+        {
+            clReleaseEvent(event);
+        }
+        return;
     }
-    if (g_opencl_global.render_project_depth_kernel != NULL)
+    if (!owned)
     {
-        clReleaseKernel(g_opencl_global.render_project_depth_kernel);
-        g_opencl_global.render_project_depth_kernel = NULL;
+        clRetainEvent(event);
     }
-    if (g_opencl_global.program != NULL)
+
+    cl_profiled_event_t *profiled = &g_opencl_global.profiled[g_opencl_global.profiled_count++];
+    profiled->event = event;
+    profiled->id = id;
+    profiled->track = PROFILER_TRACK_DEVICE + (queue == g_opencl_global.read_queue ? 1 : 0);
+    profiled->host_ns = now_ns();
+}
+
+static
+cl_int profiled_enqueue_kernel(cl_command_queue queue, cl_kernel kernel, cl_uint work_dim, const size_t *global_work_offset,
+    const size_t *global_work_size, const size_t *local_work_size, cl_uint wait_count, const cl_event *wait_list, cl_event *event)
+{
+    if (!g_profiler_enabled)
     {
-        clReleaseProgram(g_opencl_global.program);
-        g_opencl_global.program = NULL;
+        return clEnqueueNDRangeKernel(queue, kernel, work_dim, global_work_offset, global_work_size, local_work_size,
+            wait_count, wait_list, event);
     }
-    if (g_opencl_global.command_queue != NULL)
+
+    cl_event profile_event = NULL;
+    cl_int cl_ret = clEnqueueNDRangeKernel(queue, kernel, work_dim, global_work_offset, global_work_size, local_work_size,
+        wait_count, wait_list, &profile_event);
+    if (cl_ret != CL_SUCCESS)
     {
-        clReleaseCommandQueue(g_opencl_global.command_queue);
-        g_opencl_global.command_queue = NULL;
+        return cl_ret;
     }
-    if (g_opencl_global.opencl_device_context != NULL)
+
+    char name[64];
+    memset(name, 0, sizeof(name));
+    clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name) - 1, name, NULL);
+    if (event != NULL)
     {
-        clReleaseContext(g_opencl_global.opencl_device_context);
-        g_opencl_global.opencl_device_context = NULL;
+        *event = profile_event;
     }
+    profile_track(queue, profile_event, event == NULL, name);
 
-    return;
+    return CL_SUCCESS;
 }
 
-int render_gradient_opencl(uint8_t* pixel, int w, int h, int pitch)
+static
+cl_int profiled_write_buffer(cl_command_queue queue, cl_mem buffer, cl_bool blocking, size_t offset, size_t size, const void *ptr,
+    cl_uint wait_count, const cl_event *wait_list, cl_event *event, const char *name)
 {
-    cl_int cl_ret;
-    cl_context device_context = g_opencl_global.opencl_device_context;
-    cl_command_queue command_queue = g_opencl_global.command_queue;
-    cl_kernel render_gradient_kernel = g_opencl_global.render_gradient_kernel;
-
-    /* 前面的工作可事先进行，不算在render过程 */
-    uint64_t ts1 = now_ms();
-    cl_ret = clSetKernelArg(render_gradient_kernel, 0, sizeof(g_opencl_global.canvas_image), &g_opencl_global.canvas_image);
-    if (cl_ret != CL_SUCCESS)
+    if (!g_profiler_enabled)
     {
-        printf("render_gradient_opencl: clSetKernelArg() failed, ret: %d\n", cl_ret);
-        return -1;
+        return clEnqueueWriteBuffer(queue, buffer, blocking, offset, size, ptr, wait_count, wait_list, event);
     }
 
-    size_t global_work_size[2] = {w, h};
-    size_t local_work_size[2] = {16, 16};
-    cl_event result_event = NULL;
-    cl_ret = clEnqueueNDRangeKernel(command_queue, render_gradient_kernel, 2, NULL, global_work_size, local_work_size, 0, NULL, &result_event);
+    cl_event profile_event = NULL;
+    cl_int cl_ret = clEnqueueWriteBuffer(queue, buffer, blocking, offset, size, ptr, wait_count, wait_list, &profile_event);
+    if (cl_ret != CL_SUCCESS)
+    {
+        return cl_ret;
+    }
+    if (event != NULL)
+    {
+        *event = profile_event;
+    }
+    profile_track(queue, profile_event, event == NULL, name);
+
+    return CL_SUCCESS;
+}
+
+static
+cl_int profiled_read_buffer(cl_command_queue queue, cl_mem buffer, cl_bool blocking, size_t offset, size_t size, void *ptr,
+    cl_uint wait_count, const cl_event *wait_list, cl_event *event, const char *name)
+{
+    if (!g_profiler_enabled)
+    {
+        return clEnqueueReadBuffer(queue, buffer, blocking, offset, size, ptr, wait_count, wait_list, event);
+    }
+
+    cl_event profile_event = NULL;
+    cl_int cl_ret = clEnqueueReadBuffer(queue, buffer, blocking, offset, size, ptr, wait_count, wait_list, &profile_event);
+    if (cl_ret != CL_SUCCESS)
+    {
+        return cl_ret;
+    }
+    if (event != NULL)
+    {
+        *event = profile_event;
+    }
+    profile_track(queue, profile_event, event == NULL, name);
+
+    return CL_SUCCESS;
+}
+
+static
+cl_int profiled_read_image(cl_command_queue queue, cl_mem image, cl_bool blocking, const size_t origin[3], const size_t region[3],
+    size_t row_pitch, void *ptr, cl_uint wait_count, const cl_event *wait_list, cl_event *event)
+{
+    if (!g_profiler_enabled)
+    {
+        return clEnqueueReadImage(queue, image, blocking, origin, region, row_pitch, 0, ptr, wait_count, wait_list, event);
+    }
+
+    cl_event profile_event = NULL;
+    cl_int cl_ret = clEnqueueReadImage(queue, image, blocking, origin, region, row_pitch, 0, ptr, wait_count, wait_list, &profile_event);
+    if (cl_ret != CL_SUCCESS)
+    {
+        return cl_ret;
+    }
+    if (event != NULL)
+    {
+        *event = profile_event;
+    }
+    profile_track(queue, profile_event, event == NULL, "read image");
+
+    return CL_SUCCESS;
+}
+
+/********************************************************************************/
+
+#define CL_DEFAULT_WORK_GROUP_SIZE 16
+#define CL_TUNE_REPEAT 3
+
+/* global size 向上取整为 local size 的整数倍，kernel 中丢弃超出画面的 work-item */
+static
+void padded_global_size(size_t global_size[2], const size_t local_size[2], int w, int h)
+{
+    global_size[0] = (w + local_size[0] - 1) / local_size[0] * local_size[0];
+    global_size[1] = (h + local_size[1] - 1) / local_size[1] * local_size[1];
+}
+
+/* 按调优结果入队 w x h 的 2D kernel，设备不接受该 local size 时退回由实现选择 */
+static
+cl_int enqueue_kernel_2d(cl_command_queue queue, cl_kernel kernel, cl_work_group_t *work_group, int w, int h,
+    cl_uint wait_count, const cl_event *wait_list, cl_event *event)
+{
+    size_t global_work_size[2] = {w, h};
+    if (work_group->size[0] > 0 && work_group->size[1] > 0)
+    {
+        padded_global_size(global_work_size, work_group->size, w, h);
+        cl_int cl_ret = profiled_enqueue_kernel(queue, kernel, 2, NULL, global_work_size, work_group->size,
+            wait_count, wait_list, event);
+        if (cl_ret != CL_INVALID_WORK_GROUP_SIZE)
+        {
+            return cl_ret;
+        }
+        printf("enqueue_kernel_2d, work-group %zux%zu rejected, fall back to implementation defined\n",
+            work_group->size[0], work_group->size[1]);
+        work_group->size[0] = 0;
+        work_group->size[1] = 0;
+        global_work_size[0] = w;
+        global_work_size[1] = h;
+    }
+
+    return profiled_enqueue_kernel(queue, kernel, 2, NULL, global_work_size, NULL, wait_count, wait_list, event);
+}
+
+/* 增量渲染时按矩形逐个入队 2D kernel，global offset 为矩形的左上角，local size 交由实现选择，
+ * 不产生矩形之外的 work-item。rect_count 须大于 0，只有第一次入队等待 wait_list，event 为最后一次入队的 event
+ */
+static
+cl_int enqueue_kernel_rects(cl_command_queue queue, cl_kernel kernel, const render_dirty_rect_t *rects, int rect_count,
+    cl_uint wait_count, const cl_event *wait_list, cl_event *event)
+{
+    for (int i = 0; i < rect_count; ++i)
+    {
+        size_t global_work_offset[2] = {rects[i].x0, rects[i].y0};
+        size_t global_work_size[2] = {rects[i].x1 - rects[i].x0, rects[i].y1 - rects[i].y0};
+        cl_int cl_ret = profiled_enqueue_kernel(queue, kernel, 2, global_work_offset, global_work_size, NULL,
+            i == 0 ? wait_count : 0, i == 0 ? wait_list : NULL, i + 1 == rect_count ? event : NULL);
+        if (cl_ret != CL_SUCCESS)
+        {
+            return cl_ret;
+        }
+    }
+
+    return CL_SUCCESS;
+}
+
+/* 对候选 local size 逐一计时，选出最快的并保存到缓存目录，之后的启动直接读取。
+ * 调用前 kernel 参数须已绑定，输出写入当前绑定的 canvas。环境变量 RAY_TRACE_CL_TUNE=0 时使用 16x16
+ */
+static
+void tune_work_group(cl_kernel kernel, const char *kernel_name, const char *build_options, int w, int h,
+    cl_work_group_t *work_group)
+{
+    static const size_t candidates[][2] =
+    {
+        {8, 8}, {16, 8}, {8, 16}, {16, 16}, {32, 4}, {32, 8}, {8, 32}, {32, 16},
+        {16, 32}, {64, 1}, {64, 2}, {64, 4}, {128, 1}, {256, 1}, {32, 32},
+    };
+
+    work_group->tuned = 1;
+    work_group->size[0] = CL_DEFAULT_WORK_GROUP_SIZE;
+    work_group->size[1] = CL_DEFAULT_WORK_GROUP_SIZE;
+
+    char key[640];
+    snprintf(key, sizeof(key), "%s\n%s\n%s", g_opencl_global.device_key, kernel_name, build_options);
+    if (cl_cache_load_work_group(key, work_group->size) == 0)
+    {
+        printf("tune_work_group, %s: %zux%zu (cached)\n", kernel_name, work_group->size[0], work_group->size[1]);
+        return;
+    }
+    const char *tune = getenv("RAY_TRACE_CL_TUNE");
+    if (tune != NULL && strcmp(tune, "0") == 0)
+    {
+        return;
+    }
+
+    size_t max_size = 0;
+    clGetKernelWorkGroupInfo(kernel, g_opencl_global.opencl_device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_size), &max_size, NULL);
+
+    cl_command_queue command_queue = g_opencl_global.command_queue;
+    clFinish(command_queue);
+
+    uint64_t best_ns = UINT64_MAX;
+    size_t best_size[2] = {0, 0};
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); ++i)
+    {
+        const size_t *local_size = candidates[i];
+        if (local_size[0] * local_size[1] > max_size)
+        {
+            continue;
+        }
+        size_t global_work_size[2];
+        padded_global_size(global_work_size, local_size, w, h);
+
+        /* 第一次执行不计时 */
+        cl_int cl_ret = clEnqueueNDRangeKernel(command_queue, kernel, 2, NULL, global_work_size, local_size, 0, NULL, NULL);
+        if (cl_ret != CL_SUCCESS || clFinish(command_queue) != CL_SUCCESS)
+        {
+            continue;
+        }
+        uint64_t ts1 = now_ns();
+        for (int r = 0; r < CL_TUNE_REPEAT && cl_ret == CL_SUCCESS; ++r)
+        {
+            cl_ret = clEnqueueNDRangeKernel(command_queue, kernel, 2, NULL, global_work_size, local_size, 0, NULL, NULL);
+        }
+        clFinish(command_queue);
+        uint64_t ts2 = now_ns();
+        if (cl_ret == CL_SUCCESS && ts2 - ts1 < best_ns)
+        {
+            best_ns = ts2 - ts1;
+            best_size[0] = local_size[0];
+            best_size[1] = local_size[1];
+        }
+    }
+
+    work_group->size[0] = best_size[0];
+    work_group->size[1] = best_size[1];
+    if (best_ns != UINT64_MAX)
+    {
+        printf("tune_work_group, %s: %zux%zu, %.3fms per frame at %dx%d\n", kernel_name,
+            best_size[0], best_size[1], best_ns / 1e6 / CL_TUNE_REPEAT, w, h);
+    }
+    else
+    {
+        printf("tune_work_group, %s: no candidate accepted, fall back to implementation defined\n", kernel_name);
+    }
+    cl_cache_store_work_group(key, work_group->size);
+}
+
+/********************************************************************************/
+
+/* 重新采样固定使用的 work-item 个数，各 work-item 按该步长遍历边缘像素 */
+#define CL_AA_RESAMPLE_ITEMS 16384
+
+static
+void release_aa_buffers(void)
+{
+    if (g_opencl_global.aa_ids_buffer != NULL)
+    {
+        clReleaseMemObject(g_opencl_global.aa_ids_buffer);
+        g_opencl_global.aa_ids_buffer = NULL;
+    }
+    if (g_opencl_global.aa_edge_buffer != NULL)
+    {
+        clReleaseMemObject(g_opencl_global.aa_edge_buffer);
+        g_opencl_global.aa_edge_buffer = NULL;
+    }
+    g_opencl_global.aa_capacity = 0;
+    render_dirty_invalidate(&g_opencl_global.dirty);
+}
+
+/* ids 和边缘像素列表按像素个数分配，容量足够时直接复用 */
+static
+int reserve_aa_buffers(int pixel_count)
+{
+    cl_context context = g_opencl_global.opencl_device_context;
+    cl_int cl_ret;
+    if (g_opencl_global.aa_count_buffer == NULL)
+    {
+        g_opencl_global.aa_count_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int), NULL, &cl_ret);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("reserve_aa_buffers, clCreateBuffer() for edge count failed, ret: %d\n", cl_ret);
+            g_opencl_global.aa_count_buffer = NULL;
+            return -1;
+        }
+    }
+    if (g_opencl_global.aa_capacity >= pixel_count)
+    {
+        return 0;
+    }
+
+    /* 之前提交的帧可能仍在使用旧的缓冲区 */
+    clFinish(g_opencl_global.command_queue);
+    release_aa_buffers();
+    g_opencl_global.aa_ids_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * pixel_count, NULL, &cl_ret);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("reserve_aa_buffers, clCreateBuffer() for ids failed, ret: %d\n", cl_ret);
+        g_opencl_global.aa_ids_buffer = NULL;
+        return -1;
+    }
+    g_opencl_global.aa_edge_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * pixel_count, NULL, &cl_ret);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("reserve_aa_buffers, clCreateBuffer() for edge list failed, ret: %d\n", cl_ret);
+        g_opencl_global.aa_edge_buffer = NULL;
+        release_aa_buffers();
+        return -1;
+    }
+    g_opencl_global.aa_capacity = pixel_count;
+
+    return 0;
+}
+
+/* 本帧是否做抗锯齿，是则准备好缓冲区 */
+static
+int antialias_enabled(int w, int h, int pixel_step)
+{
+    return g_opencl_global.aa_grid >= 2 && pixel_step == 1 && reserve_aa_buffers(w * h) == 0;
+}
+
+/* 每帧变化的 depth kernel 参数: pixel_step、抗锯齿的 ids 缓冲区和分箱的结果，ids_buffer 为 NULL 时不写入 ids，
+ * bins 为 0 时遍历整个场景
+ */
+static
+int bind_frame_kernel_args(cl_kernel kernel, int pixel_step, cl_mem ids_buffer, int bins)
+{
+    cl_int cl_ret = clSetKernelArg(kernel, 4, sizeof(pixel_step), &pixel_step);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("bind_frame_kernel_args: clSetKernelArg(pixel_step) failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+    cl_ret = clSetKernelArg(kernel, 5, sizeof(cl_mem), ids_buffer != NULL ? &ids_buffer : NULL);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("bind_frame_kernel_args: clSetKernelArg(ids) failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+    cl_ret = clSetKernelArg(kernel, 6, sizeof(cl_mem), bins ? &g_opencl_global.bin_offsets_buffer : NULL);
+    cl_ret |= clSetKernelArg(kernel, 7, sizeof(cl_mem), bins ? &g_opencl_global.bin_nodes_buffer : NULL);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("bind_frame_kernel_args: clSetKernelArg(bins) failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+void update_aa_stats(int w, int h, int pixel_step, int grid, int edge_count)
+{
+    render_aa_stats_t *stats = &g_opencl_global.aa_stats;
+    stats->pixel_count = (uint64_t)w * h;
+    stats->edge_pixel_count = edge_count;
+    stats->sample_count = (uint64_t)((w + pixel_step - 1) / pixel_step) * ((h + pixel_step - 1) / pixel_step) +
+        (uint64_t)edge_count * grid * grid;
+}
+
+/* 在第一遍渲染之后入队抗锯齿: 计数清零、边缘检测、重新采样。kernel_event 为第一遍渲染的 event，
+ * 成功时替换为重新采样的 event; 边缘像素个数以非阻塞方式读入 edge_count，读取完成时 count_event 触发。
+ * 抗锯齿时不做增量渲染，边缘检测总是整个画面
+ */
+static
+int enqueue_antialias(cl_mem canvas_image, int w, int h, cl_event *kernel_event, cl_int *edge_count, cl_event *count_event)
+{
+    static const cl_int zero = 0;
+    cl_command_queue command_queue = g_opencl_global.command_queue;
+    cl_variant_t *variant = &g_opencl_global.variants[g_opencl_global.current_variant];
+    cl_kernel edges_kernel = variant->render_aa_edges_kernel;
+    cl_kernel resample_kernel = variant->render_aa_resample_kernel;
+    int grid = g_opencl_global.aa_grid;
+
+    cl_int cl_ret = CL_SUCCESS;
+    cl_ret |= clSetKernelArg(edges_kernel, 0, sizeof(cl_mem), &canvas_image);
+    cl_ret |= clSetKernelArg(edges_kernel, 1, sizeof(cl_mem), &g_opencl_global.aa_ids_buffer);
+    cl_ret |= clSetKernelArg(edges_kernel, 2, sizeof(cl_mem), &g_opencl_global.aa_edge_buffer);
+    cl_ret |= clSetKernelArg(edges_kernel, 3, sizeof(cl_mem), &g_opencl_global.aa_count_buffer);
+    cl_ret |= clSetKernelArg(resample_kernel, 0, sizeof(cl_mem), &g_opencl_global.camera_buffer);
+    cl_ret |= clSetKernelArg(resample_kernel, 1, sizeof(cl_mem), &g_opencl_global.spheres_buffer);
+    cl_ret |= clSetKernelArg(resample_kernel, 2, sizeof(cl_mem), &g_opencl_global.nodes_buffer);
+    cl_ret |= clSetKernelArg(resample_kernel, 3, sizeof(cl_mem), &g_opencl_global.aa_edge_buffer);
+    cl_ret |= clSetKernelArg(resample_kernel, 4, sizeof(cl_mem), &g_opencl_global.aa_count_buffer);
+    cl_ret |= clSetKernelArg(resample_kernel, 5, sizeof(cl_mem), &canvas_image);
+    cl_ret |= clSetKernelArg(resample_kernel, 6, sizeof(grid), &grid);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("enqueue_antialias: clSetKernelArg() failed\n");
+        return -1;
+    }
+
+    cl_event wait_events[2] = {*kernel_event, NULL};
+    cl_ret = profiled_write_buffer(command_queue, g_opencl_global.aa_count_buffer, CL_FALSE, 0, sizeof(zero), &zero,
+        0, NULL, &wait_events[1], "zero edge count");
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("enqueue_antialias: clEnqueueWriteBuffer() failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+
+    /* 边缘检测每次执行都会累加计数，不参与 work-group 调优 */
+    cl_work_group_t edges_work_group = {{0, 0}, 1};
+    cl_event edges_event = NULL;
+    cl_ret = enqueue_kernel_2d(command_queue, edges_kernel, &edges_work_group, w, h, 2, wait_events, &edges_event);
+    clReleaseEvent(wait_events[1]);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("enqueue_antialias: enqueue render_aa_edges failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+
+    cl_ret = profiled_read_buffer(command_queue, g_opencl_global.aa_count_buffer, CL_FALSE, 0, sizeof(cl_int), edge_count,
+        1, &edges_event, count_event, "read edge count");
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("enqueue_antialias: clEnqueueReadBuffer() failed, ret: %d\n", cl_ret);
+        clReleaseEvent(edges_event);
+        return -1;
+    }
+
+    size_t global_work_size = CL_AA_RESAMPLE_ITEMS;
+    cl_event resample_event = NULL;
+    cl_ret = profiled_enqueue_kernel(command_queue, resample_kernel, 1, NULL, &global_work_size, NULL, 1, &edges_event, &resample_event);
+    clReleaseEvent(edges_event);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("enqueue_antialias: enqueue render_aa_resample failed, ret: %d\n", cl_ret);
+        clReleaseEvent(*count_event);
+        *count_event = NULL;
+        return -1;
+    }
+
+    clReleaseEvent(*kernel_event);
+    *kernel_event = resample_event;
+
+    return 0;
+}
+
+/********************************************************************************/
+
+/* 屏幕空间分箱，见 tile_bin.h。tile_bin_scan 的 work-group 大小须与 render.cl 中的 TILE_BIN_SCAN_GROUP 一致 */
+#define CL_TILE_BIN_SCAN_GROUP 256
+/* 列表的初始容量，按 tile 个数的倍数 */
+#define CL_TILE_BIN_INITIAL_ENTRIES 8
+
+static
+void release_tile_bin_buffers(void)
+{
+    if (g_opencl_global.bin_total_event != NULL)
+    {
+        clWaitForEvents(1, &g_opencl_global.bin_total_event);
+        clReleaseEvent(g_opencl_global.bin_total_event);
+        g_opencl_global.bin_total_event = NULL;
+    }
+    if (g_opencl_global.bin_offsets_buffer != NULL)
+    {
+        clReleaseMemObject(g_opencl_global.bin_offsets_buffer);
+        g_opencl_global.bin_offsets_buffer = NULL;
+    }
+    if (g_opencl_global.bin_nodes_buffer != NULL)
+    {
+        clReleaseMemObject(g_opencl_global.bin_nodes_buffer);
+        g_opencl_global.bin_nodes_buffer = NULL;
+    }
+    g_opencl_global.bin_offsets_capacity = 0;
+    g_opencl_global.bin_nodes_capacity = 0;
+    g_opencl_global.bin_valid = 0;
+}
+
+/* 起始位置按 tile 个数加一分配; 列表至少容纳上一次的总长度，不足时按两倍增长 */
+static
+int reserve_tile_bin_buffers(int tile_count)
+{
+    cl_context context = g_opencl_global.opencl_device_context;
+    cl_int cl_ret;
+    int nodes_capacity = g_opencl_global.bin_nodes_capacity;
+    if (nodes_capacity == 0)
+    {
+        nodes_capacity = tile_count * CL_TILE_BIN_INITIAL_ENTRIES;
+    }
+    while (nodes_capacity < g_opencl_global.bin_total)
+    {
+        nodes_capacity *= 2;
+    }
+    if (g_opencl_global.bin_offsets_capacity >= tile_count + 1 && g_opencl_global.bin_nodes_capacity >= nodes_capacity)
+    {
+        return 0;
+    }
+
+    /* 之前提交的帧可能仍在使用旧的缓冲区 */
+    clFinish(g_opencl_global.command_queue);
+    cl_int total = g_opencl_global.bin_total;
+    release_tile_bin_buffers();
+    g_opencl_global.bin_total = total;
+    g_opencl_global.bin_offsets_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * (tile_count + 1), NULL, &cl_ret);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("reserve_tile_bin_buffers, clCreateBuffer() for offsets failed, ret: %d\n", cl_ret);
+        g_opencl_global.bin_offsets_buffer = NULL;
+        return -1;
+    }
+    g_opencl_global.bin_nodes_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * nodes_capacity, NULL, &cl_ret);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("reserve_tile_bin_buffers, clCreateBuffer() for node lists failed, ret: %d\n", cl_ret);
+        g_opencl_global.bin_nodes_buffer = NULL;
+        release_tile_bin_buffers();
+        return -1;
+    }
+    g_opencl_global.bin_offsets_capacity = tile_count + 1;
+    g_opencl_global.bin_nodes_capacity = nodes_capacity;
+
+    return 0;
+}
+
+/* 在设备上建立 w x h 画面各 tile 的节点列表: 计数、前缀和、填充三个 kernel，之后非阻塞地读回总长度。
+ * 须在 upload_dirty_data() 之后调用，kernel 与之后的渲染在同一个 in-order 队列中依次执行。
+ * 总长度超过容量时本次的列表不可用，render_project_depth 遍历整个场景，下一帧按读回的总长度扩充后重建。
+ * 返回 0 时可以绑定分箱的结果
+ */
+static
+int enqueue_tile_bins(int w, int h)
+{
+    if (g_opencl_global.bin_total_event != NULL)
+    {
+        /* 上一次建立时入队，此时通常早已完成 */
+        clWaitForEvents(1, &g_opencl_global.bin_total_event);
+        clReleaseEvent(g_opencl_global.bin_total_event);
+        g_opencl_global.bin_total_event = NULL;
+        if (g_opencl_global.bin_total > g_opencl_global.bin_nodes_capacity)
+        {
+            g_opencl_global.bin_valid = 0;
+        }
+    }
+    if (g_opencl_global.bin_valid && g_opencl_global.bin_width == w && g_opencl_global.bin_height == h)
+    {
+        return 0;
+    }
+
+    int tiles_x = (w + TILE_BIN_SIZE - 1) / TILE_BIN_SIZE;
+    int tiles_y = (h + TILE_BIN_SIZE - 1) / TILE_BIN_SIZE;
+    int tile_count = tiles_x * tiles_y;
+    if (reserve_tile_bin_buffers(tile_count) != 0)
+    {
+        return -1;
+    }
+
+    cl_command_queue command_queue = g_opencl_global.command_queue;
+    cl_variant_t *variant = &g_opencl_global.variants[g_opencl_global.current_variant];
+    cl_kernel count_kernel = variant->tile_bin_kernels[CL_TILE_BIN_COUNT];
+    cl_kernel scan_kernel = variant->tile_bin_kernels[CL_TILE_BIN_SCAN];
+    cl_kernel fill_kernel = variant->tile_bin_kernels[CL_TILE_BIN_FILL];
+    int capacity = g_opencl_global.bin_nodes_capacity;
+
+    cl_int cl_ret = CL_SUCCESS;
+    cl_ret |= clSetKernelArg(count_kernel, 0, sizeof(cl_mem), &g_opencl_global.camera_buffer);
+    cl_ret |= clSetKernelArg(count_kernel, 1, sizeof(cl_mem), &g_opencl_global.nodes_buffer);
+    cl_ret |= clSetKernelArg(count_kernel, 2, sizeof(w), &w);
+    cl_ret |= clSetKernelArg(count_kernel, 3, sizeof(h), &h);
+    cl_ret |= clSetKernelArg(count_kernel, 4, sizeof(cl_mem), &g_opencl_global.bin_offsets_buffer);
+    cl_ret |= clSetKernelArg(scan_kernel, 0, sizeof(cl_mem), &g_opencl_global.bin_offsets_buffer);
+    cl_ret |= clSetKernelArg(scan_kernel, 1, sizeof(tile_count), &tile_count);
+    cl_ret |= clSetKernelArg(scan_kernel, 2, sizeof(capacity), &capacity);
+    cl_ret |= clSetKernelArg(fill_kernel, 0, sizeof(cl_mem), &g_opencl_global.camera_buffer);
+    cl_ret |= clSetKernelArg(fill_kernel, 1, sizeof(cl_mem), &g_opencl_global.nodes_buffer);
+    cl_ret |= clSetKernelArg(fill_kernel, 2, sizeof(w), &w);
+    cl_ret |= clSetKernelArg(fill_kernel, 3, sizeof(h), &h);
+    cl_ret |= clSetKernelArg(fill_kernel, 4, sizeof(cl_mem), &g_opencl_global.bin_offsets_buffer);
+    cl_ret |= clSetKernelArg(fill_kernel, 5, sizeof(cl_mem), &g_opencl_global.bin_nodes_buffer);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("enqueue_tile_bins: clSetKernelArg() failed\n");
+        return -1;
+    }
+
+    /* 每个 work-item 一个 tile */
+    cl_work_group_t tile_work_group = {{8, 8}, 1};
+    cl_ret = enqueue_kernel_2d(command_queue, count_kernel, &tile_work_group, tiles_x, tiles_y, 0, NULL, NULL);
+    if (cl_ret == CL_SUCCESS)
+    {
+        size_t scan_size = CL_TILE_BIN_SCAN_GROUP;
+        cl_ret = profiled_enqueue_kernel(command_queue, scan_kernel, 1, NULL, &scan_size, &scan_size, 0, NULL, NULL);
+    }
+    if (cl_ret == CL_SUCCESS)
+    {
+        cl_ret = enqueue_kernel_2d(command_queue, fill_kernel, &tile_work_group, tiles_x, tiles_y, 0, NULL, NULL);
+    }
+    if (cl_ret == CL_SUCCESS)
+    {
+        cl_ret = profiled_read_buffer(command_queue, g_opencl_global.bin_offsets_buffer, CL_FALSE, sizeof(cl_int) * tile_count,
+            sizeof(cl_int), &g_opencl_global.bin_total, 0, NULL, &g_opencl_global.bin_total_event, "read tile bin total");
+    }
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("enqueue_tile_bins: enqueue failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+
+    g_opencl_global.bin_width = w;
+    g_opencl_global.bin_height = h;
+    g_opencl_global.bin_valid = 1;
+
+    return 0;
+}
+
+/********************************************************************************/
+
+/* wavefront 的 1D kernel 使用固定的 work-group 大小，kernel 中以 local 原子操作合并每个 work-group 的入队 */
+#define CL_WAVEFRONT_GROUP_SIZE 64
+
+static
+void release_wavefront_buffers(void)
+{
+    cl_mem *buffers[] =
+    {
+        &g_opencl_global.wf_ray_buffers[0], &g_opencl_global.wf_ray_buffers[1],
+        &g_opencl_global.wf_count_buffers[0], &g_opencl_global.wf_count_buffers[1],
+        &g_opencl_global.wf_hit_buffer, &g_opencl_global.wf_accum_buffer,
+    };
+    for (size_t i = 0; i < sizeof(buffers) / sizeof(buffers[0]); ++i)
+    {
+        if (*buffers[i] != NULL)
+        {
+            clReleaseMemObject(*buffers[i]);
+            *buffers[i] = NULL;
+        }
+    }
+    g_opencl_global.wf_capacity = 0;
+}
+
+/* 光线队列、求交结果和累加颜色按像素个数分配，容量足够时直接复用 */
+static
+int reserve_wavefront_buffers(int pixel_count)
+{
+    if (g_opencl_global.wf_capacity >= pixel_count)
+    {
+        return 0;
+    }
+
+    /* 每条光线 8 个 4 字节的标量，求交结果 2 个，与 render.cl 中的定义一致 */
+    struct
+    {
+        cl_mem *buffer;
+        size_t size;
+        const char *name;
+    } buffers[] =
+    {
+        {&g_opencl_global.wf_ray_buffers[0], sizeof(cl_float) * 8 * pixel_count, "rays"},
+        {&g_opencl_global.wf_ray_buffers[1], sizeof(cl_float) * 8 * pixel_count, "rays"},
+        {&g_opencl_global.wf_count_buffers[0], sizeof(cl_int), "ray count"},
+        {&g_opencl_global.wf_count_buffers[1], sizeof(cl_int), "ray count"},
+        {&g_opencl_global.wf_hit_buffer, sizeof(cl_float) * 2 * pixel_count, "hits"},
+        {&g_opencl_global.wf_accum_buffer, sizeof(cl_float4) * pixel_count, "accum"},
+    };
+
+    release_wavefront_buffers();
+    for (size_t i = 0; i < sizeof(buffers) / sizeof(buffers[0]); ++i)
+    {
+        cl_int cl_ret;
+        *buffers[i].buffer = clCreateBuffer(g_opencl_global.opencl_device_context, CL_MEM_READ_WRITE, buffers[i].size, NULL, &cl_ret);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("reserve_wavefront_buffers, clCreateBuffer() for %s failed, size: %zu, ret: %d\n", buffers[i].name, buffers[i].size, cl_ret);
+            *buffers[i].buffer = NULL;
+            release_wavefront_buffers();
+            return -1;
+        }
+    }
+    g_opencl_global.wf_capacity = pixel_count;
+
+    return 0;
+}
+
+/* 入队 count 个 work-item 的 1D kernel，global size 向上取整为 work-group 大小的整数倍 */
+static
+cl_int enqueue_kernel_1d(cl_command_queue queue, cl_kernel kernel, int count)
+{
+    size_t local_work_size = CL_WAVEFRONT_GROUP_SIZE;
+    size_t global_work_size = (count + local_work_size - 1) / local_work_size * local_work_size;
+    return profiled_enqueue_kernel(queue, kernel, 1, NULL, &global_work_size, &local_work_size, 0, NULL, NULL);
+}
+
+/********************************************************************************/
+
+/* 批量渲染每个输出 buffer 的字节数上限，视角更多时分批入队，相邻两批的渲染与读回重叠 */
+#define CL_BATCH_MAX_BYTES (64 << 20)
+
+static
+void release_batch_buffers(void)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        if (g_opencl_global.batch_out_buffers[i] != NULL)
+        {
+            clReleaseMemObject(g_opencl_global.batch_out_buffers[i]);
+            g_opencl_global.batch_out_buffers[i] = NULL;
+        }
+    }
+    g_opencl_global.batch_out_size = 0;
+    if (g_opencl_global.batch_camera_buffer != NULL)
+    {
+        clReleaseMemObject(g_opencl_global.batch_camera_buffer);
+        g_opencl_global.batch_camera_buffer = NULL;
+    }
+    free(g_opencl_global.batch_cameras);
+    g_opencl_global.batch_cameras = NULL;
+    g_opencl_global.batch_camera_capacity = 0;
+}
+
+/* 摄像机按视角个数、输出 buffer 按每批的字节数分配，容量足够时直接复用 */
+static
+int reserve_batch_buffers(int view_count, size_t out_size)
+{
+    cl_context context = g_opencl_global.opencl_device_context;
+    cl_int cl_ret;
+    if (g_opencl_global.batch_camera_capacity < view_count)
+    {
+        free(g_opencl_global.batch_cameras);
+        if (g_opencl_global.batch_camera_buffer != NULL)
+        {
+            clReleaseMemObject(g_opencl_global.batch_camera_buffer);
+        }
+        g_opencl_global.batch_camera_capacity = 0;
+        g_opencl_global.batch_cameras = (project_camera_t*)malloc(sizeof(project_camera_t) * view_count);
+        g_opencl_global.batch_camera_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(project_camera_t) * view_count,
+            NULL, &cl_ret);
+        if (g_opencl_global.batch_cameras == NULL || cl_ret != CL_SUCCESS)
+        {
+            printf("reserve_batch_buffers, alloc cameras failed, views: %d, ret: %d\n", view_count, cl_ret);
+            if (cl_ret != CL_SUCCESS)
+            {
+                g_opencl_global.batch_camera_buffer = NULL;
+            }
+            release_batch_buffers();
+            return -1;
+        }
+        g_opencl_global.batch_camera_capacity = view_count;
+    }
+
+    if (g_opencl_global.batch_out_size < out_size)
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            if (g_opencl_global.batch_out_buffers[i] != NULL)
+            {
+                clReleaseMemObject(g_opencl_global.batch_out_buffers[i]);
+            }
+            g_opencl_global.batch_out_buffers[i] = clCreateBuffer(context, CL_MEM_WRITE_ONLY, out_size, NULL, &cl_ret);
+            if (cl_ret != CL_SUCCESS)
+            {
+                printf("reserve_batch_buffers, clCreateBuffer() for output failed, size: %zu, ret: %d\n", out_size, cl_ret);
+                g_opencl_global.batch_out_buffers[i] = NULL;
+                release_batch_buffers();
+                return -1;
+            }
+        }
+        g_opencl_global.batch_out_size = out_size;
+    }
+
+    return 0;
+}
+
+/* 每批的视角个数: 一批的输出不超过 CL_BATCH_MAX_BYTES 和设备单个 buffer 的上限，至少一个视角 */
+static
+int batch_views_per_chunk(int w, int h, int view_count)
+{
+    cl_ulong max_alloc = 0;
+    clGetDeviceInfo(g_opencl_global.opencl_device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+    size_t limit = CL_BATCH_MAX_BYTES;
+    if (max_alloc > 0 && max_alloc < limit)
+    {
+        limit = (size_t)max_alloc;
+    }
+    size_t frame_size = (size_t)w * h * 4;
+    size_t views = limit / frame_size;
+    if (views < 1)
+    {
+        views = 1;
+    }
+    return views < (size_t)view_count ? (int)views : view_count;
+}
+
+int init_cl_rendler(const char *ocl_source_file, int w, int h)
+{
+    memset(&g_opencl_global, 0, sizeof(g_opencl_global));
+    if (!g_cl_region_sync.initialized)
+    {
+        mutex_init(&g_cl_region_sync.mutex);
+        cond_init(&g_cl_region_sync.cond);
+        g_cl_region_sync.initialized = 1;
+    }
+
+    do
+    {
+        if (init_opencl_device() != 0)
+        {
+            printf("init_opencl_device() failed\n");
+            break;
+        }
+
+        if (load_opencl_program(ocl_source_file) != 0)
+        {
+            printf("load_opencl_program() failed\n");
+            break;
+        }
+
+        if (init_opencl_image(w, h))
+        {
+            printf("init_opencl_image() failed\n");
+            break;
+        }
+
+        cl_int cl_ret;
+        g_opencl_global.camera_buffer = clCreateBuffer(g_opencl_global.opencl_device_context, CL_MEM_READ_ONLY,
+            sizeof(project_camera_t), NULL, &cl_ret);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("init_cl_rendler, clCreateBuffer() for project_camera failed, ret: %d\n", cl_ret);
+            g_opencl_global.camera_buffer = NULL;
+            break;
+        }
+        setup_project_camera(&g_opencl_global.camera);
+        g_opencl_global.dirty_flags = RENDER_DIRTY_CAMERA;
+        g_opencl_global.pipeline.depth = CL_PIPELINE_DEFAULT_DEPTH;
+        g_opencl_global.pixel_step = 1;
+        g_opencl_global.aa_grid = 1;
+        g_opencl_global.bounces = 0;
+
+        return 0;
+    } while(0);
+
+    uninit_cl_render();
+
+    return -1;
+}
+
+void uninit_cl_render(void)
+{
+    release_frame_slots();
+    if (g_opencl_global.region_event != NULL)
+    {
+        clWaitForEvents(1, &g_opencl_global.region_event);
+        clReleaseEvent(g_opencl_global.region_event);
+        g_opencl_global.region_event = NULL;
+    }
+    profile_collect(1);
+    profile_release_pending();
+    if (g_opencl_global.camera_upload_event != NULL)
+    {
+        clReleaseEvent(g_opencl_global.camera_upload_event);
+        g_opencl_global.camera_upload_event = NULL;
+    }
+    if (g_opencl_global.camera_buffer != NULL)
+    {
+        clReleaseMemObject(g_opencl_global.camera_buffer);
+        g_opencl_global.camera_buffer = NULL;
+    }
+    release_aa_buffers();
+    release_tile_bin_buffers();
+    g_opencl_global.bin_total = 0;
+    release_wavefront_buffers();
+    release_batch_buffers();
+    render_dirty_release(&g_opencl_global.dirty);
+    if (g_opencl_global.aa_count_buffer != NULL)
+    {
+        clReleaseMemObject(g_opencl_global.aa_count_buffer);
+        g_opencl_global.aa_count_buffer = NULL;
+    }
+    if (g_opencl_global.spheres_buffer != NULL)
+    {
+        clReleaseMemObject(g_opencl_global.spheres_buffer);
+        g_opencl_global.spheres_buffer = NULL;
+    }
+    if (g_opencl_global.nodes_buffer != NULL)
+    {
+        clReleaseMemObject(g_opencl_global.nodes_buffer);
+        g_opencl_global.nodes_buffer = NULL;
+    }
+    if (g_opencl_global.canvas_image != NULL)
+    {
+        clReleaseMemObject(g_opencl_global.canvas_image);
+        g_opencl_global.canvas_image = NULL;
+    }
+    if (g_opencl_global.render_gradient_kernel != NULL)
+    {
+        clReleaseKernel(g_opencl_global.render_gradient_kernel);
+        g_opencl_global.render_gradient_kernel = NULL;
+    }
+    memset(&g_opencl_global.gradient_work_group, 0, sizeof(g_opencl_global.gradient_work_group));
+    g_opencl_global.render_project_depth_kernel = NULL;
+    g_opencl_global.program = NULL;
+    for (int i = 0; i < g_opencl_global.variant_count; ++i)
+    {
+        clReleaseKernel(g_opencl_global.variants[i].render_project_depth_kernel);
+        clReleaseKernel(g_opencl_global.variants[i].render_aa_edges_kernel);
+        clReleaseKernel(g_opencl_global.variants[i].render_aa_resample_kernel);
+        for (int k = 0; k < CL_WAVEFRONT_KERNEL_COUNT; ++k)
+        {
+            clReleaseKernel(g_opencl_global.variants[i].wavefront_kernels[k]);
+        }
+        for (int k = 0; k < CL_TILE_BIN_KERNEL_COUNT; ++k)
+        {
+            clReleaseKernel(g_opencl_global.variants[i].tile_bin_kernels[k]);
+        }
+        clReleaseKernel(g_opencl_global.variants[i].render_batch_kernel);
+        clReleaseProgram(g_opencl_global.variants[i].program);
+    }
+    g_opencl_global.variant_count = 0;
+    free(g_opencl_global.ocl_source);
+    g_opencl_global.ocl_source = NULL;
+    if (g_opencl_global.read_queue != NULL)
+    {
+        clReleaseCommandQueue(g_opencl_global.read_queue);
+        g_opencl_global.read_queue = NULL;
+    }
+    if (g_opencl_global.command_queue != NULL)
+    {
+        clReleaseCommandQueue(g_opencl_global.command_queue);
+        g_opencl_global.command_queue = NULL;
+    }
+    if (g_opencl_global.opencl_device_context != NULL)
+    {
+        clReleaseContext(g_opencl_global.opencl_device_context);
+        g_opencl_global.opencl_device_context = NULL;
+    }
+
+    return;
+}
+
+/* 按新的画面尺寸重建 canvas image，尺寸不变时什么也不做 */
+int cl_render_resize(int w, int h)
+{
+    if (g_opencl_global.opencl_device_context == NULL)
+    {
+        return -1;
+    }
+    if (g_opencl_global.canvas_image != NULL)
+    {
+        if (g_opencl_global.canvas_width == w && g_opencl_global.canvas_height == h)
+        {
+            return 0;
+        }
+        clReleaseMemObject(g_opencl_global.canvas_image);
+        g_opencl_global.canvas_image = NULL;
+    }
+    render_dirty_invalidate(&g_opencl_global.dirty);
+
+    return init_opencl_image(w, h);
+}
+
+void cl_render_program_info(int *from_cache, uint64_t *load_ns)
+{
+    *from_cache = g_opencl_global.program_from_cache;
+    *load_ns = g_opencl_global.program_load_ns;
+}
+
+int cl_render_set_options(const render_options_t *options)
+{
+    if (g_opencl_global.ocl_source == NULL)
+    {
+        return -1;
+    }
+    if (options->checker_size <= 0 || options->depth_scale <= 0 ||
+        (options->shade_mode != RENDER_SHADE_DEPTH && options->shade_mode != RENDER_SHADE_NORMAL))
+    {
+        printf("cl_render_set_options, invalid options\n");
+        return -1;
+    }
+
+    int idx = find_variant(options);
+    if (idx < 0)
+    {
+        uint64_t ts1 = now_ns();
+        idx = build_variant(options);
+        if (idx < 0)
+        {
+            return -1;
+        }
+        uint64_t ts2 = now_ns();
+        printf("cl_render_set_options, variant %d %s, time elapsed: %.3fms\n", idx,
+            g_opencl_global.variants[idx].from_cache ? "loaded from cache" : "built from source", (ts2 - ts1) / 1e6);
+    }
+    select_variant(idx);
+
+    return 0;
+}
+
+void cl_render_set_scene(const scene_t *scene)
+{
+    g_opencl_global.scene = scene;
+    g_opencl_global.dirty_flags |= RENDER_DIRTY_SCENE;
+}
+
+void cl_render_set_camera(const project_camera_t *camera)
+{
+    /* 流水线渲染时上一帧的摄像机可能仍在上传 */
+    if (g_opencl_global.camera_upload_event != NULL)
+    {
+        clWaitForEvents(1, &g_opencl_global.camera_upload_event);
+        clReleaseEvent(g_opencl_global.camera_upload_event);
+        g_opencl_global.camera_upload_event = NULL;
+    }
+    g_opencl_global.camera = *camera;
+    g_opencl_global.dirty_flags |= RENDER_DIRTY_CAMERA;
+}
+
+int cl_render_set_pixel_step(int pixel_step)
+{
+    if (pixel_step < 1 || pixel_step > RENDER_MAX_PIXEL_STEP || (pixel_step & (pixel_step - 1)) != 0)
+    {
+        printf("cl_render_set_pixel_step, invalid pixel step: %d\n", pixel_step);
+        return -1;
+    }
+    g_opencl_global.pixel_step = pixel_step;
+
+    return 0;
+}
+
+int cl_render_set_antialias(int grid)
+{
+    if (grid < 1 || grid > RENDER_AA_MAX_GRID)
+    {
+        printf("cl_render_set_antialias, invalid grid: %d\n", grid);
+        return -1;
+    }
+    g_opencl_global.aa_grid = grid;
+
+    return 0;
+}
+
+void cl_render_antialias_stats(render_aa_stats_t *stats)
+{
+    *stats = g_opencl_global.aa_stats;
+}
+
+int cl_render_set_bounces(int bounces)
+{
+    if (bounces < 0 || bounces > RENDER_MAX_BOUNCES)
+    {
+        printf("cl_render_set_bounces, invalid bounces: %d\n", bounces);
+        return -1;
+    }
+    g_opencl_global.bounces = bounces;
+
+    return 0;
+}
+
+void cl_render_wavefront_stats(render_wavefront_stats_t *stats)
+{
+    *stats = g_opencl_global.wf_stats;
+}
+
+/* host 端原地修改了场景数据之后调用，flags 为 RENDER_DIRTY_* 的组合 */
+void cl_render_mark_dirty(unsigned int flags)
+{
+    g_opencl_global.dirty_flags |= flags;
+}
+
+void cl_render_scene_changed(const render_change_t *changes, int count)
+{
+    render_dirty_add_changes(&g_opencl_global.dirty, changes, count);
+    g_opencl_global.dirty_flags |= RENDER_DIRTY_SCENE;
+}
+
+void cl_render_invalidate_frame(void)
+{
+    render_dirty_invalidate(&g_opencl_global.dirty);
+}
+
+/* buffer 容量不足时按至少两倍重建，容量足够则直接复用 */
+static
+int reserve_scene_buffer(cl_mem *buffer, size_t *buffer_size, size_t size, const char *name)
+{
+    if (*buffer != NULL && *buffer_size >= size)
+    {
+        return 0;
+    }
+
+    size_t capacity = size;
+    if (*buffer != NULL)
+    {
+        if (capacity < *buffer_size * 2)
+        {
+            capacity = *buffer_size * 2;
+        }
+        clReleaseMemObject(*buffer);
+        *buffer = NULL;
+        *buffer_size = 0;
+    }
+
+    cl_int cl_ret;
+    cl_mem mem = clCreateBuffer(g_opencl_global.opencl_device_context, CL_MEM_READ_ONLY, capacity, NULL, &cl_ret);
+    if (cl_ret != CL_SUCCESS || mem == NULL)
+    {
+        printf("reserve_scene_buffer, clCreateBuffer() for %s failed, size: %zu, ret: %d\n", name, capacity, cl_ret);
+        return -1;
+    }
+    *buffer = mem;
+    *buffer_size = capacity;
+    g_opencl_global.depth_args_dirty = 1;
+    g_opencl_global.scene_buffer_generation++;
+
+    return 0;
+}
+
+/* 映射文件加载的场景页对齐，以 CL_MEM_USE_HOST_PTR 创建 buffer 直接使用映射的内存，不经过中间拷贝。
+ * 映射时文件末尾已补齐到页边界，size 向上取整到 64 字节以满足部分实现零拷贝的要求。
+ * host 端原地修改之后重新创建 buffer，buffer_size 置 0 使之后堆上的场景不会复用该 buffer
+ */
+static
+int bind_host_scene_buffer(cl_mem *buffer, size_t *buffer_size, void *host_ptr, size_t size, const char *name)
+{
+    if (*buffer != NULL)
+    {
+        clReleaseMemObject(*buffer);
+        *buffer = NULL;
+    }
+    *buffer_size = 0;
+
+    cl_int cl_ret;
+    size = (size + 63) / 64 * 64;
+    cl_mem mem = clCreateBuffer(g_opencl_global.opencl_device_context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, size, host_ptr, &cl_ret);
+    if (cl_ret != CL_SUCCESS || mem == NULL)
+    {
+        printf("bind_host_scene_buffer, clCreateBuffer() for %s failed, size: %zu, ret: %d\n", name, size, cl_ret);
+        return -1;
+    }
+    *buffer = mem;
+    g_opencl_global.depth_args_dirty = 1;
+    g_opencl_global.scene_buffer_generation++;
+
+    return 0;
+}
+
+/* 画面尺寸变化时重新计算摄像机的像素光线增量 */
+static
+void update_camera_resolution(int w, int h)
+{
+    if (g_opencl_global.camera.width == w && g_opencl_global.camera.height == h)
+    {
+        return;
+    }
+    project_camera_t camera = g_opencl_global.camera;
+    project_camera_set_resolution(&camera, w, h);
+    cl_render_set_camera(&camera);
+}
+
+/* 以非阻塞方式上传所有 dirty 的数据，返回的 events 作为 kernel 的等待列表。
+ * host 端数据在写入完成之前不能被修改: 摄像机保存在 g_opencl_global 中，场景数据由调用者保证
+ */
+static
+int upload_dirty_data(int w, int h, cl_event *events, cl_uint *event_count)
+{
+    cl_command_queue command_queue = g_opencl_global.command_queue;
+    const scene_t *scene = g_opencl_global.scene;
+    unsigned int dirty_flags = g_opencl_global.dirty_flags;
+    cl_int cl_ret = CL_SUCCESS;
+
+    update_camera_resolution(w, h);
+    dirty_flags = g_opencl_global.dirty_flags;
+    if (dirty_flags & (RENDER_DIRTY_CAMERA | RENDER_DIRTY_NODES))
+    {
+        g_opencl_global.bin_valid = 0;
+    }
+    *event_count = 0;
+    do
+    {
+        if (dirty_flags & RENDER_DIRTY_CAMERA)
+        {
+            cl_ret = profiled_write_buffer(command_queue, g_opencl_global.camera_buffer, CL_FALSE, 0, sizeof(project_camera_t),
+                &g_opencl_global.camera, 0, NULL, &events[*event_count], "upload camera");
+            if (cl_ret != CL_SUCCESS)
+            {
+                printf("upload_dirty_data, clEnqueueWriteBuffer() for project_camera failed, ret: %d\n", cl_ret);
+                break;
+            }
+            if (g_opencl_global.camera_upload_event != NULL)
+            {
+                clReleaseEvent(g_opencl_global.camera_upload_event);
+            }
+            clRetainEvent(events[*event_count]);
+            g_opencl_global.camera_upload_event = events[*event_count];
+            (*event_count)++;
+        }
+
+        if (scene->mapping != NULL && (dirty_flags & RENDER_DIRTY_SCENE))
+        {
+            /* 场景数据只在创建 buffer 时确定位置，不需要入队写入 */
+            if (((dirty_flags & RENDER_DIRTY_SPHERES) && bind_host_scene_buffer(&g_opencl_global.spheres_buffer,
+                    &g_opencl_global.spheres_buffer_size, scene->spheres, sizeof(sphere_t) * scene->sphere_count, "spheres") != 0) ||
+                ((dirty_flags & RENDER_DIRTY_NODES) && bind_host_scene_buffer(&g_opencl_global.nodes_buffer,
+                    &g_opencl_global.nodes_buffer_size, scene->nodes, sizeof(bvh_node_t) * scene->node_count, "bvh nodes") != 0))
+            {
+                cl_ret = CL_OUT_OF_RESOURCES;
+                break;
+            }
+            dirty_flags &= ~RENDER_DIRTY_SCENE;
+        }
+
+        if (dirty_flags & RENDER_DIRTY_SPHERES)
+        {
+            size_t spheres_size = sizeof(sphere_t) * scene->sphere_count;
+            if (reserve_scene_buffer(&g_opencl_global.spheres_buffer, &g_opencl_global.spheres_buffer_size, spheres_size, "spheres") != 0)
+            {
+                cl_ret = CL_OUT_OF_RESOURCES;
+                break;
+            }
+            cl_ret = profiled_write_buffer(command_queue, g_opencl_global.spheres_buffer, CL_FALSE, 0, spheres_size,
+                scene->spheres, 0, NULL, &events[*event_count], "upload spheres");
+            if (cl_ret != CL_SUCCESS)
+            {
+                printf("upload_dirty_data, clEnqueueWriteBuffer() for spheres failed, ret: %d\n", cl_ret);
+                break;
+            }
+            (*event_count)++;
+        }
+
+        if (dirty_flags & RENDER_DIRTY_NODES)
+        {
+            size_t nodes_size = sizeof(bvh_node_t) * scene->node_count;
+            if (reserve_scene_buffer(&g_opencl_global.nodes_buffer, &g_opencl_global.nodes_buffer_size, nodes_size, "bvh nodes") != 0)
+            {
+                cl_ret = CL_OUT_OF_RESOURCES;
+                break;
+            }
+            cl_ret = profiled_write_buffer(command_queue, g_opencl_global.nodes_buffer, CL_FALSE, 0, nodes_size,
+                scene->nodes, 0, NULL, &events[*event_count], "upload bvh nodes");
+            if (cl_ret != CL_SUCCESS)
+            {
+                printf("upload_dirty_data, clEnqueueWriteBuffer() for bvh nodes failed, ret: %d\n", cl_ret);
+                break;
+            }
+            (*event_count)++;
+        }
+    } while(0);
+
+    if (cl_ret != CL_SUCCESS)
+    {
+        for (cl_uint i = 0; i < *event_count; ++i)
+        {
+            clReleaseEvent(events[i]);
+        }
+        *event_count = 0;
+        return -1;
+    }
+
+    g_opencl_global.dirty_flags = 0;
+
+    return 0;
+}
+
+static
+int bind_depth_kernel_args(cl_kernel render_project_depth_kernel, cl_mem canvas_image)
+{
+    cl_int cl_ret;
+
+    cl_ret = clSetKernelArg(render_project_depth_kernel, 0, sizeof(cl_mem), &g_opencl_global.camera_buffer);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("bind_depth_kernel_args: clSetKernelArg(camera) failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+    cl_ret = clSetKernelArg(render_project_depth_kernel, 1, sizeof(cl_mem), &g_opencl_global.spheres_buffer);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("bind_depth_kernel_args: clSetKernelArg(spheres) failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+    cl_ret = clSetKernelArg(render_project_depth_kernel, 2, sizeof(cl_mem), &g_opencl_global.nodes_buffer);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("bind_depth_kernel_args: clSetKernelArg(nodes) failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+    cl_ret = clSetKernelArg(render_project_depth_kernel, 3, sizeof(cl_mem), &canvas_image);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("bind_depth_kernel_args: clSetKernelArg(image) failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+int render_gradient_opencl(uint8_t* pixel, int w, int h, int pitch)
+{
+    cl_int cl_ret;
+    cl_command_queue command_queue = g_opencl_global.command_queue;
+    cl_kernel render_gradient_kernel = g_opencl_global.render_gradient_kernel;
+
+    render_dirty_invalidate(&g_opencl_global.dirty);
+    uint64_t ts1 = now_ms();
+    if (g_opencl_global.gradient_args_dirty)
+    {
+        cl_ret = clSetKernelArg(render_gradient_kernel, 0, sizeof(g_opencl_global.canvas_image), &g_opencl_global.canvas_image);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("render_gradient_opencl: clSetKernelArg() failed, ret: %d\n", cl_ret);
+            return -1;
+        }
+        g_opencl_global.gradient_args_dirty = 0;
+    }
+
+    cl_work_group_t *work_group = &g_opencl_global.gradient_work_group;
+    if (!work_group->tuned)
+    {
+        tune_work_group(render_gradient_kernel, "render_gradient", "", w, h, work_group);
+    }
+
+    cl_event result_event = NULL;
+    cl_ret = enqueue_kernel_2d(command_queue, render_gradient_kernel, work_group, w, h, 0, NULL, &result_event);
     if (cl_ret != CL_SUCCESS)
     {
         printf("render_gradient_opencl: clEnqueueNDRangeKernel() failed, ret: %d\n", cl_ret);
         return -1;
     }
 
-    size_t origin[3] = {0, 0, 0};
-    size_t region[3] = {w, h, 1};
-    cl_ret = clEnqueueReadImage(command_queue, g_opencl_global.canvas_image, CL_TRUE, origin, region, pitch, 0, pixel, 1, &result_event, NULL);
+    size_t origin[3] = {0, 0, 0};
+    size_t region[3] = {w, h, 1};
+    cl_ret = profiled_read_image(command_queue, g_opencl_global.canvas_image, CL_TRUE, origin, region, pitch, pixel, 1, &result_event, NULL);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("render_gradient_opencl: clEnqueueReadImage() failed\n");
+        clReleaseEvent(result_event);
+        return -1;
+    }
+    profile_collect(0);
+    uint64_t ts2 = now_ms();
+    if (g_render_verbose)
+    {
+        printf("render_gradient_opencl, width: %d, height: %d, time elapsed: %" PRIu64 "ms\n", w, h, (ts2-ts1));
+    }
+
+    clReleaseEvent(result_event);
+
+    return 0;
+}
+
+int render_project_depth_opencl(uint8_t* pixel, int w, int h, int pitch)
+{
+    if (g_opencl_global.scene == NULL)
+    {
+        printf("render_project_depth_opencl, no scene was set\n");
+        return -1;
+    }
+
+    cl_int cl_ret;
+    cl_command_queue command_queue = g_opencl_global.command_queue;
+    cl_kernel render_project_depth_kernel = g_opencl_global.render_project_depth_kernel;
+
+    uint64_t ts1 = now_ms();
+    cl_event upload_events[3];
+    cl_uint upload_event_count = 0;
+    if (upload_dirty_data(w, h, upload_events, &upload_event_count) != 0)
+    {
+        return -1;
+    }
+    if (g_opencl_global.depth_args_dirty)
+    {
+        if (bind_depth_kernel_args(render_project_depth_kernel, g_opencl_global.canvas_image) != 0)
+        {
+            for (cl_uint i = 0; i < upload_event_count; ++i)
+            {
+                clReleaseEvent(upload_events[i]);
+            }
+            return -1;
+        }
+        g_opencl_global.depth_args_dirty = 0;
+    }
+
+    /* 每个 work-item 负责一个 pixel_step x pixel_step 的像素块 */
+    int pixel_step = g_opencl_global.pixel_step;
+    int grid_w = (w + pixel_step - 1) / pixel_step;
+    int grid_h = (h + pixel_step - 1) / pixel_step;
+    int antialias = antialias_enabled(w, h, pixel_step);
+    int bins = enqueue_tile_bins(w, h) == 0;
+    if (bind_frame_kernel_args(render_project_depth_kernel, pixel_step, antialias ? g_opencl_global.aa_ids_buffer : NULL, bins) != 0)
+    {
+        for (cl_uint i = 0; i < upload_event_count; ++i)
+        {
+            clReleaseEvent(upload_events[i]);
+        }
+        return -1;
+    }
+
+    cl_variant_t *variant = &g_opencl_global.variants[g_opencl_global.current_variant];
+    if (!variant->work_group.tuned)
+    {
+        tune_work_group(render_project_depth_kernel, "render_project_depth", variant->build_options, grid_w, grid_h, &variant->work_group);
+    }
+
+    /* 增量渲染时只入队 dirty 矩形，其余像素保留 canvas_image 中上一帧的结果; 没有 dirty 矩形时只读回画面 */
+    render_frame_key_t key;
+    render_frame_key_init(&key, w, h, &g_opencl_global.camera, &variant->options, pixel_step, antialias ? g_opencl_global.aa_grid : 1);
+    render_dirty_region_t *dirty = &g_opencl_global.dirty;
+    int dirty_count = render_dirty_begin(dirty, &key);
+
+    cl_event result_event = NULL;
+    if (dirty_count < 0)
+    {
+        cl_ret = enqueue_kernel_2d(command_queue, render_project_depth_kernel, &variant->work_group, grid_w, grid_h,
+            upload_event_count, upload_event_count > 0 ? upload_events : NULL, &result_event);
+    }
+    else if (dirty->rect_count > 0)
+    {
+        cl_ret = enqueue_kernel_rects(command_queue, render_project_depth_kernel, dirty->rects, dirty->rect_count,
+            upload_event_count, upload_event_count > 0 ? upload_events : NULL, &result_event);
+    }
+    else
+    {
+        cl_ret = CL_SUCCESS;
+    }
+    for (cl_uint i = 0; i < upload_event_count; ++i)
+    {
+        clReleaseEvent(upload_events[i]);
+    }
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("render_project_depth_opencl: clEnqueueNDRangeKernel() failed, ret: %d\n", cl_ret);
+        render_dirty_invalidate(dirty);
+        return -1;
+    }
+
+    cl_int edge_count = 0;
+    cl_event count_event = NULL;
+    if (antialias && result_event != NULL &&
+        enqueue_antialias(g_opencl_global.canvas_image, w, h, &result_event, &edge_count, &count_event) != 0)
+    {
+        clReleaseEvent(result_event);
+        render_dirty_invalidate(dirty);
+        return -1;
+    }
+
+    /* in-order 队列，没有入队 kernel 时读回也在之前的上传之后执行 */
+    size_t origin[3] = {0, 0, 0};
+    size_t region[3] = {w, h, 1};
+    cl_ret = profiled_read_image(command_queue, g_opencl_global.canvas_image, CL_TRUE, origin, region, pitch, pixel,
+        result_event != NULL ? 1 : 0, result_event != NULL ? &result_event : NULL, NULL);
+    if (count_event != NULL)
+    {
+        /* 与读回画面在同一个队列中，此时已经完成 */
+        clWaitForEvents(1, &count_event);
+        clReleaseEvent(count_event);
+    }
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("render_project_depth_opencl: clEnqueueReadImage() failed, ret: %d\n", cl_ret);
+        if (result_event != NULL)
+        {
+            clReleaseEvent(result_event);
+        }
+        return -1;
+    }
+    update_aa_stats(w, h, pixel_step, antialias ? g_opencl_global.aa_grid : 0, edge_count);
+    if (dirty_count >= 0)
+    {
+        g_opencl_global.aa_stats.sample_count = dirty->pixel_count;
+    }
+    profile_collect(0);
+    uint64_t ts2 = now_ms();
+    if (g_render_verbose)
+    {
+        printf("render_project_depth_opencl, width: %d, height: %d, dirty tiles: %d, time elapsed: %" PRIu64 "ms\n",
+            w, h, dirty_count, (ts2-ts1));
+    }
+
+    if (result_event != NULL)
+    {
+        clReleaseEvent(result_event);
+    }
+
+    return 0;
+}
+
+/* wavefront 渲染: 生成、求交、着色、输出各为一个 kernel，阶段之间以设备内存中紧凑的光线队列连接。
+ * 每一轮着色之后读回下一轮队列的长度，按长度入队下一轮的求交和着色，直到队列为空或达到 bounces 次反射。
+ * 所有命令在同一个 in-order 队列中依次执行; 不做预览和抗锯齿
+ */
+int render_project_depth_opencl_wavefront(uint8_t* pixel, int w, int h, int pitch)
+{
+    static const cl_int zero = 0;
+
+    if (g_opencl_global.scene == NULL)
+    {
+        printf("render_project_depth_opencl_wavefront, no scene was set\n");
+        return -1;
+    }
+    if (reserve_wavefront_buffers(w * h) != 0)
+    {
+        return -1;
+    }
+
+    cl_int cl_ret;
+    cl_command_queue command_queue = g_opencl_global.command_queue;
+    cl_variant_t *variant = &g_opencl_global.variants[g_opencl_global.current_variant];
+    cl_kernel raygen_kernel = variant->wavefront_kernels[CL_WAVEFRONT_RAYGEN];
+    cl_kernel intersect_kernel = variant->wavefront_kernels[CL_WAVEFRONT_INTERSECT];
+    cl_kernel shade_kernel = variant->wavefront_kernels[CL_WAVEFRONT_SHADE];
+    cl_kernel resolve_kernel = variant->wavefront_kernels[CL_WAVEFRONT_RESOLVE];
+    render_wavefront_stats_t *stats = &g_opencl_global.wf_stats;
+    memset(stats, 0, sizeof(*stats));
+    stats->pixel_count = (uint64_t)w * h;
+
+    /* 反射光线使变化影响的范围无法由投影确定，总是整帧渲染 */
+    render_dirty_invalidate(&g_opencl_global.dirty);
+    uint64_t ts1 = now_ms();
+    cl_event upload_events[3];
+    cl_uint upload_event_count = 0;
+    if (upload_dirty_data(w, h, upload_events, &upload_event_count) != 0)
+    {
+        return -1;
+    }
+    /* in-order 队列中之后的命令都在上传完成之后执行 */
+    cl_ret = profiled_write_buffer(command_queue, g_opencl_global.wf_count_buffers[0], CL_FALSE, 0, sizeof(zero), &zero,
+        upload_event_count, upload_event_count > 0 ? upload_events : NULL, NULL, "zero ray count");
+    for (cl_uint i = 0; i < upload_event_count; ++i)
+    {
+        clReleaseEvent(upload_events[i]);
+    }
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("render_project_depth_opencl_wavefront: clEnqueueWriteBuffer() failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+
+    cl_ret = CL_SUCCESS;
+    cl_ret |= clSetKernelArg(raygen_kernel, 0, sizeof(cl_mem), &g_opencl_global.camera_buffer);
+    cl_ret |= clSetKernelArg(raygen_kernel, 1, sizeof(cl_mem), &g_opencl_global.wf_ray_buffers[0]);
+    cl_ret |= clSetKernelArg(raygen_kernel, 2, sizeof(cl_mem), &g_opencl_global.wf_count_buffers[0]);
+    cl_ret |= clSetKernelArg(raygen_kernel, 3, sizeof(cl_mem), &g_opencl_global.wf_accum_buffer);
+    cl_ret |= clSetKernelArg(raygen_kernel, 4, sizeof(w), &w);
+    cl_ret |= clSetKernelArg(raygen_kernel, 5, sizeof(h), &h);
+    cl_ret |= clSetKernelArg(intersect_kernel, 0, sizeof(cl_mem), &g_opencl_global.spheres_buffer);
+    cl_ret |= clSetKernelArg(intersect_kernel, 1, sizeof(cl_mem), &g_opencl_global.nodes_buffer);
+    cl_ret |= clSetKernelArg(intersect_kernel, 4, sizeof(cl_mem), &g_opencl_global.wf_hit_buffer);
+    cl_ret |= clSetKernelArg(shade_kernel, 0, sizeof(cl_mem), &g_opencl_global.spheres_buffer);
+    cl_ret |= clSetKernelArg(shade_kernel, 3, sizeof(cl_mem), &g_opencl_global.wf_hit_buffer);
+    cl_ret |= clSetKernelArg(shade_kernel, 4, sizeof(cl_mem), &g_opencl_global.wf_accum_buffer);
+    cl_ret |= clSetKernelArg(shade_kernel, 5, sizeof(w), &w);
+    cl_ret |= clSetKernelArg(resolve_kernel, 0, sizeof(cl_mem), &g_opencl_global.wf_accum_buffer);
+    cl_ret |= clSetKernelArg(resolve_kernel, 1, sizeof(cl_mem), &g_opencl_global.canvas_image);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("render_project_depth_opencl_wavefront: clSetKernelArg() failed\n");
+        return -1;
+    }
+
+    /* 生成阶段每次执行都会累加计数，不参与 work-group 调优 */
+    cl_work_group_t raygen_work_group = {{CL_DEFAULT_WORK_GROUP_SIZE, CL_DEFAULT_WORK_GROUP_SIZE}, 1};
+    cl_ret = enqueue_kernel_2d(command_queue, raygen_kernel, &raygen_work_group, w, h, 0, NULL, NULL);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("render_project_depth_opencl_wavefront: enqueue wavefront_raygen failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+
+    int current = 0;
+    for (int bounce = 0; bounce <= g_opencl_global.bounces; ++bounce)
+    {
+        cl_int ray_count = 0;
+        cl_ret = profiled_read_buffer(command_queue, g_opencl_global.wf_count_buffers[current], CL_TRUE, 0, sizeof(ray_count),
+            &ray_count, 0, NULL, NULL, "read ray count");
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("render_project_depth_opencl_wavefront: clEnqueueReadBuffer() failed, ret: %d\n", cl_ret);
+            return -1;
+        }
+        if (ray_count == 0)
+        {
+            break;
+        }
+        stats->ray_counts[bounce] = ray_count;
+        stats->ray_count += ray_count;
+        stats->pass_count++;
+
+        int next = 1 - current;
+        cl_int spawn = bounce < g_opencl_global.bounces;
+        cl_ret = profiled_write_buffer(command_queue, g_opencl_global.wf_count_buffers[next], CL_FALSE, 0, sizeof(zero), &zero,
+            0, NULL, NULL, "zero ray count");
+        cl_ret |= clSetKernelArg(intersect_kernel, 2, sizeof(cl_mem), &g_opencl_global.wf_ray_buffers[current]);
+        cl_ret |= clSetKernelArg(intersect_kernel, 3, sizeof(ray_count), &ray_count);
+        cl_ret |= clSetKernelArg(shade_kernel, 1, sizeof(cl_mem), &g_opencl_global.wf_ray_buffers[current]);
+        cl_ret |= clSetKernelArg(shade_kernel, 2, sizeof(ray_count), &ray_count);
+        cl_ret |= clSetKernelArg(shade_kernel, 6, sizeof(spawn), &spawn);
+        cl_ret |= clSetKernelArg(shade_kernel, 7, sizeof(cl_mem), &g_opencl_global.wf_ray_buffers[next]);
+        cl_ret |= clSetKernelArg(shade_kernel, 8, sizeof(cl_mem), &g_opencl_global.wf_count_buffers[next]);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("render_project_depth_opencl_wavefront: prepare pass %d failed\n", bounce);
+            return -1;
+        }
+
+        cl_ret = enqueue_kernel_1d(command_queue, intersect_kernel, ray_count);
+        if (cl_ret == CL_SUCCESS)
+        {
+            cl_ret = enqueue_kernel_1d(command_queue, shade_kernel, ray_count);
+        }
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("render_project_depth_opencl_wavefront: enqueue pass %d failed, ret: %d\n", bounce, cl_ret);
+            return -1;
+        }
+        current = next;
+    }
+
+    cl_work_group_t resolve_work_group = {{CL_DEFAULT_WORK_GROUP_SIZE, CL_DEFAULT_WORK_GROUP_SIZE}, 1};
+    cl_ret = enqueue_kernel_2d(command_queue, resolve_kernel, &resolve_work_group, w, h, 0, NULL, NULL);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("render_project_depth_opencl_wavefront: enqueue wavefront_resolve failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+
+    size_t origin[3] = {0, 0, 0};
+    size_t region[3] = {w, h, 1};
+    cl_ret = profiled_read_image(command_queue, g_opencl_global.canvas_image, CL_TRUE, origin, region, pitch, pixel, 0, NULL, NULL);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("render_project_depth_opencl_wavefront: clEnqueueReadImage() failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+    profile_collect(0);
+    uint64_t ts2 = now_ms();
+    if (g_render_verbose)
+    {
+        printf("render_project_depth_opencl_wavefront, width: %d, height: %d, passes: %d, rays: %" PRIu64 ", time elapsed: %" PRIu64 "ms\n",
+            w, h, stats->pass_count, stats->ray_count, (ts2-ts1));
+    }
+
+    return 0;
+}
+
+/* 第 i 批在 command_queue 上渲染到 batch_out_buffers[i % 2]，在 read_queue 上读回到 pixel 中对应的位置。
+ * 再次写入同一个输出 buffer 之前等待它上一次的读回，因此渲染第 i + 1 批时第 i 批仍可在读回
+ */
+int render_project_depth_opencl_batch(uint8_t* pixel, int w, int h, const project_camera_t *cameras, int view_count)
+{
+    if (g_opencl_global.scene == NULL)
+    {
+        printf("render_project_depth_opencl_batch, no scene was set\n");
+        return -1;
+    }
+    if (view_count <= 0)
+    {
+        return 0;
+    }
+
+    size_t frame_size = (size_t)w * h * 4;
+    int chunk_views = batch_views_per_chunk(w, h, view_count);
+    if (reserve_batch_buffers(view_count, frame_size * chunk_views) != 0)
+    {
+        return -1;
+    }
+
+    cl_int cl_ret;
+    cl_command_queue command_queue = g_opencl_global.command_queue;
+    cl_command_queue read_queue = g_opencl_global.read_queue;
+    cl_variant_t *variant = &g_opencl_global.variants[g_opencl_global.current_variant];
+    cl_kernel batch_kernel = variant->render_batch_kernel;
+
+    uint64_t ts1 = now_ms();
+    project_camera_t *batch_cameras = g_opencl_global.batch_cameras;
+    for (int v = 0; v < view_count; ++v)
+    {
+        batch_cameras[v] = cameras[v];
+        if (batch_cameras[v].width != w || batch_cameras[v].height != h)
+        {
+            project_camera_set_resolution(&batch_cameras[v], w, h);
+        }
+    }
+
+    cl_event upload_events[3];
+    cl_uint upload_event_count = 0;
+    if (upload_dirty_data(w, h, upload_events, &upload_event_count) != 0)
+    {
+        return -1;
+    }
+    /* in-order 队列中之后的命令都在上传完成之后执行 */
+    cl_ret = profiled_write_buffer(command_queue, g_opencl_global.batch_camera_buffer, CL_FALSE, 0,
+        sizeof(project_camera_t) * view_count, batch_cameras, upload_event_count, upload_event_count > 0 ? upload_events : NULL,
+        NULL, "batch cameras");
+    for (cl_uint i = 0; i < upload_event_count; ++i)
+    {
+        clReleaseEvent(upload_events[i]);
+    }
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("render_project_depth_opencl_batch: clEnqueueWriteBuffer() failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+
+    cl_ret = CL_SUCCESS;
+    cl_ret |= clSetKernelArg(batch_kernel, 0, sizeof(cl_mem), &g_opencl_global.batch_camera_buffer);
+    cl_ret |= clSetKernelArg(batch_kernel, 1, sizeof(cl_mem), &g_opencl_global.spheres_buffer);
+    cl_ret |= clSetKernelArg(batch_kernel, 2, sizeof(cl_mem), &g_opencl_global.nodes_buffer);
+    cl_ret |= clSetKernelArg(batch_kernel, 4, sizeof(w), &w);
+    cl_ret |= clSetKernelArg(batch_kernel, 5, sizeof(h), &h);
     if (cl_ret != CL_SUCCESS)
     {
-        printf("render_gradient_opencl: clEnqueueReadImage() failed\n");
-        clReleaseEvent(result_event);
+        printf("render_project_depth_opencl_batch: clSetKernelArg() failed\n");
         return -1;
     }
+
+    /* 前两维沿用 render_project_depth 的调优结果，第三维每个 work-group 一个视角 */
+    size_t local_work_size[3] = {variant->work_group.size[0], variant->work_group.size[1], 1};
+    int use_local = local_work_size[0] > 0 && local_work_size[1] > 0;
+    cl_event read_events[2] = {NULL, NULL};
+    int chunk_count = 0;
+    int ret = 0;
+    for (int base = 0; base < view_count; base += chunk_views)
+    {
+        int slot = chunk_count++ & 1;
+        cl_int count = view_count - base < chunk_views ? view_count - base : chunk_views;
+        cl_int view_base = base;
+        cl_ret = clSetKernelArg(batch_kernel, 3, sizeof(cl_mem), &g_opencl_global.batch_out_buffers[slot]);
+        cl_ret |= clSetKernelArg(batch_kernel, 6, sizeof(view_base), &view_base);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("render_project_depth_opencl_batch: clSetKernelArg() for views %d failed\n", base);
+            ret = -1;
+            break;
+        }
+
+        /* 输出 buffer 上一次的读回完成之后才能覆盖 */
+        cl_uint wait_count = read_events[slot] != NULL ? 1 : 0;
+        const cl_event *wait_list = wait_count > 0 ? &read_events[slot] : NULL;
+        cl_event kernel_event = NULL;
+        size_t global_work_size[3] = {w, h, count};
+        if (use_local)
+        {
+            padded_global_size(global_work_size, local_work_size, w, h);
+            cl_ret = profiled_enqueue_kernel(command_queue, batch_kernel, 3, NULL, global_work_size, local_work_size,
+                wait_count, wait_list, &kernel_event);
+            if (cl_ret == CL_INVALID_WORK_GROUP_SIZE)
+            {
+                printf("render_project_depth_opencl_batch, work-group %zux%zu rejected, fall back to implementation defined\n",
+                    local_work_size[0], local_work_size[1]);
+                use_local = 0;
+                global_work_size[0] = w;
+                global_work_size[1] = h;
+            }
+        }
+        if (!use_local)
+        {
+            cl_ret = profiled_enqueue_kernel(command_queue, batch_kernel, 3, NULL, global_work_size, NULL,
+                wait_count, wait_list, &kernel_event);
+        }
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("render_project_depth_opencl_batch: enqueue views %d failed, ret: %d\n", base, cl_ret);
+            ret = -1;
+            break;
+        }
+        /* 读回在另一个队列上执行，提交之后渲染队列即可开始下一批 */
+        clFlush(command_queue);
+
+        if (read_events[slot] != NULL)
+        {
+            clReleaseEvent(read_events[slot]);
+            read_events[slot] = NULL;
+        }
+        cl_ret = profiled_read_buffer(read_queue, g_opencl_global.batch_out_buffers[slot], CL_FALSE, 0, frame_size * count,
+            pixel + frame_size * base, 1, &kernel_event, &read_events[slot], "read batch views");
+        clReleaseEvent(kernel_event);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("render_project_depth_opencl_batch: clEnqueueReadBuffer() failed, ret: %d\n", cl_ret);
+            read_events[slot] = NULL;
+            ret = -1;
+            break;
+        }
+        clFlush(read_queue);
+    }
+
+    /* pixel 和 batch_cameras 在返回之前必须不再被设备访问 */
+    clFinish(command_queue);
+    clFinish(read_queue);
+    for (int i = 0; i < 2; ++i)
+    {
+        if (read_events[i] != NULL)
+        {
+            clReleaseEvent(read_events[i]);
+        }
+    }
+    profile_collect(0);
     uint64_t ts2 = now_ms();
-    printf("render_gradient_opencl, width: %d, height: %d, time elapsed: %" PRIu64 "ms\n", w, h, (ts2-ts1));
+    if (ret == 0 && g_render_verbose)
+    {
+        printf("render_project_depth_opencl_batch, width: %d, height: %d, views: %d, chunks: %d, time elapsed: %" PRIu64 "ms\n",
+            w, h, view_count, chunk_count, (ts2-ts1));
+    }
 
-    clReleaseEvent(result_event);
+    return ret;
+}
 
-    return 0;
+/********************************************************************************/
+
+static
+void release_frame_slots(void)
+{
+    cl_pipeline_t *pipeline = &g_opencl_global.pipeline;
+
+    /* 未取回的帧直接丢弃，但必须等它们执行完才能释放资源 */
+    if (g_opencl_global.command_queue != NULL)
+    {
+        clFinish(g_opencl_global.command_queue);
+    }
+    for (int i = 0; i < CL_PIPELINE_MAX_DEPTH; ++i)
+    {
+        cl_frame_slot_t *slot = &pipeline->slots[i];
+        if (slot->read_event != NULL)
+        {
+            clWaitForEvents(1, &slot->read_event);
+            clReleaseEvent(slot->read_event);
+        }
+        if (slot->aa_count_event != NULL)
+        {
+            clReleaseEvent(slot->aa_count_event);
+        }
+        if (slot->host_pixel != NULL)
+        {
+            clEnqueueUnmapMemObject(g_opencl_global.read_queue, slot->host_buffer, slot->host_pixel, 0, NULL, NULL);
+        }
+    }
+    if (g_opencl_global.read_queue != NULL)
+    {
+        clFinish(g_opencl_global.read_queue);
+    }
+    for (int i = 0; i < CL_PIPELINE_MAX_DEPTH; ++i)
+    {
+        cl_frame_slot_t *slot = &pipeline->slots[i];
+        if (slot->host_buffer != NULL)
+        {
+            clReleaseMemObject(slot->host_buffer);
+        }
+        if (slot->canvas_image != NULL)
+        {
+            clReleaseMemObject(slot->canvas_image);
+        }
+        if (slot->kernel != NULL)
+        {
+            clReleaseKernel(slot->kernel);
+        }
+        memset(slot, 0, sizeof(*slot));
+    }
+
+    pipeline->ready = 0;
+    pipeline->width = 0;
+    pipeline->height = 0;
+    pipeline->submit_slot = 0;
+    pipeline->retire_slot = 0;
+    pipeline->in_flight_count = 0;
 }
 
-int render_project_depth_opencl(uint8_t* pixel, int w, int h, int pitch)
+static
+int init_frame_slots(int w, int h)
 {
-    cl_int cl_ret;
+    cl_pipeline_t *pipeline = &g_opencl_global.pipeline;
     cl_context device_context = g_opencl_global.opencl_device_context;
-    cl_command_queue command_queue = g_opencl_global.command_queue;
-    cl_kernel render_project_depth_kernel = g_opencl_global.render_project_depth_kernel;
+    cl_image_format image_format = {CL_RGBA, CL_UNSIGNED_INT8};
+    size_t frame_size = (size_t)w * h * 4;
+    cl_int cl_ret;
 
-    project_camera_t camera;
-    setup_project_camera(&camera);
-    cl_mem cl_project_camera = clCreateBuffer(device_context, CL_MEM_READ_ONLY, sizeof(camera), NULL, &cl_ret);
+    for (int i = 0; i < pipeline->depth; ++i)
+    {
+        cl_frame_slot_t *slot = &pipeline->slots[i];
+        slot->bound_generation = -1;
+
+        slot->kernel = clCreateKernel(g_opencl_global.program, "render_project_depth", &cl_ret);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("init_frame_slots, clCreateKernel() failed, ret: %d\n", cl_ret);
+            slot->kernel = NULL;
+            break;
+        }
+        slot->canvas_image = clCreateImage2D(device_context, CL_MEM_READ_WRITE, &image_format, w, h, 0, NULL, &cl_ret);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("init_frame_slots, clCreateImage2D() failed, ret: %d\n", cl_ret);
+            slot->canvas_image = NULL;
+            break;
+        }
+        slot->host_buffer = clCreateBuffer(device_context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, frame_size, NULL, &cl_ret);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("init_frame_slots, clCreateBuffer() for host pixel failed, ret: %d\n", cl_ret);
+            slot->host_buffer = NULL;
+            break;
+        }
+        /* 常驻映射，映射得到的 pinned 内存作为 clEnqueueReadImage 的目标 */
+        slot->host_pixel = (uint8_t*)clEnqueueMapBuffer(g_opencl_global.read_queue, slot->host_buffer, CL_TRUE,
+            CL_MAP_READ | CL_MAP_WRITE, 0, frame_size, 0, NULL, NULL, &cl_ret);
+        if (cl_ret != CL_SUCCESS)
+        {
+            printf("init_frame_slots, clEnqueueMapBuffer() failed, ret: %d\n", cl_ret);
+            slot->host_pixel = NULL;
+            break;
+        }
+    }
     if (cl_ret != CL_SUCCESS)
     {
-        printf("render_project_depth_opencl, clCreateBuffer() for project_camera failed, ret: %d\n", cl_ret);
+        release_frame_slots();
         return -1;
     }
-    cl_ret = clEnqueueWriteBuffer(command_queue, cl_project_camera, CL_TRUE, 0, sizeof(camera), &camera, 0, NULL, NULL);
+
+    pipeline->width = w;
+    pipeline->height = h;
+    pipeline->ready = 1;
+
+    return 0;
+}
+
+/* 等待最早提交的一帧读回完成并拷贝到 pixel */
+static
+int retire_frame(uint8_t* pixel, int pitch)
+{
+    cl_pipeline_t *pipeline = &g_opencl_global.pipeline;
+    cl_frame_slot_t *slot = &pipeline->slots[pipeline->retire_slot];
+
+    cl_int cl_ret = clWaitForEvents(1, &slot->read_event);
+    clReleaseEvent(slot->read_event);
+    slot->read_event = NULL;
+    if (slot->aa_count_event != NULL)
+    {
+        clWaitForEvents(1, &slot->aa_count_event);
+        clReleaseEvent(slot->aa_count_event);
+        slot->aa_count_event = NULL;
+    }
+    update_aa_stats(pipeline->width, pipeline->height, slot->pixel_step, slot->aa_grid, slot->aa_edge_count);
+    pipeline->retire_slot = (pipeline->retire_slot + 1) % pipeline->depth;
+    pipeline->in_flight_count--;
+    profile_collect(0);
     if (cl_ret != CL_SUCCESS)
     {
-        printf("render_project_depth_opencl, clEnqueueWriteBuffer() for project_camera failed, ret: %d\n", cl_ret);
-        clReleaseMemObject(cl_project_camera);
+        printf("retire_frame, clWaitForEvents() failed, ret: %d\n", cl_ret);
         return -1;
     }
 
-    sphere_t sphere;
-    setup_sphere(&sphere);
-    cl_mem cl_sphere = clCreateBuffer(device_context, CL_MEM_READ_ONLY, sizeof(sphere), NULL, &cl_ret);
-    if (cl_ret != CL_SUCCESS)
+    size_t line_size = (size_t)pipeline->width * 4;
+    for (int j = 0; j < pipeline->height; ++j)
+    {
+        memcpy(pixel + j * pitch, slot->host_pixel + j * line_size, line_size);
+    }
+
+    return 0;
+}
+
+/* 流水线中 canvas 的数量，取值 2 或 3，须在 init_cl_rendler() 之后调用，尚未取回的帧会被丢弃 */
+int cl_render_set_pipeline_depth(int depth)
+{
+    if (depth < 2 || depth > CL_PIPELINE_MAX_DEPTH)
     {
-        printf("render_project_depth_opencl, clCreateBuffer() for sphere failed, ret: %d\n", cl_ret);
-        clReleaseMemObject(cl_project_camera);
         return -1;
     }
-    cl_ret = clEnqueueWriteBuffer(command_queue, cl_sphere, CL_TRUE, 0, sizeof(sphere), &sphere, 0, NULL, NULL);
-    if (cl_ret != CL_SUCCESS)
+    release_frame_slots();
+    g_opencl_global.pipeline.depth = depth;
+
+    return 0;
+}
+
+/* 提交一帧，并在流水线满时取回最早提交的一帧到 pixel 中。
+ * 输出比提交晚 depth - 1 帧; 取回了一帧返回 0, 流水线尚未填满返回 1, 失败返回 -1
+ */
+int render_project_depth_opencl_pipelined(uint8_t* pixel, int w, int h, int pitch)
+{
+    if (g_opencl_global.scene == NULL)
     {
-        printf("render_project_depth_opencl, clEnqueueWriteBuffer() for sphere failed, ret: %d\n", cl_ret);
-        clReleaseMemObject(cl_sphere);
-        clReleaseMemObject(cl_project_camera);
+        printf("render_project_depth_opencl_pipelined, no scene was set\n");
         return -1;
     }
 
-    uint64_t ts1 = now_ms();
-    do
+    /* 各 slot 使用独立的 canvas，但与 render_project_depth_opencl() 共用 ids 缓冲区 */
+    render_dirty_invalidate(&g_opencl_global.dirty);
+
+    cl_pipeline_t *pipeline = &g_opencl_global.pipeline;
+    if (!pipeline->ready || pipeline->width != w || pipeline->height != h)
     {
-        cl_ret = clSetKernelArg(render_project_depth_kernel, 0, sizeof(cl_project_camera), &cl_project_camera);
-        if (cl_ret != CL_SUCCESS)
+        release_frame_slots();
+        if (init_frame_slots(w, h) != 0)
         {
-            printf("render_project_depth_opencl: clSetKernelArg(cl_project_camera) failed, ret: %d\n", cl_ret);
-            break;
+            return -1;
         }
-        cl_ret = clSetKernelArg(render_project_depth_kernel, 1, sizeof(cl_sphere), &cl_sphere);
-        if (cl_ret != CL_SUCCESS)
+    }
+
+    cl_int cl_ret;
+    cl_command_queue command_queue = g_opencl_global.command_queue;
+    cl_command_queue read_queue = g_opencl_global.read_queue;
+    cl_frame_slot_t *slot = &pipeline->slots[pipeline->submit_slot];
+
+    uint64_t ts1 = now_ms();
+    cl_event upload_events[3];
+    cl_uint upload_event_count = 0;
+    if (upload_dirty_data(w, h, upload_events, &upload_event_count) != 0)
+    {
+        return -1;
+    }
+    if (slot->bound_generation != g_opencl_global.scene_buffer_generation)
+    {
+        if (bind_depth_kernel_args(slot->kernel, slot->canvas_image) != 0)
         {
-            printf("render_project_depth_opencl: clSetKernelArg(cl_sphere) failed, ret: %d\n", cl_ret);
-            break;
+            for (cl_uint i = 0; i < upload_event_count; ++i)
+            {
+                clReleaseEvent(upload_events[i]);
+            }
+            return -1;
         }
-        cl_ret = clSetKernelArg(render_project_depth_kernel, 2, sizeof(g_opencl_global.canvas_image), &g_opencl_global.canvas_image);
-        if (cl_ret != CL_SUCCESS)
+        slot->bound_generation = g_opencl_global.scene_buffer_generation;
+    }
+
+    int pixel_step = g_opencl_global.pixel_step;
+    int grid_w = (w + pixel_step - 1) / pixel_step;
+    int grid_h = (h + pixel_step - 1) / pixel_step;
+    int antialias = antialias_enabled(w, h, pixel_step);
+    int bins = enqueue_tile_bins(w, h) == 0;
+    if (bind_frame_kernel_args(slot->kernel, pixel_step, antialias ? g_opencl_global.aa_ids_buffer : NULL, bins) != 0)
+    {
+        for (cl_uint i = 0; i < upload_event_count; ++i)
         {
-            printf("render_project_depth_opencl: clSetKernelArg(image) failed, ret: %d\n", cl_ret);
-            break;
+            clReleaseEvent(upload_events[i]);
         }
-    }while(0);
+        return -1;
+    }
+
+    cl_variant_t *variant = &g_opencl_global.variants[g_opencl_global.current_variant];
+    if (!variant->work_group.tuned)
+    {
+        tune_work_group(slot->kernel, "render_project_depth", variant->build_options, grid_w, grid_h, &variant->work_group);
+    }
+
+    cl_event kernel_event = NULL;
+    cl_ret = enqueue_kernel_2d(command_queue, slot->kernel, &variant->work_group, grid_w, grid_h,
+        upload_event_count, upload_event_count > 0 ? upload_events : NULL, &kernel_event);
+    for (cl_uint i = 0; i < upload_event_count; ++i)
+    {
+        clReleaseEvent(upload_events[i]);
+    }
     if (cl_ret != CL_SUCCESS)
     {
-        clReleaseMemObject(cl_sphere);
-        clReleaseMemObject(cl_project_camera);
+        printf("render_project_depth_opencl_pipelined: clEnqueueNDRangeKernel() failed, ret: %d\n", cl_ret);
         return -1;
     }
 
-    cl_uint work_dim = 2;
-    size_t global_work_size[2] = {w, h};
-    size_t local_work_size[2] = {16, 16};
-    cl_event result_event = NULL;
-    cl_ret = clEnqueueNDRangeKernel(command_queue, render_project_depth_kernel, work_dim, NULL, global_work_size, local_work_size, 0, NULL, &result_event);
-    if (cl_ret != CL_SUCCESS)
+    slot->pixel_step = pixel_step;
+    slot->aa_grid = antialias ? g_opencl_global.aa_grid : 0;
+    slot->aa_edge_count = 0;
+    if (antialias && enqueue_antialias(slot->canvas_image, w, h, &kernel_event, &slot->aa_edge_count, &slot->aa_count_event) != 0)
     {
-        printf("render_project_depth_opencl: clEnqueueNDRangeKernel() failed, ret: %d\n", cl_ret);
-        clReleaseMemObject(cl_sphere);
-        clReleaseMemObject(cl_project_camera);
+        clReleaseEvent(kernel_event);
         return -1;
     }
 
     size_t origin[3] = {0, 0, 0};
     size_t region[3] = {w, h, 1};
-    cl_ret = clEnqueueReadImage(command_queue, g_opencl_global.canvas_image, CL_TRUE, origin, region, pitch, 0, pixel, 1, &result_event, NULL);
+    cl_ret = profiled_read_image(read_queue, slot->canvas_image, CL_FALSE, origin, region, (size_t)w * 4, slot->host_pixel,
+        1, &kernel_event, &slot->read_event);
+    clReleaseEvent(kernel_event);
     if (cl_ret != CL_SUCCESS)
     {
-        printf("render_project_depth_opencl: clEnqueueReadImage() failed, ret: %d\n", cl_ret);
-        clReleaseEvent(result_event);
-        clReleaseMemObject(cl_sphere);
-        clReleaseMemObject(cl_project_camera);
+        printf("render_project_depth_opencl_pipelined: clEnqueueReadImage() failed, ret: %d\n", cl_ret);
+        slot->read_event = NULL;
         return -1;
     }
+    clFlush(command_queue);
+    clFlush(read_queue);
+    pipeline->submit_slot = (pipeline->submit_slot + 1) % pipeline->depth;
+    pipeline->in_flight_count++;
+
+    int ret = 1;
+    if (pipeline->in_flight_count == pipeline->depth)
+    {
+        ret = retire_frame(pixel, pitch);
+    }
     uint64_t ts2 = now_ms();
-    printf("render_project_depth_opencl, width: %d, height: %d, time elapsed: %" PRIu64 "ms\n", w, h, (ts2-ts1));
+    if (g_render_verbose)
+    {
+        printf("render_project_depth_opencl_pipelined, width: %d, height: %d, time elapsed: %" PRIu64 "ms\n", w, h, (ts2-ts1));
+    }
 
-    clReleaseEvent(result_event);
-    clReleaseMemObject(cl_sphere);
-    clReleaseMemObject(cl_project_camera);
+    return ret;
+}
+
+/* 取回流水线中所有尚未输出的帧，pixel 中留下最后提交的一帧; 没有未输出的帧时返回 1 */
+int cl_render_pipeline_flush(uint8_t* pixel, int pitch)
+{
+    cl_pipeline_t *pipeline = &g_opencl_global.pipeline;
+    if (pipeline->in_flight_count == 0)
+    {
+        return 1;
+    }
+    while (pipeline->in_flight_count > 0)
+    {
+        if (retire_frame(pixel, pitch) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/********************************************************************************/
+
+/* render_backend_t 接口: 入队 [y0, y1) 的 kernel 和读回之后立即返回，wait 时等待读回完成 */
+
+/* 读回完成之后 event 回调可能稍晚才执行，最多等待该时长，超时则以等待结束的时刻为完成时刻 */
+#define CL_REGION_CALLBACK_TIMEOUT_NS 2000000ull
+
+static
+void CL_CALLBACK region_done_callback(cl_event event, cl_int status, void *user_data)
+{
+    (void)event;
+    (void)status;
+    mutex_lock(&g_cl_region_sync.mutex);
+    if ((unsigned)(uintptr_t)user_data == g_cl_region_sync.sequence)
+    {
+        g_cl_region_sync.done_ns = now_ns();
+        cond_broadcast(&g_cl_region_sync.cond);
+    }
+    mutex_unlock(&g_cl_region_sync.mutex);
+}
+
+static
+int cl_backend_init(const char *ocl_source_file, int w, int h)
+{
+    return init_cl_rendler(ocl_source_file, w, h);
+}
+
+static
+int cl_backend_render_region(uint8_t* pixel, int w, int h, int pitch, int y0, int y1)
+{
+    if (g_opencl_global.scene == NULL)
+    {
+        printf("cl_backend_render_region, no scene was set\n");
+        return -1;
+    }
+    if (g_opencl_global.region_event != NULL)
+    {
+        printf("cl_backend_render_region, previous region was not waited\n");
+        return -1;
+    }
+    if (cl_render_resize(w, h) != 0)
+    {
+        return -1;
+    }
+    g_opencl_global.region_submit_ns = now_ns();
+    g_opencl_global.region_callback = 0;
+    if (y1 <= y0)
+    {
+        return 0;
+    }
+
+    cl_int cl_ret;
+    cl_command_queue command_queue = g_opencl_global.command_queue;
+    cl_kernel kernel = g_opencl_global.render_project_depth_kernel;
+    cl_event upload_events[3];
+    cl_uint upload_event_count = 0;
+    if (upload_dirty_data(w, h, upload_events, &upload_event_count) != 0)
+    {
+        return -1;
+    }
+    int pixel_step = g_opencl_global.pixel_step;
+    int bind_ret = 0;
+    if (g_opencl_global.depth_args_dirty)
+    {
+        bind_ret = bind_depth_kernel_args(kernel, g_opencl_global.canvas_image);
+        g_opencl_global.depth_args_dirty = bind_ret != 0;
+    }
+    if (bind_ret == 0)
+    {
+        bind_ret = bind_frame_kernel_args(kernel, pixel_step, NULL, enqueue_tile_bins(w, h) == 0);
+    }
+    if (bind_ret != 0)
+    {
+        for (cl_uint i = 0; i < upload_event_count; ++i)
+        {
+            clReleaseEvent(upload_events[i]);
+        }
+        return -1;
+    }
+    /* canvas 中其余的行不是上一帧的结果 */
+    render_dirty_invalidate(&g_opencl_global.dirty);
+
+    /* 每个 work-item 负责一个 pixel_step x pixel_step 的像素块，y0 为 pixel_step 的整数倍 */
+    cl_event kernel_event = NULL;
+    size_t global_work_offset[2] = {0, y0 / pixel_step};
+    size_t global_work_size[2] = {(w + pixel_step - 1) / pixel_step, (y1 - y0 + pixel_step - 1) / pixel_step};
+    cl_ret = profiled_enqueue_kernel(command_queue, kernel, 2, global_work_offset, global_work_size, NULL,
+        upload_event_count, upload_event_count > 0 ? upload_events : NULL, &kernel_event);
+    for (cl_uint i = 0; i < upload_event_count; ++i)
+    {
+        clReleaseEvent(upload_events[i]);
+    }
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("cl_backend_render_region: enqueue render_project_depth failed, ret: %d\n", cl_ret);
+        return -1;
+    }
+
+    size_t origin[3] = {0, y0, 0};
+    size_t region[3] = {w, y1 - y0, 1};
+    cl_ret = profiled_read_image(command_queue, g_opencl_global.canvas_image, CL_FALSE, origin, region, pitch,
+        pixel + (size_t)y0 * pitch, 1, &kernel_event, &g_opencl_global.region_event);
+    clReleaseEvent(kernel_event);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("cl_backend_render_region: clEnqueueReadImage() failed, ret: %d\n", cl_ret);
+        g_opencl_global.region_event = NULL;
+        return -1;
+    }
+    mutex_lock(&g_cl_region_sync.mutex);
+    unsigned sequence = ++g_cl_region_sync.sequence;
+    g_cl_region_sync.done_ns = 0;
+    mutex_unlock(&g_cl_region_sync.mutex);
+    /* 没有回调时以等待结束的时刻为完成时刻 */
+    g_opencl_global.region_callback = clSetEventCallback(g_opencl_global.region_event, CL_COMPLETE, region_done_callback,
+        (void*)(uintptr_t)sequence) == CL_SUCCESS;
+    /* 调用者接下来在 CPU 上渲染其余的行，先让设备开始执行 */
+    clFlush(command_queue);
+
+    return 0;
+}
+
+static
+int cl_backend_wait(uint64_t *elapsed_ns)
+{
+    *elapsed_ns = 0;
+    if (g_opencl_global.region_event == NULL)
+    {
+        return 0;
+    }
+
+    cl_int cl_ret = clWaitForEvents(1, &g_opencl_global.region_event);
+    uint64_t wait_ns = now_ns();
+    uint64_t done_ns = 0;
+    if (g_opencl_global.region_callback)
+    {
+        mutex_lock(&g_cl_region_sync.mutex);
+        uint64_t waited_ns;
+        while (g_cl_region_sync.done_ns == 0 && (waited_ns = now_ns() - wait_ns) < CL_REGION_CALLBACK_TIMEOUT_NS)
+        {
+            cond_timed_wait_ms(&g_cl_region_sync.cond, &g_cl_region_sync.mutex,
+                (int)((CL_REGION_CALLBACK_TIMEOUT_NS - waited_ns + 999999) / 1000000));
+        }
+        done_ns = g_cl_region_sync.done_ns;
+        mutex_unlock(&g_cl_region_sync.mutex);
+    }
+    if (done_ns == 0)
+    {
+        done_ns = wait_ns;
+    }
+    *elapsed_ns = done_ns - g_opencl_global.region_submit_ns;
+    clReleaseEvent(g_opencl_global.region_event);
+    g_opencl_global.region_event = NULL;
+    profile_collect(0);
+    if (cl_ret != CL_SUCCESS)
+    {
+        printf("cl_backend_wait, clWaitForEvents() failed, ret: %d\n", cl_ret);
+        return -1;
+    }
 
     return 0;
 }
+
+const render_backend_t g_cl_render_backend =
+{
+    "opencl",
+    cl_backend_init,
+    uninit_cl_render,
+    cl_render_set_scene,
+    cl_render_set_options,
+    cl_render_set_camera,
+    cl_render_set_pixel_step,
+    cl_backend_render_region,
+    cl_backend_wait,
+};
@@ -1,6 +1,8 @@
 
 #include "common.h"
 
+#include <string.h>
+
 #define _USE_MATH_DEFINES
 #include <math.h>
 
@@ -9,14 +11,68 @@ const point_t point_zero = {0.0, 0.0, 0.0};
 const direction_t direction_none = {0.0, 0.0, 0.0};
 
 static
+float vector_normalize(float3_t *v)
+{
+    float length = sqrtf(v->x * v->x + v->y * v->y + v->z * v->z);
+    if (length > 0)
+    {
+        v->x /= length;
+        v->y /= length;
+        v->z /= length;
+    }
+    return length;
+}
+
+static
+void vector_cross(float3_t *vo, const float3_t *v1, const float3_t *v2)
+{
+    float3_t v;
+    v.x = v1->y * v2->z - v1->z * v2->y;
+    v.y = v1->z * v2->x - v1->x * v2->z;
+    v.z = v1->x * v2->y - v1->y * v2->x;
+    *vo = v;
+}
+
+/* 由 front、up 计算观察坐标系，画面尺寸已设置时一并更新像素光线 */
+static
+void project_camera_update_basis(project_camera_t *camera)
+{
+    camera->basis_front = camera->front;
+    vector_normalize(&camera->basis_front);
+
+    vector_cross(&camera->basis_right, &camera->basis_front, &camera->up);
+    if (vector_normalize(&camera->basis_right) < 1e-6f)
+    {
+        /* up 与 front 平行: 沿 y 轴观察时画面上方取 -z，否则取 +y */
+        float3_t up = {0.0f, 1.0f, 0.0f};
+        if (fabsf(camera->basis_front.y) > 0.5f)
+        {
+            up.y = 0.0f;
+            up.z = -1.0f;
+        }
+        vector_cross(&camera->basis_right, &camera->basis_front, &up);
+        vector_normalize(&camera->basis_right);
+    }
+    vector_cross(&camera->basis_up, &camera->basis_right, &camera->basis_front);
+
+    if (camera->width > 0 && camera->height > 0)
+    {
+        project_camera_set_resolution(camera, camera->width, camera->height);
+    }
+}
+
 void project_camera_init
 (
     project_camera_t* camera, const point_t* eye, const direction_t* front, 
     float left_fov, float right_fov, float top_fov, float bottom_fov
 )
 {
+    memset(camera, 0, sizeof(*camera));
     camera->eye = *eye;
     camera->front = *front;
+    camera->up.x = 0.0f;
+    camera->up.y = 1.0f;
+    camera->up.z = 0.0f;
     camera->left_fov = left_fov;
     camera->right_fov = right_fov;
     camera->top_fov = top_fov;
@@ -27,15 +83,79 @@ void project_camera_init
     camera->top_angle_tan = tanf((top_fov / 180) * M_PI);
     camera->bottom_angle_tan = -tanf((bottom_fov / 180) * M_PI);
 
+    project_camera_update_basis(camera);
+
     return;
 }
 
+void project_camera_set_up(project_camera_t *camera, const direction_t *up)
+{
+    camera->up = *up;
+    project_camera_update_basis(camera);
+}
+
+void project_camera_set_resolution(project_camera_t *camera, int width, int height)
+{
+    camera->width = width;
+    camera->height = height;
+    if (width <= 0 || height <= 0)
+    {
+        return;
+    }
+
+    float h_size = (camera->right_angle_tan - camera->left_angle_tan) / width;
+    float v_size = (camera->top_angle_tan - camera->bottom_angle_tan) / height;
+    float pixel_size = h_size > v_size ? h_size : v_size;
+    camera->pixel_size = pixel_size;
+    camera->plane_left = (camera->left_angle_tan + camera->right_angle_tan) * 0.5f - pixel_size * width * 0.5f;
+    camera->plane_top = (camera->top_angle_tan + camera->bottom_angle_tan) * 0.5f + pixel_size * height * 0.5f;
+
+    const float3_t *right = &camera->basis_right;
+    const float3_t *up = &camera->basis_up;
+    const float3_t *front = &camera->basis_front;
+    camera->pixel_origin.x = front->x + right->x * camera->plane_left + up->x * camera->plane_top;
+    camera->pixel_origin.y = front->y + right->y * camera->plane_left + up->y * camera->plane_top;
+    camera->pixel_origin.z = front->z + right->z * camera->plane_left + up->z * camera->plane_top;
+    camera->pixel_dx.x = right->x * pixel_size;
+    camera->pixel_dx.y = right->y * pixel_size;
+    camera->pixel_dx.z = right->z * pixel_size;
+    camera->pixel_dy.x = -up->x * pixel_size;
+    camera->pixel_dy.y = -up->y * pixel_size;
+    camera->pixel_dy.z = -up->z * pixel_size;
+}
+
+void project_camera_set_window(project_camera_t *camera, int full_width, int full_height, int x, int y, int width, int height)
+{
+    project_camera_set_resolution(camera, full_width, full_height);
+
+    /* 窗口左上角像素的方向即整个画面中 (x, y) 像素的方向，增量不变 */
+    camera->pixel_origin.x += camera->pixel_dx.x * x + camera->pixel_dy.x * y;
+    camera->pixel_origin.y += camera->pixel_dx.y * x + camera->pixel_dy.y * y;
+    camera->pixel_origin.z += camera->pixel_dx.z * x + camera->pixel_dy.z * y;
+    camera->plane_left += camera->pixel_size * x;
+    camera->plane_top -= camera->pixel_size * y;
+    camera->width = width;
+    camera->height = height;
+}
+
 void setup_project_camera(project_camera_t *camera)
 {
     point_t eye = {320.0, 240.0, 180.0};
     direction_t front = {0.0, 0.0, -1.0};
-    /* 为避免不能完全看到目标场景全貌，视角范围可以尽量大一些 */
-    project_camera_init(camera, &eye, &front, 80, 80, 80, 80);
+    /* 视野为 z = 0 平面上 {0 <= x <= 640, 0 <= y <= 480} 的范围: atan(320 / 180)、atan(240 / 180) */
+    project_camera_init(camera, &eye, &front, 60.642246f, 60.642246f, 53.130102f, 53.130102f);
+
+    return;
+}
+
+void setup_render_options(render_options_t *options)
+{
+    options->shade_mode = RENDER_SHADE_DEPTH;
+    options->checker_size = 40;
+    /* 相切点的距离最大，当前坐标和尺寸时，最大距离约为
+     * sqrtf(300^2 - 210^2) = 214.24
+     */
+    options->depth_scale = 200;
 
     return;
 }
@@ -57,9 +177,37 @@ void setup_sphere(sphere_t *sphere)
     return;
 }
 
+int g_render_verbose = 1;
+
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+uint64_t now_ns(void)
+{
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+
+    /* 整秒和余数分开换算，避免 counter * 10^9 溢出 */
+    uint64_t seconds = counter.QuadPart / frequency.QuadPart;
+    uint64_t remainder = counter.QuadPart % frequency.QuadPart;
+    return seconds * 1000000000ull + remainder * 1000000000ull / frequency.QuadPart;
+}
+#else
+#include <time.h>
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+#endif
+
 uint64_t now_ms(void)
 {
-    return GetTickCount();
+    return now_ns() / 1000000;
 }
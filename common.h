@@ -18,7 +18,10 @@ extern const point_t point_zero;
 /* 如果 direction 等于 direction_none , 表示该条光线为无效的光线 */
 typedef struct ray {point_t origin; direction_t direction;} ray_t;
 
-/* 透视摄像机 */
+/* 透视摄像机
+ * 由 front 和 up 构成正交的观察坐标系，影像平面位于 eye 前方单位距离处。
+ * 各成员的偏移与 render.cl 中的定义一致，float3 之后的填充对应 OpenCL 中 float3 的 16 字节对齐
+ */
 typedef struct project_camera
 {
     /* 基础字面属性 */
@@ -27,13 +30,22 @@ typedef struct project_camera
 
     direction_t front;
     float pad_for_front;
-    
-    /* 视角单位为度 */
+
+    /* 画面上方的参考方向，不须与 front 垂直 */
+    direction_t up;
+    float pad_for_up;
+
+    /* 视角单位为度，为视线与视野各边界的夹角 */
     float left_fov;
     float right_fov;
     float top_fov;
     float bottom_fov;
 
+    /* 画面的像素尺寸，由 project_camera_set_resolution() 设置 */
+    int width;
+    int height;
+    int pad_for_resolution[2];
+
     /* 计算属性 */
 
     /* 视角方向边界, 水平和垂直两面个面的角度边界 */
@@ -41,8 +53,34 @@ typedef struct project_camera
     float right_angle_tan;
     float top_angle_tan;
     float bottom_angle_tan;
+
+    /* 观察坐标系: 右、上、前三个单位向量 */
+    direction_t basis_right;
+    float pad_for_basis_right;
+    direction_t basis_up;
+    float pad_for_basis_up;
+    direction_t basis_front;
+    float pad_for_basis_front;
+
+    /* 像素 (x, y) 的光线方向为 pixel_origin + y * pixel_dy + x * pixel_dx，未单位化。
+     * 像素为正方形，边长 pixel_size (影像平面上的正切值) 取能容纳四个视角的最小值，多出的视野在两侧均分;
+     * plane_left、plane_top 为像素 (0, 0) 在影像平面上的坐标
+     */
+    float pixel_size;
+    float plane_left;
+    float plane_top;
+    float pad_for_plane;
+    float3_t pixel_origin;
+    float pad_for_pixel_origin;
+    float3_t pixel_dx;
+    float pad_for_pixel_dx;
+    float3_t pixel_dy;
+    float pad_for_pixel_dy;
 } project_camera_t;
 
+/* 与 render.cl 中的定义大小一致 */
+typedef char project_camera_size_check[sizeof(project_camera_t) == 208 ? 1 : -1];
+
 typedef struct sphere
 {
     point_t center;
@@ -53,10 +91,126 @@ typedef struct sphere
     float pad[2];
 } sphere_t;
 
+/* 扁平化的 BVH 节点，soft render 与 OpenCL kernel 共用同一内存布局
+ * 只使用标量成员，避免 float3 在 OpenCL 中按 16 字节对齐导致的布局差异
+ */
+typedef struct bvh_node
+{
+    float min_x;
+    float min_y;
+    float min_z;
+    /* 内部节点: 左子节点下标，右子节点紧随其后; 叶节点: 第一个 sphere 的下标 */
+    int left_first;
+
+    float max_x;
+    float max_y;
+    float max_z;
+    /* 叶节点包含的 sphere 个数，0 表示内部节点 */
+    int count;
+} bvh_node_t;
+
+/* 遍历 BVH 时的栈深度上限，构建时保证树深不超过该值 */
+#define BVH_STACK_SIZE 64
+
+/* 场景中的 sphere 按 BVH 叶节点顺序存放，每个叶节点引用其中连续的一段 */
+typedef struct scene
+{
+    sphere_t *spheres;
+    int sphere_count;
+    int sphere_capacity;
+
+    bvh_node_t *nodes;
+    int node_count;
+
+    /* 由 scene_load_file() 加载时 spheres 和 nodes 直接指向文件的映射 (写时复制)，
+     * 两者均按 SCENE_FILE_ALIGN 对齐; 堆上构建的场景为 NULL
+     */
+    void *mapping;
+    uint64_t mapping_size;
+} scene_t;
+
+/* 着色方式 */
+#define RENDER_SHADE_DEPTH 0
+#define RENDER_SHADE_NORMAL 1
+
+/* 影响像素颜色的渲染参数
+ * OpenCL 对每种组合以 -D 编译选项单独编译 kernel; soft render 按着色方式选择特化的函数，数值参数为循环外的常量
+ */
+typedef struct render_options
+{
+    int shade_mode;
+    /* 棋盘背景格子的边长，像素 */
+    int checker_size;
+    /* 深度着色时距离为 depth_scale 的交点显示为黑色 */
+    float depth_scale;
+} render_options_t;
+
+/* 视角单位为度，须在 (0, 90) 之内，由视角计算各方向边界的正切值; up 取 +y，可由 project_camera_set_up() 修改。
+ * 画面尺寸未设置，各渲染实现在渲染前按画面尺寸调用 project_camera_set_resolution()
+ */
+extern void project_camera_init
+(
+    project_camera_t* camera, const point_t* eye, const direction_t* front,
+    float left_fov, float right_fov, float top_fov, float bottom_fov
+);
+
+/* 修改参考的上方向并重新计算观察坐标系，up 与 front 平行时取与 front 垂直的任一方向 */
+extern void project_camera_set_up(project_camera_t *camera, const direction_t *up);
+
+/* 按画面尺寸计算像素光线方向的起点和增量，尺寸不变时不需要重新计算 */
+extern void project_camera_set_resolution(project_camera_t *camera, int width, int height);
+
+/* 只渲染 full_width x full_height 画面中以 (x, y) 为左上角的 width x height 窗口，
+ * 像素方向与渲染整个画面时相同; 渲染实现看到的画面尺寸即窗口尺寸。须在 project_camera_set_up() 之后调用
+ */
+extern void project_camera_set_window(project_camera_t *camera, int full_width, int full_height, int x, int y, int width, int height);
+
 extern void setup_project_camera(project_camera_t *camera);
 
+extern void setup_render_options(render_options_t *options);
+
 extern void setup_sphere(sphere_t *sphere);
 
+extern int scene_init(scene_t *scene);
+
+extern void scene_uninit(scene_t *scene);
+
+extern int scene_add_sphere(scene_t *scene, const point_t *center, float radius);
+
+/* 使用 SAH 分桶构建 BVH，构建过程中会按叶节点顺序重排 spheres */
+extern int scene_build_bvh(scene_t *scene);
+
+/* sphere 原地移动或缩放之后按原有的树结构重新计算各节点的包围盒，不改变 spheres 的顺序，
+ * 映射的场景也可以使用; 新增或删除 sphere 须重新构建
+ */
+extern int scene_refit_bvh(scene_t *scene);
+
+/* 默认场景: setup_sphere() 的大球，再加上 random_sphere_count 个位置固定种子随机的小球 */
+extern int setup_scene(scene_t *scene, int random_sphere_count);
+
+/* scene_file.c: 带版本号的二进制场景文件，内容为构建好 BVH 的 spheres 和 nodes 数组，与内存布局一致。
+ * 加载时整个文件以写时复制方式映射，不做解析，各数组的起始位置按 SCENE_FILE_ALIGN 对齐
+ */
+/* 版本 2: 摄像机只保存字面属性，增加 up，视角为视线与视野边界的夹角 */
+#define SCENE_FILE_VERSION 2
+#define SCENE_FILE_ALIGN 4096
+
+/* camera 非 NULL 时一并保存摄像机 */
+extern int scene_save_file(const scene_t *scene, const project_camera_t *camera, const char *path);
+
+/* 成功时 scene 指向文件的映射，由 scene_uninit() 解除映射; 文件中保存了摄像机时返回 1，camera 非 NULL 则写入 camera，
+ * 没有摄像机返回 0，失败返回 -1
+ */
+extern int scene_load_file(scene_t *scene, project_camera_t *camera, const char *path);
+
+extern void scene_unmap_file(scene_t *scene);
+
 extern uint64_t now_ms(void);
 
+/* 单调时钟，纳秒精度 */
+extern uint64_t now_ns(void);
+
+/* 为 0 时各 render_* 函数不再输出每帧的耗时，供 bench 等批量渲染的场景使用，默认为 1 */
+extern int g_render_verbose;
+
 #endif
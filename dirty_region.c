@@ -0,0 +1,283 @@
+#include "dirty_region.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+/* 投影范围向外扩展的像素数: 覆盖舍入误差、边缘检测读取的相邻像素和抗锯齿 ±0.5 像素的采样 */
+#define RENDER_DIRTY_MARGIN 2
+
+void render_frame_key_init(render_frame_key_t *key, int w, int h, const project_camera_t *camera,
+    const render_options_t *options, int pixel_step, int aa_grid)
+{
+    memset(key, 0, sizeof(*key));
+    key->w = w;
+    key->h = h;
+    key->pixel_step = pixel_step;
+    key->aa_grid = aa_grid;
+    key->options = *options;
+    key->camera = *camera;
+    key->camera.pad_for_eye = 0;
+    key->camera.pad_for_front = 0;
+    key->camera.pad_for_up = 0;
+    memset(key->camera.pad_for_resolution, 0, sizeof(key->camera.pad_for_resolution));
+    key->camera.pad_for_basis_right = 0;
+    key->camera.pad_for_basis_up = 0;
+    key->camera.pad_for_basis_front = 0;
+    key->camera.pad_for_plane = 0;
+    key->camera.pad_for_pixel_origin = 0;
+    key->camera.pad_for_pixel_dx = 0;
+    key->camera.pad_for_pixel_dy = 0;
+}
+
+void render_dirty_add_changes(render_dirty_region_t *region, const render_change_t *changes, int count)
+{
+    if (region->overflow || count <= 0)
+    {
+        return;
+    }
+    if (region->change_count + count > RENDER_MAX_CHANGES)
+    {
+        region->overflow = 1;
+        return;
+    }
+
+    if (region->change_count + count > region->change_capacity)
+    {
+        int capacity = region->change_capacity > 0 ? region->change_capacity : 16;
+        while (capacity < region->change_count + count)
+        {
+            capacity *= 2;
+        }
+        render_change_t *buffer = (render_change_t*)realloc(region->changes, sizeof(render_change_t) * capacity);
+        if (buffer == NULL)
+        {
+            printf("render_dirty_add_changes, alloc failed, changes: %d\n", capacity);
+            region->overflow = 1;
+            return;
+        }
+        region->changes = buffer;
+        region->change_capacity = capacity;
+    }
+
+    memcpy(region->changes + region->change_count, changes, sizeof(render_change_t) * count);
+    region->change_count += count;
+}
+
+/* 取包围盒 8 个顶点在影像平面上的投影的外接矩形，透视投影下包围盒的投影在其凸包之内 */
+int render_box_window_rect(render_dirty_rect_t *rect, const float3_t *box_min, const float3_t *box_max,
+    const project_camera_t *camera, int w, int h)
+{
+    const point_t *eye = &camera->eye;
+    const float3_t *right = &camera->basis_right;
+    const float3_t *up = &camera->basis_up;
+    const float3_t *front = &camera->basis_front;
+    float min_x = FLT_MAX, min_y = FLT_MAX;
+    float max_x = -FLT_MAX, max_y = -FLT_MAX;
+    for (int k = 0; k < 8; ++k)
+    {
+        float dx = ((k & 1) ? box_max->x : box_min->x) - eye->x;
+        float dy = ((k & 2) ? box_max->y : box_min->y) - eye->y;
+        float dz = ((k & 4) ? box_max->z : box_min->z) - eye->z;
+        float depth = dx * front->x + dy * front->y + dz * front->z;
+        if (depth <= 0 || camera->pixel_size <= 0)
+        {
+            rect->x0 = 0;
+            rect->y0 = 0;
+            rect->x1 = w;
+            rect->y1 = h;
+            return 1;
+        }
+
+        /* 影像平面上的坐标换算为窗口坐标，窗口的 y 向下 */
+        float u = (dx * right->x + dy * right->y + dz * right->z) / depth;
+        float v = (dx * up->x + dy * up->y + dz * up->z) / depth;
+        float x = (u - camera->plane_left) / camera->pixel_size;
+        float y = (camera->plane_top - v) / camera->pixel_size;
+        min_x = x < min_x ? x : min_x;
+        max_x = x > max_x ? x : max_x;
+        min_y = y < min_y ? y : min_y;
+        max_y = y > max_y ? y : max_y;
+    }
+
+    float x0 = floorf(min_x) - RENDER_DIRTY_MARGIN;
+    float x1 = ceilf(max_x) + 1 + RENDER_DIRTY_MARGIN;
+    float y0 = floorf(min_y) - RENDER_DIRTY_MARGIN;
+    float y1 = ceilf(max_y) + 1 + RENDER_DIRTY_MARGIN;
+    if (x1 <= 0 || y1 <= 0 || x0 >= w || y0 >= h)
+    {
+        return 0;
+    }
+    rect->x0 = x0 > 0 ? (int)x0 : 0;
+    rect->y0 = y0 > 0 ? (int)y0 : 0;
+    rect->x1 = x1 < w ? (int)x1 : w;
+    rect->y1 = y1 < h ? (int)y1 : h;
+
+    return 1;
+}
+
+/* 包围球在窗口上覆盖的范围，radius 不大于 0 时为空 */
+static
+int sphere_window_rect(render_dirty_rect_t *rect, const point_t *center, float radius,
+    const project_camera_t *camera, int w, int h)
+{
+    if (radius <= 0)
+    {
+        return 0;
+    }
+
+    float r = radius * 1.0001f + 1e-4f;
+    float3_t box_min = {center->x - r, center->y - r, center->z - r};
+    float3_t box_max = {center->x + r, center->y + r, center->z + r};
+    return render_box_window_rect(rect, &box_min, &box_max, camera, w, h);
+}
+
+static
+void mark_rect(render_dirty_region_t *region, const render_dirty_rect_t *rect)
+{
+    int tx0 = rect->x0 / RENDER_DIRTY_TILE_SIZE;
+    int ty0 = rect->y0 / RENDER_DIRTY_TILE_SIZE;
+    int tx1 = (rect->x1 - 1) / RENDER_DIRTY_TILE_SIZE;
+    int ty1 = (rect->y1 - 1) / RENDER_DIRTY_TILE_SIZE;
+    for (int ty = ty0; ty <= ty1; ++ty)
+    {
+        memset(region->mask + ty * region->tiles_x + tx0, 1, tx1 - tx0 + 1);
+    }
+}
+
+/* 由待处理的变化计算 tile 掩码、tile 列表和矩形列表，内存不足时返回 -1 */
+static
+int build_tiles(render_dirty_region_t *region, const render_frame_key_t *key)
+{
+    int w = key->w;
+    int h = key->h;
+    region->tiles_x = (w + RENDER_DIRTY_TILE_SIZE - 1) / RENDER_DIRTY_TILE_SIZE;
+    region->tiles_y = (h + RENDER_DIRTY_TILE_SIZE - 1) / RENDER_DIRTY_TILE_SIZE;
+    int tile_total = region->tiles_x * region->tiles_y;
+    if (region->mask_capacity < tile_total)
+    {
+        free(region->mask);
+        free(region->tiles);
+        free(region->rects);
+        region->mask = (uint8_t*)malloc(tile_total);
+        region->tiles = (int*)malloc(sizeof(int) * tile_total);
+        region->rects = (render_dirty_rect_t*)malloc(sizeof(render_dirty_rect_t) * tile_total);
+        if (region->mask == NULL || region->tiles == NULL || region->rects == NULL)
+        {
+            printf("render_dirty_begin, alloc failed, tiles: %d\n", tile_total);
+            free(region->mask);
+            free(region->tiles);
+            free(region->rects);
+            region->mask = NULL;
+            region->tiles = NULL;
+            region->rects = NULL;
+            region->mask_capacity = 0;
+            return -1;
+        }
+        region->mask_capacity = tile_total;
+    }
+    memset(region->mask, 0, tile_total);
+
+    for (int i = 0; i < region->change_count; ++i)
+    {
+        const render_change_t *change = &region->changes[i];
+        render_dirty_rect_t rect;
+        if (sphere_window_rect(&rect, &change->old_center, change->old_radius, &key->camera, w, h))
+        {
+            mark_rect(region, &rect);
+        }
+        if (sphere_window_rect(&rect, &change->new_center, change->new_radius, &key->camera, w, h))
+        {
+            mark_rect(region, &rect);
+        }
+    }
+
+    region->tile_count = 0;
+    region->rect_count = 0;
+    region->pixel_count = 0;
+    for (int ty = 0; ty < region->tiles_y; ++ty)
+    {
+        const uint8_t *row = region->mask + ty * region->tiles_x;
+        int y0 = ty * RENDER_DIRTY_TILE_SIZE;
+        int y1 = y0 + RENDER_DIRTY_TILE_SIZE < h ? y0 + RENDER_DIRTY_TILE_SIZE : h;
+        int tx = 0;
+        while (tx < region->tiles_x)
+        {
+            if (!row[tx])
+            {
+                tx++;
+                continue;
+            }
+
+            int run_begin = tx;
+            while (tx < region->tiles_x && row[tx])
+            {
+                region->tiles[region->tile_count++] = ty * region->tiles_x + tx;
+                tx++;
+            }
+            int x0 = run_begin * RENDER_DIRTY_TILE_SIZE;
+            int x1 = tx * RENDER_DIRTY_TILE_SIZE < w ? tx * RENDER_DIRTY_TILE_SIZE : w;
+            region->pixel_count += (uint64_t)(x1 - x0) * (y1 - y0);
+
+            /* 与上一行 tile 中范围相同的矩形合并 */
+            render_dirty_rect_t *rect = NULL;
+            for (int k = 0; k < region->rect_count; ++k)
+            {
+                render_dirty_rect_t *prev = &region->rects[k];
+                if (prev->y1 == y0 && prev->x0 == x0 && prev->x1 == x1)
+                {
+                    rect = prev;
+                    break;
+                }
+            }
+            if (rect == NULL)
+            {
+                rect = &region->rects[region->rect_count++];
+                rect->x0 = x0;
+                rect->y0 = y0;
+                rect->x1 = x1;
+            }
+            rect->y1 = y1;
+        }
+    }
+
+    return region->tile_count;
+}
+
+int render_dirty_begin(render_dirty_region_t *region, const render_frame_key_t *key)
+{
+    /* 只有提交过变化时才增量渲染，没有提交变化的帧按场景可能被任意修改处理。
+     * 抗锯齿时整帧渲染: 边缘检测比较相邻像素，dirty tile 边上的像素要与相邻 tile 第一遍的结果比较，
+     * 而保留的像素已是重新采样之后的颜色，相邻 tile 中靠边的像素也需要重新检测
+     */
+    int incremental = region->last_valid && region->change_count > 0 && !region->overflow &&
+        key->pixel_step == 1 && key->aa_grid < 2 && memcmp(&region->last_key, key, sizeof(*key)) == 0;
+
+    int tile_count = incremental ? build_tiles(region, key) : -1;
+
+    region->last_key = *key;
+    region->last_valid = 1;
+    region->change_count = 0;
+    region->overflow = 0;
+
+    return tile_count;
+}
+
+void render_dirty_invalidate(render_dirty_region_t *region)
+{
+    region->last_valid = 0;
+    region->change_count = 0;
+    region->overflow = 0;
+}
+
+void render_dirty_release(render_dirty_region_t *region)
+{
+    free(region->changes);
+    free(region->mask);
+    free(region->tiles);
+    free(region->rects);
+    memset(region, 0, sizeof(*region));
+}
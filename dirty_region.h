@@ -0,0 +1,81 @@
+#ifndef DIRTY_REGION_H
+#define DIRTY_REGION_H
+
+#include "common.h"
+#include "render.h"
+
+#include <stdint.h>
+
+/* 增量渲染的公共部分: 累积 *_render_scene_changed() 提交的变化，与上一帧的参数比较，
+ * 由变化前后的包围球在屏幕上的投影得到需要重新渲染的 tile
+ */
+
+/* 决定本帧能否保留上一帧像素的渲染参数 */
+typedef struct render_frame_key
+{
+    int w;
+    int h;
+    int pixel_step;
+    int aa_grid;
+    render_options_t options;
+    project_camera_t camera;
+} render_frame_key_t;
+
+typedef struct render_dirty_rect
+{
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+} render_dirty_rect_t;
+
+typedef struct render_dirty_region
+{
+    /* 上一帧渲染之后提交的变化 */
+    render_change_t *changes;
+    int change_count;
+    int change_capacity;
+    /* 变化过多或内存不足，须整帧渲染 */
+    int overflow;
+
+    render_frame_key_t last_key;
+    int last_valid;
+
+    /* render_dirty_begin() 的结果: tile 掩码、需要渲染的 tile 下标，以及由 dirty tile 合并成的矩形，
+     * 每行中连续的 dirty tile 合并为一个矩形，范围相同的相邻行再纵向合并
+     */
+    int tiles_x;
+    int tiles_y;
+    uint8_t *mask;
+    int mask_capacity;
+    int *tiles;
+    int tile_count;
+    render_dirty_rect_t *rects;
+    int rect_count;
+    /* dirty tile 覆盖的像素个数 */
+    uint64_t pixel_count;
+} render_dirty_region_t;
+
+/* 包围盒在窗口上覆盖的范围 [x0, x1) x [y0, y1)，向外扩展几个像素以覆盖舍入误差，与画面不相交时返回 0。
+ * 摄像机须已设置画面尺寸; 有顶点不在摄像机前方时为整个画面
+ */
+extern int render_box_window_rect(render_dirty_rect_t *rect, const float3_t *box_min, const float3_t *box_max,
+    const project_camera_t *camera, int w, int h);
+
+/* camera 中的填充成员不参与比较 */
+extern void render_frame_key_init(render_frame_key_t *key, int w, int h, const project_camera_t *camera,
+    const render_options_t *options, int pixel_step, int aa_grid);
+
+extern void render_dirty_add_changes(render_dirty_region_t *region, const render_change_t *changes, int count);
+
+/* 开始渲染一帧，之后 key 记为上一帧的参数，待处理的变化清空。
+ * 可以增量渲染时返回 dirty tile 的个数 (可能为 0)，须整帧渲染时返回 -1
+ */
+extern int render_dirty_begin(render_dirty_region_t *region, const render_frame_key_t *key);
+
+/* 画布被其他方式的渲染覆盖，下一帧须整帧渲染 */
+extern void render_dirty_invalidate(render_dirty_region_t *region);
+
+extern void render_dirty_release(render_dirty_region_t *region);
+
+#endif
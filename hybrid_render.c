@@ -0,0 +1,156 @@
+#include "common.h"
+#include "render.h"
+#include "profiler.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+/* 分割行按 RENDER_MAX_PIXEL_STEP 对齐，任意 pixel_step 下设备和 CPU 的像素块都不会跨过分割行 */
+#define HYBRID_ROW_ALIGN RENDER_MAX_PIXEL_STEP
+/* 每一侧至少分到的行数，保证两侧每帧都有新的耗时样本 */
+#define HYBRID_MIN_ROWS (2 * HYBRID_ROW_ALIGN)
+#define HYBRID_INITIAL_SHARE 0.5
+/* 每行耗时的指数平滑系数，越大越跟随最近一帧 */
+#define HYBRID_SMOOTHING 0.5
+
+typedef struct hybrid_render_global
+{
+    const render_backend_t *device;
+    const render_backend_t *host;
+    /* 平滑之后每毫秒渲染的行数，0 表示还没有样本 */
+    double device_rows_per_ms;
+    double host_rows_per_ms;
+    double device_share;
+    int last_h;
+    render_hybrid_stats_t stats;
+} hybrid_render_global_t;
+
+static hybrid_render_global_t g_hybrid_render =
+{
+    &g_cl_render_backend,
+    &g_soft_render_backend,
+    0,
+    0,
+    HYBRID_INITIAL_SHARE,
+    0,
+    {0, 0, 0, 0},
+};
+
+void hybrid_render_reset(void)
+{
+    g_hybrid_render.device_rows_per_ms = 0;
+    g_hybrid_render.host_rows_per_ms = 0;
+    g_hybrid_render.device_share = HYBRID_INITIAL_SHARE;
+    g_hybrid_render.last_h = 0;
+    memset(&g_hybrid_render.stats, 0, sizeof(g_hybrid_render.stats));
+}
+
+void hybrid_render_stats(render_hybrid_stats_t *stats)
+{
+    *stats = g_hybrid_render.stats;
+}
+
+static
+int hybrid_split_row(int h)
+{
+    if (h < 2 * HYBRID_MIN_ROWS)
+    {
+        /* 画面太小，全部交给设备 */
+        return h;
+    }
+
+    int split = (int)(g_hybrid_render.device_share * h + HYBRID_ROW_ALIGN / 2);
+    split -= split % HYBRID_ROW_ALIGN;
+    if (split < HYBRID_MIN_ROWS)
+    {
+        split = HYBRID_MIN_ROWS;
+    }
+    int max_split = (h - HYBRID_MIN_ROWS) - (h - HYBRID_MIN_ROWS) % HYBRID_ROW_ALIGN;
+    if (split > max_split)
+    {
+        split = max_split;
+    }
+
+    return split;
+}
+
+static
+double smooth_rate(double old_rate, int rows, uint64_t elapsed_ns)
+{
+    if (rows <= 0 || elapsed_ns == 0)
+    {
+        return old_rate;
+    }
+    double rate = rows / (elapsed_ns / 1000000.0);
+    if (old_rate <= 0)
+    {
+        return rate;
+    }
+
+    return old_rate + (rate - old_rate) * HYBRID_SMOOTHING;
+}
+
+int render_project_depth_hybrid(uint8_t* pixel, int w, int h, int pitch)
+{
+    const render_backend_t *device = g_hybrid_render.device;
+    const render_backend_t *host = g_hybrid_render.host;
+    uint64_t ts1 = now_ms();
+
+    if (h != g_hybrid_render.last_h)
+    {
+        /* 行数变化之后每行的耗时不再可比 */
+        hybrid_render_reset();
+        g_hybrid_render.last_h = h;
+    }
+
+    /* 设备先入队上部的行，CPU 随即渲染下部的行，两者同时执行 */
+    int split = hybrid_split_row(h);
+    if (device->render_region(pixel, w, h, pitch, 0, split) != 0)
+    {
+        printf("render_project_depth_hybrid, %s render_region failed\n", device->name);
+        return -1;
+    }
+    int host_ret = host->render_region(pixel, w, h, pitch, split, h);
+    uint64_t host_ns = 0;
+    uint64_t device_ns = 0;
+    if (host_ret == 0)
+    {
+        host_ret = host->wait(&host_ns);
+    }
+    uint64_t span = profiler_begin();
+    int device_ret = device->wait(&device_ns);
+    profiler_end("hybrid wait device", "hybrid", span);
+    if (host_ret != 0 || device_ret != 0)
+    {
+        printf("render_project_depth_hybrid, render failed, %s: %d, %s: %d\n", device->name, device_ret, host->name, host_ret);
+        return -1;
+    }
+
+    g_hybrid_render.device_rows_per_ms = smooth_rate(g_hybrid_render.device_rows_per_ms, split, device_ns);
+    g_hybrid_render.host_rows_per_ms = smooth_rate(g_hybrid_render.host_rows_per_ms, h - split, host_ns);
+    if (g_hybrid_render.device_rows_per_ms > 0 && g_hybrid_render.host_rows_per_ms > 0)
+    {
+        /* 两侧同时完成时 split / d == (h - split) / c，即 split / h == d / (d + c) */
+        g_hybrid_render.device_share = g_hybrid_render.device_rows_per_ms /
+            (g_hybrid_render.device_rows_per_ms + g_hybrid_render.host_rows_per_ms);
+    }
+
+    render_hybrid_stats_t *stats = &g_hybrid_render.stats;
+    stats->split_row = split;
+    stats->device_ms = device_ns / 1000000.0;
+    stats->host_ms = host_ns / 1000000.0;
+    stats->device_share = g_hybrid_render.device_share;
+
+    uint64_t ts2 = now_ms();
+    if (g_render_verbose)
+    {
+        printf("render_project_depth_hybrid, width: %d, height: %d, split: %d, %s: %.2fms, %s: %.2fms, "
+            "next share: %.3f, time elapsed: %" PRIu64 "ms\n",
+            w, h, split, device->name, stats->device_ms, host->name, stats->host_ms,
+            stats->device_share, (ts2-ts1));
+    }
+
+    return 0;
+}
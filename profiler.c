@@ -0,0 +1,397 @@
+#include "profiler.h"
+#include "common.h"
+#include "thread_compat.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define PROFILER_THREAD_LOCAL __declspec(thread)
+#else
+#define PROFILER_THREAD_LOCAL __thread
+#endif
+
+#define PROFILER_MAX_TRACKS 64
+
+/* trace 中的一个区间，CPU 区间的 queued 和 submit 为 0 */
+typedef struct profiler_event
+{
+    int id;
+    int track;
+    uint64_t queued_ns;
+    uint64_t submit_ns;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} profiler_event_t;
+
+/* 一个统计项，durations 和 waits 为最近 PROFILER_STAT_WINDOW 次的环形缓冲区 */
+typedef struct profiler_entry
+{
+    char name[64];
+    char category[16];
+    uint64_t count;
+    uint64_t durations[PROFILER_STAT_WINDOW];
+    uint64_t waits[PROFILER_STAT_WINDOW];
+    int window_count;
+    int window_pos;
+} profiler_entry_t;
+
+typedef struct profiler_track
+{
+    int track;
+    char name[64];
+} profiler_track_t;
+
+/* 所有记录在 mutex 保护下写入，记录的粒度为一帧中的阶段和设备命令，不在逐像素的路径上 */
+struct profiler
+{
+    thread_mutex_t mutex;
+    uint64_t base_ns;
+
+    profiler_event_t *events;
+    int event_capacity;
+    /* 下一个写入的位置和累计写入的事件数 */
+    int event_pos;
+    uint64_t event_total;
+
+    profiler_entry_t entries[PROFILER_MAX_NAMES];
+    int entry_count;
+
+    profiler_track_t tracks[PROFILER_MAX_TRACKS];
+    int track_count;
+    int next_cpu_track;
+} g_profiler;
+
+int g_profiler_enabled = 0;
+
+/* 0 表示当前线程尚未分配轨道号 */
+static PROFILER_THREAD_LOCAL int t_cpu_track = 0;
+
+int profiler_enable(int max_events)
+{
+    if (g_profiler_enabled)
+    {
+        return 0;
+    }
+    if (max_events <= 0)
+    {
+        printf("profiler_enable, invalid event capacity: %d\n", max_events);
+        return -1;
+    }
+
+    memset(&g_profiler, 0, sizeof(g_profiler));
+    g_profiler.events = (profiler_event_t*)malloc(sizeof(profiler_event_t) * max_events);
+    if (g_profiler.events == NULL)
+    {
+        printf("profiler_enable, alloc failed, events: %d\n", max_events);
+        return -1;
+    }
+    g_profiler.event_capacity = max_events;
+    g_profiler.base_ns = now_ns();
+    g_profiler.next_cpu_track = 1;
+    mutex_init(&g_profiler.mutex);
+    g_profiler_enabled = 1;
+
+    return 0;
+}
+
+void profiler_uninit(void)
+{
+    if (!g_profiler_enabled)
+    {
+        return;
+    }
+    g_profiler_enabled = 0;
+    mutex_destroy(&g_profiler.mutex);
+    free(g_profiler.events);
+    memset(&g_profiler, 0, sizeof(g_profiler));
+}
+
+uint64_t profiler_begin(void)
+{
+    return g_profiler_enabled ? now_ns() : 0;
+}
+
+/* 须持有 mutex */
+static
+int find_entry(const char *name, const char *category)
+{
+    for (int i = 0; i < g_profiler.entry_count; ++i)
+    {
+        if (strcmp(g_profiler.entries[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+    if (g_profiler.entry_count == PROFILER_MAX_NAMES)
+    {
+        return -1;
+    }
+
+    profiler_entry_t *entry = &g_profiler.entries[g_profiler.entry_count];
+    memset(entry, 0, sizeof(*entry));
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    snprintf(entry->category, sizeof(entry->category), "%s", category);
+    return g_profiler.entry_count++;
+}
+
+/* 须持有 mutex */
+static
+void add_event(int id, int track, uint64_t queued_ns, uint64_t submit_ns, uint64_t start_ns, uint64_t end_ns)
+{
+    if (id < 0)
+    {
+        return;
+    }
+
+    profiler_event_t *event = &g_profiler.events[g_profiler.event_pos];
+    event->id = id;
+    event->track = track;
+    event->queued_ns = queued_ns;
+    event->submit_ns = submit_ns;
+    event->start_ns = start_ns;
+    event->end_ns = end_ns;
+    g_profiler.event_pos = (g_profiler.event_pos + 1) % g_profiler.event_capacity;
+    g_profiler.event_total++;
+
+    profiler_entry_t *entry = &g_profiler.entries[id];
+    entry->durations[entry->window_pos] = end_ns > start_ns ? end_ns - start_ns : 0;
+    entry->waits[entry->window_pos] = queued_ns != 0 && start_ns > queued_ns ? start_ns - queued_ns : 0;
+    entry->window_pos = (entry->window_pos + 1) % PROFILER_STAT_WINDOW;
+    if (entry->window_count < PROFILER_STAT_WINDOW)
+    {
+        entry->window_count++;
+    }
+    entry->count++;
+}
+
+void profiler_end(const char *name, const char *category, uint64_t start_ns)
+{
+    if (!g_profiler_enabled || start_ns == 0)
+    {
+        return;
+    }
+
+    uint64_t end_ns = now_ns();
+    mutex_lock(&g_profiler.mutex);
+    if (t_cpu_track == 0)
+    {
+        t_cpu_track = g_profiler.next_cpu_track++;
+    }
+    add_event(find_entry(name, category), t_cpu_track, 0, 0, start_ns, end_ns);
+    mutex_unlock(&g_profiler.mutex);
+}
+
+int profiler_register(const char *name, const char *category)
+{
+    if (!g_profiler_enabled)
+    {
+        return -1;
+    }
+
+    mutex_lock(&g_profiler.mutex);
+    int id = find_entry(name, category);
+    mutex_unlock(&g_profiler.mutex);
+
+    return id;
+}
+
+void profiler_record_device(int id, int track, uint64_t queued_ns, uint64_t submit_ns, uint64_t start_ns, uint64_t end_ns)
+{
+    if (!g_profiler_enabled)
+    {
+        return;
+    }
+
+    mutex_lock(&g_profiler.mutex);
+    add_event(id, track, queued_ns, submit_ns, start_ns, end_ns);
+    mutex_unlock(&g_profiler.mutex);
+}
+
+void profiler_name_track(int track, const char *name)
+{
+    if (!g_profiler_enabled)
+    {
+        return;
+    }
+
+    mutex_lock(&g_profiler.mutex);
+    int i = 0;
+    while (i < g_profiler.track_count && g_profiler.tracks[i].track != track)
+    {
+        i++;
+    }
+    if (i < PROFILER_MAX_TRACKS)
+    {
+        g_profiler.tracks[i].track = track;
+        snprintf(g_profiler.tracks[i].name, sizeof(g_profiler.tracks[i].name), "%s", name);
+        if (i == g_profiler.track_count)
+        {
+            g_profiler.track_count++;
+        }
+    }
+    mutex_unlock(&g_profiler.mutex);
+}
+
+int profiler_stat_count(void)
+{
+    return g_profiler_enabled ? g_profiler.entry_count : 0;
+}
+
+int profiler_get_stat(int index, profiler_stat_t *stat)
+{
+    if (!g_profiler_enabled || index < 0 || index >= g_profiler.entry_count)
+    {
+        return -1;
+    }
+
+    mutex_lock(&g_profiler.mutex);
+    const profiler_entry_t *entry = &g_profiler.entries[index];
+    memset(stat, 0, sizeof(*stat));
+    stat->name = entry->name;
+    stat->category = entry->category;
+    stat->count = entry->count;
+    stat->window_count = entry->window_count;
+    if (entry->window_count > 0)
+    {
+        uint64_t sum = 0, wait_sum = 0;
+        uint64_t min_ns = UINT64_MAX, max_ns = 0;
+        for (int i = 0; i < entry->window_count; ++i)
+        {
+            uint64_t d = entry->durations[i];
+            sum += d;
+            wait_sum += entry->waits[i];
+            min_ns = d < min_ns ? d : min_ns;
+            max_ns = d > max_ns ? d : max_ns;
+        }
+        int last = (entry->window_pos + PROFILER_STAT_WINDOW - 1) % PROFILER_STAT_WINDOW;
+        stat->last_ms = entry->durations[last] / 1e6;
+        stat->mean_ms = sum / 1e6 / entry->window_count;
+        stat->min_ms = min_ns / 1e6;
+        stat->max_ms = max_ns / 1e6;
+        stat->mean_wait_ms = wait_sum / 1e6 / entry->window_count;
+    }
+    mutex_unlock(&g_profiler.mutex);
+
+    return 0;
+}
+
+void profiler_reset_stats(void)
+{
+    if (!g_profiler_enabled)
+    {
+        return;
+    }
+
+    mutex_lock(&g_profiler.mutex);
+    for (int i = 0; i < g_profiler.entry_count; ++i)
+    {
+        profiler_entry_t *entry = &g_profiler.entries[i];
+        entry->count = 0;
+        entry->window_count = 0;
+        entry->window_pos = 0;
+    }
+    mutex_unlock(&g_profiler.mutex);
+}
+
+void profiler_print_stats(void)
+{
+    printf("%-32s %-8s %8s %10s %10s %10s %10s %10s\n", "name", "category", "count", "last ms", "mean ms", "min ms", "max ms", "wait ms");
+    for (int i = 0; i < profiler_stat_count(); ++i)
+    {
+        profiler_stat_t stat;
+        if (profiler_get_stat(i, &stat) != 0 || stat.window_count == 0)
+        {
+            continue;
+        }
+        printf("%-32s %-8s %8llu %10.3f %10.3f %10.3f %10.3f %10.3f\n", stat.name, stat.category,
+            (unsigned long long)stat.count, stat.last_ms, stat.mean_ms, stat.min_ms, stat.max_ms, stat.mean_wait_ms);
+    }
+}
+
+/* 名称中只会出现 kernel 名和代码中的常量字符串，仍然转义引号和反斜杠 */
+static
+void write_json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s != '\0'; ++s)
+    {
+        if (*s == '"' || *s == '\\')
+        {
+            fputc('\\', fp);
+        }
+        fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+/* 时间戳为相对 profiler_enable() 的微秒数 */
+static
+double trace_us(uint64_t ns)
+{
+    return ns > g_profiler.base_ns ? (ns - g_profiler.base_ns) / 1e3 : 0.0;
+}
+
+int profiler_write_trace(const char *path)
+{
+    if (!g_profiler_enabled)
+    {
+        printf("profiler_write_trace, profiler is not enabled\n");
+        return -1;
+    }
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        printf("profiler_write_trace, failed to open %s\n", path);
+        return -1;
+    }
+
+    mutex_lock(&g_profiler.mutex);
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(fp, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"ray_trace\"}}");
+    for (int i = 0; i < g_profiler.track_count; ++i)
+    {
+        fprintf(fp, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": ",
+            g_profiler.tracks[i].track);
+        write_json_string(fp, g_profiler.tracks[i].name);
+        fprintf(fp, "}}");
+    }
+
+    /* 环形缓冲区写满之后从最早的事件开始输出 */
+    int count = g_profiler.event_total < (uint64_t)g_profiler.event_capacity ? (int)g_profiler.event_total : g_profiler.event_capacity;
+    int first = g_profiler.event_total < (uint64_t)g_profiler.event_capacity ? 0 : g_profiler.event_pos;
+    for (int i = 0; i < count; ++i)
+    {
+        const profiler_event_t *event = &g_profiler.events[(first + i) % g_profiler.event_capacity];
+        const profiler_entry_t *entry = &g_profiler.entries[event->id];
+        fprintf(fp, ",\n{\"name\": ");
+        write_json_string(fp, entry->name);
+        fprintf(fp, ", \"cat\": ");
+        write_json_string(fp, entry->category);
+        fprintf(fp, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+            event->track, trace_us(event->start_ns), event->end_ns > event->start_ns ? (event->end_ns - event->start_ns) / 1e3 : 0.0);
+        if (event->queued_ns != 0)
+        {
+            fprintf(fp, ", \"args\": {\"queued_us\": %.3f, \"submit_us\": %.3f, \"wait_us\": %.3f}",
+                trace_us(event->queued_ns), trace_us(event->submit_ns),
+                event->start_ns > event->queued_ns ? (event->start_ns - event->queued_ns) / 1e3 : 0.0);
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "\n]}\n");
+    uint64_t total = g_profiler.event_total;
+    mutex_unlock(&g_profiler.mutex);
+
+    int ok = !ferror(fp);
+    if (fclose(fp) != 0 || !ok)
+    {
+        printf("profiler_write_trace, failed to write %s\n", path);
+        return -1;
+    }
+    printf("profiler_write_trace, %s, events: %d of %llu\n", path, count, (unsigned long long)total);
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+
+/* 性能分析: 记录 CPU 各阶段和 OpenCL 各命令的耗时区间，可导出为 Chrome trace-event JSON
+ * (chrome://tracing 或 Perfetto 打开)，同时按名称维护最近 PROFILER_STAT_WINDOW 次的滚动统计。
+ * 未开启时各记录函数只检查一次标志位; OpenCL 的队列在 init_cl_rendler() 时按是否开启决定是否带 profiling 属性，
+ * 因此须在其之前调用 profiler_enable()
+ */
+
+/* 每个统计项保留的最近样本数 */
+#define PROFILER_STAT_WINDOW 128
+/* 统计项个数上限，超过之后的新名称不再记录 */
+#define PROFILER_MAX_NAMES 128
+
+/* CPU 线程的轨道号从 1 开始按首次记录的顺序分配，设备队列使用 PROFILER_TRACK_DEVICE 之后的轨道号 */
+#define PROFILER_TRACK_DEVICE 1000
+
+typedef struct profiler_stat
+{
+    const char *name;
+    const char *category;
+    /* 开启以来的总次数 */
+    uint64_t count;
+    /* 以下为最近 PROFILER_STAT_WINDOW 次的统计 */
+    int window_count;
+    double last_ms;
+    double mean_ms;
+    double min_ms;
+    double max_ms;
+    /* 设备命令从入队到开始执行的平均等待，CPU 区间为 0 */
+    double mean_wait_ms;
+} profiler_stat_t;
+
+/* max_events 为 trace 环形缓冲区保留的事件数，写满之后覆盖最早的事件 */
+extern int profiler_enable(int max_events);
+
+extern void profiler_uninit(void);
+
+extern int g_profiler_enabled;
+
+/* 当前时刻，未开启时返回 0 */
+extern uint64_t profiler_begin(void);
+
+/* 记录当前线程从 start_ns 到现在的区间，start_ns 为 0 时不记录 */
+extern void profiler_end(const char *name, const char *category, uint64_t start_ns);
+
+/* 登记统计项，返回其下标，同名的统计项只登记一次; 表满或未开启时返回 -1 */
+extern int profiler_register(const char *name, const char *category);
+
+/* 记录一个设备命令，queued、submit、start、end 均已换算为 now_ns() 的时间基准 */
+extern void profiler_record_device(int id, int track, uint64_t queued_ns, uint64_t submit_ns, uint64_t start_ns, uint64_t end_ns);
+
+/* trace 中显示的轨道名 */
+extern void profiler_name_track(int track, const char *name);
+
+extern int profiler_stat_count(void);
+
+extern int profiler_get_stat(int index, profiler_stat_t *stat);
+
+/* 清空滚动统计，trace 中的事件保留 */
+extern void profiler_reset_stats(void);
+
+extern void profiler_print_stats(void);
+
+extern int profiler_write_trace(const char *path);
+
+#endif
@@ -0,0 +1,1007 @@
+#include "common.h"
+#include "render.h"
+#include "thread_pool.h"
+#include "thread_compat.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _WIN32
+#define open_pipe(command) _popen((command), "wb")
+#define close_pipe(fp) _pclose(fp)
+#else
+#include <signal.h>
+
+#define open_pipe(command) popen((command), "w")
+#define close_pipe(fp) pclose(fp)
+#endif
+
+/* 无窗口渲染动画: 摄像机沿路径移动 (环绕、平移)，部分 sphere 往复运动，逐帧渲染后交给编码线程。
+ * 渲染线程和编码线程之间是 --queue 个帧缓冲组成的有界队列: 编码线程做颜色转换和写入，
+ * 写入变慢时队列填满，渲染线程才会等待; 内存不随帧数增长
+ */
+
+#define ANIM_MAX_QUEUE 16
+#define ANIM_MAX_PATH 256
+/* 运动的 sphere 沿 x 轴往复的幅度，一个周期为整个序列，首尾相接 */
+#define ANIM_MOVE_AMPLITUDE 80.0f
+
+typedef struct anim_backend
+{
+    const char *name;
+    /* 1 为 cl_render.c 的单设备渲染，2 为 cl_multi_render.c 的多设备渲染 */
+    int need_opencl;
+    int (*render)(uint8_t* pixel, int w, int h, int pitch);
+} anim_backend_t;
+
+static
+int anim_depth_soft_simd(uint8_t* pixel, int w, int h, int pitch)
+{
+    render_project_depth_soft_simd(pixel, w, h, pitch);
+    return 0;
+}
+
+static
+int anim_depth_soft_mt(uint8_t* pixel, int w, int h, int pitch)
+{
+    render_project_depth_soft_mt(pixel, w, h, pitch);
+    return 0;
+}
+
+static
+int anim_depth_soft_wavefront(uint8_t* pixel, int w, int h, int pitch)
+{
+    render_project_depth_soft_wavefront(pixel, w, h, pitch);
+    return 0;
+}
+
+/* 流水线渲染的输出滞后于提交，不适合逐帧输出，不在此列 */
+static const anim_backend_t g_anim_backends[] =
+{
+    {"depth_soft_simd", 0, anim_depth_soft_simd},
+    {"depth_soft_mt", 0, anim_depth_soft_mt},
+    {"depth_soft_wavefront", 0, anim_depth_soft_wavefront},
+    {"depth_opencl", 1, render_project_depth_opencl},
+    {"depth_opencl_wavefront", 1, render_project_depth_opencl_wavefront},
+    {"depth_hybrid", 1, render_project_depth_hybrid},
+    {"depth_opencl_multi", 2, render_project_depth_opencl_multi},
+};
+#define ANIM_BACKEND_COUNT ((int)(sizeof(g_anim_backends) / sizeof(g_anim_backends[0])))
+
+enum
+{
+    ANIM_FORMAT_Y4M,
+    ANIM_FORMAT_PPM,
+};
+
+typedef struct anim_options
+{
+    int w;
+    int h;
+    int frame_count;
+    int fps;
+    int queue_size;
+    const anim_backend_t *backend;
+    int thread_count;
+    const char *cl_source_file;
+    int random_sphere_count;
+    const char *scene_file;
+    render_options_t render_options;
+    int aa_grid;
+    int bounces;
+    /* 整个序列中摄像机绕场景中心转过的角度 */
+    float orbit;
+    /* 每帧摄像机位置的平移 */
+    float pan[3];
+    int move_count;
+    /* 输出: .y4m 文件、含 %d 的 PPM 文件名模板，或者以 Y4M 写入标准输入的命令 */
+    const char *output;
+    const char *pipe_command;
+    int format;
+} anim_options_t;
+
+static
+void print_usage(const char *program)
+{
+    printf("usage: %s (--output <file.y4m|frame_%%04d.ppm> | --pipe <command>) [options]\n", program);
+    printf("  --size <WxH>         frame size (default: 1280x720)\n");
+    printf("  --frames <n>         frames to render (default: 120)\n");
+    printf("  --fps <n>            frame rate written to the Y4M header (default: 30)\n");
+    printf("  --queue <n>          frames buffered between renderer and encoder, 1~%d (default: 4)\n", ANIM_MAX_QUEUE);
+    printf("  --backend <name>     ");
+    for (int i = 0; i < ANIM_BACKEND_COUNT; ++i)
+    {
+        printf("%s%s", i > 0 ? ", " : "", g_anim_backends[i].name);
+    }
+    printf(" (default: %s)\n", g_anim_backends[0].name);
+    printf("  --threads <n>        soft render worker threads, 0 for all cores (default: 0)\n");
+    printf("  --cl-source <file>   OpenCL kernel source (default: render.cl)\n");
+    printf("  --spheres <n>        extra random spheres in the scene (default: 0)\n");
+    printf("  --scene <file>       binary scene written by scene_convert, its camera is the first frame's\n");
+    printf("  --shade <mode>       depth or normal (default: depth)\n");
+    printf("  --aa <n>             adaptive anti-aliasing with n x n samples on edge pixels, 1 to disable (default: 1)\n");
+    printf("  --bounces <n>        reflection bounces of the wavefront backends (default: 0)\n");
+    printf("  --orbit <deg>        orbit the camera around the scene center by deg over the sequence (default: 0)\n");
+    printf("  --pan <x,y,z>        move the camera by this much every frame (default: 0,0,0)\n");
+    printf("  --move <n>           n spheres swing along x, one period over the sequence (default: 0)\n");
+    printf("  --pipe <command>     stream Y4M to the standard input of command, e.g. \"ffmpeg -i - out.mp4\"\n");
+}
+
+/* PPM 模板须恰好包含一个 %d，可带宽度，例如 frames/frame_%04d.ppm */
+static
+int check_pattern(const char *pattern)
+{
+    int count = 0;
+    for (const char *p = pattern; *p != '\0'; ++p)
+    {
+        if (*p != '%')
+        {
+            continue;
+        }
+        ++p;
+        while (*p >= '0' && *p <= '9')
+        {
+            ++p;
+        }
+        if (*p != 'd')
+        {
+            return -1;
+        }
+        ++count;
+    }
+    return count == 1 ? 0 : -1;
+}
+
+static
+int has_suffix(const char *s, const char *suffix)
+{
+    size_t n = strlen(s);
+    size_t m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+static
+int parse_options(anim_options_t *options, int argc, char *argv[])
+{
+    memset(options, 0, sizeof(*options));
+    options->w = 1280;
+    options->h = 720;
+    options->frame_count = 120;
+    options->fps = 30;
+    options->queue_size = 4;
+    options->backend = &g_anim_backends[0];
+    options->cl_source_file = "render.cl";
+    setup_render_options(&options->render_options);
+    options->aa_grid = 1;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *opt = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(opt, "--help") == 0 || strcmp(opt, "-h") == 0)
+        {
+            print_usage(argv[0]);
+            exit(0);
+        }
+        if (value == NULL)
+        {
+            printf("missing value for %s\n", opt);
+            return -1;
+        }
+        ++i;
+
+        if (strcmp(opt, "--size") == 0)
+        {
+            if (sscanf(value, "%dx%d", &options->w, &options->h) != 2)
+            {
+                printf("invalid size: %s\n", value);
+                return -1;
+            }
+        }
+        else if (strcmp(opt, "--frames") == 0)
+        {
+            options->frame_count = atoi(value);
+        }
+        else if (strcmp(opt, "--fps") == 0)
+        {
+            options->fps = atoi(value);
+        }
+        else if (strcmp(opt, "--queue") == 0)
+        {
+            options->queue_size = atoi(value);
+        }
+        else if (strcmp(opt, "--backend") == 0)
+        {
+            options->backend = NULL;
+            for (int k = 0; k < ANIM_BACKEND_COUNT; ++k)
+            {
+                if (strcmp(value, g_anim_backends[k].name) == 0)
+                {
+                    options->backend = &g_anim_backends[k];
+                }
+            }
+            if (options->backend == NULL)
+            {
+                printf("unknown backend: %s\n", value);
+                return -1;
+            }
+        }
+        else if (strcmp(opt, "--threads") == 0)
+        {
+            options->thread_count = atoi(value);
+        }
+        else if (strcmp(opt, "--cl-source") == 0)
+        {
+            options->cl_source_file = value;
+        }
+        else if (strcmp(opt, "--spheres") == 0)
+        {
+            options->random_sphere_count = atoi(value);
+        }
+        else if (strcmp(opt, "--scene") == 0)
+        {
+            options->scene_file = value;
+        }
+        else if (strcmp(opt, "--shade") == 0)
+        {
+            if (strcmp(value, "depth") == 0)
+            {
+                options->render_options.shade_mode = RENDER_SHADE_DEPTH;
+            }
+            else if (strcmp(value, "normal") == 0)
+            {
+                options->render_options.shade_mode = RENDER_SHADE_NORMAL;
+            }
+            else
+            {
+                printf("unknown shade mode: %s\n", value);
+                return -1;
+            }
+        }
+        else if (strcmp(opt, "--aa") == 0)
+        {
+            options->aa_grid = atoi(value);
+        }
+        else if (strcmp(opt, "--bounces") == 0)
+        {
+            options->bounces = atoi(value);
+        }
+        else if (strcmp(opt, "--orbit") == 0)
+        {
+            options->orbit = (float)atof(value);
+        }
+        else if (strcmp(opt, "--pan") == 0)
+        {
+            if (sscanf(value, "%f,%f,%f", &options->pan[0], &options->pan[1], &options->pan[2]) != 3)
+            {
+                printf("invalid pan: %s, expected x,y,z\n", value);
+                return -1;
+            }
+        }
+        else if (strcmp(opt, "--move") == 0)
+        {
+            options->move_count = atoi(value);
+        }
+        else if (strcmp(opt, "--output") == 0)
+        {
+            options->output = value;
+        }
+        else if (strcmp(opt, "--pipe") == 0)
+        {
+            options->pipe_command = value;
+        }
+        else
+        {
+            printf("unknown option: %s\n", opt);
+            return -1;
+        }
+    }
+
+    if ((options->output == NULL) == (options->pipe_command == NULL))
+    {
+        printf("exactly one of --output and --pipe is required\n");
+        return -1;
+    }
+    if (options->pipe_command != NULL || has_suffix(options->output, ".y4m"))
+    {
+        options->format = ANIM_FORMAT_Y4M;
+    }
+    else if (has_suffix(options->output, ".ppm") && check_pattern(options->output) == 0 &&
+        strlen(options->output) < ANIM_MAX_PATH - 16)
+    {
+        options->format = ANIM_FORMAT_PPM;
+    }
+    else
+    {
+        printf("invalid output: %s, expected a .y4m file or a .ppm pattern with one %%d\n", options->output);
+        return -1;
+    }
+    if (options->w <= 0 || options->h <= 0 || options->w > 16384 || options->h > 16384)
+    {
+        printf("invalid size: %dx%d\n", options->w, options->h);
+        return -1;
+    }
+    if (options->frame_count <= 0 || options->fps <= 0)
+    {
+        printf("invalid frame count or fps: %d, %d\n", options->frame_count, options->fps);
+        return -1;
+    }
+    if (options->queue_size < 1 || options->queue_size > ANIM_MAX_QUEUE)
+    {
+        printf("invalid queue size: %d\n", options->queue_size);
+        return -1;
+    }
+    if (options->aa_grid < 1 || options->aa_grid > RENDER_AA_MAX_GRID || options->bounces < 0)
+    {
+        printf("invalid aa grid or bounces: %d, %d\n", options->aa_grid, options->bounces);
+        return -1;
+    }
+    if (options->move_count < 0 || options->move_count > RENDER_MAX_CHANGES)
+    {
+        printf("invalid move count: %d\n", options->move_count);
+        return -1;
+    }
+
+    return 0;
+}
+
+/********************************************************************************/
+
+/* 编码线程: 渲染线程从空闲列表取帧缓冲，写满之后按帧序放入队列; 编码线程取出、转换、写入后放回空闲列表 */
+
+typedef struct anim_frame
+{
+    uint8_t *pixel;
+    int index;
+} anim_frame_t;
+
+typedef struct anim_encoder
+{
+    int format;
+    int w;
+    int h;
+    const char *pattern;
+    /* Y4M 的输出文件或管道 */
+    FILE *fp;
+    int is_pipe;
+    /* 转换后的 RGB 或 YUV 4:2:0 */
+    uint8_t *data;
+    size_t data_size;
+
+    anim_frame_t frames[ANIM_MAX_QUEUE];
+    int frame_count;
+    int free_list[ANIM_MAX_QUEUE];
+    int free_count;
+    int queue[ANIM_MAX_QUEUE];
+    int queue_head;
+    int queue_count;
+    int max_queue_count;
+    int quit;
+    int failed;
+
+    thread_handle_t thread;
+    thread_mutex_t mutex;
+    thread_cond_t queue_cond;
+    thread_cond_t free_cond;
+
+    int written_frames;
+    uint64_t encode_ns;
+    uint64_t last_write_ns;
+} anim_encoder_t;
+
+static anim_encoder_t g_anim_encoder;
+
+/* BGRA 转为 BT.601 有限范围的 YUV 4:2:0，色度取 2x2 像素的平均值，奇数尺寸时边缘的块只含 1 或 2 个像素 */
+static
+void convert_yuv420(uint8_t *out, const uint8_t *pixel, int w, int h)
+{
+    int cw = (w + 1) / 2;
+    int ch = (h + 1) / 2;
+    uint8_t *y_plane = out;
+    uint8_t *u_plane = out + (size_t)w * h;
+    uint8_t *v_plane = u_plane + (size_t)cw * ch;
+    for (int j = 0; j < h; ++j)
+    {
+        const uint8_t *src = pixel + (size_t)j * w * 4;
+        uint8_t *dst = y_plane + (size_t)j * w;
+        for (int i = 0; i < w; ++i)
+        {
+            int b = src[i * 4];
+            int g = src[i * 4 + 1];
+            int r = src[i * 4 + 2];
+            dst[i] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        }
+    }
+    for (int j = 0; j < ch; ++j)
+    {
+        for (int i = 0; i < cw; ++i)
+        {
+            int r = 0;
+            int g = 0;
+            int b = 0;
+            int n = 0;
+            for (int y = 2 * j; y < 2 * j + 2 && y < h; ++y)
+            {
+                for (int x = 2 * i; x < 2 * i + 2 && x < w; ++x)
+                {
+                    const uint8_t *src = pixel + ((size_t)y * w + x) * 4;
+                    b += src[0];
+                    g += src[1];
+                    r += src[2];
+                    ++n;
+                }
+            }
+            r /= n;
+            g /= n;
+            b /= n;
+            /* 右移负数为算术右移，各主流编译器一致 */
+            u_plane[(size_t)j * cw + i] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            v_plane[(size_t)j * cw + i] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+}
+
+static
+int encode_frame(anim_encoder_t *encoder, const anim_frame_t *frame)
+{
+    size_t pixel_count = (size_t)encoder->w * encoder->h;
+    if (encoder->format == ANIM_FORMAT_Y4M)
+    {
+        convert_yuv420(encoder->data, frame->pixel, encoder->w, encoder->h);
+        if (fwrite("FRAME\n", 1, 6, encoder->fp) != 6 ||
+            fwrite(encoder->data, 1, encoder->data_size, encoder->fp) != encoder->data_size)
+        {
+            printf("encode_frame, failed to write frame %d\n", frame->index);
+            return -1;
+        }
+        return 0;
+    }
+
+    for (size_t i = 0; i < pixel_count; ++i)
+    {
+        encoder->data[i * 3] = frame->pixel[i * 4 + 2];
+        encoder->data[i * 3 + 1] = frame->pixel[i * 4 + 1];
+        encoder->data[i * 3 + 2] = frame->pixel[i * 4];
+    }
+    char path[ANIM_MAX_PATH];
+    snprintf(path, sizeof(path), encoder->pattern, frame->index);
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        printf("encode_frame, failed to open %s\n", path);
+        return -1;
+    }
+    fprintf(fp, "P6\n%d %d\n255\n", encoder->w, encoder->h);
+    int ok = fwrite(encoder->data, 1, encoder->data_size, fp) == encoder->data_size;
+    if (fclose(fp) != 0 || !ok)
+    {
+        printf("encode_frame, failed to write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef _WIN32
+static
+DWORD WINAPI encoder_routine(LPVOID param)
+#else
+static
+void* encoder_routine(void *param)
+#endif
+{
+    anim_encoder_t *encoder = (anim_encoder_t*)param;
+    mutex_lock(&encoder->mutex);
+    while (1)
+    {
+        while (encoder->queue_count == 0 && !encoder->quit)
+        {
+            cond_wait(&encoder->queue_cond, &encoder->mutex);
+        }
+        if (encoder->queue_count == 0)
+        {
+            break;
+        }
+        int slot = encoder->queue[encoder->queue_head];
+        encoder->queue_head = (encoder->queue_head + 1) % ANIM_MAX_QUEUE;
+        --encoder->queue_count;
+        int failed = encoder->failed;
+        mutex_unlock(&encoder->mutex);
+
+        if (!failed)
+        {
+            uint64_t ts1 = now_ns();
+            failed = encode_frame(encoder, &encoder->frames[slot]) != 0;
+            uint64_t ts2 = now_ns();
+            encoder->encode_ns += ts2 - ts1;
+            encoder->last_write_ns = ts2;
+            encoder->written_frames += !failed;
+        }
+
+        mutex_lock(&encoder->mutex);
+        encoder->failed |= failed;
+        encoder->free_list[encoder->free_count++] = slot;
+        cond_broadcast(&encoder->free_cond);
+    }
+    mutex_unlock(&encoder->mutex);
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+static
+void free_encoder_buffers(anim_encoder_t *encoder)
+{
+    for (int i = 0; i < encoder->frame_count; ++i)
+    {
+        free(encoder->frames[i].pixel);
+    }
+    free(encoder->data);
+}
+
+static
+int close_output(anim_encoder_t *encoder)
+{
+    if (encoder->fp == NULL)
+    {
+        return 0;
+    }
+    int ret = encoder->is_pipe ? close_pipe(encoder->fp) : fclose(encoder->fp);
+    encoder->fp = NULL;
+    return ret == 0 ? 0 : -1;
+}
+
+static
+int anim_encoder_open(const anim_options_t *options)
+{
+    anim_encoder_t *encoder = &g_anim_encoder;
+    memset(encoder, 0, sizeof(*encoder));
+    encoder->format = options->format;
+    encoder->w = options->w;
+    encoder->h = options->h;
+    encoder->pattern = options->output;
+    encoder->frame_count = options->queue_size;
+
+    size_t pixel_count = (size_t)options->w * options->h;
+    encoder->data_size = options->format == ANIM_FORMAT_Y4M ?
+        pixel_count + 2 * (size_t)((options->w + 1) / 2) * ((options->h + 1) / 2) : pixel_count * 3;
+    encoder->data = (uint8_t*)malloc(encoder->data_size);
+    int alloc_ok = encoder->data != NULL;
+    for (int i = 0; i < encoder->frame_count; ++i)
+    {
+        /* 增量渲染保留画面中未变化的部分，第一次渲染之前清零 */
+        encoder->frames[i].pixel = (uint8_t*)calloc(pixel_count, 4);
+        alloc_ok = alloc_ok && encoder->frames[i].pixel != NULL;
+        encoder->free_list[encoder->free_count++] = i;
+    }
+    if (!alloc_ok)
+    {
+        printf("anim_encoder_open, out of memory\n");
+        free_encoder_buffers(encoder);
+        return -1;
+    }
+
+    if (options->format == ANIM_FORMAT_Y4M)
+    {
+        if (options->pipe_command != NULL)
+        {
+        #ifndef _WIN32
+            /* 命令提前退出时 fwrite 返回错误，而不是进程被 SIGPIPE 终止 */
+            signal(SIGPIPE, SIG_IGN);
+        #endif
+            encoder->fp = open_pipe(options->pipe_command);
+            encoder->is_pipe = 1;
+        }
+        else
+        {
+            encoder->fp = fopen(options->output, "wb");
+        }
+        if (encoder->fp == NULL ||
+            fprintf(encoder->fp, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", options->w, options->h, options->fps) < 0)
+        {
+            printf("anim_encoder_open, failed to open %s\n", options->pipe_command != NULL ? options->pipe_command : options->output);
+            close_output(encoder);
+            free_encoder_buffers(encoder);
+            return -1;
+        }
+    }
+
+    mutex_init(&encoder->mutex);
+    cond_init(&encoder->queue_cond);
+    cond_init(&encoder->free_cond);
+#ifdef _WIN32
+    encoder->thread = CreateThread(NULL, 0, encoder_routine, (LPVOID)encoder, 0, NULL);
+    if (encoder->thread == NULL)
+#else
+    if (pthread_create(&encoder->thread, NULL, encoder_routine, (void*)encoder) != 0)
+#endif
+    {
+        printf("anim_encoder_open, failed to create the encoder thread\n");
+        cond_destroy(&encoder->free_cond);
+        cond_destroy(&encoder->queue_cond);
+        mutex_destroy(&encoder->mutex);
+        close_output(encoder);
+        free_encoder_buffers(encoder);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* 取一个空闲的帧缓冲，编码线程出错时返回 NULL */
+static
+anim_frame_t* anim_encoder_acquire(void)
+{
+    anim_encoder_t *encoder = &g_anim_encoder;
+    anim_frame_t *frame = NULL;
+    mutex_lock(&encoder->mutex);
+    while (encoder->free_count == 0 && !encoder->failed)
+    {
+        cond_wait(&encoder->free_cond, &encoder->mutex);
+    }
+    if (!encoder->failed)
+    {
+        frame = &encoder->frames[encoder->free_list[--encoder->free_count]];
+    }
+    mutex_unlock(&encoder->mutex);
+    return frame;
+}
+
+static
+void anim_encoder_submit(anim_frame_t *frame, int index)
+{
+    anim_encoder_t *encoder = &g_anim_encoder;
+    frame->index = index;
+    mutex_lock(&encoder->mutex);
+    int tail = (encoder->queue_head + encoder->queue_count) % ANIM_MAX_QUEUE;
+    encoder->queue[tail] = (int)(frame - encoder->frames);
+    ++encoder->queue_count;
+    if (encoder->queue_count > encoder->max_queue_count)
+    {
+        encoder->max_queue_count = encoder->queue_count;
+    }
+    cond_broadcast(&encoder->queue_cond);
+    mutex_unlock(&encoder->mutex);
+}
+
+static
+void anim_encoder_release(anim_frame_t *frame)
+{
+    anim_encoder_t *encoder = &g_anim_encoder;
+    mutex_lock(&encoder->mutex);
+    encoder->free_list[encoder->free_count++] = (int)(frame - encoder->frames);
+    mutex_unlock(&encoder->mutex);
+}
+
+/* 等待队列中的帧写完，关闭输出 */
+static
+int anim_encoder_close(void)
+{
+    anim_encoder_t *encoder = &g_anim_encoder;
+    mutex_lock(&encoder->mutex);
+    encoder->quit = 1;
+    cond_broadcast(&encoder->queue_cond);
+    mutex_unlock(&encoder->mutex);
+#ifdef _WIN32
+    WaitForSingleObject(encoder->thread, INFINITE);
+    CloseHandle(encoder->thread);
+#else
+    pthread_join(encoder->thread, NULL);
+#endif
+
+    int ret = encoder->failed ? -1 : 0;
+    if (close_output(encoder) != 0)
+    {
+        printf("anim_encoder_close, failed to close the output\n");
+        ret = -1;
+    }
+    cond_destroy(&encoder->free_cond);
+    cond_destroy(&encoder->queue_cond);
+    mutex_destroy(&encoder->mutex);
+    free_encoder_buffers(encoder);
+    return ret;
+}
+
+/********************************************************************************/
+
+typedef struct anim_state
+{
+    const anim_options_t *options;
+    scene_t *scene;
+    int opencl_ready;
+    int multi_ready;
+    project_camera_t base_camera;
+    /* 环绕的中心: 摄像机视线上离场景包围盒中心最近的点 */
+    point_t orbit_center;
+    int *move_ids;
+    point_t *move_origins;
+} anim_state_t;
+
+/* 第 frame 帧的摄像机: eye 绕过 orbit_center、平行于 up 的轴旋转，视线始终朝向 orbit_center，再加上平移 */
+static
+void frame_camera(const anim_state_t *state, int frame, project_camera_t *camera)
+{
+    const anim_options_t *options = state->options;
+    const project_camera_t *base = &state->base_camera;
+    point_t eye = base->eye;
+    direction_t front = base->front;
+    if (options->orbit != 0)
+    {
+        float angle = options->orbit / 180.0f * (float)M_PI * frame / options->frame_count;
+        const float3_t *axis = &base->basis_up;
+        float ox = base->eye.x - state->orbit_center.x;
+        float oy = base->eye.y - state->orbit_center.y;
+        float oz = base->eye.z - state->orbit_center.z;
+        /* Rodrigues 旋转公式，axis 为单位向量 */
+        float c = cosf(angle);
+        float s = sinf(angle);
+        float dot = ox * axis->x + oy * axis->y + oz * axis->z;
+        float cx = axis->y * oz - axis->z * oy;
+        float cy = axis->z * ox - axis->x * oz;
+        float cz = axis->x * oy - axis->y * ox;
+        eye.x = state->orbit_center.x + ox * c + cx * s + axis->x * dot * (1 - c);
+        eye.y = state->orbit_center.y + oy * c + cy * s + axis->y * dot * (1 - c);
+        eye.z = state->orbit_center.z + oz * c + cz * s + axis->z * dot * (1 - c);
+        front.x = state->orbit_center.x - eye.x;
+        front.y = state->orbit_center.y - eye.y;
+        front.z = state->orbit_center.z - eye.z;
+    }
+    eye.x += options->pan[0] * frame;
+    eye.y += options->pan[1] * frame;
+    eye.z += options->pan[2] * frame;
+
+    project_camera_init(camera, &eye, &front, base->left_fov, base->right_fov, base->top_fov, base->bottom_fov);
+    project_camera_set_up(camera, &base->up);
+}
+
+static
+void set_camera(const anim_state_t *state, const project_camera_t *camera)
+{
+    soft_render_set_camera(camera);
+    if (state->opencl_ready)
+    {
+        cl_render_set_camera(camera);
+    }
+    if (state->multi_ready)
+    {
+        cl_multi_render_set_camera(camera);
+    }
+}
+
+/* 把运动的 sphere 移到第 frame 帧的位置，重新计算 BVH 的包围盒之后提交给各渲染实现 */
+static
+void move_spheres(anim_state_t *state, int frame)
+{
+    const anim_options_t *options = state->options;
+    float offset = ANIM_MOVE_AMPLITUDE * sinf(2.0f * (float)M_PI * frame / options->frame_count);
+    render_change_t changes[64];
+    int change_count = 0;
+    for (int k = 0; k < options->move_count; ++k)
+    {
+        sphere_t *sphere = &state->scene->spheres[state->move_ids[k]];
+        render_change_t *change = &changes[change_count++];
+        change->old_center = sphere->center;
+        change->old_radius = sphere->radius;
+        /* 相邻的 sphere 方向相反 */
+        sphere->center.x = state->move_origins[k].x + ((k & 1) ? -offset : offset);
+        change->new_center = sphere->center;
+        change->new_radius = sphere->radius;
+        if (change_count == (int)(sizeof(changes) / sizeof(changes[0])) || k + 1 == options->move_count)
+        {
+            soft_render_scene_changed(changes, change_count);
+            if (state->opencl_ready)
+            {
+                cl_render_scene_changed(changes, change_count);
+            }
+            change_count = 0;
+        }
+    }
+    scene_refit_bvh(state->scene);
+    if (state->multi_ready)
+    {
+        cl_multi_render_scene_changed();
+    }
+}
+
+static
+int render_sequence(anim_state_t *state)
+{
+    const anim_options_t *options = state->options;
+    int w = options->w;
+    int h = options->h;
+    if (anim_encoder_open(options) != 0)
+    {
+        return -1;
+    }
+
+    printf("rendering %d frames of %dx%d with %s, queue %d, output %s\n", options->frame_count, w, h,
+        options->backend->name, options->queue_size, options->pipe_command != NULL ? options->pipe_command : options->output);
+
+    int ret = 0;
+    uint64_t render_ns = 0;
+    uint64_t stall_ns = 0;
+    uint8_t *previous = NULL;
+    uint64_t ts1 = now_ns();
+    for (int frame = 0; frame < options->frame_count; ++frame)
+    {
+        uint64_t ts2 = now_ns();
+        anim_frame_t *slot = anim_encoder_acquire();
+        uint64_t ts3 = now_ns();
+        stall_ns += ts3 - ts2;
+        if (slot == NULL)
+        {
+            ret = -1;
+            break;
+        }
+
+        project_camera_t camera;
+        frame_camera(state, frame, &camera);
+        set_camera(state, &camera);
+        if (options->move_count > 0)
+        {
+            move_spheres(state, frame);
+        }
+        /* 提交了变化时增量渲染只重新渲染运动的 sphere 覆盖的 tile (摄像机不动时)，其余像素须为上一帧 */
+        if (options->move_count > 0 && previous != NULL && previous != slot->pixel)
+        {
+            memcpy(slot->pixel, previous, (size_t)w * h * 4);
+        }
+        if (options->backend->render(slot->pixel, w, h, w * 4) != 0)
+        {
+            printf("render_sequence, %s failed on frame %d\n", options->backend->name, frame);
+            anim_encoder_release(slot);
+            ret = -1;
+            break;
+        }
+        render_ns += now_ns() - ts3;
+        previous = slot->pixel;
+        anim_encoder_submit(slot, frame);
+
+        if ((frame + 1) % options->fps == 0 || frame + 1 == options->frame_count)
+        {
+            printf("frame %d / %d, %.1f fps\n", frame + 1, options->frame_count, (frame + 1) / ((now_ns() - ts1) / 1e9));
+        }
+    }
+    uint64_t render_done_ns = now_ns();
+    if (anim_encoder_close() != 0)
+    {
+        ret = -1;
+    }
+
+    /* 编码线程已经退出，统计数据不再变化 */
+    const anim_encoder_t *encoder = &g_anim_encoder;
+    int frames = encoder->written_frames;
+    double total_s = frames > 0 ? (encoder->last_write_ns - ts1) / 1e9 : 0;
+    printf("frames: %d, end-to-end %.3fs, %.2f fps\n", frames, total_s, total_s > 0 ? frames / total_s : 0.0);
+    printf("    render  %9.3fms per frame, %.2f fps, waited for a free frame %.3fs\n",
+        frames > 0 ? render_ns / 1e6 / frames : 0.0, render_ns > 0 ? frames / (render_ns / 1e9) : 0.0, stall_ns / 1e9);
+    printf("    encode  %9.3fms per frame, %.2f fps, max queued %d of %d, %.3fs after the last render\n",
+        frames > 0 ? encoder->encode_ns / 1e6 / frames : 0.0, encoder->encode_ns > 0 ? frames / (encoder->encode_ns / 1e9) : 0.0,
+        encoder->max_queue_count, options->queue_size,
+        encoder->last_write_ns > render_done_ns ? (encoder->last_write_ns - render_done_ns) / 1e9 : 0.0);
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    anim_options_t options;
+    if (parse_options(&options, argc, argv) != 0)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    g_render_verbose = 0;
+
+    static anim_state_t state;
+    scene_t scene;
+    state.options = &options;
+    state.scene = &scene;
+    setup_project_camera(&state.base_camera);
+    if (options.scene_file != NULL ? scene_load_file(&scene, &state.base_camera, options.scene_file) < 0 :
+        setup_scene(&scene, options.random_sphere_count) != 0)
+    {
+        printf("failed to build the scene\n");
+        return 1;
+    }
+    if (options.move_count > scene.sphere_count)
+    {
+        printf("cannot move %d of %d spheres\n", options.move_count, scene.sphere_count);
+        scene_uninit(&scene);
+        return 1;
+    }
+
+    /* 包围盒中心投影到视线上，视线背向场景时取摄像机到中心的距离 */
+    const bvh_node_t *root = &scene.nodes[0];
+    point_t center = {(root->min_x + root->max_x) * 0.5f, (root->min_y + root->max_y) * 0.5f, (root->min_z + root->max_z) * 0.5f};
+    const project_camera_t *base = &state.base_camera;
+    float dx = center.x - base->eye.x;
+    float dy = center.y - base->eye.y;
+    float dz = center.z - base->eye.z;
+    float t = dx * base->basis_front.x + dy * base->basis_front.y + dz * base->basis_front.z;
+    if (t <= 0)
+    {
+        t = sqrtf(dx * dx + dy * dy + dz * dz);
+    }
+    state.orbit_center.x = base->eye.x + base->basis_front.x * t;
+    state.orbit_center.y = base->eye.y + base->basis_front.y * t;
+    state.orbit_center.z = base->eye.z + base->basis_front.z * t;
+
+    /* 按固定步长选出运动的 sphere，记录初始位置 */
+    if (options.move_count > 0)
+    {
+        state.move_ids = (int*)malloc(sizeof(int) * options.move_count);
+        state.move_origins = (point_t*)malloc(sizeof(point_t) * options.move_count);
+        if (state.move_ids == NULL || state.move_origins == NULL)
+        {
+            printf("out of memory\n");
+            free(state.move_ids);
+            free(state.move_origins);
+            scene_uninit(&scene);
+            return 1;
+        }
+        for (int k = 0; k < options.move_count; ++k)
+        {
+            state.move_ids[k] = (int)((int64_t)k * scene.sphere_count / options.move_count);
+            state.move_origins[k] = scene.spheres[state.move_ids[k]].center;
+        }
+    }
+
+    thread_pool_init(options.thread_count);
+    soft_simd_init();
+    soft_render_set_scene(&scene);
+    soft_render_set_options(&options.render_options);
+    int ret = soft_render_set_antialias(options.aa_grid) == 0 && soft_render_set_bounces(options.bounces) == 0 ? 0 : -1;
+    /* 混合渲染同时使用 CPU 和 cl_render.c */
+    if (ret == 0 && options.backend->need_opencl == 1)
+    {
+        state.opencl_ready = init_cl_rendler(options.cl_source_file, options.w, options.h) == 0;
+        if (state.opencl_ready)
+        {
+            cl_render_set_scene(&scene);
+            state.opencl_ready = cl_render_set_options(&options.render_options) == 0 &&
+                cl_render_set_antialias(options.aa_grid) == 0 && cl_render_set_bounces(options.bounces) == 0;
+        }
+        ret = state.opencl_ready ? 0 : -1;
+    }
+    if (ret == 0 && options.backend->need_opencl == 2)
+    {
+        state.multi_ready = init_cl_multi_render(options.cl_source_file) == 0;
+        if (state.multi_ready)
+        {
+            cl_multi_render_set_scene(&scene);
+            state.multi_ready = cl_multi_render_set_options(&options.render_options) == 0;
+        }
+        ret = state.multi_ready ? 0 : -1;
+    }
+
+    if (ret == 0)
+    {
+        ret = render_sequence(&state);
+    }
+    else
+    {
+        printf("failed to set up %s\n", options.backend->name);
+    }
+
+    if (options.backend->need_opencl == 1)
+    {
+        uninit_cl_render();
+    }
+    if (options.backend->need_opencl == 2)
+    {
+        uninit_cl_multi_render();
+    }
+    thread_pool_uninit();
+    free(state.move_ids);
+    free(state.move_origins);
+    scene_uninit(&scene);
+
+    return ret == 0 ? 0 : 1;
+}
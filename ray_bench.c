@@ -0,0 +1,1399 @@
+
+#include "common.h"
+#include "render.h"
+#include "thread_pool.h"
+#include "profiler.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* 无窗口的性能测试程序，对各渲染实现在指定分辨率下先预热若干帧，再计时若干帧，
+ * 统计帧耗时的 min/median/p95/p99 以及每秒主光线数，结果以 JSON 格式输出，便于 CI 中比对回归。
+ * --check 时按内置的参考配置逐一测试，并把各实现的输出与参考实现逐像素比较
+ */
+
+typedef struct bench_backend
+{
+    const char *name;
+    /* 1 为 cl_render.c 的单设备渲染，2 为 cl_multi_render.c 的多设备渲染 */
+    int need_opencl;
+    int (*render)(uint8_t* pixel, int w, int h, int pitch);
+    /* 最近一帧的采样统计，NULL 表示每像素固定一条光线 */
+    void (*aa_stats)(render_aa_stats_t *stats);
+    /* --check 时比较的参考实现，为自身时不比较 */
+    const char *reference;
+    /* wavefront 渲染有反射或抗锯齿时的输出与逐像素渲染不同，改为与 depth_soft_wavefront 比较 */
+    int wavefront;
+    /* 只渲染主光线，不做抗锯齿和反射，这类参数下不比较 */
+    int primary_only;
+    /* 每次调用渲染 --views 个视角，帧耗时为整批的耗时，输出为第一个视角 */
+    int batch;
+} bench_backend_t;
+
+static
+int bench_gradient_soft(uint8_t* pixel, int w, int h, int pitch)
+{
+    render_gradient_soft(pixel, w, h, pitch);
+    return 0;
+}
+
+static
+int bench_depth_soft(uint8_t* pixel, int w, int h, int pitch)
+{
+    render_project_depth_soft(pixel, w, h, pitch);
+    return 0;
+}
+
+static
+int bench_depth_soft_simd(uint8_t* pixel, int w, int h, int pitch)
+{
+    render_project_depth_soft_simd(pixel, w, h, pitch);
+    return 0;
+}
+
+static
+int bench_depth_soft_mt(uint8_t* pixel, int w, int h, int pitch)
+{
+    render_project_depth_soft_mt(pixel, w, h, pitch);
+    return 0;
+}
+
+/* 流水线渲染的输出滞后于提交，稳定之后每次调用的耗时即为连续渲染时的帧间隔 */
+static
+int bench_depth_opencl_pipelined(uint8_t* pixel, int w, int h, int pitch)
+{
+    return render_project_depth_opencl_pipelined(pixel, w, h, pitch) < 0 ? -1 : 0;
+}
+
+static
+int bench_depth_soft_wavefront(uint8_t* pixel, int w, int h, int pitch)
+{
+    render_project_depth_soft_wavefront(pixel, w, h, pitch);
+    return 0;
+}
+
+/* 批量渲染的视角: 第一个为默认摄像机，与其他实现的输出可以直接比较，其余绕画面中心依次水平旋转 */
+#define BENCH_BATCH_STEP_RADIANS 0.01f
+
+typedef struct bench_batch
+{
+    int view_count;
+    project_camera_t *cameras;
+    uint8_t *pixels;
+    size_t pixel_size;
+} bench_batch_t;
+
+static bench_batch_t g_bench_batch;
+
+static
+int prepare_batch(int w, int h)
+{
+    size_t pixel_size = (size_t)w * h * 4 * g_bench_batch.view_count;
+    if (g_bench_batch.pixel_size < pixel_size)
+    {
+        free(g_bench_batch.pixels);
+        g_bench_batch.pixels = (uint8_t*)malloc(pixel_size);
+        if (g_bench_batch.pixels == NULL)
+        {
+            printf("prepare_batch, alloc failed, size: %zu\n", pixel_size);
+            g_bench_batch.pixel_size = 0;
+            return -1;
+        }
+        g_bench_batch.pixel_size = pixel_size;
+    }
+    if (g_bench_batch.cameras == NULL)
+    {
+        g_bench_batch.cameras = (project_camera_t*)malloc(sizeof(project_camera_t) * g_bench_batch.view_count);
+        if (g_bench_batch.cameras == NULL)
+        {
+            printf("prepare_batch, alloc cameras failed, views: %d\n", g_bench_batch.view_count);
+            return -1;
+        }
+        project_camera_t base;
+        setup_project_camera(&base);
+        for (int v = 0; v < g_bench_batch.view_count; ++v)
+        {
+            float angle = BENCH_BATCH_STEP_RADIANS * v;
+            point_t eye = {base.eye.x + base.eye.z * sinf(angle), base.eye.y, base.eye.z * cosf(angle)};
+            direction_t front = {-sinf(angle), 0.0f, -cosf(angle)};
+            project_camera_init(&g_bench_batch.cameras[v], &eye, &front,
+                base.left_fov, base.right_fov, base.top_fov, base.bottom_fov);
+        }
+    }
+    return 0;
+}
+
+static
+void release_batch(void)
+{
+    free(g_bench_batch.cameras);
+    free(g_bench_batch.pixels);
+    memset(&g_bench_batch, 0, sizeof(g_bench_batch));
+}
+
+/* 第一个视角按 pitch 逐行复制到 pixel，与其他实现的输出比较 */
+static
+void copy_first_view(uint8_t* pixel, int w, int h, int pitch)
+{
+    for (int y = 0; y < h; ++y)
+    {
+        memcpy(pixel + (size_t)y * pitch, g_bench_batch.pixels + (size_t)y * w * 4, (size_t)w * 4);
+    }
+}
+
+static
+int bench_depth_soft_batch(uint8_t* pixel, int w, int h, int pitch)
+{
+    if (prepare_batch(w, h) != 0 ||
+        render_project_depth_soft_batch(g_bench_batch.pixels, w, h, g_bench_batch.cameras, g_bench_batch.view_count) != 0)
+    {
+        return -1;
+    }
+    copy_first_view(pixel, w, h, pitch);
+    return 0;
+}
+
+static
+int bench_depth_opencl_batch(uint8_t* pixel, int w, int h, int pitch)
+{
+    if (prepare_batch(w, h) != 0 ||
+        render_project_depth_opencl_batch(g_bench_batch.pixels, w, h, g_bench_batch.cameras, g_bench_batch.view_count) != 0)
+    {
+        return -1;
+    }
+    copy_first_view(pixel, w, h, pitch);
+    return 0;
+}
+
+/* wavefront 渲染的光线数包括各轮反射光线 */
+static
+void wavefront_ray_stats(render_aa_stats_t *stats, const render_wavefront_stats_t *wf_stats)
+{
+    stats->pixel_count = wf_stats->pixel_count;
+    stats->edge_pixel_count = 0;
+    stats->sample_count = wf_stats->ray_count;
+}
+
+static
+void bench_soft_wavefront_stats(render_aa_stats_t *stats)
+{
+    render_wavefront_stats_t wf_stats;
+    soft_render_wavefront_stats(&wf_stats);
+    wavefront_ray_stats(stats, &wf_stats);
+}
+
+static
+void bench_opencl_wavefront_stats(render_aa_stats_t *stats)
+{
+    render_wavefront_stats_t wf_stats;
+    cl_render_wavefront_stats(&wf_stats);
+    wavefront_ray_stats(stats, &wf_stats);
+}
+
+/* 新增的渲染实现在此登记即可参与测试 */
+static const bench_backend_t g_bench_backends[] =
+{
+    {"gradient_soft", 0, bench_gradient_soft, NULL, "gradient_soft", 0, 0, 0},
+    {"depth_soft", 0, bench_depth_soft, soft_render_antialias_stats, "depth_soft", 0, 0, 0},
+    {"depth_soft_simd", 0, bench_depth_soft_simd, soft_render_antialias_stats, "depth_soft", 0, 0, 0},
+    {"depth_soft_mt", 0, bench_depth_soft_mt, soft_render_antialias_stats, "depth_soft", 0, 0, 0},
+    {"depth_soft_wavefront", 0, bench_depth_soft_wavefront, bench_soft_wavefront_stats, "depth_soft", 1, 0, 0},
+    {"depth_soft_batch", 0, bench_depth_soft_batch, NULL, "depth_soft", 0, 1, 1},
+    {"gradient_opencl", 1, render_gradient_opencl, NULL, "gradient_soft", 0, 0, 0},
+    {"depth_opencl", 1, render_project_depth_opencl, cl_render_antialias_stats, "depth_soft", 0, 0, 0},
+    {"depth_opencl_pipelined", 1, bench_depth_opencl_pipelined, cl_render_antialias_stats, "depth_soft", 0, 0, 0},
+    {"depth_opencl_wavefront", 1, render_project_depth_opencl_wavefront, bench_opencl_wavefront_stats, "depth_soft", 1, 0, 0},
+    {"depth_opencl_batch", 1, bench_depth_opencl_batch, NULL, "depth_soft", 0, 1, 1},
+    {"depth_hybrid", 1, render_project_depth_hybrid, NULL, "depth_soft", 0, 1, 0},
+    {"depth_opencl_multi", 2, render_project_depth_opencl_multi, NULL, "depth_soft", 0, 1, 0},
+};
+#define BENCH_BACKEND_COUNT ((int)(sizeof(g_bench_backends) / sizeof(g_bench_backends[0])))
+
+#define BENCH_MAX_SIZES 16
+/* --trace 时 trace 保留的事件数 */
+#define BENCH_TRACE_EVENTS (1 << 18)
+
+/* 一组渲染参数。--check 时依次使用 g_check_cases 中的参考配置，否则只有命令行指定的一组 */
+typedef struct bench_case
+{
+    const char *name;
+    int shade_mode;
+    int aa_grid;
+    int bounces;
+} bench_case_t;
+
+static const bench_case_t g_check_cases[] =
+{
+    {"depth", RENDER_SHADE_DEPTH, 1, 0},
+    {"normal", RENDER_SHADE_NORMAL, 1, 0},
+    {"depth_aa4", RENDER_SHADE_DEPTH, 4, 0},
+    {"normal_bounces2", RENDER_SHADE_NORMAL, 1, 2},
+};
+#define BENCH_CHECK_CASE_COUNT ((int)(sizeof(g_check_cases) / sizeof(g_check_cases[0])))
+
+/* 基线文件每行一项: <配置>/<backend>/<W>x<H> <Mrays/s> */
+#define BENCH_MAX_BASELINE 1024
+
+typedef struct bench_baseline_entry
+{
+    char key[96];
+    double mrays_per_s;
+} bench_baseline_entry_t;
+
+typedef struct bench_baseline
+{
+    bench_baseline_entry_t entries[BENCH_MAX_BASELINE];
+    int count;
+} bench_baseline_t;
+
+/* 与参考实现的比较结果，只比较 RGB 三个通道 */
+typedef struct bench_diff
+{
+    /* 任一通道的差超过容差的像素个数 */
+    uint64_t mismatch_pixels;
+    int max_diff;
+    /* 输出完全相同时为 BENCH_PSNR_IDENTICAL */
+    double psnr_db;
+} bench_diff_t;
+
+#define BENCH_PSNR_IDENTICAL 100.0
+
+typedef struct bench_options
+{
+    int backend_enabled[BENCH_BACKEND_COUNT];
+    int sizes[BENCH_MAX_SIZES][2];
+    int size_count;
+    int warmup_frames;
+    int measure_frames;
+    int random_sphere_count;
+    int thread_count;
+    int aa_grid;
+    int bounces;
+    /* 每帧移动的 sphere 个数，大于 0 时提交变化并增量渲染 */
+    int edit_count;
+    /* depth_opencl_multi 使用的设备数，0 为全部 */
+    int device_count;
+    /* 批量渲染每次调用的视角数 */
+    int view_count;
+    render_options_t render_options;
+    /* 非 NULL 时从二进制场景文件加载，random_sphere_count 不起作用 */
+    const char *scene_file;
+    const char *output_file;
+    const char *cl_source_file;
+    /* 非 NULL 时开启性能分析，各阶段的统计写入报告，trace 写入该文件 */
+    const char *trace_file;
+
+    /* 回归测试: 图像比较的容差和阈值，以及吞吐量基线 */
+    int check;
+    int tolerance;
+    double max_mismatch;
+    double min_psnr;
+    double max_slowdown;
+    const char *baseline_file;
+    const char *save_baseline_file;
+    /* 非 NULL 时把不一致的输出、参考和差异图以 PPM 格式写入该目录 */
+    const char *diff_dir;
+    /* --check 或 --baseline 时 OpenCL 不可用默认算作失败，为 1 时只跳过 OpenCL 的实现 */
+    int allow_no_opencl;
+} bench_options_t;
+
+typedef struct bench_stats
+{
+    double min_ms;
+    double median_ms;
+    double p95_ms;
+    double p99_ms;
+    double mean_ms;
+    double mrays_per_s;
+    /* 按中位数帧耗时每秒渲染的视角数，批量渲染时每帧 view_count 个 */
+    double views_per_s;
+    /* 最后一帧中重新采样的边缘像素数和平均每像素的光线数 */
+    uint64_t edge_pixels;
+    double samples_per_pixel;
+} bench_stats_t;
+
+static
+void print_usage(const char *program)
+{
+    printf("usage: %s [options]\n", program);
+    printf("  --backends <list>    comma separated backend names or 'all' (default: all)\n");
+    printf("  --sizes <list>       comma separated WxH list (default: 640x480,1920x1080)\n");
+    printf("  --warmup <n>         warmup frames per run (default: 3)\n");
+    printf("  --frames <n>         measured frames per run (default: 20)\n");
+    printf("  --spheres <n>        extra random spheres in the scene (default: 0)\n");
+    printf("  --scene <file>       binary scene written by scene_convert, replaces --spheres\n");
+    printf("  --threads <n>        soft render worker threads, 0 for all cores (default: 0)\n");
+    printf("  --shade <mode>       depth or normal (default: depth)\n");
+    printf("  --checker <n>        checkerboard block size in pixels (default: 40)\n");
+    printf("  --depth-scale <f>    distance shaded as black in depth mode (default: 200)\n");
+    printf("  --aa <n>             adaptive anti-aliasing with n x n samples on edge pixels, 1 to disable (default: 1)\n");
+    printf("  --bounces <n>        reflection bounces of the wavefront backends (default: 0)\n");
+    printf("  --edit <n>           move n spheres before every frame and render incrementally (default: 0)\n");
+    printf("  --devices <n>        OpenCL devices used by depth_opencl_multi, 0 for all (default: 0)\n");
+    printf("  --views <n>          camera views rendered per call by the *_batch backends (default: 16)\n");
+    printf("  --cl-source <file>   OpenCL kernel source (default: render.cl)\n");
+    printf("  --output <file>      JSON report file (default: bench_result.json)\n");
+    printf("  --trace <file>       profile stages, write Chrome trace-event JSON and per-stage stats in the report\n");
+    printf("  --check              render the reference configurations and compare every backend with its reference\n");
+    printf("                       (--shade, --aa and --bounces are taken from the configurations)\n");
+    printf("  --tolerance <n>      per channel difference still counted as a match (default: 2)\n");
+    printf("  --max-mismatch <f>   fraction of pixels allowed to exceed the tolerance (default: 0.001)\n");
+    printf("  --min-psnr <dB>      minimum PSNR against the reference (default: 40)\n");
+    printf("  --baseline <file>    fail when Mrays/s drops below the baseline by more than --max-slowdown\n");
+    printf("  --max-slowdown <n>   allowed throughput drop in percent (default: 10)\n");
+    printf("  --save-baseline <f>  write this run's Mrays/s as a baseline file\n");
+    printf("  --diff-dir <dir>     write output, reference and difference images of failed checks as PPM\n");
+    printf("  --allow-no-opencl    skip the OpenCL backends when no device is available instead of failing\n");
+    printf("                       --check or --baseline\n");
+    printf("backends:");
+    for (int i = 0; i < BENCH_BACKEND_COUNT; ++i)
+    {
+        printf(" %s", g_bench_backends[i].name);
+    }
+    printf("\n");
+}
+
+static
+int parse_backends(bench_options_t *options, const char *arg)
+{
+    memset(options->backend_enabled, 0, sizeof(options->backend_enabled));
+    if (strcmp(arg, "all") == 0)
+    {
+        for (int i = 0; i < BENCH_BACKEND_COUNT; ++i)
+        {
+            options->backend_enabled[i] = 1;
+        }
+        return 0;
+    }
+
+    const char *p = arg;
+    while (*p != '\0')
+    {
+        size_t len = strcspn(p, ",");
+        int found = 0;
+        for (int i = 0; i < BENCH_BACKEND_COUNT; ++i)
+        {
+            if (strlen(g_bench_backends[i].name) == len && strncmp(g_bench_backends[i].name, p, len) == 0)
+            {
+                options->backend_enabled[i] = 1;
+                found = 1;
+                break;
+            }
+        }
+        if (!found)
+        {
+            printf("unknown backend: %.*s\n", (int)len, p);
+            return -1;
+        }
+        p += len;
+        if (*p == ',')
+        {
+            p++;
+        }
+    }
+
+    return 0;
+}
+
+static
+int parse_sizes(bench_options_t *options, const char *arg)
+{
+    options->size_count = 0;
+
+    const char *p = arg;
+    while (*p != '\0')
+    {
+        int w, h, consumed;
+        if (options->size_count >= BENCH_MAX_SIZES ||
+            sscanf(p, "%dx%d%n", &w, &h, &consumed) != 2 || w <= 0 || h <= 0)
+        {
+            printf("invalid size list: %s\n", arg);
+            return -1;
+        }
+        options->sizes[options->size_count][0] = w;
+        options->sizes[options->size_count][1] = h;
+        options->size_count++;
+        p += consumed;
+        if (*p == ',')
+        {
+            p++;
+        }
+    }
+
+    return options->size_count > 0 ? 0 : -1;
+}
+
+static
+int parse_options(bench_options_t *options, int argc, char *argv[])
+{
+    memset(options, 0, sizeof(*options));
+    parse_backends(options, "all");
+    parse_sizes(options, "640x480,1920x1080");
+    setup_render_options(&options->render_options);
+    options->warmup_frames = 3;
+    options->measure_frames = 20;
+    options->aa_grid = 1;
+    options->view_count = 16;
+    options->output_file = "bench_result.json";
+    options->cl_source_file = "render.cl";
+    options->tolerance = 2;
+    options->max_mismatch = 0.001;
+    options->min_psnr = 40.0;
+    options->max_slowdown = 10.0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *opt = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(opt, "--help") == 0 || strcmp(opt, "-h") == 0)
+        {
+            print_usage(argv[0]);
+            exit(0);
+        }
+        if (strcmp(opt, "--check") == 0)
+        {
+            options->check = 1;
+            continue;
+        }
+        if (strcmp(opt, "--allow-no-opencl") == 0)
+        {
+            options->allow_no_opencl = 1;
+            continue;
+        }
+        if (value == NULL)
+        {
+            printf("missing value for %s\n", opt);
+            return -1;
+        }
+        i++;
+
+        if (strcmp(opt, "--backends") == 0)
+        {
+            if (parse_backends(options, value) != 0)
+            {
+                return -1;
+            }
+        }
+        else if (strcmp(opt, "--sizes") == 0)
+        {
+            if (parse_sizes(options, value) != 0)
+            {
+                return -1;
+            }
+        }
+        else if (strcmp(opt, "--warmup") == 0)
+        {
+            options->warmup_frames = atoi(value);
+        }
+        else if (strcmp(opt, "--frames") == 0)
+        {
+            options->measure_frames = atoi(value);
+        }
+        else if (strcmp(opt, "--spheres") == 0)
+        {
+            options->random_sphere_count = atoi(value);
+        }
+        else if (strcmp(opt, "--scene") == 0)
+        {
+            options->scene_file = value;
+        }
+        else if (strcmp(opt, "--threads") == 0)
+        {
+            options->thread_count = atoi(value);
+        }
+        else if (strcmp(opt, "--shade") == 0)
+        {
+            if (strcmp(value, "depth") == 0)
+            {
+                options->render_options.shade_mode = RENDER_SHADE_DEPTH;
+            }
+            else if (strcmp(value, "normal") == 0)
+            {
+                options->render_options.shade_mode = RENDER_SHADE_NORMAL;
+            }
+            else
+            {
+                printf("unknown shade mode: %s\n", value);
+                return -1;
+            }
+        }
+        else if (strcmp(opt, "--checker") == 0)
+        {
+            options->render_options.checker_size = atoi(value);
+        }
+        else if (strcmp(opt, "--aa") == 0)
+        {
+            options->aa_grid = atoi(value);
+        }
+        else if (strcmp(opt, "--bounces") == 0)
+        {
+            options->bounces = atoi(value);
+        }
+        else if (strcmp(opt, "--edit") == 0)
+        {
+            options->edit_count = atoi(value);
+        }
+        else if (strcmp(opt, "--devices") == 0)
+        {
+            options->device_count = atoi(value);
+        }
+        else if (strcmp(opt, "--views") == 0)
+        {
+            options->view_count = atoi(value);
+        }
+        else if (strcmp(opt, "--depth-scale") == 0)
+        {
+            options->render_options.depth_scale = (float)atof(value);
+        }
+        else if (strcmp(opt, "--cl-source") == 0)
+        {
+            options->cl_source_file = value;
+        }
+        else if (strcmp(opt, "--output") == 0)
+        {
+            options->output_file = value;
+        }
+        else if (strcmp(opt, "--trace") == 0)
+        {
+            options->trace_file = value;
+        }
+        else if (strcmp(opt, "--tolerance") == 0)
+        {
+            options->tolerance = atoi(value);
+        }
+        else if (strcmp(opt, "--max-mismatch") == 0)
+        {
+            options->max_mismatch = atof(value);
+        }
+        else if (strcmp(opt, "--min-psnr") == 0)
+        {
+            options->min_psnr = atof(value);
+        }
+        else if (strcmp(opt, "--baseline") == 0)
+        {
+            options->baseline_file = value;
+        }
+        else if (strcmp(opt, "--max-slowdown") == 0)
+        {
+            options->max_slowdown = atof(value);
+        }
+        else if (strcmp(opt, "--save-baseline") == 0)
+        {
+            options->save_baseline_file = value;
+        }
+        else if (strcmp(opt, "--diff-dir") == 0)
+        {
+            options->diff_dir = value;
+        }
+        else
+        {
+            printf("unknown option: %s\n", opt);
+            return -1;
+        }
+    }
+
+    if (options->render_options.checker_size <= 0 || options->render_options.depth_scale <= 0)
+    {
+        printf("invalid checker size or depth scale\n");
+        return -1;
+    }
+
+    if (options->aa_grid < 1 || options->aa_grid > RENDER_AA_MAX_GRID)
+    {
+        printf("invalid aa grid: %d\n", options->aa_grid);
+        return -1;
+    }
+
+    if (options->bounces < 0 || options->bounces > RENDER_MAX_BOUNCES)
+    {
+        printf("invalid bounces: %d\n", options->bounces);
+        return -1;
+    }
+
+    if (options->edit_count < 0 || options->edit_count > RENDER_MAX_CHANGES)
+    {
+        printf("invalid edit count: %d\n", options->edit_count);
+        return -1;
+    }
+
+    if (options->device_count < 0 || options->device_count > RENDER_MAX_CL_DEVICES)
+    {
+        printf("invalid device count: %d\n", options->device_count);
+        return -1;
+    }
+
+    if (options->view_count <= 0)
+    {
+        printf("invalid view count: %d\n", options->view_count);
+        return -1;
+    }
+
+    if (options->warmup_frames < 0 || options->measure_frames <= 0)
+    {
+        printf("invalid frame count, warmup: %d, frames: %d\n", options->warmup_frames, options->measure_frames);
+        return -1;
+    }
+
+    if (options->tolerance < 0 || options->max_mismatch < 0 || options->max_slowdown < 0)
+    {
+        printf("invalid tolerance: %d, max mismatch: %g or max slowdown: %g\n",
+            options->tolerance, options->max_mismatch, options->max_slowdown);
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+int compare_u64(const void *a, const void *b)
+{
+    uint64_t va = *(const uint64_t*)a;
+    uint64_t vb = *(const uint64_t*)b;
+    return va < vb ? -1 : (va > vb ? 1 : 0);
+}
+
+/* nearest-rank 百分位，samples 须已升序排列 */
+static
+double percentile_ms(const uint64_t *samples, int count, int percent)
+{
+    int rank = (count * percent + 99) / 100;
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    return samples[rank - 1] / 1e6;
+}
+
+static
+void compute_stats(bench_stats_t *stats, uint64_t *samples, int count, uint64_t rays_per_frame)
+{
+    qsort(samples, count, sizeof(samples[0]), compare_u64);
+
+    uint64_t total = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        total += samples[i];
+    }
+
+    stats->min_ms = samples[0] / 1e6;
+    stats->median_ms = (count & 1) ? samples[count / 2] / 1e6 : (samples[count / 2 - 1] + samples[count / 2]) / 2e6;
+    stats->p95_ms = percentile_ms(samples, count, 95);
+    stats->p99_ms = percentile_ms(samples, count, 99);
+    stats->mean_ms = total / 1e6 / count;
+    stats->mrays_per_s = stats->median_ms > 0 ? ((double)rays_per_frame / 1e6) / (stats->median_ms / 1e3) : 0;
+}
+
+/* 模拟编辑: 按固定步长选出 edit_count 个 sphere，偶数帧沿 x 轴正向、奇数帧反向移动，
+ * 重新计算 BVH 的包围盒之后把变化提交给各渲染实现
+ */
+#define BENCH_EDIT_STEP 4.0f
+
+static
+int edit_scene(scene_t *scene, int edit_count, int frame, uint8_t *pixel, int pitch)
+{
+    /* 流水线中未完成的帧仍在读取场景数据，先取回到 pixel 再修改 */
+    if (cl_render_pipeline_flush(pixel, pitch) < 0)
+    {
+        return -1;
+    }
+
+    render_change_t changes[64];
+    int change_count = 0;
+    float step = (frame & 1) ? -BENCH_EDIT_STEP : BENCH_EDIT_STEP;
+    for (int k = 0; k < edit_count; ++k)
+    {
+        sphere_t *sphere = &scene->spheres[(int)((int64_t)k * scene->sphere_count / edit_count)];
+        render_change_t *change = &changes[change_count++];
+        change->old_center = sphere->center;
+        change->old_radius = sphere->radius;
+        sphere->center.x += step;
+        change->new_center = sphere->center;
+        change->new_radius = sphere->radius;
+        if (change_count == (int)(sizeof(changes) / sizeof(changes[0])) || k + 1 == edit_count)
+        {
+            soft_render_scene_changed(changes, change_count);
+            cl_render_scene_changed(changes, change_count);
+            change_count = 0;
+        }
+    }
+    scene_refit_bvh(scene);
+    cl_multi_render_scene_changed();
+
+    return 0;
+}
+
+/* 返回 0 表示测试完成，否则 error 中为失败原因。pixel 为 w x h 的画布，结束时为最后一帧的输出 */
+static
+int run_bench(const bench_backend_t *backend, const bench_options_t *options, scene_t *scene, uint8_t *pixel, int w, int h,
+    bench_stats_t *stats, const char **error)
+{
+    int pitch = w * 4;
+    uint64_t *samples = (uint64_t*)malloc(sizeof(uint64_t) * options->measure_frames);
+    if (samples == NULL)
+    {
+        *error = "out of memory";
+        return -1;
+    }
+
+    if (backend->need_opencl == 1 && cl_render_resize(w, h) != 0)
+    {
+        free(samples);
+        *error = "cl_render_resize failed";
+        return -1;
+    }
+
+    /* 增量渲染要求 pixel 中为上一帧，新分配的画布先整帧渲染一次 */
+    int ret = 0;
+    if (options->edit_count > 0)
+    {
+        soft_render_invalidate_frame();
+        cl_render_invalidate_frame();
+        ret = backend->render(pixel, w, h, pitch);
+    }
+    int frame = 0;
+    for (int i = 0; i < options->warmup_frames && ret == 0; ++i)
+    {
+        if (options->edit_count > 0)
+        {
+            ret = edit_scene(scene, options->edit_count, frame++, pixel, pitch);
+        }
+        if (ret == 0)
+        {
+            ret = backend->render(pixel, w, h, pitch);
+        }
+    }
+    /* 阶段统计只包括计时的帧 */
+    profiler_reset_stats();
+    /* 编辑时的帧耗时包括移动 sphere 和重新计算包围盒 */
+    for (int i = 0; i < options->measure_frames && ret == 0; ++i)
+    {
+        uint64_t ts1 = now_ns();
+        if (options->edit_count > 0)
+        {
+            ret = edit_scene(scene, options->edit_count, frame++, pixel, pitch);
+        }
+        if (ret == 0)
+        {
+            ret = backend->render(pixel, w, h, pitch);
+        }
+        uint64_t ts2 = now_ns();
+        samples[i] = ts2 - ts1;
+    }
+    /* 移回原位，各次测试的场景相同。--check 时移回之后再增量渲染一帧，并取回流水线中的帧，
+     * pixel 为原场景的增量渲染结果，与参考实现的整帧渲染比较
+     */
+    if ((frame & 1) && ret == 0)
+    {
+        ret = edit_scene(scene, options->edit_count, frame, pixel, pitch);
+        if (ret == 0 && options->check)
+        {
+            ret = backend->render(pixel, w, h, pitch);
+        }
+    }
+    if (options->edit_count > 0 && options->check && ret == 0)
+    {
+        ret = cl_render_pipeline_flush(pixel, pitch) < 0 ? -1 : 0;
+    }
+
+    if (ret == 0)
+    {
+        /* 抗锯齿或增量渲染时光线数随画面内容变化，按最后一帧统计; 否则每个像素一条主光线 */
+        render_aa_stats_t aa_stats = {(uint64_t)w * h, 0, (uint64_t)w * h};
+        if (backend->aa_stats != NULL)
+        {
+            backend->aa_stats(&aa_stats);
+        }
+        /* 批量渲染每帧的光线数为所有视角之和 */
+        int views = backend->batch ? options->view_count : 1;
+        compute_stats(stats, samples, options->measure_frames, aa_stats.sample_count * views);
+        stats->views_per_s = stats->median_ms > 0 ? views / (stats->median_ms / 1e3) : 0;
+        stats->edge_pixels = aa_stats.edge_pixel_count;
+        stats->samples_per_pixel = (double)aa_stats.sample_count / ((double)w * h);
+    }
+    else
+    {
+        *error = "render failed";
+    }
+
+    free(samples);
+
+    return ret == 0 ? 0 : -1;
+}
+
+/********************************************************************************/
+
+static
+int find_backend(const char *name)
+{
+    for (int i = 0; i < BENCH_BACKEND_COUNT; ++i)
+    {
+        if (strcmp(g_bench_backends[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* 返回参考实现的下标 */
+static
+int check_reference(int backend_index, const bench_case_t *bench_case)
+{
+    const bench_backend_t *backend = &g_bench_backends[backend_index];
+    int differs = bench_case->bounces > 0 || bench_case->aa_grid >= 2;
+    if (differs && backend->primary_only)
+    {
+        return -1;
+    }
+    return find_backend(differs && backend->wavefront ? "depth_soft_wavefront" : backend->reference);
+}
+
+/* 多设备渲染最后一帧各设备领取的 tile 数和忙碌时间，用于观察负载分配和随设备数的扩展 */
+static
+void write_device_stats(FILE *fp, const char *key)
+{
+    render_multi_stats_t multi_stats;
+    cl_multi_render_stats(&multi_stats);
+    fprintf(fp, ", \"device_count\": %d, \"tile_count\": %d, \"devices\": [", multi_stats.device_count, multi_stats.tile_count);
+    for (int i = 0; i < multi_stats.device_count; ++i)
+    {
+        const render_device_stats_t *dev = &multi_stats.devices[i];
+        fprintf(fp, "%s{\"name\": \"%s\", \"tiles\": %d, \"busy_ms\": %.4f}", i > 0 ? ", " : "", dev->name,
+            dev->tile_count, dev->busy_ms);
+        printf("%-40s device %d %-24s %5d tiles  busy %9.3fms\n", key, i, dev->name, dev->tile_count, dev->busy_ms);
+    }
+    fprintf(fp, "]");
+}
+
+/* 应用一组渲染参数，OpenCL 变体编译失败时返回 -1 */
+static
+int apply_case(const bench_case_t *bench_case, bench_options_t *options, int opencl_ready, int *multi_ready)
+{
+    options->render_options.shade_mode = bench_case->shade_mode;
+    soft_render_set_options(&options->render_options);
+    soft_render_set_antialias(bench_case->aa_grid);
+    soft_render_set_bounces(bench_case->bounces);
+    if (*multi_ready && cl_multi_render_set_options(&options->render_options) != 0)
+    {
+        *multi_ready = 0;
+    }
+    if (!opencl_ready)
+    {
+        return 0;
+    }
+    if (cl_render_set_options(&options->render_options) != 0)
+    {
+        return -1;
+    }
+    cl_render_set_antialias(bench_case->aa_grid);
+    cl_render_set_bounces(bench_case->bounces);
+    return 0;
+}
+
+static
+void diff_images(bench_diff_t *diff, const uint8_t *pixel, const uint8_t *reference, int w, int h, int tolerance)
+{
+    memset(diff, 0, sizeof(*diff));
+    uint64_t square_sum = 0;
+    for (size_t i = 0; i < (size_t)w * h; ++i)
+    {
+        int pixel_diff = 0;
+        for (int c = 0; c < 3; ++c)
+        {
+            int d = abs(pixel[i * 4 + c] - reference[i * 4 + c]);
+            square_sum += (uint64_t)(d * d);
+            pixel_diff = d > pixel_diff ? d : pixel_diff;
+        }
+        diff->max_diff = pixel_diff > diff->max_diff ? pixel_diff : diff->max_diff;
+        if (pixel_diff > tolerance)
+        {
+            diff->mismatch_pixels++;
+        }
+    }
+
+    double mse = (double)square_sum / ((double)w * h * 3);
+    diff->psnr_db = mse > 0 ? 10.0 * log10(255.0 * 255.0 / mse) : BENCH_PSNR_IDENTICAL;
+}
+
+/* 以 PPM (P6) 格式写出 BGRA 画布，diff_with 不为 NULL 时写出与其差值放大 16 倍的差异图 */
+static
+int write_ppm(const char *path, const uint8_t *pixel, const uint8_t *diff_with, int w, int h)
+{
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        printf("write_ppm, failed to open %s\n", path);
+        return -1;
+    }
+    fprintf(fp, "P6\n%d %d\n255\n", w, h);
+    for (size_t i = 0; i < (size_t)w * h; ++i)
+    {
+        uint8_t rgb[3];
+        for (int c = 0; c < 3; ++c)
+        {
+            int v = pixel[i * 4 + 2 - c];
+            if (diff_with != NULL)
+            {
+                v = abs(v - diff_with[i * 4 + 2 - c]) * 16;
+                v = v > 255 ? 255 : v;
+            }
+            rgb[c] = (uint8_t)v;
+        }
+        fwrite(rgb, 1, 3, fp);
+    }
+    int ok = !ferror(fp);
+    if (fclose(fp) != 0 || !ok)
+    {
+        printf("write_ppm, failed to write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static
+void write_diff_images(const char *dir, const char *key, const uint8_t *pixel, const uint8_t *reference, int w, int h)
+{
+    char name[128];
+    snprintf(name, sizeof(name), "%s", key);
+    for (char *p = name; *p != '\0'; ++p)
+    {
+        *p = *p == '/' ? '_' : *p;
+    }
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s_output.ppm", dir, name);
+    write_ppm(path, pixel, NULL, w, h);
+    snprintf(path, sizeof(path), "%s/%s_reference.ppm", dir, name);
+    write_ppm(path, reference, NULL, w, h);
+    snprintf(path, sizeof(path), "%s/%s_diff.ppm", dir, name);
+    write_ppm(path, pixel, reference, w, h);
+}
+
+/* 文件不存在时基线为空 */
+static
+int load_baseline(bench_baseline_t *baseline, const char *path)
+{
+    baseline->count = 0;
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        printf("load_baseline, %s not found, throughput is not checked\n", path);
+        return 0;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+        {
+            continue;
+        }
+        bench_baseline_entry_t *entry = &baseline->entries[baseline->count];
+        if (baseline->count == BENCH_MAX_BASELINE || sscanf(line, "%95s %lf", entry->key, &entry->mrays_per_s) != 2)
+        {
+            printf("load_baseline, invalid line in %s: %s", path, line);
+            fclose(fp);
+            return -1;
+        }
+        baseline->count++;
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+static
+const bench_baseline_entry_t* find_baseline(const bench_baseline_t *baseline, const char *key)
+{
+    for (int i = 0; i < baseline->count; ++i)
+    {
+        if (strcmp(baseline->entries[i].key, key) == 0)
+        {
+            return &baseline->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static
+int save_baseline(const bench_baseline_t *baseline, const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        printf("save_baseline, failed to open %s\n", path);
+        return -1;
+    }
+    fprintf(fp, "# <configuration>/<backend>/<width>x<height> <Mrays/s>, written by ray_bench --save-baseline\n");
+    for (int i = 0; i < baseline->count; ++i)
+    {
+        fprintf(fp, "%s %.3f\n", baseline->entries[i].key, baseline->entries[i].mrays_per_s);
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+/* 最近一次 run_bench() 计时的帧中各阶段的耗时，窗口为最近 PROFILER_STAT_WINDOW 次 */
+static
+void write_stage_stats(FILE *fp)
+{
+    fprintf(fp, ", \"stages\": [");
+    int first = 1;
+    for (int i = 0; i < profiler_stat_count(); ++i)
+    {
+        profiler_stat_t stat;
+        if (profiler_get_stat(i, &stat) != 0 || stat.count == 0)
+        {
+            continue;
+        }
+        fprintf(fp, "%s{\"name\": \"%s\", \"category\": \"%s\", \"count\": %" PRIu64 ", \"mean_ms\": %.4f, "
+            "\"min_ms\": %.4f, \"max_ms\": %.4f, \"mean_wait_ms\": %.4f}",
+            first ? "" : ", ", stat.name, stat.category, stat.count, stat.mean_ms, stat.min_ms, stat.max_ms, stat.mean_wait_ms);
+        first = 0;
+    }
+    fprintf(fp, "]");
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options_t options;
+    if (parse_options(&options, argc, argv) != 0)
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    scene_t scene;
+    uint64_t ts1 = now_ns();
+    if (options.scene_file != NULL)
+    {
+        /* 摄像机仍使用默认值，各渲染实现之间的结果可以直接比较 */
+        if (scene_load_file(&scene, NULL, options.scene_file) < 0)
+        {
+            return -1;
+        }
+    }
+    else if (setup_scene(&scene, options.random_sphere_count) != 0)
+    {
+        printf("setup_scene() failed, sphere count: %d\n", options.random_sphere_count + 1);
+        return -1;
+    }
+    uint64_t ts2 = now_ns();
+    double scene_build_ms = (ts2 - ts1) / 1e6;
+
+    /* OpenCL 的队列创建时须已开启 */
+    if (options.trace_file != NULL && profiler_enable(BENCH_TRACE_EVENTS) != 0)
+    {
+        return -1;
+    }
+
+    thread_pool_init(options.thread_count);
+    g_bench_batch.view_count = options.view_count;
+    const char *simd_isa = soft_simd_init();
+    soft_render_set_scene(&scene);
+    soft_render_set_options(&options.render_options);
+    soft_render_set_antialias(options.aa_grid);
+    soft_render_set_bounces(options.bounces);
+
+    int need_opencl = 0;
+    int need_multi = 0;
+    for (int i = 0; i < BENCH_BACKEND_COUNT; ++i)
+    {
+        need_opencl |= options.backend_enabled[i] && g_bench_backends[i].need_opencl == 1;
+        need_multi |= options.backend_enabled[i] && g_bench_backends[i].need_opencl == 2;
+    }
+    int opencl_ready = 0;
+    double opencl_init_ms = 0;
+    if (need_opencl)
+    {
+        ts1 = now_ns();
+        opencl_ready = init_cl_rendler(options.cl_source_file, options.sizes[0][0], options.sizes[0][1]) == 0;
+        ts2 = now_ns();
+        opencl_init_ms = (ts2 - ts1) / 1e6;
+        if (opencl_ready)
+        {
+            cl_render_set_scene(&scene);
+            opencl_ready = cl_render_set_options(&options.render_options) == 0;
+            cl_render_set_antialias(options.aa_grid);
+            cl_render_set_bounces(options.bounces);
+        }
+    }
+    int multi_ready = 0;
+    if (need_multi && init_cl_multi_render(options.cl_source_file) == 0)
+    {
+        cl_multi_render_set_scene(&scene);
+        multi_ready = cl_multi_render_set_options(&options.render_options) == 0 &&
+            (options.device_count == 0 || cl_multi_render_set_active_devices(options.device_count) == 0);
+    }
+
+    FILE *fp = fopen(options.output_file, "w");
+    if (fp == NULL)
+    {
+        printf("failed to open %s\n", options.output_file);
+        return -1;
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"spheres\": %d,\n", scene.sphere_count);
+    fprintf(fp, "  \"bvh_nodes\": %d,\n", scene.node_count);
+    fprintf(fp, "  \"scene_source\": \"%s\",\n", options.scene_file != NULL ? "file" : "generated");
+    fprintf(fp, "  \"scene_build_ms\": %.3f,\n", scene_build_ms);
+    fprintf(fp, "  \"threads\": %d,\n", thread_pool_thread_count());
+    fprintf(fp, "  \"simd\": \"%s\",\n", simd_isa);
+    fprintf(fp, "  \"shade\": \"%s\",\n", options.render_options.shade_mode == RENDER_SHADE_NORMAL ? "normal" : "depth");
+    fprintf(fp, "  \"checker_size\": %d,\n", options.render_options.checker_size);
+    fprintf(fp, "  \"depth_scale\": %g,\n", options.render_options.depth_scale);
+    fprintf(fp, "  \"aa_grid\": %d,\n", options.aa_grid);
+    fprintf(fp, "  \"bounces\": %d,\n", options.bounces);
+    fprintf(fp, "  \"edit_spheres\": %d,\n", options.edit_count);
+    fprintf(fp, "  \"batch_views\": %d,\n", options.view_count);
+    fprintf(fp, "  \"check\": %s,\n", options.check ? "true" : "false");
+    if (opencl_ready)
+    {
+        /* 第一次运行为冷启动，缓存命中之后为热启动 */
+        int from_cache;
+        uint64_t program_load_ns;
+        cl_render_program_info(&from_cache, &program_load_ns);
+        fprintf(fp, "  \"opencl_init_ms\": %.3f,\n", opencl_init_ms);
+        fprintf(fp, "  \"opencl_program_load_ms\": %.3f,\n", program_load_ns / 1e6);
+        fprintf(fp, "  \"opencl_program_cache\": \"%s\",\n", from_cache ? "hit" : "miss");
+        printf("opencl init %.3fms, program %s in %.3fms\n", opencl_init_ms,
+            from_cache ? "loaded from cache" : "built from source", program_load_ns / 1e6);
+    }
+    fprintf(fp, "  \"warmup_frames\": %d,\n", options.warmup_frames);
+    fprintf(fp, "  \"measured_frames\": %d,\n", options.measure_frames);
+    fprintf(fp, "  \"results\": [");
+
+    g_render_verbose = 0;
+
+    bench_baseline_t *baseline = (bench_baseline_t*)calloc(1, sizeof(bench_baseline_t));
+    bench_baseline_t *current = (bench_baseline_t*)calloc(1, sizeof(bench_baseline_t));
+    if (baseline == NULL || current == NULL ||
+        (options.baseline_file != NULL && load_baseline(baseline, options.baseline_file) != 0))
+    {
+        free(baseline);
+        free(current);
+        fclose(fp);
+        return -1;
+    }
+
+    bench_case_t user_case = {"custom", options.render_options.shade_mode, options.aa_grid, options.bounces};
+    const bench_case_t *cases = options.check ? g_check_cases : &user_case;
+    int case_count = options.check ? BENCH_CHECK_CASE_COUNT : 1;
+
+    /* 回归测试时 OpenCL 不可用算作失败，否则 render.cl 与 soft_render.c 的差异无从发现 */
+    int opencl_required = (options.check || options.baseline_file != NULL) && !options.allow_no_opencl;
+    int skipped[BENCH_BACKEND_COUNT];
+    memset(skipped, 0, sizeof(skipped));
+
+    int failed = 0;
+    int first = 1;
+    for (int c = 0; c < case_count; ++c)
+    {
+        const bench_case_t *bench_case = &cases[c];
+        int case_multi_ready = multi_ready;
+        int case_opencl_ready = apply_case(bench_case, &options, opencl_ready, &case_multi_ready) == 0 && opencl_ready;
+        /* 各尺寸下参考实现的输出，首次比较时渲染 */
+        uint8_t *references[BENCH_MAX_SIZES][BENCH_BACKEND_COUNT];
+        memset(references, 0, sizeof(references));
+
+        for (int i = 0; i < BENCH_BACKEND_COUNT; ++i)
+        {
+            const bench_backend_t *backend = &g_bench_backends[i];
+            if (!options.backend_enabled[i])
+            {
+                continue;
+            }
+
+            for (int s = 0; s < options.size_count; ++s)
+            {
+                int w = options.sizes[s][0];
+                int h = options.sizes[s][1];
+                bench_stats_t stats;
+                memset(&stats, 0, sizeof(stats));
+                const char *error = NULL;
+                uint8_t *pixel = (uint8_t*)calloc((size_t)w * h, 4);
+
+                if (pixel == NULL)
+                {
+                    error = "out of memory";
+                    failed = 1;
+                }
+                else if (backend->need_opencl == 1 && !case_opencl_ready)
+                {
+                    error = opencl_ready ? "opencl variant build failed" : "opencl unavailable";
+                    failed |= opencl_ready || opencl_required;
+                    skipped[i] = !opencl_ready;
+                }
+                else if (backend->need_opencl == 2 && !case_multi_ready)
+                {
+                    error = multi_ready ? "opencl variant build failed" : "opencl unavailable";
+                    failed |= multi_ready || opencl_required;
+                    skipped[i] = !multi_ready;
+                }
+                else if (run_bench(backend, &options, &scene, pixel, w, h, &stats, &error) != 0)
+                {
+                    failed = 1;
+                }
+
+                char key[96];
+                snprintf(key, sizeof(key), "%s/%s/%dx%d", bench_case->name, backend->name, w, h);
+                fprintf(fp, "%s\n    {\"backend\": \"%s\", \"width\": %d, \"height\": %d, ", first ? "" : ",", backend->name, w, h);
+                if (options.check)
+                {
+                    fprintf(fp, "\"case\": \"%s\", ", bench_case->name);
+                }
+                first = 0;
+                if (error != NULL)
+                {
+                    fprintf(fp, "\"error\": \"%s\"}", error);
+                    printf("%-40s %s\n", key, error);
+                    free(pixel);
+                    continue;
+                }
+
+                fprintf(fp, "\"min_ms\": %.4f, \"median_ms\": %.4f, \"p95_ms\": %.4f, \"p99_ms\": %.4f, "
+                    "\"mean_ms\": %.4f, \"mrays_per_s\": %.3f, \"views_per_s\": %.3f, \"edge_pixels\": %" PRIu64 ", "
+                    "\"samples_per_pixel\": %.4f",
+                    stats.min_ms, stats.median_ms, stats.p95_ms, stats.p99_ms, stats.mean_ms, stats.mrays_per_s, stats.views_per_s,
+                    stats.edge_pixels, stats.samples_per_pixel);
+                if (g_profiler_enabled)
+                {
+                    write_stage_stats(fp);
+                }
+                printf("%-40s min %9.3fms  median %9.3fms  p95 %9.3fms  p99 %9.3fms  %9.2f Mrays/s  %9.1f views/s\n",
+                    key, stats.min_ms, stats.median_ms, stats.p95_ms, stats.p99_ms, stats.mrays_per_s, stats.views_per_s);
+                if (backend->need_opencl == 2)
+                {
+                    write_device_stats(fp, key);
+                }
+
+                /* 与参考实现逐像素比较。编辑时参考为整帧渲染，与自身比较可以发现增量渲染的差异 */
+                int ref = options.check ? check_reference(i, bench_case) : -1;
+                if (ref >= 0 && (ref != i || options.edit_count > 0))
+                {
+                    if (references[s][ref] == NULL)
+                    {
+                        soft_render_invalidate_frame();
+                        cl_render_invalidate_frame();
+                        references[s][ref] = (uint8_t*)calloc((size_t)w * h, 4);
+                        if (references[s][ref] != NULL && g_bench_backends[ref].render(references[s][ref], w, h, w * 4) != 0)
+                        {
+                            free(references[s][ref]);
+                            references[s][ref] = NULL;
+                        }
+                    }
+                    if (references[s][ref] == NULL)
+                    {
+                        fprintf(fp, ", \"reference\": \"%s\", \"image_ok\": false", g_bench_backends[ref].name);
+                        printf("%-40s reference %s failed\n", key, g_bench_backends[ref].name);
+                        failed = 1;
+                    }
+                    else
+                    {
+                        /* 与自身的整帧渲染比较时须完全相同 */
+                        int exact = ref == i;
+                        bench_diff_t diff;
+                        diff_images(&diff, pixel, references[s][ref], w, h, exact ? 0 : options.tolerance);
+                        int image_ok = exact ? diff.mismatch_pixels == 0 :
+                            diff.mismatch_pixels <= options.max_mismatch * w * h && diff.psnr_db >= options.min_psnr;
+                        fprintf(fp, ", \"reference\": \"%s\", \"mismatch_pixels\": %" PRIu64 ", \"max_diff\": %d, "
+                            "\"psnr_db\": %.2f, \"image_ok\": %s", g_bench_backends[ref].name, diff.mismatch_pixels,
+                            diff.max_diff, diff.psnr_db, image_ok ? "true" : "false");
+                        printf("%-40s vs %-16s mismatch %8" PRIu64 "  max diff %3d  psnr %6.2fdB  %s\n", key,
+                            g_bench_backends[ref].name, diff.mismatch_pixels, diff.max_diff, diff.psnr_db, image_ok ? "ok" : "DIVERGED");
+                        if (!image_ok)
+                        {
+                            failed = 1;
+                            if (options.diff_dir != NULL)
+                            {
+                                write_diff_images(options.diff_dir, key, pixel, references[s][ref], w, h);
+                            }
+                        }
+                    }
+                }
+                free(pixel);
+
+                /* 吞吐量与基线比较 */
+                const bench_baseline_entry_t *base = find_baseline(baseline, key);
+                if (base != NULL)
+                {
+                    int perf_ok = stats.mrays_per_s >= base->mrays_per_s * (1.0 - options.max_slowdown / 100.0);
+                    fprintf(fp, ", \"baseline_mrays_per_s\": %.3f, \"perf_ok\": %s", base->mrays_per_s, perf_ok ? "true" : "false");
+                    if (!perf_ok)
+                    {
+                        printf("%-40s %.2f Mrays/s, baseline %.2f Mrays/s, SLOWER by %.1f%%\n", key, stats.mrays_per_s,
+                            base->mrays_per_s, 100.0 * (1.0 - stats.mrays_per_s / base->mrays_per_s));
+                        failed = 1;
+                    }
+                }
+                if (current->count < BENCH_MAX_BASELINE)
+                {
+                    bench_baseline_entry_t *entry = &current->entries[current->count++];
+                    snprintf(entry->key, sizeof(entry->key), "%s", key);
+                    entry->mrays_per_s = stats.mrays_per_s;
+                }
+                fprintf(fp, "}");
+            }
+        }
+
+        for (int s = 0; s < options.size_count; ++s)
+        {
+            for (int i = 0; i < BENCH_BACKEND_COUNT; ++i)
+            {
+                free(references[s][i]);
+            }
+        }
+    }
+
+    if (options.save_baseline_file != NULL && save_baseline(current, options.save_baseline_file) != 0)
+    {
+        failed = 1;
+    }
+
+    /* 没有运行的实现在最后列出，回归测试时除非指定了 --allow-no-opencl 都已算作失败 */
+    int skipped_count = 0;
+    for (int i = 0; i < BENCH_BACKEND_COUNT; ++i)
+    {
+        if (skipped[i])
+        {
+            printf("%s %s", skipped_count == 0 ? "skipped, opencl unavailable:" : ",", g_bench_backends[i].name);
+            skipped_count++;
+        }
+    }
+    if (skipped_count > 0)
+    {
+        printf("%s\n", opencl_required ? " (FAILED, pass --allow-no-opencl or restrict --backends to skip them)" : "");
+    }
+    free(baseline);
+    free(current);
+
+    fprintf(fp, "\n  ]\n}\n");
+    fclose(fp);
+
+    g_render_verbose = 1;
+
+    if (opencl_ready)
+    {
+        uninit_cl_render();
+    }
+    uninit_cl_multi_render();
+    release_batch();
+    if (options.trace_file != NULL)
+    {
+        if (profiler_write_trace(options.trace_file) != 0)
+        {
+            failed = 1;
+        }
+        profiler_uninit();
+    }
+    thread_pool_uninit();
+    scene_uninit(&scene);
+
+    return failed ? 1 : 0;
+}
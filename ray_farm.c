@@ -0,0 +1,1358 @@
+
+#include "common.h"
+#include "render.h"
+#include "thread_pool.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+typedef SOCKET farm_socket_t;
+#define FARM_INVALID_SOCKET INVALID_SOCKET
+#define close_socket(s) closesocket(s)
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <signal.h>
+#include <unistd.h>
+
+typedef int farm_socket_t;
+#define FARM_INVALID_SOCKET (-1)
+#define close_socket(s) close(s)
+#endif
+
+/* 离线渲染农场: coordinator 监听 TCP 端口，worker 进程连接上来之后按 coordinator 下发的参数各自构建场景，
+ * 每帧按行切成 band_rows 行的 tile，每个 worker 同时最多有 FARM_TILES_IN_FLIGHT 个 tile 在途，
+ * worker 用 render_backend_t (soft 或 OpenCL) 渲染 tile 并立即传回。
+ * worker 断开、出错或 tile 超时未返回时关闭其连接，其在途的 tile 重新排队给其他 worker。
+ * 完成的帧按顺序写出为 PPM
+ *
+ * 消息格式: 8 字节消息头 (类型、payload 长度) 加 payload，整数和浮点数均按网络字节序的 32 位传输
+ */
+
+#define FARM_PROTOCOL_VERSION 2
+#define FARM_DEFAULT_PORT 7878
+#define FARM_MAX_WORKERS 64
+/* 同时渲染的帧数，后一帧的 tile 可以在前一帧的最后几个 tile 完成之前开始 */
+#define FARM_OPEN_FRAMES 2
+#define FARM_TILES_IN_FLIGHT 2
+#define FARM_MAX_PATH 256
+/* worker 连接 coordinator 失败时的重试间隔和次数 */
+#define FARM_CONNECT_RETRY_MS 500
+#define FARM_CONNECT_RETRIES 60
+
+enum
+{
+    /* worker -> coordinator: version, backend 名 */
+    FARM_MSG_HELLO = 1,
+    /* coordinator -> worker: 画面尺寸、渲染参数和场景 */
+    FARM_MSG_SETUP = 2,
+    /* worker -> coordinator: 场景和渲染实现初始化的结果 */
+    FARM_MSG_READY = 3,
+    /* coordinator -> worker: frame, y0, y1, 摄像机 */
+    FARM_MSG_TILE = 4,
+    /* worker -> coordinator: frame, y0, y1, 渲染耗时，随后为 y1 - y0 行像素 */
+    FARM_MSG_RESULT = 5,
+    FARM_MSG_QUIT = 6,
+};
+
+#define FARM_HEADER_SIZE 8
+#define FARM_BACKEND_NAME_SIZE 16
+/* 摄像机在消息中为 eye、front、up 和四个视角，worker 重新计算其余属性 */
+#define FARM_CAMERA_WORDS 13
+#define FARM_HELLO_WORDS 1
+#define FARM_SETUP_WORDS 7
+#define FARM_TILE_WORDS (3 + FARM_CAMERA_WORDS)
+#define FARM_RESULT_WORDS 4
+
+/********************************************************************************/
+
+static
+void put_u32(uint8_t *p, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+static
+uint32_t get_u32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+static
+void put_f32(uint8_t *p, float f)
+{
+    uint32_t v;
+    memcpy(&v, &f, 4);
+    put_u32(p, v);
+}
+
+static
+float get_f32(const uint8_t *p)
+{
+    uint32_t v = get_u32(p);
+    float f;
+    memcpy(&f, &v, 4);
+    return f;
+}
+
+static
+void put_camera(uint8_t *p, const project_camera_t *camera)
+{
+    const float words[FARM_CAMERA_WORDS] =
+    {
+        camera->eye.x, camera->eye.y, camera->eye.z,
+        camera->front.x, camera->front.y, camera->front.z,
+        camera->up.x, camera->up.y, camera->up.z,
+        camera->left_fov, camera->right_fov, camera->top_fov, camera->bottom_fov,
+    };
+    for (int i = 0; i < FARM_CAMERA_WORDS; ++i)
+    {
+        put_f32(p + i * 4, words[i]);
+    }
+}
+
+static
+void get_camera(const uint8_t *p, project_camera_t *camera)
+{
+    float words[FARM_CAMERA_WORDS];
+    for (int i = 0; i < FARM_CAMERA_WORDS; ++i)
+    {
+        words[i] = get_f32(p + i * 4);
+    }
+    point_t eye = {words[0], words[1], words[2]};
+    direction_t front = {words[3], words[4], words[5]};
+    direction_t up = {words[6], words[7], words[8]};
+    project_camera_init(camera, &eye, &front, words[9], words[10], words[11], words[12]);
+    project_camera_set_up(camera, &up);
+}
+
+static
+int send_all(farm_socket_t s, const void *data, size_t size)
+{
+    const char *p = (const char*)data;
+    while (size > 0)
+    {
+        int n = send(s, p, size > (1 << 30) ? (1 << 30) : (int)size, 0);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static
+int recv_all(farm_socket_t s, void *data, size_t size)
+{
+    char *p = (char*)data;
+    while (size > 0)
+    {
+        int n = recv(s, p, size > (1 << 30) ? (1 << 30) : (int)size, 0);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/* payload 为 words 个 32 位数，后面可以再跟 extra_size 字节的数据 */
+static
+int send_message(farm_socket_t s, uint32_t type, const uint8_t *words, int word_count, const void *extra, size_t extra_size)
+{
+    uint8_t header[FARM_HEADER_SIZE];
+    put_u32(header, type);
+    put_u32(header + 4, (uint32_t)(word_count * 4 + extra_size));
+    if (send_all(s, header, sizeof(header)) != 0 ||
+        (word_count > 0 && send_all(s, words, word_count * 4) != 0) ||
+        (extra_size > 0 && send_all(s, extra, extra_size) != 0))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static
+int recv_header(farm_socket_t s, uint32_t *type, uint32_t *size)
+{
+    uint8_t header[FARM_HEADER_SIZE];
+    if (recv_all(s, header, sizeof(header)) != 0)
+    {
+        return -1;
+    }
+    *type = get_u32(header);
+    *size = get_u32(header + 4);
+    return 0;
+}
+
+/* 跳过不认识的或多余的 payload */
+static
+int skip_bytes(farm_socket_t s, size_t size)
+{
+    uint8_t buffer[4096];
+    while (size > 0)
+    {
+        size_t n = size < sizeof(buffer) ? size : sizeof(buffer);
+        if (recv_all(s, buffer, n) != 0)
+        {
+            return -1;
+        }
+        size -= n;
+    }
+    return 0;
+}
+
+static
+void set_recv_timeout(farm_socket_t s, int timeout_ms)
+{
+#ifdef _WIN32
+    DWORD timeout = (DWORD)timeout_ms;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+#else
+    struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#endif
+}
+
+static
+void set_no_delay(farm_socket_t s)
+{
+    int flag = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&flag, sizeof(flag));
+}
+
+static
+void sleep_ms(int ms)
+{
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    usleep(ms * 1000);
+#endif
+}
+
+static
+int socket_startup(void)
+{
+#ifdef _WIN32
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+    {
+        printf("socket_startup, WSAStartup() failed\n");
+        return -1;
+    }
+#else
+    /* 对端断开之后的写入返回错误，而不是结束进程 */
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    return 0;
+}
+
+static
+void socket_cleanup(void)
+{
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+/* BGRA 转为 PPM 的 RGB */
+static
+int write_ppm(const char *path, const uint8_t *pixel, int w, int h)
+{
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        printf("write_ppm, failed to open %s\n", path);
+        return -1;
+    }
+    fprintf(fp, "P6\n%d %d\n255\n", w, h);
+    for (size_t i = 0; i < (size_t)w * h; ++i)
+    {
+        uint8_t rgb[3] = {pixel[i * 4 + 2], pixel[i * 4 + 1], pixel[i * 4]};
+        fwrite(rgb, 1, 3, fp);
+    }
+    int ok = !ferror(fp);
+    if (fclose(fp) != 0 || !ok)
+    {
+        printf("write_ppm, failed to write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/********************************************************************************/
+
+typedef struct farm_options
+{
+    int worker;
+    /* coordinator */
+    int port;
+    int w;
+    int h;
+    int frame_count;
+    int band_rows;
+    int min_workers;
+    int timeout_ms;
+    /* 每帧摄像机沿 x 轴移动的距离，生成动画 */
+    float pan;
+    int random_sphere_count;
+    const char *scene_file;
+    render_options_t render_options;
+    const char *output_dir;
+    const char *report_file;
+    /* worker */
+    const char *host;
+    const char *backend;
+    int thread_count;
+    const char *cl_source_file;
+    /* 渲染该数量的 tile 之后直接退出，模拟 worker 丢失，0 为不退出 */
+    int fail_after;
+} farm_options_t;
+
+static
+void print_usage(const char *program)
+{
+    printf("usage: %s coordinator [options]\n", program);
+    printf("       %s worker [options]\n", program);
+    printf("coordinator options:\n");
+    printf("  --port <n>           listen port (default: %d)\n", FARM_DEFAULT_PORT);
+    printf("  --size <WxH>         frame size (default: 1920x1080)\n");
+    printf("  --frames <n>         frames to render (default: 1)\n");
+    printf("  --pan <f>            camera movement along x per frame (default: 4)\n");
+    printf("  --band <n>           rows per tile, a multiple of %d (default: 32)\n", RENDER_MAX_PIXEL_STEP);
+    printf("  --min-workers <n>    workers to wait for before the first tile is sent (default: 1)\n");
+    printf("  --timeout <ms>       a worker that holds a tile longer than this is dropped (default: 10000)\n");
+    printf("  --spheres <n>        extra random spheres in the scene (default: 0)\n");
+    printf("  --scene <file>       binary scene written by scene_convert, must be readable by every worker\n");
+    printf("  --shade <mode>       depth or normal (default: depth)\n");
+    printf("  --output-dir <dir>   write every frame as <dir>/frame_NNNN.ppm\n");
+    printf("  --report <file>      JSON report with throughput and per worker tiles\n");
+    printf("worker options:\n");
+    printf("  --connect <host:port> coordinator address (default: 127.0.0.1:%d)\n", FARM_DEFAULT_PORT);
+    printf("  --backend <name>     soft or opencl (default: soft)\n");
+    printf("  --threads <n>        soft render worker threads, 0 for all cores (default: 0)\n");
+    printf("  --cl-source <file>   OpenCL kernel source (default: render.cl)\n");
+    printf("  --fail-after <n>     exit without answering after n tiles, to test re-dispatch\n");
+}
+
+static
+int parse_options(farm_options_t *options, int argc, char *argv[])
+{
+    memset(options, 0, sizeof(*options));
+    options->port = FARM_DEFAULT_PORT;
+    options->w = 1920;
+    options->h = 1080;
+    options->frame_count = 1;
+    options->band_rows = 32;
+    options->min_workers = 1;
+    options->timeout_ms = 10000;
+    options->pan = 4.0f;
+    setup_render_options(&options->render_options);
+    options->host = "127.0.0.1";
+    options->backend = "soft";
+    options->cl_source_file = "render.cl";
+
+    if (argc < 2)
+    {
+        return -1;
+    }
+    if (strcmp(argv[1], "worker") == 0)
+    {
+        options->worker = 1;
+    }
+    else if (strcmp(argv[1], "coordinator") != 0)
+    {
+        return -1;
+    }
+
+    for (int i = 2; i < argc; ++i)
+    {
+        const char *opt = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(opt, "--help") == 0 || strcmp(opt, "-h") == 0)
+        {
+            print_usage(argv[0]);
+            exit(0);
+        }
+        if (value == NULL)
+        {
+            printf("missing value for %s\n", opt);
+            return -1;
+        }
+        ++i;
+
+        if (strcmp(opt, "--port") == 0)
+        {
+            options->port = atoi(value);
+        }
+        else if (strcmp(opt, "--size") == 0)
+        {
+            if (sscanf(value, "%dx%d", &options->w, &options->h) != 2)
+            {
+                printf("invalid size: %s\n", value);
+                return -1;
+            }
+        }
+        else if (strcmp(opt, "--frames") == 0)
+        {
+            options->frame_count = atoi(value);
+        }
+        else if (strcmp(opt, "--pan") == 0)
+        {
+            options->pan = (float)atof(value);
+        }
+        else if (strcmp(opt, "--band") == 0)
+        {
+            options->band_rows = atoi(value);
+        }
+        else if (strcmp(opt, "--min-workers") == 0)
+        {
+            options->min_workers = atoi(value);
+        }
+        else if (strcmp(opt, "--timeout") == 0)
+        {
+            options->timeout_ms = atoi(value);
+        }
+        else if (strcmp(opt, "--spheres") == 0)
+        {
+            options->random_sphere_count = atoi(value);
+        }
+        else if (strcmp(opt, "--scene") == 0)
+        {
+            options->scene_file = value;
+        }
+        else if (strcmp(opt, "--shade") == 0)
+        {
+            if (strcmp(value, "depth") == 0)
+            {
+                options->render_options.shade_mode = RENDER_SHADE_DEPTH;
+            }
+            else if (strcmp(value, "normal") == 0)
+            {
+                options->render_options.shade_mode = RENDER_SHADE_NORMAL;
+            }
+            else
+            {
+                printf("unknown shade mode: %s\n", value);
+                return -1;
+            }
+        }
+        else if (strcmp(opt, "--output-dir") == 0)
+        {
+            options->output_dir = value;
+        }
+        else if (strcmp(opt, "--report") == 0)
+        {
+            options->report_file = value;
+        }
+        else if (strcmp(opt, "--connect") == 0)
+        {
+            static char host[FARM_MAX_PATH];
+            const char *colon = strrchr(value, ':');
+            if (colon == NULL || colon == value || (size_t)(colon - value) >= sizeof(host))
+            {
+                printf("invalid address: %s, expected host:port\n", value);
+                return -1;
+            }
+            memcpy(host, value, colon - value);
+            host[colon - value] = '\0';
+            options->host = host;
+            options->port = atoi(colon + 1);
+        }
+        else if (strcmp(opt, "--backend") == 0)
+        {
+            options->backend = value;
+        }
+        else if (strcmp(opt, "--threads") == 0)
+        {
+            options->thread_count = atoi(value);
+        }
+        else if (strcmp(opt, "--cl-source") == 0)
+        {
+            options->cl_source_file = value;
+        }
+        else if (strcmp(opt, "--fail-after") == 0)
+        {
+            options->fail_after = atoi(value);
+        }
+        else
+        {
+            printf("unknown option: %s\n", opt);
+            return -1;
+        }
+    }
+
+    if (options->port <= 0 || options->port > 65535)
+    {
+        printf("invalid port: %d\n", options->port);
+        return -1;
+    }
+    if (options->w <= 0 || options->h <= 0 || options->frame_count <= 0)
+    {
+        printf("invalid size or frame count: %dx%d, %d frames\n", options->w, options->h, options->frame_count);
+        return -1;
+    }
+    if (options->band_rows <= 0 || options->band_rows % RENDER_MAX_PIXEL_STEP != 0)
+    {
+        printf("invalid band: %d, must be a positive multiple of %d\n", options->band_rows, RENDER_MAX_PIXEL_STEP);
+        return -1;
+    }
+    if (options->min_workers < 1 || options->min_workers > FARM_MAX_WORKERS || options->timeout_ms <= 0)
+    {
+        printf("invalid worker count or timeout: %d, %dms\n", options->min_workers, options->timeout_ms);
+        return -1;
+    }
+    if (options->scene_file != NULL && strlen(options->scene_file) >= FARM_MAX_PATH)
+    {
+        printf("scene path too long: %s\n", options->scene_file);
+        return -1;
+    }
+
+    return 0;
+}
+
+/********************************************************************************/
+
+/* worker: 连接 coordinator，按 SETUP 构建场景，之后逐个渲染收到的 tile */
+
+static
+farm_socket_t connect_coordinator(const char *host, int port)
+{
+    char port_text[16];
+    snprintf(port_text, sizeof(port_text), "%d", port);
+    for (int attempt = 0; attempt < FARM_CONNECT_RETRIES; ++attempt)
+    {
+        struct addrinfo hints;
+        struct addrinfo *result = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, port_text, &hints, &result) != 0)
+        {
+            printf("connect_coordinator, cannot resolve %s\n", host);
+            return FARM_INVALID_SOCKET;
+        }
+        for (struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next)
+        {
+            farm_socket_t s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (s == FARM_INVALID_SOCKET)
+            {
+                continue;
+            }
+            if (connect(s, ai->ai_addr, (int)ai->ai_addrlen) == 0)
+            {
+                freeaddrinfo(result);
+                set_no_delay(s);
+                return s;
+            }
+            close_socket(s);
+        }
+        freeaddrinfo(result);
+        /* coordinator 可能还没有启动 */
+        sleep_ms(FARM_CONNECT_RETRY_MS);
+    }
+    printf("connect_coordinator, failed to connect %s:%d\n", host, port);
+    return FARM_INVALID_SOCKET;
+}
+
+typedef struct farm_worker_state
+{
+    const render_backend_t *backend;
+    int backend_ready;
+    scene_t scene;
+    int scene_ready;
+    int w;
+    int h;
+    uint8_t *pixel;
+} farm_worker_state_t;
+
+static
+int worker_setup(farm_worker_state_t *state, const farm_options_t *options, const uint8_t *payload, uint32_t size)
+{
+    if (size < FARM_SETUP_WORDS * 4 + FARM_MAX_PATH)
+    {
+        printf("worker_setup, short setup message\n");
+        return -1;
+    }
+    state->w = (int)get_u32(payload);
+    state->h = (int)get_u32(payload + 4);
+    render_options_t render_options;
+    render_options.shade_mode = (int)get_u32(payload + 8);
+    render_options.checker_size = (int)get_u32(payload + 12);
+    render_options.depth_scale = get_f32(payload + 16);
+    int random_sphere_count = (int)get_u32(payload + 20);
+    int has_scene_file = (int)get_u32(payload + 24);
+    char scene_file[FARM_MAX_PATH];
+    memcpy(scene_file, payload + FARM_SETUP_WORDS * 4, FARM_MAX_PATH);
+    scene_file[FARM_MAX_PATH - 1] = '\0';
+
+    if (state->w <= 0 || state->h <= 0 || state->w > 65536 || state->h > 65536)
+    {
+        printf("worker_setup, invalid frame size: %dx%d\n", state->w, state->h);
+        return -1;
+    }
+    state->pixel = (uint8_t*)calloc((size_t)state->w * state->h, 4);
+    if (state->pixel == NULL)
+    {
+        printf("worker_setup, out of memory\n");
+        return -1;
+    }
+
+    /* 随机场景使用固定种子，各 worker 构建的场景相同 */
+    if (has_scene_file ? scene_load_file(&state->scene, NULL, scene_file) < 0 : setup_scene(&state->scene, random_sphere_count) != 0)
+    {
+        printf("worker_setup, failed to build the scene\n");
+        return -1;
+    }
+    state->scene_ready = 1;
+
+    if (strcmp(options->backend, "opencl") == 0)
+    {
+        state->backend = &g_cl_render_backend;
+    }
+    else if (strcmp(options->backend, "soft") == 0)
+    {
+        thread_pool_init(options->thread_count);
+        soft_simd_init();
+        state->backend = &g_soft_render_backend;
+    }
+    else
+    {
+        printf("worker_setup, unknown backend: %s\n", options->backend);
+        return -1;
+    }
+    if (state->backend->init(options->cl_source_file, state->w, state->h) != 0)
+    {
+        printf("worker_setup, %s init failed\n", state->backend->name);
+        return -1;
+    }
+    state->backend_ready = 1;
+    state->backend->set_scene(&state->scene);
+    if (state->backend->set_options(&render_options) != 0 || state->backend->set_pixel_step(1) != 0)
+    {
+        return -1;
+    }
+
+    printf("worker ready, %dx%d, %d spheres, backend %s\n", state->w, state->h, state->scene.sphere_count, state->backend->name);
+    return 0;
+}
+
+static
+int worker_render_tile(farm_worker_state_t *state, farm_socket_t s, const uint8_t *payload, uint32_t size)
+{
+    if (size < FARM_TILE_WORDS * 4)
+    {
+        printf("worker_render_tile, short tile message\n");
+        return -1;
+    }
+    uint32_t frame = get_u32(payload);
+    int y0 = (int)get_u32(payload + 4);
+    int y1 = (int)get_u32(payload + 8);
+    if (y0 < 0 || y1 > state->h || y0 >= y1 || y0 % RENDER_MAX_PIXEL_STEP != 0)
+    {
+        printf("worker_render_tile, invalid rows: [%d, %d)\n", y0, y1);
+        return -1;
+    }
+    project_camera_t camera;
+    get_camera(payload + 12, &camera);
+
+    uint64_t ts1 = now_ns();
+    int pitch = state->w * 4;
+    uint64_t elapsed_ns = 0;
+    state->backend->set_camera(&camera);
+    if (state->backend->render_region(state->pixel, state->w, state->h, pitch, y0, y1) != 0 ||
+        state->backend->wait(&elapsed_ns) != 0)
+    {
+        return -1;
+    }
+    uint64_t ts2 = now_ns();
+
+    uint8_t words[FARM_RESULT_WORDS * 4];
+    put_u32(words, frame);
+    put_u32(words + 4, (uint32_t)y0);
+    put_u32(words + 8, (uint32_t)y1);
+    put_u32(words + 12, (uint32_t)((ts2 - ts1) / 1000));
+    return send_message(s, FARM_MSG_RESULT, words, FARM_RESULT_WORDS, state->pixel + (size_t)y0 * pitch, (size_t)(y1 - y0) * pitch);
+}
+
+static
+int run_worker(const farm_options_t *options)
+{
+    farm_socket_t s = connect_coordinator(options->host, options->port);
+    if (s == FARM_INVALID_SOCKET)
+    {
+        return -1;
+    }
+
+    uint8_t hello[FARM_HELLO_WORDS * 4 + FARM_BACKEND_NAME_SIZE];
+    memset(hello, 0, sizeof(hello));
+    put_u32(hello, FARM_PROTOCOL_VERSION);
+    strncpy((char*)hello + FARM_HELLO_WORDS * 4, options->backend, FARM_BACKEND_NAME_SIZE - 1);
+    if (send_message(s, FARM_MSG_HELLO, hello, FARM_HELLO_WORDS, hello + FARM_HELLO_WORDS * 4, FARM_BACKEND_NAME_SIZE) != 0)
+    {
+        close_socket(s);
+        return -1;
+    }
+
+    farm_worker_state_t state;
+    memset(&state, 0, sizeof(state));
+    g_render_verbose = 0;
+    int ret = 0;
+    int tile_count = 0;
+    uint8_t payload[FARM_SETUP_WORDS * 4 + FARM_MAX_PATH];
+    for (;;)
+    {
+        uint32_t type, size;
+        if (recv_header(s, &type, &size) != 0)
+        {
+            printf("run_worker, coordinator closed the connection\n");
+            break;
+        }
+        uint32_t keep = size < sizeof(payload) ? size : (uint32_t)sizeof(payload);
+        if (recv_all(s, payload, keep) != 0 || skip_bytes(s, size - keep) != 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        if (type == FARM_MSG_SETUP)
+        {
+            uint8_t status[4];
+            int setup_ret = state.pixel == NULL ? worker_setup(&state, options, payload, keep) : -1;
+            put_u32(status, setup_ret == 0 ? 0 : 1);
+            if (send_message(s, FARM_MSG_READY, status, 1, NULL, 0) != 0 || setup_ret != 0)
+            {
+                ret = -1;
+                break;
+            }
+        }
+        else if (type == FARM_MSG_TILE && state.backend_ready)
+        {
+            if (options->fail_after > 0 && tile_count >= options->fail_after)
+            {
+                printf("run_worker, exiting after %d tiles (--fail-after)\n", tile_count);
+                break;
+            }
+            if (worker_render_tile(&state, s, payload, keep) != 0)
+            {
+                ret = -1;
+                break;
+            }
+            tile_count++;
+        }
+        else if (type == FARM_MSG_QUIT)
+        {
+            break;
+        }
+        else
+        {
+            printf("run_worker, unexpected message: %u\n", type);
+            ret = -1;
+            break;
+        }
+    }
+
+    printf("worker done, tiles: %d\n", tile_count);
+    close_socket(s);
+    if (state.backend_ready)
+    {
+        state.backend->uninit();
+        if (state.backend == &g_soft_render_backend)
+        {
+            thread_pool_uninit();
+        }
+    }
+    if (state.scene_ready)
+    {
+        scene_uninit(&state.scene);
+    }
+    free(state.pixel);
+
+    return ret;
+}
+
+/********************************************************************************/
+
+/* coordinator: 单线程，select 等待新的连接和各 worker 的消息 */
+
+typedef struct farm_tile
+{
+    int y0;
+    int y1;
+    /* 负责的 worker，-1 为等待分配 */
+    int worker;
+    int done;
+    uint64_t assign_ns;
+} farm_tile_t;
+
+typedef struct farm_frame
+{
+    /* -1 为空闲 */
+    int index;
+    uint8_t *pixel;
+    project_camera_t camera;
+    farm_tile_t *tiles;
+    int done_count;
+    uint64_t start_ns;
+} farm_frame_t;
+
+typedef struct farm_worker
+{
+    farm_socket_t socket;
+    char address[64];
+    char backend[FARM_BACKEND_NAME_SIZE];
+    int ready;
+    int in_flight;
+    int tile_count;
+    uint64_t render_us;
+} farm_worker_t;
+
+typedef struct farm_coordinator
+{
+    const farm_options_t *options;
+    farm_socket_t listen_socket;
+    farm_worker_t workers[FARM_MAX_WORKERS];
+    /* 出现过的 worker 个数，断开的 worker 保留统计，socket 为 FARM_INVALID_SOCKET */
+    int worker_count;
+    int ready_count;
+    int lost_count;
+    int redispatch_count;
+
+    /* 第 0 帧的摄像机，场景文件中保存了摄像机时使用文件中的 */
+    project_camera_t base_camera;
+    farm_frame_t frames[FARM_OPEN_FRAMES];
+    int tile_count;
+    int next_frame;
+    int done_frames;
+    uint64_t first_tile_ns;
+    double *frame_ms;
+} farm_coordinator_t;
+
+static
+farm_socket_t listen_port(int port)
+{
+    farm_socket_t s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == FARM_INVALID_SOCKET)
+    {
+        printf("listen_port, socket() failed\n");
+        return FARM_INVALID_SOCKET;
+    }
+    int reuse = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((unsigned short)port);
+    if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(s, FARM_MAX_WORKERS) != 0)
+    {
+        printf("listen_port, failed to listen on port %d\n", port);
+        close_socket(s);
+        return FARM_INVALID_SOCKET;
+    }
+    return s;
+}
+
+static
+void send_setup(farm_coordinator_t *farm, farm_worker_t *worker)
+{
+    const farm_options_t *options = farm->options;
+    uint8_t words[FARM_SETUP_WORDS * 4];
+    char scene_file[FARM_MAX_PATH];
+    memset(scene_file, 0, sizeof(scene_file));
+    if (options->scene_file != NULL)
+    {
+        strcpy(scene_file, options->scene_file);
+    }
+    put_u32(words, (uint32_t)options->w);
+    put_u32(words + 4, (uint32_t)options->h);
+    put_u32(words + 8, (uint32_t)options->render_options.shade_mode);
+    put_u32(words + 12, (uint32_t)options->render_options.checker_size);
+    put_f32(words + 16, options->render_options.depth_scale);
+    put_u32(words + 20, (uint32_t)options->random_sphere_count);
+    put_u32(words + 24, options->scene_file != NULL);
+    send_message(worker->socket, FARM_MSG_SETUP, words, FARM_SETUP_WORDS, scene_file, sizeof(scene_file));
+}
+
+/* 关闭 worker 的连接，其在途的 tile 重新排队 */
+static
+void drop_worker(farm_coordinator_t *farm, int id, const char *reason)
+{
+    farm_worker_t *worker = &farm->workers[id];
+    if (worker->socket == FARM_INVALID_SOCKET)
+    {
+        return;
+    }
+    int requeued = 0;
+    for (int f = 0; f < FARM_OPEN_FRAMES; ++f)
+    {
+        farm_frame_t *frame = &farm->frames[f];
+        for (int t = 0; frame->index >= 0 && t < farm->tile_count; ++t)
+        {
+            if (frame->tiles[t].worker == id && !frame->tiles[t].done)
+            {
+                frame->tiles[t].worker = -1;
+                requeued++;
+            }
+        }
+    }
+    printf("worker %d (%s) lost: %s, %d tiles re-queued\n", id, worker->address, reason, requeued);
+    close_socket(worker->socket);
+    worker->socket = FARM_INVALID_SOCKET;
+    if (worker->ready)
+    {
+        farm->ready_count--;
+    }
+    worker->ready = 0;
+    worker->in_flight = 0;
+    farm->lost_count++;
+    farm->redispatch_count += requeued;
+}
+
+static
+void accept_worker(farm_coordinator_t *farm)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    farm_socket_t s = accept(farm->listen_socket, (struct sockaddr*)&addr, &addr_len);
+    if (s == FARM_INVALID_SOCKET)
+    {
+        return;
+    }
+    if (farm->worker_count >= FARM_MAX_WORKERS)
+    {
+        printf("accept_worker, too many workers\n");
+        close_socket(s);
+        return;
+    }
+    set_no_delay(s);
+    /* 一条消息一旦开始接收就应在超时之内收完 */
+    set_recv_timeout(s, farm->options->timeout_ms);
+    farm_worker_t *worker = &farm->workers[farm->worker_count++];
+    memset(worker, 0, sizeof(*worker));
+    worker->socket = s;
+    snprintf(worker->address, sizeof(worker->address), "%s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+}
+
+static
+void open_frames(farm_coordinator_t *farm)
+{
+    const farm_options_t *options = farm->options;
+    for (int f = 0; f < FARM_OPEN_FRAMES && farm->next_frame < options->frame_count; ++f)
+    {
+        farm_frame_t *frame = &farm->frames[f];
+        if (frame->index >= 0)
+        {
+            continue;
+        }
+        frame->index = farm->next_frame++;
+        frame->done_count = 0;
+        frame->start_ns = 0;
+        const project_camera_t *base = &farm->base_camera;
+        point_t eye = base->eye;
+        eye.x += options->pan * frame->index;
+        project_camera_init(&frame->camera, &eye, &base->front, base->left_fov, base->right_fov, base->top_fov, base->bottom_fov);
+        project_camera_set_up(&frame->camera, &base->up);
+        for (int t = 0; t < farm->tile_count; ++t)
+        {
+            frame->tiles[t].y0 = t * options->band_rows;
+            frame->tiles[t].y1 = (t + 1) * options->band_rows < options->h ? (t + 1) * options->band_rows : options->h;
+            frame->tiles[t].worker = -1;
+            frame->tiles[t].done = 0;
+        }
+    }
+}
+
+/* 按帧的顺序找第一个等待分配的 tile */
+static
+int find_pending_tile(farm_coordinator_t *farm, farm_frame_t **frame_out)
+{
+    farm_frame_t *best = NULL;
+    int best_tile = -1;
+    for (int f = 0; f < FARM_OPEN_FRAMES; ++f)
+    {
+        farm_frame_t *frame = &farm->frames[f];
+        if (frame->index < 0 || (best != NULL && frame->index > best->index))
+        {
+            continue;
+        }
+        for (int t = 0; t < farm->tile_count; ++t)
+        {
+            if (frame->tiles[t].worker < 0 && !frame->tiles[t].done)
+            {
+                best = frame;
+                best_tile = t;
+                break;
+            }
+        }
+    }
+    *frame_out = best;
+    return best_tile;
+}
+
+static
+void dispatch_tiles(farm_coordinator_t *farm)
+{
+    if (farm->ready_count < farm->options->min_workers && farm->first_tile_ns == 0)
+    {
+        return;
+    }
+    int assigned;
+    do
+    {
+        assigned = 0;
+        for (int id = 0; id < farm->worker_count; ++id)
+        {
+            farm_worker_t *worker = &farm->workers[id];
+            if (!worker->ready || worker->in_flight >= FARM_TILES_IN_FLIGHT)
+            {
+                continue;
+            }
+            farm_frame_t *frame;
+            int t = find_pending_tile(farm, &frame);
+            if (t < 0)
+            {
+                return;
+            }
+            farm_tile_t *tile = &frame->tiles[t];
+            uint8_t words[FARM_TILE_WORDS * 4];
+            put_u32(words, (uint32_t)frame->index);
+            put_u32(words + 4, (uint32_t)tile->y0);
+            put_u32(words + 8, (uint32_t)tile->y1);
+            put_camera(words + 12, &frame->camera);
+            if (send_message(worker->socket, FARM_MSG_TILE, words, FARM_TILE_WORDS, NULL, 0) != 0)
+            {
+                drop_worker(farm, id, "send failed");
+                continue;
+            }
+            uint64_t now = now_ns();
+            if (farm->first_tile_ns == 0)
+            {
+                farm->first_tile_ns = now;
+            }
+            if (frame->start_ns == 0)
+            {
+                frame->start_ns = now;
+            }
+            tile->worker = id;
+            tile->assign_ns = now;
+            worker->in_flight++;
+            assigned = 1;
+        }
+    } while (assigned);
+}
+
+static
+void finish_frame(farm_coordinator_t *farm, farm_frame_t *frame)
+{
+    const farm_options_t *options = farm->options;
+    double ms = (now_ns() - frame->start_ns) / 1e6;
+    farm->frame_ms[frame->index] = ms;
+    printf("frame %d done, %.3fms\n", frame->index, ms);
+    if (options->output_dir != NULL)
+    {
+        char path[FARM_MAX_PATH + 32];
+        snprintf(path, sizeof(path), "%s/frame_%04d.ppm", options->output_dir, frame->index);
+        write_ppm(path, frame->pixel, options->w, options->h);
+    }
+    frame->index = -1;
+    farm->done_frames++;
+}
+
+static
+void handle_message(farm_coordinator_t *farm, int id)
+{
+    const farm_options_t *options = farm->options;
+    farm_worker_t *worker = &farm->workers[id];
+    uint32_t type, size;
+    if (recv_header(worker->socket, &type, &size) != 0)
+    {
+        drop_worker(farm, id, "connection closed");
+        return;
+    }
+
+    if (type == FARM_MSG_HELLO)
+    {
+        uint8_t payload[FARM_HELLO_WORDS * 4 + FARM_BACKEND_NAME_SIZE];
+        if (size != sizeof(payload) || recv_all(worker->socket, payload, sizeof(payload)) != 0 ||
+            get_u32(payload) != FARM_PROTOCOL_VERSION)
+        {
+            drop_worker(farm, id, "bad hello");
+            return;
+        }
+        memcpy(worker->backend, payload + FARM_HELLO_WORDS * 4, FARM_BACKEND_NAME_SIZE);
+        worker->backend[FARM_BACKEND_NAME_SIZE - 1] = '\0';
+        send_setup(farm, worker);
+    }
+    else if (type == FARM_MSG_READY)
+    {
+        uint8_t status[4];
+        if (size != sizeof(status) || recv_all(worker->socket, status, sizeof(status)) != 0 || get_u32(status) != 0)
+        {
+            drop_worker(farm, id, "setup failed");
+            return;
+        }
+        worker->ready = 1;
+        farm->ready_count++;
+        printf("worker %d (%s, %s) ready, %d workers\n", id, worker->address, worker->backend, farm->ready_count);
+    }
+    else if (type == FARM_MSG_RESULT)
+    {
+        uint8_t words[FARM_RESULT_WORDS * 4];
+        if (size < sizeof(words) || recv_all(worker->socket, words, sizeof(words)) != 0)
+        {
+            drop_worker(farm, id, "bad result");
+            return;
+        }
+        int frame_index = (int)get_u32(words);
+        int y0 = (int)get_u32(words + 4);
+        int y1 = (int)get_u32(words + 8);
+        size_t pixel_size = size - sizeof(words);
+
+        farm_frame_t *frame = NULL;
+        for (int f = 0; f < FARM_OPEN_FRAMES; ++f)
+        {
+            if (farm->frames[f].index == frame_index)
+            {
+                frame = &farm->frames[f];
+            }
+        }
+        int t = y0 / options->band_rows;
+        if (frame == NULL || t >= farm->tile_count || frame->tiles[t].y0 != y0 || frame->tiles[t].y1 != y1 ||
+            frame->tiles[t].worker != id || pixel_size != (size_t)(y1 - y0) * options->w * 4)
+        {
+            drop_worker(farm, id, "unexpected result");
+            return;
+        }
+        if (recv_all(worker->socket, frame->pixel + (size_t)y0 * options->w * 4, pixel_size) != 0)
+        {
+            drop_worker(farm, id, "truncated result");
+            return;
+        }
+        frame->tiles[t].done = 1;
+        frame->done_count++;
+        worker->in_flight--;
+        worker->tile_count++;
+        worker->render_us += get_u32(words + 12);
+        if (frame->done_count == farm->tile_count)
+        {
+            finish_frame(farm, frame);
+        }
+    }
+    else
+    {
+        drop_worker(farm, id, "unexpected message");
+    }
+}
+
+/* 在途时间超过 timeout 的 tile 视为 worker 已经失去响应 */
+static
+void check_timeouts(farm_coordinator_t *farm)
+{
+    uint64_t now = now_ns();
+    uint64_t timeout_ns = (uint64_t)farm->options->timeout_ms * 1000000ull;
+    for (int f = 0; f < FARM_OPEN_FRAMES; ++f)
+    {
+        farm_frame_t *frame = &farm->frames[f];
+        for (int t = 0; frame->index >= 0 && t < farm->tile_count; ++t)
+        {
+            farm_tile_t *tile = &frame->tiles[t];
+            if (tile->worker >= 0 && !tile->done && now - tile->assign_ns > timeout_ns)
+            {
+                drop_worker(farm, tile->worker, "tile timed out");
+            }
+        }
+    }
+}
+
+static
+void write_report(farm_coordinator_t *farm, double total_s)
+{
+    const farm_options_t *options = farm->options;
+    FILE *fp = fopen(options->report_file, "w");
+    if (fp == NULL)
+    {
+        printf("write_report, failed to open %s\n", options->report_file);
+        return;
+    }
+    double mpixels = (double)options->w * options->h * options->frame_count / 1e6;
+    fprintf(fp, "{\n  \"width\": %d, \"height\": %d, \"frames\": %d, \"band_rows\": %d,\n",
+        options->w, options->h, options->frame_count, options->band_rows);
+    fprintf(fp, "  \"workers\": %d, \"workers_lost\": %d, \"tiles_redispatched\": %d,\n",
+        farm->worker_count, farm->lost_count, farm->redispatch_count);
+    fprintf(fp, "  \"total_s\": %.4f, \"mpixels_per_s\": %.3f,\n", total_s, total_s > 0 ? mpixels / total_s : 0.0);
+    fprintf(fp, "  \"frame_ms\": [");
+    for (int i = 0; i < options->frame_count; ++i)
+    {
+        fprintf(fp, "%s%.3f", i > 0 ? ", " : "", farm->frame_ms[i]);
+    }
+    fprintf(fp, "],\n  \"worker_stats\": [");
+    for (int id = 0; id < farm->worker_count; ++id)
+    {
+        const farm_worker_t *worker = &farm->workers[id];
+        fprintf(fp, "%s\n    {\"address\": \"%s\", \"backend\": \"%s\", \"tiles\": %d, \"render_ms\": %.3f}",
+            id > 0 ? "," : "", worker->address, worker->backend, worker->tile_count, worker->render_us / 1e3);
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    fclose(fp);
+}
+
+static
+int run_coordinator(const farm_options_t *options)
+{
+    static farm_coordinator_t farm;
+    memset(&farm, 0, sizeof(farm));
+    farm.options = options;
+    farm.tile_count = (options->h + options->band_rows - 1) / options->band_rows;
+    setup_project_camera(&farm.base_camera);
+    if (options->scene_file != NULL)
+    {
+        /* 只为读取摄像机并确认文件可用，场景由各 worker 自己映射 */
+        scene_t scene;
+        if (scene_load_file(&scene, &farm.base_camera, options->scene_file) < 0)
+        {
+            return -1;
+        }
+        scene_uninit(&scene);
+    }
+    farm.frame_ms = (double*)calloc(options->frame_count, sizeof(double));
+    int alloc_ok = farm.frame_ms != NULL;
+    for (int f = 0; f < FARM_OPEN_FRAMES; ++f)
+    {
+        farm.frames[f].index = -1;
+        farm.frames[f].pixel = (uint8_t*)calloc((size_t)options->w * options->h, 4);
+        farm.frames[f].tiles = (farm_tile_t*)calloc(farm.tile_count, sizeof(farm_tile_t));
+        alloc_ok = alloc_ok && farm.frames[f].pixel != NULL && farm.frames[f].tiles != NULL;
+    }
+
+    farm.listen_socket = alloc_ok ? listen_port(options->port) : FARM_INVALID_SOCKET;
+    if (farm.listen_socket == FARM_INVALID_SOCKET)
+    {
+        for (int f = 0; f < FARM_OPEN_FRAMES; ++f)
+        {
+            free(farm.frames[f].pixel);
+            free(farm.frames[f].tiles);
+        }
+        free(farm.frame_ms);
+        return -1;
+    }
+    printf("coordinator listening on port %d, %dx%d, %d frames, %d tiles per frame, waiting for %d workers\n",
+        options->port, options->w, options->h, options->frame_count, farm.tile_count, options->min_workers);
+
+    while (farm.done_frames < options->frame_count)
+    {
+        open_frames(&farm);
+        dispatch_tiles(&farm);
+
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(farm.listen_socket, &read_set);
+        farm_socket_t max_socket = farm.listen_socket;
+        for (int id = 0; id < farm.worker_count; ++id)
+        {
+            if (farm.workers[id].socket != FARM_INVALID_SOCKET)
+            {
+                FD_SET(farm.workers[id].socket, &read_set);
+                max_socket = farm.workers[id].socket > max_socket ? farm.workers[id].socket : max_socket;
+            }
+        }
+        /* 定期醒来检查超时 */
+        struct timeval wait_time = {0, 100000};
+        int n = select((int)max_socket + 1, &read_set, NULL, NULL, &wait_time);
+        if (n < 0)
+        {
+            printf("run_coordinator, select() failed\n");
+            break;
+        }
+        if (FD_ISSET(farm.listen_socket, &read_set))
+        {
+            accept_worker(&farm);
+        }
+        for (int id = 0; id < farm.worker_count; ++id)
+        {
+            if (farm.workers[id].socket != FARM_INVALID_SOCKET && FD_ISSET(farm.workers[id].socket, &read_set))
+            {
+                handle_message(&farm, id);
+            }
+        }
+        check_timeouts(&farm);
+    }
+
+    double total_s = farm.first_tile_ns > 0 ? (now_ns() - farm.first_tile_ns) / 1e9 : 0;
+    int ret = farm.done_frames == options->frame_count ? 0 : -1;
+    for (int id = 0; id < farm.worker_count; ++id)
+    {
+        farm_worker_t *worker = &farm.workers[id];
+        if (worker->socket != FARM_INVALID_SOCKET)
+        {
+            send_message(worker->socket, FARM_MSG_QUIT, NULL, 0, NULL, 0);
+            close_socket(worker->socket);
+        }
+    }
+    close_socket(farm.listen_socket);
+
+    double mpixels = (double)options->w * options->h * options->frame_count / 1e6;
+    printf("frames: %d, workers: %d (lost %d, tiles re-dispatched %d), total %.3fs, %.2f Mpixels/s\n",
+        farm.done_frames, farm.worker_count, farm.lost_count, farm.redispatch_count, total_s,
+        total_s > 0 ? mpixels / total_s : 0.0);
+    for (int id = 0; id < farm.worker_count; ++id)
+    {
+        const farm_worker_t *worker = &farm.workers[id];
+        printf("    worker %d %-21s %-8s tiles %6d  render %9.3fms\n", id, worker->address, worker->backend,
+            worker->tile_count, worker->render_us / 1e3);
+    }
+    if (options->report_file != NULL)
+    {
+        write_report(&farm, total_s);
+    }
+
+    for (int f = 0; f < FARM_OPEN_FRAMES; ++f)
+    {
+        free(farm.frames[f].pixel);
+        free(farm.frames[f].tiles);
+    }
+    free(farm.frame_ms);
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    farm_options_t options;
+    if (parse_options(&options, argc, argv) != 0)
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+    if (socket_startup() != 0)
+    {
+        return -1;
+    }
+
+    int ret = options.worker ? run_worker(&options) : run_coordinator(&options);
+
+    socket_cleanup();
+    return ret == 0 ? 0 : 1;
+}
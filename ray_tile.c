@@ -0,0 +1,767 @@
+#include "common.h"
+#include "render.h"
+#include "thread_pool.h"
+#include "thread_compat.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define file_seek(fp, offset) _fseeki64((fp), (__int64)(offset), SEEK_SET)
+#else
+#define file_seek(fp, offset) fseeko((fp), (off_t)(offset), SEEK_SET)
+#endif
+
+/* 分块渲染任意大小的画面: 渲染设备只分配一个 tile 大小的画面，逐个 tile 调整摄像机窗口后渲染，
+ * 完成的 tile 交给写入线程转换为 RGB 后直接写到输出文件中的位置。
+ * 内存只有 TILE_MAX_BUFFERS 以内的 tile 缓冲和每个 tile 十几字节的文件头，与输出分辨率无关
+ */
+
+#define TILE_DEFAULT_SIZE 960
+#define TILE_DEFAULT_BUFFERS 3
+#define TILE_MAX_BUFFERS 16
+/* TIFF 的 ImageWidth / ImageLength 为 32 位，PPM 的读取程序一般也不接受更大的尺寸 */
+#define TILE_MAX_DIMENSION 1000000
+
+enum
+{
+    TILE_FORMAT_TIFF,
+    TILE_FORMAT_PPM,
+};
+
+typedef struct tile_options
+{
+    int w;
+    int h;
+    int tile_size;
+    int buffer_count;
+    int random_sphere_count;
+    const char *scene_file;
+    render_options_t render_options;
+    const char *output_file;
+    int format;
+    const char *backend;
+    int thread_count;
+    const char *cl_source_file;
+} tile_options_t;
+
+static
+void print_usage(const char *program)
+{
+    printf("usage: %s --output <file.tif|file.ppm> [options]\n", program);
+    printf("  --size <WxH>         output size (default: 16384x16384)\n");
+    printf("  --tile <n>           tile edge, a multiple of twice the checker size (default: %d)\n", TILE_DEFAULT_SIZE);
+    printf("  --buffers <n>        tile buffers shared with the writer thread, 2~%d (default: %d)\n",
+        TILE_MAX_BUFFERS, TILE_DEFAULT_BUFFERS);
+    printf("  --backend <name>     soft or opencl (default: soft)\n");
+    printf("  --threads <n>        soft render worker threads, 0 for all cores (default: 0)\n");
+    printf("  --cl-source <file>   OpenCL kernel source (default: render.cl)\n");
+    printf("  --spheres <n>        extra random spheres in the scene (default: 0)\n");
+    printf("  --scene <file>       binary scene written by scene_convert\n");
+    printf("  --shade <mode>       depth or normal (default: depth)\n");
+}
+
+static
+int has_suffix(const char *s, const char *suffix)
+{
+    size_t n = strlen(s);
+    size_t m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+static
+int parse_options(tile_options_t *options, int argc, char *argv[])
+{
+    memset(options, 0, sizeof(*options));
+    options->w = 16384;
+    options->h = 16384;
+    options->tile_size = TILE_DEFAULT_SIZE;
+    options->buffer_count = TILE_DEFAULT_BUFFERS;
+    setup_render_options(&options->render_options);
+    options->backend = "soft";
+    options->cl_source_file = "render.cl";
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *opt = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(opt, "--help") == 0 || strcmp(opt, "-h") == 0)
+        {
+            print_usage(argv[0]);
+            exit(0);
+        }
+        if (value == NULL)
+        {
+            printf("missing value for %s\n", opt);
+            return -1;
+        }
+        ++i;
+
+        if (strcmp(opt, "--size") == 0)
+        {
+            if (sscanf(value, "%dx%d", &options->w, &options->h) != 2)
+            {
+                printf("invalid size: %s\n", value);
+                return -1;
+            }
+        }
+        else if (strcmp(opt, "--tile") == 0)
+        {
+            options->tile_size = atoi(value);
+        }
+        else if (strcmp(opt, "--buffers") == 0)
+        {
+            options->buffer_count = atoi(value);
+        }
+        else if (strcmp(opt, "--backend") == 0)
+        {
+            options->backend = value;
+        }
+        else if (strcmp(opt, "--threads") == 0)
+        {
+            options->thread_count = atoi(value);
+        }
+        else if (strcmp(opt, "--cl-source") == 0)
+        {
+            options->cl_source_file = value;
+        }
+        else if (strcmp(opt, "--spheres") == 0)
+        {
+            options->random_sphere_count = atoi(value);
+        }
+        else if (strcmp(opt, "--scene") == 0)
+        {
+            options->scene_file = value;
+        }
+        else if (strcmp(opt, "--shade") == 0)
+        {
+            if (strcmp(value, "depth") == 0)
+            {
+                options->render_options.shade_mode = RENDER_SHADE_DEPTH;
+            }
+            else if (strcmp(value, "normal") == 0)
+            {
+                options->render_options.shade_mode = RENDER_SHADE_NORMAL;
+            }
+            else
+            {
+                printf("unknown shade mode: %s\n", value);
+                return -1;
+            }
+        }
+        else if (strcmp(opt, "--output") == 0)
+        {
+            options->output_file = value;
+        }
+        else
+        {
+            printf("unknown option: %s\n", opt);
+            return -1;
+        }
+    }
+
+    if (options->output_file == NULL)
+    {
+        printf("missing --output\n");
+        return -1;
+    }
+    if (has_suffix(options->output_file, ".tif") || has_suffix(options->output_file, ".tiff"))
+    {
+        options->format = TILE_FORMAT_TIFF;
+    }
+    else if (has_suffix(options->output_file, ".ppm"))
+    {
+        options->format = TILE_FORMAT_PPM;
+    }
+    else
+    {
+        printf("unknown output format: %s, expected .tif or .ppm\n", options->output_file);
+        return -1;
+    }
+    if (options->w <= 0 || options->h <= 0 || options->w > TILE_MAX_DIMENSION || options->h > TILE_MAX_DIMENSION)
+    {
+        printf("invalid size: %dx%d\n", options->w, options->h);
+        return -1;
+    }
+    /* tile 边长为棋盘格边长的偶数倍时，各 tile 从自己的左上角开始画的棋盘格与整幅画面的一致 */
+    int checker_period = 2 * options->render_options.checker_size;
+    if (options->tile_size <= 0 || options->tile_size % checker_period != 0 || options->tile_size > 16384)
+    {
+        printf("invalid tile: %d, must be a multiple of %d up to 16384\n", options->tile_size, checker_period);
+        return -1;
+    }
+    if (options->buffer_count < 2 || options->buffer_count > TILE_MAX_BUFFERS)
+    {
+        printf("invalid buffer count: %d\n", options->buffer_count);
+        return -1;
+    }
+
+    return 0;
+}
+
+/********************************************************************************/
+
+/* TIFF 文件头: 分块 (tile) 存储、不压缩的 8 位 RGB，tile 按行优先依次紧接着存放。
+ * 所有 tile 的偏移都可以预先算出，文件头一次写好，之后每个 tile 是一次连续写入。
+ * 文件超过 4GB 时使用 BigTIFF (64 位偏移)
+ */
+
+#define TIFF_SHORT 3
+#define TIFF_LONG 4
+#define TIFF_LONG8 16
+
+#define TIFF_ENTRY_COUNT 11
+/* 文件头之后的 tile 数据按页对齐 */
+#define TIFF_DATA_ALIGN 4096
+
+typedef struct tiff_builder
+{
+    uint8_t *data;
+    int big;
+    size_t entry_pos;
+    /* 放不进目录项的数组写在目录之后 */
+    size_t extra_pos;
+} tiff_builder_t;
+
+static
+void put_le(uint8_t *p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; ++i)
+    {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+/* 写入一个目录项，值为 first + i * step (i < count)，放得下时直接存放在目录项中 */
+static
+void tiff_add_entry(tiff_builder_t *b, uint16_t tag, uint16_t type, uint64_t count, uint64_t first, uint64_t step)
+{
+    int value_size = type == TIFF_SHORT ? 2 : type == TIFF_LONG ? 4 : 8;
+    int field_size = b->big ? 8 : 4;
+    uint8_t *entry = b->data + b->entry_pos;
+    put_le(entry, tag, 2);
+    put_le(entry + 2, type, 2);
+    put_le(entry + 4, count, field_size);
+
+    uint8_t *out = entry + 4 + field_size;
+    if (count * value_size > (uint64_t)field_size)
+    {
+        put_le(out, b->extra_pos, field_size);
+        out = b->data + b->extra_pos;
+        b->extra_pos += (size_t)count * value_size;
+        b->extra_pos = (b->extra_pos + 7) & ~(size_t)7;
+    }
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        put_le(out + i * value_size, first + i * step, value_size);
+    }
+    b->entry_pos += 4 + 2 * field_size;
+}
+
+/* 生成文件头，返回其大小即第一个 tile 的偏移，失败返回 0 */
+static
+uint64_t tiff_build_header(uint8_t **header, int w, int h, int tile_size, int tiles_x, int tiles_y)
+{
+    uint64_t tile_count = (uint64_t)tiles_x * tiles_y;
+    uint64_t tile_bytes = (uint64_t)tile_size * tile_size * 3;
+    /* 按 BigTIFF 估计上限: 头 16 字节，目录 8 + 20 * n + 8 字节，数组之间各有最多 7 字节的填充 */
+    uint64_t max_header = 16 + 8 + 20 * TIFF_ENTRY_COUNT + 8 + 8 + 2 * (tile_count * 8 + 8);
+    uint64_t data_offset = (max_header + TIFF_DATA_ALIGN - 1) / TIFF_DATA_ALIGN * TIFF_DATA_ALIGN;
+    int big = data_offset + tile_count * tile_bytes > 0xFFFFFFFFull;
+
+    uint8_t *data = (uint8_t*)calloc((size_t)data_offset, 1);
+    if (data == NULL)
+    {
+        return 0;
+    }
+    tiff_builder_t b;
+    b.data = data;
+    b.big = big;
+    data[0] = 'I';
+    data[1] = 'I';
+    if (big)
+    {
+        put_le(data + 2, 43, 2);
+        put_le(data + 4, 8, 2);
+        put_le(data + 6, 0, 2);
+        put_le(data + 8, 16, 8);
+        put_le(data + 16, TIFF_ENTRY_COUNT, 8);
+        b.entry_pos = 24;
+        b.extra_pos = b.entry_pos + 20 * TIFF_ENTRY_COUNT + 8;
+    }
+    else
+    {
+        put_le(data + 2, 42, 2);
+        put_le(data + 4, 8, 4);
+        put_le(data + 8, TIFF_ENTRY_COUNT, 2);
+        b.entry_pos = 10;
+        b.extra_pos = b.entry_pos + 12 * TIFF_ENTRY_COUNT + 4;
+    }
+
+    /* 目录项须按 tag 升序排列，下一个目录的偏移保持为 0 */
+    uint16_t offset_type = big ? TIFF_LONG8 : TIFF_LONG;
+    tiff_add_entry(&b, 256, TIFF_LONG, 1, (uint64_t)w, 0);          /* ImageWidth */
+    tiff_add_entry(&b, 257, TIFF_LONG, 1, (uint64_t)h, 0);          /* ImageLength */
+    tiff_add_entry(&b, 258, TIFF_SHORT, 3, 8, 0);                   /* BitsPerSample */
+    tiff_add_entry(&b, 259, TIFF_SHORT, 1, 1, 0);                   /* Compression: 无 */
+    tiff_add_entry(&b, 262, TIFF_SHORT, 1, 2, 0);                   /* PhotometricInterpretation: RGB */
+    tiff_add_entry(&b, 277, TIFF_SHORT, 1, 3, 0);                   /* SamplesPerPixel */
+    tiff_add_entry(&b, 284, TIFF_SHORT, 1, 1, 0);                   /* PlanarConfiguration: 交错 */
+    tiff_add_entry(&b, 322, TIFF_LONG, 1, (uint64_t)tile_size, 0);  /* TileWidth */
+    tiff_add_entry(&b, 323, TIFF_LONG, 1, (uint64_t)tile_size, 0);  /* TileLength */
+    tiff_add_entry(&b, 324, offset_type, tile_count, data_offset, tile_bytes); /* TileOffsets */
+    tiff_add_entry(&b, 325, offset_type, tile_count, tile_bytes, 0);           /* TileByteCounts */
+
+    *header = data;
+    return data_offset;
+}
+
+/********************************************************************************/
+
+/* 写入线程: 渲染线程从空闲列表取缓冲，渲染完成后放入写入队列; 写入线程按顺序取出写入文件后放回空闲列表。
+ * 缓冲全部在写入队列中时渲染线程等待，写入的速度跟不上时内存不会增长
+ */
+
+typedef struct tile_buffer
+{
+    uint8_t *pixel;
+    int tx;
+    int ty;
+} tile_buffer_t;
+
+typedef struct tile_writer
+{
+    FILE *fp;
+    int format;
+    int w;
+    int h;
+    int tile_size;
+    int tiles_x;
+    /* 像素数据在文件中的起始偏移 */
+    uint64_t data_offset;
+    /* BGRA 转换为 RGB 的缓冲，TIFF 为整个 tile，PPM 为一行 */
+    uint8_t *rgb;
+
+    tile_buffer_t buffers[TILE_MAX_BUFFERS];
+    int buffer_count;
+    int free_list[TILE_MAX_BUFFERS];
+    int free_count;
+    int queue[TILE_MAX_BUFFERS];
+    int queue_head;
+    int queue_count;
+    int quit;
+    int failed;
+
+    thread_handle_t thread;
+    thread_mutex_t mutex;
+    thread_cond_t queue_cond;
+    thread_cond_t free_cond;
+
+    uint64_t write_ns;
+    uint64_t write_bytes;
+} tile_writer_t;
+
+static tile_writer_t g_tile_writer;
+
+static
+int write_at(FILE *fp, uint64_t offset, const void *data, size_t size)
+{
+    if (file_seek(fp, offset) != 0 || fwrite(data, 1, size, fp) != size)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static
+int write_tile(tile_writer_t *writer, const tile_buffer_t *buffer)
+{
+    int tile_size = writer->tile_size;
+    int x0 = buffer->tx * tile_size;
+    int y0 = buffer->ty * tile_size;
+    if (writer->format == TILE_FORMAT_TIFF)
+    {
+        /* 右边和下边超出画面的部分同样写入，TIFF 的 tile 总是完整的 */
+        size_t pixel_count = (size_t)tile_size * tile_size;
+        for (size_t i = 0; i < pixel_count; ++i)
+        {
+            writer->rgb[i * 3] = buffer->pixel[i * 4 + 2];
+            writer->rgb[i * 3 + 1] = buffer->pixel[i * 4 + 1];
+            writer->rgb[i * 3 + 2] = buffer->pixel[i * 4];
+        }
+        uint64_t index = (uint64_t)buffer->ty * writer->tiles_x + buffer->tx;
+        writer->write_bytes += pixel_count * 3;
+        return write_at(writer->fp, writer->data_offset + index * pixel_count * 3, writer->rgb, pixel_count * 3);
+    }
+
+    /* PPM 按行存放，tile 的每一行写到该行在文件中的位置 */
+    int w = writer->w - x0 < tile_size ? writer->w - x0 : tile_size;
+    int h = writer->h - y0 < tile_size ? writer->h - y0 : tile_size;
+    for (int j = 0; j < h; ++j)
+    {
+        const uint8_t *row = buffer->pixel + (size_t)j * tile_size * 4;
+        for (int i = 0; i < w; ++i)
+        {
+            writer->rgb[i * 3] = row[i * 4 + 2];
+            writer->rgb[i * 3 + 1] = row[i * 4 + 1];
+            writer->rgb[i * 3 + 2] = row[i * 4];
+        }
+        uint64_t offset = writer->data_offset + ((uint64_t)(y0 + j) * writer->w + x0) * 3;
+        if (write_at(writer->fp, offset, writer->rgb, (size_t)w * 3) != 0)
+        {
+            return -1;
+        }
+    }
+    writer->write_bytes += (uint64_t)w * h * 3;
+    return 0;
+}
+
+#ifdef _WIN32
+static
+DWORD WINAPI writer_routine(LPVOID param)
+#else
+static
+void* writer_routine(void *param)
+#endif
+{
+    tile_writer_t *writer = (tile_writer_t*)param;
+    mutex_lock(&writer->mutex);
+    while (1)
+    {
+        while (writer->queue_count == 0 && !writer->quit)
+        {
+            cond_wait(&writer->queue_cond, &writer->mutex);
+        }
+        if (writer->queue_count == 0)
+        {
+            /* quit 之前提交的 tile 都已写完 */
+            break;
+        }
+        int index = writer->queue[writer->queue_head];
+        writer->queue_head = (writer->queue_head + 1) % TILE_MAX_BUFFERS;
+        --writer->queue_count;
+        int failed = writer->failed;
+        mutex_unlock(&writer->mutex);
+
+        if (!failed)
+        {
+            uint64_t ts1 = now_ns();
+            if (write_tile(writer, &writer->buffers[index]) != 0)
+            {
+                printf("writer_routine, failed to write tile (%d, %d)\n", writer->buffers[index].tx, writer->buffers[index].ty);
+                failed = 1;
+            }
+            writer->write_ns += now_ns() - ts1;
+        }
+
+        mutex_lock(&writer->mutex);
+        writer->failed |= failed;
+        writer->free_list[writer->free_count++] = index;
+        cond_broadcast(&writer->free_cond);
+    }
+    mutex_unlock(&writer->mutex);
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+static
+void free_writer_buffers(tile_writer_t *writer)
+{
+    for (int i = 0; i < writer->buffer_count; ++i)
+    {
+        free(writer->buffers[i].pixel);
+    }
+    free(writer->rgb);
+}
+
+static
+int tile_writer_open(const tile_options_t *options, int tiles_x, int tiles_y)
+{
+    tile_writer_t *writer = &g_tile_writer;
+    memset(writer, 0, sizeof(*writer));
+    writer->format = options->format;
+    writer->w = options->w;
+    writer->h = options->h;
+    writer->tile_size = options->tile_size;
+    writer->tiles_x = tiles_x;
+    writer->buffer_count = options->buffer_count;
+
+    size_t tile_pixels = (size_t)options->tile_size * options->tile_size;
+    int alloc_ok = 1;
+    for (int i = 0; i < writer->buffer_count; ++i)
+    {
+        writer->buffers[i].pixel = (uint8_t*)malloc(tile_pixels * 4);
+        alloc_ok = alloc_ok && writer->buffers[i].pixel != NULL;
+        writer->free_list[writer->free_count++] = i;
+    }
+    writer->rgb = (uint8_t*)malloc(options->format == TILE_FORMAT_TIFF ? tile_pixels * 3 : (size_t)options->tile_size * 3);
+    if (!alloc_ok || writer->rgb == NULL)
+    {
+        printf("tile_writer_open, out of memory\n");
+        free_writer_buffers(writer);
+        return -1;
+    }
+
+    uint8_t *header = NULL;
+    size_t header_size = 0;
+    if (options->format == TILE_FORMAT_TIFF)
+    {
+        writer->data_offset = tiff_build_header(&header, options->w, options->h, options->tile_size, tiles_x, tiles_y);
+        header_size = (size_t)writer->data_offset;
+    }
+    else
+    {
+        char text[64];
+        header_size = (size_t)snprintf(text, sizeof(text), "P6\n%d %d\n255\n", options->w, options->h);
+        header = (uint8_t*)malloc(header_size);
+        if (header != NULL)
+        {
+            memcpy(header, text, header_size);
+        }
+        writer->data_offset = header_size;
+    }
+    writer->fp = header != NULL ? fopen(options->output_file, "wb") : NULL;
+    if (writer->fp == NULL || write_at(writer->fp, 0, header, header_size) != 0)
+    {
+        printf("tile_writer_open, failed to create %s\n", options->output_file);
+        if (writer->fp != NULL)
+        {
+            fclose(writer->fp);
+        }
+        free(header);
+        free_writer_buffers(writer);
+        return -1;
+    }
+    free(header);
+
+    mutex_init(&writer->mutex);
+    cond_init(&writer->queue_cond);
+    cond_init(&writer->free_cond);
+#ifdef _WIN32
+    writer->thread = CreateThread(NULL, 0, writer_routine, (LPVOID)writer, 0, NULL);
+    if (writer->thread == NULL)
+#else
+    if (pthread_create(&writer->thread, NULL, writer_routine, (void*)writer) != 0)
+#endif
+    {
+        printf("tile_writer_open, failed to create the writer thread\n");
+        cond_destroy(&writer->free_cond);
+        cond_destroy(&writer->queue_cond);
+        mutex_destroy(&writer->mutex);
+        fclose(writer->fp);
+        free_writer_buffers(writer);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* 取一个空闲的缓冲，写入线程出错时返回 NULL */
+static
+tile_buffer_t* tile_writer_acquire(void)
+{
+    tile_writer_t *writer = &g_tile_writer;
+    tile_buffer_t *buffer = NULL;
+    mutex_lock(&writer->mutex);
+    while (writer->free_count == 0 && !writer->failed)
+    {
+        cond_wait(&writer->free_cond, &writer->mutex);
+    }
+    if (!writer->failed)
+    {
+        buffer = &writer->buffers[writer->free_list[--writer->free_count]];
+    }
+    mutex_unlock(&writer->mutex);
+    return buffer;
+}
+
+static
+void tile_writer_submit(tile_buffer_t *buffer, int tx, int ty)
+{
+    tile_writer_t *writer = &g_tile_writer;
+    buffer->tx = tx;
+    buffer->ty = ty;
+    mutex_lock(&writer->mutex);
+    int tail = (writer->queue_head + writer->queue_count) % TILE_MAX_BUFFERS;
+    writer->queue[tail] = (int)(buffer - writer->buffers);
+    ++writer->queue_count;
+    cond_broadcast(&writer->queue_cond);
+    mutex_unlock(&writer->mutex);
+}
+
+/* 不提交而放回缓冲 */
+static
+void tile_writer_release(tile_buffer_t *buffer)
+{
+    tile_writer_t *writer = &g_tile_writer;
+    mutex_lock(&writer->mutex);
+    writer->free_list[writer->free_count++] = (int)(buffer - writer->buffers);
+    mutex_unlock(&writer->mutex);
+}
+
+/* 等待队列中的 tile 写完并关闭文件 */
+static
+int tile_writer_close(void)
+{
+    tile_writer_t *writer = &g_tile_writer;
+    mutex_lock(&writer->mutex);
+    writer->quit = 1;
+    cond_broadcast(&writer->queue_cond);
+    mutex_unlock(&writer->mutex);
+#ifdef _WIN32
+    WaitForSingleObject(writer->thread, INFINITE);
+    CloseHandle(writer->thread);
+#else
+    pthread_join(writer->thread, NULL);
+#endif
+
+    int ret = writer->failed ? -1 : 0;
+    if (fclose(writer->fp) != 0)
+    {
+        printf("tile_writer_close, failed to close the output file\n");
+        ret = -1;
+    }
+    cond_destroy(&writer->free_cond);
+    cond_destroy(&writer->queue_cond);
+    mutex_destroy(&writer->mutex);
+    free_writer_buffers(writer);
+    return ret;
+}
+
+/********************************************************************************/
+
+static
+int render_tiles(const tile_options_t *options, const render_backend_t *backend, const project_camera_t *base_camera)
+{
+    int tile_size = options->tile_size;
+    int tiles_x = (options->w + tile_size - 1) / tile_size;
+    int tiles_y = (options->h + tile_size - 1) / tile_size;
+    if (tile_writer_open(options, tiles_x, tiles_y) != 0)
+    {
+        return -1;
+    }
+
+    printf("rendering %dx%d as %dx%d tiles of %d, backend %s, %d buffers (%.1f MB)\n",
+        options->w, options->h, tiles_x, tiles_y, tile_size, backend->name, options->buffer_count,
+        (double)options->buffer_count * tile_size * tile_size * 4 / (1 << 20));
+
+    int ret = 0;
+    uint64_t render_ns = 0;
+    uint64_t stall_ns = 0;
+    uint64_t ts1 = now_ns();
+    for (int ty = 0; ty < tiles_y && ret == 0; ++ty)
+    {
+        for (int tx = 0; tx < tiles_x; ++tx)
+        {
+            uint64_t ts2 = now_ns();
+            tile_buffer_t *buffer = tile_writer_acquire();
+            stall_ns += now_ns() - ts2;
+            if (buffer == NULL)
+            {
+                ret = -1;
+                break;
+            }
+
+            /* 边缘的 tile 同样按完整大小渲染，设备的画面尺寸始终不变 */
+            project_camera_t camera = *base_camera;
+            project_camera_set_window(&camera, options->w, options->h, tx * tile_size, ty * tile_size, tile_size, tile_size);
+            backend->set_camera(&camera);
+            uint64_t elapsed_ns = 0;
+            if (backend->render_region(buffer->pixel, tile_size, tile_size, tile_size * 4, 0, tile_size) != 0 ||
+                backend->wait(&elapsed_ns) != 0)
+            {
+                printf("render_tiles, %s failed on tile (%d, %d)\n", backend->name, tx, ty);
+                tile_writer_release(buffer);
+                ret = -1;
+                break;
+            }
+            render_ns += elapsed_ns;
+            tile_writer_submit(buffer, tx, ty);
+        }
+        printf("tile row %d / %d done, %.1fs\n", ty + 1, tiles_y, (now_ns() - ts1) / 1e9);
+    }
+    if (tile_writer_close() != 0)
+    {
+        ret = -1;
+    }
+    double total_s = (now_ns() - ts1) / 1e9;
+
+    const tile_writer_t *writer = &g_tile_writer;
+    printf("tiles: %d, total %.3fs, %.2f Mpixels/s, render %.3fs, write %.3fs (%.1f MB/s), waited for buffers %.3fs\n",
+        tiles_x * tiles_y, total_s, total_s > 0 ? (double)options->w * options->h / 1e6 / total_s : 0.0,
+        render_ns / 1e9, writer->write_ns / 1e9,
+        writer->write_ns > 0 ? writer->write_bytes / (1024.0 * 1024.0) / (writer->write_ns / 1e9) : 0.0,
+        stall_ns / 1e9);
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    tile_options_t options;
+    if (parse_options(&options, argc, argv) != 0)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    /* 各 backend 不再打印每次渲染的耗时 */
+    g_render_verbose = 0;
+
+    scene_t scene;
+    project_camera_t camera;
+    setup_project_camera(&camera);
+    if (options.scene_file != NULL ? scene_load_file(&scene, &camera, options.scene_file) < 0 :
+        setup_scene(&scene, options.random_sphere_count) != 0)
+    {
+        printf("failed to build the scene\n");
+        return 1;
+    }
+
+    const render_backend_t *backend = NULL;
+    if (strcmp(options.backend, "opencl") == 0)
+    {
+        backend = &g_cl_render_backend;
+    }
+    else if (strcmp(options.backend, "soft") == 0)
+    {
+        thread_pool_init(options.thread_count);
+        soft_simd_init();
+        backend = &g_soft_render_backend;
+    }
+    else
+    {
+        printf("unknown backend: %s\n", options.backend);
+        scene_uninit(&scene);
+        return 1;
+    }
+
+    int ret = -1;
+    if (backend->init(options.cl_source_file, options.tile_size, options.tile_size) == 0)
+    {
+        backend->set_scene(&scene);
+        if (backend->set_options(&options.render_options) == 0 && backend->set_pixel_step(1) == 0)
+        {
+            ret = render_tiles(&options, backend, &camera);
+        }
+        backend->uninit();
+    }
+    else
+    {
+        printf("%s init failed\n", backend->name);
+    }
+    if (strcmp(options.backend, "soft") == 0)
+    {
+        thread_pool_uninit();
+    }
+    scene_uninit(&scene);
+
+    return ret == 0 ? 0 : 1;
+}
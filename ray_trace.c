@@ -1,94 +1,1066 @@
 
+#include "common.h"
+#include "render.h"
+#include "thread_pool.h"
+#include "profiler.h"
+#include "thread_compat.h"
+
 #include <SDL2/SDL.h>
 
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/********************************************************************************/
+
+static
+int view_gradient_soft(uint8_t* pixel, int w, int h, int pitch)
+{
+    render_gradient_soft(pixel, w, h, pitch);
+    return 0;
+}
+
+static
+int view_depth_soft(uint8_t* pixel, int w, int h, int pitch)
+{
+    render_project_depth_soft(pixel, w, h, pitch);
+    return 0;
+}
+
+static
+int view_depth_soft_mt(uint8_t* pixel, int w, int h, int pitch)
+{
+    render_project_depth_soft_mt(pixel, w, h, pitch);
+    return 0;
+}
+
+static
+int view_depth_soft_simd(uint8_t* pixel, int w, int h, int pitch)
+{
+    render_project_depth_soft_simd(pixel, w, h, pitch);
+    return 0;
+}
+
+static
+int view_depth_soft_wavefront(uint8_t* pixel, int w, int h, int pitch)
+{
+    render_project_depth_soft_wavefront(pixel, w, h, pitch);
+    return 0;
+}
+
+/* 交互窗口中可选的渲染方式，按数字键 1 ~ 9、0 切换前 10 个，Tab 依次切换 */
+typedef struct view_backend
+{
+    const char *name;
+    /* 1 为 cl_render.c 的单设备渲染，2 为 cl_multi_render.c 的多设备渲染 */
+    int need_opencl;
+    /* 是否使用摄像机，只有这类渲染方式才做渐进式的预览 */
+    int use_camera;
+    /* 流水线渲染返回的是之前提交的帧，返回 1 表示本次没有输出 */
+    int pipelined;
+    int (*render)(uint8_t* pixel, int w, int h, int pitch);
+    void (*aa_stats)(render_aa_stats_t *stats);
+    /* wavefront 渲染的光线统计，其他渲染方式为 NULL */
+    void (*wavefront_stats)(render_wavefront_stats_t *stats);
+    /* 混合渲染的分割统计，其他渲染方式为 NULL */
+    void (*hybrid_stats)(render_hybrid_stats_t *stats);
+} view_backend_t;
+
+static const view_backend_t g_view_backends[] =
+{
+    {"gradient_soft", 0, 0, 0, view_gradient_soft, NULL, NULL, NULL},
+    {"gradient_opencl", 1, 0, 0, render_gradient_opencl, NULL, NULL, NULL},
+    {"depth_soft", 0, 1, 0, view_depth_soft, soft_render_antialias_stats, NULL, NULL},
+    {"depth_opencl", 1, 1, 0, render_project_depth_opencl, cl_render_antialias_stats, NULL, NULL},
+    {"depth_soft_mt", 0, 1, 0, view_depth_soft_mt, soft_render_antialias_stats, NULL, NULL},
+    {"depth_soft_simd", 0, 1, 0, view_depth_soft_simd, soft_render_antialias_stats, NULL, NULL},
+    {"depth_opencl_pipelined", 1, 1, 1, render_project_depth_opencl_pipelined, cl_render_antialias_stats, NULL, NULL},
+    {"depth_soft_wavefront", 0, 1, 0, view_depth_soft_wavefront, NULL, soft_render_wavefront_stats, NULL},
+    {"depth_opencl_wavefront", 1, 1, 0, render_project_depth_opencl_wavefront, NULL, cl_render_wavefront_stats, NULL},
+    {"depth_hybrid", 1, 1, 0, render_project_depth_hybrid, NULL, NULL, hybrid_render_stats},
+    {"depth_opencl_multi", 2, 1, 0, render_project_depth_opencl_multi, NULL, NULL, NULL},
+};
+
+#define VIEW_BACKEND_COUNT ((int)(sizeof(g_view_backends) / sizeof(g_view_backends[0])))
+
+/* 摄像机移动速度，影像平面上一个像素为一个单位 */
+#define VIEW_MOVE_SPEED 200.0f
+#define VIEW_WHEEL_STEP 20.0f
+/* 摄像机不穿过默认场景所在的 z = 0 平面 */
+#define VIEW_MIN_EYE_Z 1.0f
+
+/* 移动时预览帧的目标耗时，据此在 2 ~ RENDER_MAX_PIXEL_STEP 之间调整预览的 pixel_step */
+#define VIEW_PREVIEW_TARGET_MS 16.0
+#define VIEW_STATS_INTERVAL_NS 500000000ull
 
-extern int init_cl_rendler(const char *ocl_source_file, int w, int h);
-extern void uninit_cl_render(void);
-extern int render_gradient_opencl(uint8_t* pixel, int w, int h, int pitch);
-extern int render_project_depth_opencl(uint8_t* pixel, int w, int h, int pitch);
+/* M 键切换的编辑演示: 一个 sphere 沿 x 轴来回移动，每帧提交变化并增量渲染 */
+#define VIEW_ANIM_AMPLITUDE 80.0f
+#define VIEW_ANIM_SPEED 2.0f
 
-extern void render_gradient_soft(uint8_t* pixel, int w, int h, int pitch);
-extern void render_project_depth_soft(uint8_t* pixel, int w, int h, int pitch);
+/* 开启性能分析时 trace 保留的事件数，约为最近几千帧 */
+#define VIEW_PROFILE_EVENTS (1 << 18)
+
+/* 三个主机帧缓冲: 渲染线程写 back，窗口线程显示 front，最近完成的一帧放在 ready 中，
+ * 双方各自用一次原子交换把手中的缓冲与 ready 对调，互不等待
+ */
+#define VIEW_FRAME_COUNT 3
+/* ready 的下标或上此标志表示该帧完成之后还没有被窗口线程取走 */
+#define VIEW_FRAME_FRESH 4
+
+/* 请求重新渲染的方式，多次请求合并时取较大的一个 */
+#define VIEW_RESTART_NONE 0
+#define VIEW_RESTART_FULL 1
+#define VIEW_RESTART_PREVIEW 2
+
+/* 帧节奏和延迟的统计，每 VIEW_STATS_INTERVAL_NS 刷新一次窗口标题 */
+typedef struct view_stats
+{
+    uint64_t window_start_ns;
+    uint64_t last_present_ns;
+    int frame_count;
+    uint64_t interval_sum_ns;
+    uint64_t interval_max_ns;
+    uint64_t latency_sum_ns;
+    uint64_t latency_max_ns;
+    /* 显示时输入或设置已经改变的帧 */
+    int stale_count;
+    /* 统计开始时渲染线程的丢弃计数 */
+    long dropped_base;
+} view_stats_t;
+
+/* 窗口线程提交给渲染线程的设置，两边各有一份，提交时整体复制 */
+typedef struct view_request
+{
+    int backend;
+    render_options_t render_options;
+    /* 抗锯齿每边的采样数，1 为关闭 */
+    int aa_grid;
+    /* wavefront 渲染的反射次数 */
+    int bounces;
+    project_camera_t camera;
+    int animate;
+    /* 每次提交加一，输出的帧记录开始渲染时的序号 */
+    uint64_t generation;
+    /* 以下在渲染线程取走请求之后清零 */
+    int restart;
+    int moving;
+    int quit;
+} view_request_t;
+
+typedef struct view_frame
+{
+    uint8_t *pixel;
+    uint64_t submit_ns;
+    uint64_t generation;
+    int pixel_step;
+    int backend;
+    int aa_grid;
+    int bounces;
+    /* 渲染完成时各渲染方式的统计，窗口线程只读取帧中的副本 */
+    render_aa_stats_t aa_stats;
+    render_wavefront_stats_t wavefront_stats;
+    render_hybrid_stats_t hybrid_stats;
+} view_frame_t;
+
+typedef struct view_renderer
+{
+    thread_handle_t thread;
+    thread_mutex_t mutex;
+    thread_cond_t cond;
+    /* 最新提交的请求，由 mutex 保护 */
+    view_request_t request;
+    /* 完成一帧时推送给窗口线程的 SDL 事件，把它从等待输入中唤醒 */
+    Uint32 wake_event;
+
+    view_frame_t frames[VIEW_FRAME_COUNT];
+    int w;
+    int h;
+    int pitch;
+    volatile long ready;
+    /* 放入 ready 时上一帧仍未被取走、因而没有显示过的帧数 */
+    volatile long dropped_count;
+
+    /* 以下只由渲染线程访问 */
+    int opencl_ready;
+    int multi_ready;
+    scene_t *scene;
+    int back;
+    /* 最近放入 ready 的帧，-1 表示还没有 */
+    int last;
+    /* 已生效的设置 */
+    view_request_t current;
+
+    /* 下一帧使用的 pixel_step，0 表示画面已经是完整分辨率，不需要再渲染 */
+    int pending_step;
+    int preview_step;
+    int moving;
+
+    /* 编辑演示移动的 sphere 及其初始位置 */
+    int anim_sphere;
+    point_t anim_origin;
+    float anim_phase;
+    uint64_t anim_ns;
+    /* 提交过场景变化，下一帧可能增量渲染 */
+    int scene_changed;
+
+    /* 流水线中已提交、尚未输出的帧的提交时刻、pixel_step 和请求序号，按提交顺序排列 */
+    uint64_t submit_ns[4];
+    int submit_step[4];
+    uint64_t submit_generation[4];
+    int in_flight_count;
+} view_renderer_t;
+
+static view_renderer_t g_view_renderer;
 
 /********************************************************************************/
 
+/* 渲染线程: 执行所有的渲染和场景修改，完成的帧放入 ready */
+
+static
+void publish_frame(view_renderer_t *renderer, uint64_t submit_ns, int pixel_step, uint64_t generation)
+{
+    const view_backend_t *backend = &g_view_backends[renderer->current.backend];
+    view_frame_t *frame = &renderer->frames[renderer->back];
+    frame->submit_ns = submit_ns;
+    frame->generation = generation;
+    frame->pixel_step = pixel_step;
+    frame->backend = renderer->current.backend;
+    frame->aa_grid = renderer->current.aa_grid;
+    frame->bounces = renderer->current.bounces;
+    if (backend->aa_stats != NULL && frame->aa_grid > 1)
+    {
+        backend->aa_stats(&frame->aa_stats);
+    }
+    if (backend->wavefront_stats != NULL)
+    {
+        backend->wavefront_stats(&frame->wavefront_stats);
+    }
+    if (backend->hybrid_stats != NULL)
+    {
+        backend->hybrid_stats(&frame->hybrid_stats);
+    }
+
+    /* 交换同时发布帧的内容和以上的信息 */
+    long prev = atomic_exchange_long(&renderer->ready, renderer->back | VIEW_FRAME_FRESH);
+    renderer->last = renderer->back;
+    renderer->back = (int)(prev & ~VIEW_FRAME_FRESH);
+    if (prev & VIEW_FRAME_FRESH)
+    {
+        atomic_add_long(&renderer->dropped_count, 1);
+    }
+    else
+    {
+        /* 上一帧已被取走，窗口线程可能在等待输入; 否则已有一个唤醒事件尚未处理 */
+        SDL_Event event;
+        memset(&event, 0, sizeof(event));
+        event.type = renderer->wake_event;
+        SDL_PushEvent(&event);
+    }
+}
+
+/* 输出流水线中尚未取回的帧，切换渲染方式或着色方式之前调用 */
+static
+void drain_pipeline(view_renderer_t *renderer)
+{
+    if (renderer->in_flight_count == 0)
+    {
+        return;
+    }
+
+    int ret = cl_render_pipeline_flush(renderer->frames[renderer->back].pixel, renderer->pitch);
+    if (ret == 0)
+    {
+        int last = renderer->in_flight_count - 1;
+        publish_frame(renderer, renderer->submit_ns[last], renderer->submit_step[last], renderer->submit_generation[last]);
+    }
+    renderer->in_flight_count = 0;
+}
+
+static
+void render_frame(view_renderer_t *renderer, int pixel_step)
+{
+    const view_backend_t *backend = &g_view_backends[renderer->current.backend];
+    if (backend->use_camera)
+    {
+        soft_render_set_pixel_step(pixel_step);
+        if (renderer->opencl_ready)
+        {
+            cl_render_set_pixel_step(pixel_step);
+        }
+        if (renderer->multi_ready)
+        {
+            cl_multi_render_set_pixel_step(pixel_step);
+        }
+    }
+    else
+    {
+        pixel_step = 1;
+    }
+
+    /* 增量渲染只重新渲染 dirty tile，其余像素须是上一帧的输出，而 back 是更早的一帧 */
+    uint8_t *pixel = renderer->frames[renderer->back].pixel;
+    if (renderer->scene_changed && renderer->last >= 0)
+    {
+        uint64_t span = profiler_begin();
+        memcpy(pixel, renderer->frames[renderer->last].pixel, (size_t)renderer->pitch * renderer->h);
+        profiler_end("frame copy", "frame", span);
+    }
+    renderer->scene_changed = 0;
+
+    uint64_t submit_ns = now_ns();
+    uint64_t generation = renderer->current.generation;
+    uint64_t span = profiler_begin();
+    int ret = backend->render(pixel, renderer->w, renderer->h, renderer->pitch);
+    profiler_end(backend->name, "frame", span);
+    if (ret < 0)
+    {
+        return;
+    }
+
+    if (!backend->pipelined)
+    {
+        publish_frame(renderer, submit_ns, pixel_step, generation);
+        return;
+    }
+
+    /* 输出的是最早提交的一帧 */
+    if (ret == 0)
+    {
+        publish_frame(renderer, renderer->submit_ns[0], renderer->submit_step[0], renderer->submit_generation[0]);
+        for (int i = 1; i < renderer->in_flight_count; ++i)
+        {
+            renderer->submit_ns[i - 1] = renderer->submit_ns[i];
+            renderer->submit_step[i - 1] = renderer->submit_step[i];
+            renderer->submit_generation[i - 1] = renderer->submit_generation[i];
+        }
+        renderer->in_flight_count--;
+    }
+    renderer->submit_ns[renderer->in_flight_count] = submit_ns;
+    renderer->submit_step[renderer->in_flight_count] = pixel_step;
+    renderer->submit_generation[renderer->in_flight_count] = generation;
+    renderer->in_flight_count++;
+}
+
+static
+void apply_camera(view_renderer_t *renderer, const project_camera_t *camera)
+{
+    soft_render_set_camera(camera);
+    if (renderer->opencl_ready)
+    {
+        cl_render_set_camera(camera);
+    }
+    if (renderer->multi_ready)
+    {
+        cl_multi_render_set_camera(camera);
+    }
+}
+
+/* 按请求中与已生效的设置不同的部分修改各渲染实现 */
+static
+void apply_request(view_renderer_t *renderer, const view_request_t *request)
+{
+    view_request_t *current = &renderer->current;
+    if (request->backend != current->backend)
+    {
+        drain_pipeline(renderer);
+        /* 帧缓冲中是之前的渲染实现的输出 */
+        soft_render_invalidate_frame();
+        current->backend = request->backend;
+    }
+    if (memcmp(&request->render_options, &current->render_options, sizeof(request->render_options)) != 0)
+    {
+        /* OpenCL 切换变体时会丢弃流水线中的帧 */
+        drain_pipeline(renderer);
+        soft_render_set_options(&request->render_options);
+        if (renderer->opencl_ready)
+        {
+            cl_render_set_options(&request->render_options);
+        }
+        if (renderer->multi_ready)
+        {
+            cl_multi_render_set_options(&request->render_options);
+        }
+    }
+    if (request->aa_grid != current->aa_grid)
+    {
+        soft_render_set_antialias(request->aa_grid);
+        if (renderer->opencl_ready)
+        {
+            cl_render_set_antialias(request->aa_grid);
+        }
+    }
+    if (request->bounces != current->bounces)
+    {
+        soft_render_set_bounces(request->bounces);
+        if (renderer->opencl_ready)
+        {
+            cl_render_set_bounces(request->bounces);
+        }
+    }
+    if (memcmp(&request->camera, &current->camera, sizeof(request->camera)) != 0)
+    {
+        apply_camera(renderer, &request->camera);
+    }
+    *current = *request;
+
+    if (request->restart == VIEW_RESTART_PREVIEW && g_view_backends[current->backend].use_camera)
+    {
+        renderer->pending_step = renderer->preview_step;
+    }
+    else if (request->restart != VIEW_RESTART_NONE)
+    {
+        renderer->pending_step = 1;
+    }
+    renderer->moving = request->moving;
+}
+
+/* 移动 sphere 之后重新计算 BVH 的包围盒，并把移动前后的位置提交给各渲染实现 */
+static
+void animate_sphere(view_renderer_t *renderer)
+{
+    uint64_t ts = now_ns();
+    float dt = renderer->anim_ns != 0 ? (ts - renderer->anim_ns) / 1e9f : 0.0f;
+    renderer->anim_ns = ts;
+    /* 长时间停顿之后不按停顿的时长移动 */
+    if (dt > 0.1f)
+    {
+        dt = 0.1f;
+    }
+
+    /* 流水线中的帧可能仍在上传场景数据 */
+    if (g_view_backends[renderer->current.backend].pipelined)
+    {
+        drain_pipeline(renderer);
+    }
+
+    sphere_t *sphere = &renderer->scene->spheres[renderer->anim_sphere];
+    render_change_t change;
+    change.old_center = sphere->center;
+    change.old_radius = sphere->radius;
+    renderer->anim_phase += VIEW_ANIM_SPEED * dt;
+    sphere->center.x = renderer->anim_origin.x + VIEW_ANIM_AMPLITUDE * sinf(renderer->anim_phase);
+    change.new_center = sphere->center;
+    change.new_radius = sphere->radius;
+    scene_refit_bvh(renderer->scene);
+
+    soft_render_scene_changed(&change, 1);
+    if (renderer->opencl_ready)
+    {
+        cl_render_scene_changed(&change, 1);
+    }
+    if (renderer->multi_ready)
+    {
+        cl_multi_render_scene_changed();
+    }
+    renderer->scene_changed = 1;
+    if (renderer->pending_step == 0)
+    {
+        renderer->pending_step = 1;
+    }
+}
+
+#ifdef _WIN32
+static
+DWORD WINAPI render_routine(LPVOID param)
+#else
+static
+void* render_routine(void *param)
+#endif
+{
+    view_renderer_t *renderer = (view_renderer_t*)param;
+    while (1)
+    {
+        /* 画面已经完整、流水线已清空且没有新的请求时等待。
+         * 编辑演示每一帧都有变化，等上一帧被取走之后再移动，否则增量渲染远快于显示，多出的帧都被丢弃;
+         * 不使用摄像机的渲染方式不做编辑演示，照常等待
+         */
+        mutex_lock(&renderer->mutex);
+        int animating = renderer->current.animate && g_view_backends[renderer->current.backend].use_camera;
+        while (!renderer->request.quit && renderer->request.generation == renderer->current.generation &&
+            renderer->pending_step == 0 && renderer->in_flight_count == 0 &&
+            !(animating && !(atomic_load_long(&renderer->ready) & VIEW_FRAME_FRESH)))
+        {
+            cond_wait(&renderer->cond, &renderer->mutex);
+        }
+        view_request_t request = renderer->request;
+        renderer->request.restart = VIEW_RESTART_NONE;
+        renderer->request.moving = 0;
+        mutex_unlock(&renderer->mutex);
+        if (request.quit)
+        {
+            break;
+        }
+
+        if (request.generation != renderer->current.generation)
+        {
+            apply_request(renderer, &request);
+        }
+        int use_camera = g_view_backends[renderer->current.backend].use_camera;
+        if (renderer->current.animate && use_camera)
+        {
+            animate_sphere(renderer);
+        }
+        else
+        {
+            renderer->anim_ns = 0;
+        }
+
+        if (renderer->pending_step > 0)
+        {
+            /* 移动时以较大的 pixel_step 预览，停止之后每帧减半，直到完整分辨率 */
+            int pixel_step = renderer->pending_step;
+            uint64_t render_ts1 = now_ns();
+            render_frame(renderer, pixel_step);
+            double render_ms = (now_ns() - render_ts1) / 1e6;
+            renderer->pending_step = pixel_step / 2;
+
+            /* 流水线渲染时 render_ms 包含等待最早一帧的时间，即稳定状态下的帧间隔 */
+            if (renderer->moving && use_camera)
+            {
+                if (render_ms > VIEW_PREVIEW_TARGET_MS && renderer->preview_step < RENDER_MAX_PIXEL_STEP)
+                {
+                    renderer->preview_step *= 2;
+                }
+                else if (render_ms < VIEW_PREVIEW_TARGET_MS / 4 && renderer->preview_step > 2)
+                {
+                    renderer->preview_step /= 2;
+                }
+            }
+            renderer->moving = 0;
+        }
+        else if (renderer->in_flight_count > 0)
+        {
+            /* 完整分辨率的帧已经提交，取回流水线中剩余的帧 */
+            drain_pipeline(renderer);
+        }
+    }
+
+    drain_pipeline(renderer);
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+static
+void free_frames(view_renderer_t *renderer)
+{
+    for (int i = 0; i < VIEW_FRAME_COUNT; ++i)
+    {
+        free(renderer->frames[i].pixel);
+        renderer->frames[i].pixel = NULL;
+    }
+}
+
+/* 分配帧缓冲并启动渲染线程，initial 为初始的设置，之后由 post_request() 修改 */
+static
+int view_renderer_start(view_renderer_t *renderer, int w, int h, const view_request_t *initial)
+{
+    renderer->w = w;
+    renderer->h = h;
+    renderer->pitch = w * 4;
+    for (int i = 0; i < VIEW_FRAME_COUNT; ++i)
+    {
+        renderer->frames[i].pixel = (uint8_t*)calloc((size_t)renderer->pitch * h, 1);
+        if (renderer->frames[i].pixel == NULL)
+        {
+            printf("view_renderer_start, alloc failed, %dx%d\n", w, h);
+            free_frames(renderer);
+            return -1;
+        }
+    }
+    renderer->back = 0;
+    renderer->ready = 1;
+    renderer->last = -1;
+    renderer->dropped_count = 0;
+
+    renderer->request = *initial;
+    renderer->current = *initial;
+    /* 第一次请求时选择渲染方式并设置摄像机 */
+    renderer->current.backend = -1;
+    memset(&renderer->current.camera, 0, sizeof(renderer->current.camera));
+    renderer->current.generation = initial->generation - 1;
+    renderer->pending_step = 0;
+    renderer->preview_step = 4;
+    renderer->in_flight_count = 0;
+
+    mutex_init(&renderer->mutex);
+    cond_init(&renderer->cond);
+#ifdef _WIN32
+    renderer->thread = CreateThread(NULL, 0, render_routine, (LPVOID)renderer, 0, NULL);
+    if (renderer->thread == NULL)
+#else
+    if (pthread_create(&renderer->thread, NULL, render_routine, (void*)renderer) != 0)
+#endif
+    {
+        printf("view_renderer_start, failed to create the render thread\n");
+        cond_destroy(&renderer->cond);
+        mutex_destroy(&renderer->mutex);
+        free_frames(renderer);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* 等待当前的一帧渲染完成，清空流水线之后结束渲染线程 */
+static
+void view_renderer_stop(view_renderer_t *renderer)
+{
+    mutex_lock(&renderer->mutex);
+    renderer->request.quit = 1;
+    cond_broadcast(&renderer->cond);
+    mutex_unlock(&renderer->mutex);
+#ifdef _WIN32
+    WaitForSingleObject(renderer->thread, INFINITE);
+    CloseHandle(renderer->thread);
+#else
+    pthread_join(renderer->thread, NULL);
+#endif
+    cond_destroy(&renderer->cond);
+    mutex_destroy(&renderer->mutex);
+    free_frames(renderer);
+}
+
+/********************************************************************************/
+
+/* 窗口线程: 处理输入、提交请求，并把最新完成的帧经 SDL texture 显示出来 */
+
+typedef struct view_state
+{
+    SDL_Window *window;
+    SDL_Renderer *sdl_renderer;
+    SDL_Texture *texture;
+    int opencl_ready;
+    int multi_ready;
+
+    /* 窗口线程一侧的设置，修改之后经 post_request() 整体提交 */
+    view_request_t settings;
+    project_camera_t home_camera;
+
+    /* 正在显示的帧，shown 为 0 时还没有取到过帧 */
+    int front;
+    int shown;
+
+    view_stats_t stats;
+} view_state_t;
+
+static
+void post_request(view_state_t *state, int restart, int moving)
+{
+    view_renderer_t *renderer = &g_view_renderer;
+    state->settings.generation++;
+    mutex_lock(&renderer->mutex);
+    /* 渲染线程还没有取走的上一次请求与本次合并 */
+    int pending_restart = renderer->request.restart;
+    int pending_moving = renderer->request.moving;
+    renderer->request = state->settings;
+    renderer->request.restart = restart > pending_restart ? restart : pending_restart;
+    renderer->request.moving = moving || pending_moving;
+    cond_broadcast(&renderer->cond);
+    mutex_unlock(&renderer->mutex);
+}
+
+static
+void update_title(view_state_t *state)
+{
+    const view_backend_t *backend = &g_view_backends[state->settings.backend];
+    /* 切换之后还没有新的帧时只显示名称 */
+    const view_frame_t *frame = NULL;
+    if (state->shown && g_view_renderer.frames[state->front].backend == state->settings.backend)
+    {
+        frame = &g_view_renderer.frames[state->front];
+    }
+    view_stats_t *stats = &state->stats;
+    int shown_step = frame != NULL ? frame->pixel_step : 1;
+    char title[384];
+    int len;
+    if (stats->frame_count > 0)
+    {
+        double avg_interval_ms = stats->interval_sum_ns / 1e6 / stats->frame_count;
+        long dropped = atomic_load_long(&g_view_renderer.dropped_count) - stats->dropped_base;
+        len = snprintf(title, sizeof(title), "%s | step %d | %.1f fps, frame %.1fms (max %.1fms) | latency %.1fms (max %.1fms) | dropped %ld, stale %d",
+            backend->name, shown_step,
+            avg_interval_ms > 0 ? 1000.0 / avg_interval_ms : 0.0, avg_interval_ms, stats->interval_max_ns / 1e6,
+            stats->latency_sum_ns / 1e6 / stats->frame_count, stats->latency_max_ns / 1e6, dropped, stats->stale_count);
+    }
+    else
+    {
+        len = snprintf(title, sizeof(title), "%s | step %d | idle", backend->name, shown_step);
+    }
+    if (frame != NULL && backend->aa_stats != NULL && frame->aa_grid > 1 && len > 0 && len < (int)sizeof(title))
+    {
+        const render_aa_stats_t *aa_stats = &frame->aa_stats;
+        snprintf(title + len, sizeof(title) - len, " | aa %dx%d, %.1f%% edges, %.2f spp", frame->aa_grid, frame->aa_grid,
+            aa_stats->pixel_count > 0 ? 100.0 * aa_stats->edge_pixel_count / aa_stats->pixel_count : 0.0,
+            aa_stats->pixel_count > 0 ? (double)aa_stats->sample_count / aa_stats->pixel_count : 0.0);
+    }
+    if (frame != NULL && backend->wavefront_stats != NULL && len > 0 && len < (int)sizeof(title))
+    {
+        const render_wavefront_stats_t *wf_stats = &frame->wavefront_stats;
+        snprintf(title + len, sizeof(title) - len, " | bounces %d, %.2f rays per pixel", frame->bounces,
+            wf_stats->pixel_count > 0 ? (double)wf_stats->ray_count / wf_stats->pixel_count : 0.0);
+    }
+    if (frame != NULL && backend->hybrid_stats != NULL && len > 0 && len < (int)sizeof(title))
+    {
+        const render_hybrid_stats_t *hybrid_stats = &frame->hybrid_stats;
+        snprintf(title + len, sizeof(title) - len, " | split %d, device %.1fms, cpu %.1fms", hybrid_stats->split_row,
+            hybrid_stats->device_ms, hybrid_stats->host_ms);
+    }
+    SDL_SetWindowTitle(state->window, title);
+}
+
+static
+void reset_stats(view_state_t *state, uint64_t ts)
+{
+    view_stats_t *stats = &state->stats;
+    memset(stats, 0, sizeof(*stats));
+    stats->window_start_ns = ts;
+    stats->last_present_ns = ts;
+    stats->dropped_base = atomic_load_long(&g_view_renderer.dropped_count);
+}
+
+/* 渲染线程完成了新的一帧时与之交换，返回 1 */
+static
+int take_frame(view_state_t *state)
+{
+    view_renderer_t *renderer = &g_view_renderer;
+    if (!(atomic_load_long(&renderer->ready) & VIEW_FRAME_FRESH))
+    {
+        return 0;
+    }
+
+    /* 只有渲染线程会放入新的帧，此时 ready 仍带有 VIEW_FRAME_FRESH */
+    long prev = atomic_exchange_long(&renderer->ready, state->front);
+    state->front = (int)(prev & ~VIEW_FRAME_FRESH);
+    state->shown = 1;
+    if (state->settings.animate)
+    {
+        /* 渲染线程在等待这一帧被取走 */
+        mutex_lock(&renderer->mutex);
+        cond_broadcast(&renderer->cond);
+        mutex_unlock(&renderer->mutex);
+    }
+    return 1;
+}
+
+/* 有新的帧时更新 texture，之后重新显示，开启垂直同步时在此等待下一次刷新 */
+static
+void present_frame(view_state_t *state)
+{
+    int fresh = take_frame(state);
+    if (fresh)
+    {
+        uint64_t span = profiler_begin();
+        SDL_UpdateTexture(state->texture, NULL, g_view_renderer.frames[state->front].pixel, g_view_renderer.pitch);
+        profiler_end("texture upload", "frame", span);
+    }
+    uint64_t span = profiler_begin();
+    SDL_RenderClear(state->sdl_renderer);
+    if (state->shown)
+    {
+        SDL_RenderCopy(state->sdl_renderer, state->texture, NULL, NULL);
+    }
+    SDL_RenderPresent(state->sdl_renderer);
+    profiler_end("present", "frame", span);
+
+    view_stats_t *stats = &state->stats;
+    uint64_t ts = now_ns();
+    if (fresh)
+    {
+        const view_frame_t *frame = &g_view_renderer.frames[state->front];
+        if (stats->last_present_ns != 0)
+        {
+            uint64_t interval = ts - stats->last_present_ns;
+            stats->interval_sum_ns += interval;
+            stats->interval_max_ns = interval > stats->interval_max_ns ? interval : stats->interval_max_ns;
+        }
+        stats->last_present_ns = ts;
+        uint64_t latency = ts - frame->submit_ns;
+        stats->latency_sum_ns += latency;
+        stats->latency_max_ns = latency > stats->latency_max_ns ? latency : stats->latency_max_ns;
+        stats->frame_count++;
+        if (frame->generation != state->settings.generation)
+        {
+            stats->stale_count++;
+        }
+    }
+
+    /* 停止渲染之后也刷新一次，标题显示 idle */
+    if (ts - stats->window_start_ns >= VIEW_STATS_INTERVAL_NS && (fresh || stats->frame_count > 0))
+    {
+        update_title(state);
+        reset_stats(state, ts);
+    }
+}
+
+static
+void select_backend(view_state_t *state, int backend)
+{
+    int need_opencl = g_view_backends[backend].need_opencl;
+    if ((need_opencl == 1 && !state->opencl_ready) || (need_opencl == 2 && !state->multi_ready))
+    {
+        printf("%s unavailable, opencl init failed\n", g_view_backends[backend].name);
+        return;
+    }
+    state->settings.backend = backend;
+    post_request(state, VIEW_RESTART_PREVIEW, 0);
+    update_title(state);
+}
+
 int main(int argc, char *argv[])
 {
     int win_w = 640, win_h = 480;
     const char *cl_source_file = "render.cl";
-    init_cl_rendler(cl_source_file, win_w, win_h);
+
+    /* 可选参数: 场景中额外的随机小球个数，或者由 scene_convert 生成的二进制场景文件 */
+    const char *scene_arg = argc > 1 ? argv[1] : "0";
+    scene_t scene;
+    project_camera_t camera;
+    setup_project_camera(&camera);
+    if (scene_arg[strspn(scene_arg, "0123456789")] != '\0')
+    {
+        if (scene_load_file(&scene, &camera, scene_arg) < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        int random_sphere_count = atoi(scene_arg);
+        uint64_t ts1 = now_ms();
+        if (setup_scene(&scene, random_sphere_count) != 0)
+        {
+            printf("setup_scene() failed, sphere count: %d\n", random_sphere_count + 1);
+            return -1;
+        }
+        uint64_t ts2 = now_ms();
+        printf("setup_scene, spheres: %d, bvh nodes: %d, time elapsed: %" PRIu64 "ms\n", scene.sphere_count, scene.node_count, (ts2-ts1));
+    }
+
+    /* RAY_TRACE_PROFILE=<trace.json> 开启性能分析，退出时写出 trace; OpenCL 的队列创建时须已开启 */
+    const char *trace_file = getenv("RAY_TRACE_PROFILE");
+    if (trace_file != NULL && (trace_file[0] == '\0' || profiler_enable(VIEW_PROFILE_EVENTS) != 0))
+    {
+        trace_file = NULL;
+    }
+
+    view_state_t state;
+    memset(&state, 0, sizeof(state));
+    state.opencl_ready = init_cl_rendler(cl_source_file, win_w, win_h) == 0;
+    if (state.opencl_ready)
+    {
+        cl_render_set_scene(&scene);
+    }
+    state.multi_ready = init_cl_multi_render(cl_source_file) == 0;
+    if (state.multi_ready)
+    {
+        cl_multi_render_set_scene(&scene);
+    }
+    thread_pool_init(0);
+    soft_simd_init();
+    soft_render_set_scene(&scene);
+    /* 连续渲染时不再逐帧输出耗时，帧率和延迟显示在窗口标题上 */
+    g_render_verbose = 0;
 
     SDL_Init(SDL_INIT_VIDEO);
-    SDL_Window *window = SDL_CreateWindow("Render Window", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, win_w, win_h, 0);
-    SDL_Surface *surface = SDL_GetWindowSurface(window);
+    state.window = SDL_CreateWindow("Render Window", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, win_w, win_h, 0);
+    /* 垂直同步使窗口线程每次刷新处理一遍输入，不论渲染一帧需要多久 */
+    state.sdl_renderer = state.window != NULL ? SDL_CreateRenderer(state.window, -1, SDL_RENDERER_PRESENTVSYNC) : NULL;
+    /* 各渲染实现输出 BGRA，即小端上的 ARGB8888 */
+    state.texture = state.sdl_renderer != NULL ?
+        SDL_CreateTexture(state.sdl_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, win_w, win_h) : NULL;
+    if (state.texture == NULL)
+    {
+        printf("SDL window setup failed: %s\n", SDL_GetError());
+        return -1;
+    }
 
-    int render_ok = 0;
-    SDL_LockSurface(surface);
-    render_ok = render_project_depth_opencl((uint8_t*)surface->pixels, surface->w, surface->h, surface->pitch) == 0;
-    SDL_UnlockSurface(surface);
-    if (render_ok)
+    view_renderer_t *renderer = &g_view_renderer;
+    renderer->opencl_ready = state.opencl_ready;
+    renderer->multi_ready = state.multi_ready;
+    renderer->scene = &scene;
+    renderer->anim_sphere = scene.sphere_count - 1;
+    renderer->anim_origin = scene.spheres[renderer->anim_sphere].center;
+    renderer->wake_event = SDL_RegisterEvents(1);
+
+    state.settings.backend = state.opencl_ready ? 6 : 4;
+    setup_render_options(&state.settings.render_options);
+    state.settings.aa_grid = 1;
+    state.settings.bounces = 0;
+    state.settings.camera = camera;
+    state.home_camera = camera;
+    state.settings.generation = 1;
+    state.front = 2;
+    if (view_renderer_start(renderer, win_w, win_h, &state.settings) != 0)
     {
-        SDL_UpdateWindowSurface(window);
+        return -1;
     }
+    reset_stats(&state, now_ns());
+    post_request(&state, VIEW_RESTART_FULL, 0);
+    update_title(&state);
 
-    while (1)
+    printf("keys: 1~9, 0 backend, Tab next backend, W/S/A/D/Q/E move (shift faster), left drag pan, wheel zoom, R reset camera, N shade mode, G anti-aliasing, B reflection bounces, M move a sphere, P profile stats, Esc quit\n");
+
+    uint64_t last_frame_ns = now_ns();
+    int quit = 0;
+    while (!quit)
     {
+        /* 没有按住移动键、也没有新完成的帧时阻塞等待输入，渲染线程完成一帧时会推送事件唤醒 */
+        const Uint8 *keys = SDL_GetKeyboardState(NULL);
+        int move_held = keys[SDL_SCANCODE_W] || keys[SDL_SCANCODE_S] || keys[SDL_SCANCODE_A] ||
+            keys[SDL_SCANCODE_D] || keys[SDL_SCANCODE_Q] || keys[SDL_SCANCODE_E];
+        if (!move_held && !(atomic_load_long(&renderer->ready) & VIEW_FRAME_FRESH))
+        {
+            SDL_WaitEventTimeout(NULL, 100);
+        }
+
+        float move_x = 0, move_y = 0, move_z = 0;
         SDL_Event event;
-        if (SDL_WaitEventTimeout(&event, 500))
+        while (SDL_PollEvent(&event))
         {
-            if (event.type == SDL_KEYUP)
+            if (event.type == SDL_QUIT)
+            {
+                quit = 1;
+            }
+            else if (event.type == SDL_KEYDOWN)
             {
                 SDL_Scancode key_scancode = event.key.keysym.scancode;
-                if (key_scancode == SDL_SCANCODE_1)
+                if (key_scancode >= SDL_SCANCODE_1 && key_scancode < SDL_SCANCODE_1 + VIEW_BACKEND_COUNT)
                 {
-                    SDL_LockSurface(surface);
-                    render_gradient_soft((uint8_t*)surface->pixels, surface->w, surface->h, surface->pitch);
-                    SDL_UpdateWindowSurface(window);
-                    SDL_UnlockSurface(surface);
+                    select_backend(&state, key_scancode - SDL_SCANCODE_1);
                 }
-                else if (key_scancode == SDL_SCANCODE_2)
+                else if (key_scancode == SDL_SCANCODE_TAB)
                 {
-                    SDL_LockSurface(surface);
-                    render_ok = render_gradient_opencl((uint8_t*)surface->pixels, surface->w, surface->h, surface->pitch) == 0;
-                    SDL_UnlockSurface(surface);
-                    if (render_ok)
+                    /* 跳过不可用的渲染方式 */
+                    int next = state.settings.backend;
+                    do
                     {
-                        SDL_UpdateWindowSurface(window);
-                    }
+                        next = (next + 1) % VIEW_BACKEND_COUNT;
+                        int need_opencl = g_view_backends[next].need_opencl;
+                        if ((need_opencl != 1 || state.opencl_ready) && (need_opencl != 2 || state.multi_ready))
+                        {
+                            break;
+                        }
+                    } while (next != state.settings.backend);
+                    select_backend(&state, next);
+                }
+                else if (key_scancode == SDL_SCANCODE_N)
+                {
+                    /* 在深度着色和法线着色之间切换 */
+                    render_options_t *options = &state.settings.render_options;
+                    options->shade_mode = options->shade_mode == RENDER_SHADE_DEPTH ? RENDER_SHADE_NORMAL : RENDER_SHADE_DEPTH;
+                    post_request(&state, VIEW_RESTART_PREVIEW, 0);
+                }
+                else if (key_scancode == SDL_SCANCODE_G)
+                {
+                    /* 抗锯齿在 关闭、2x2、4x4 之间切换，只作用于完整分辨率的帧 */
+                    state.settings.aa_grid = state.settings.aa_grid >= RENDER_AA_MAX_GRID ? 1 : state.settings.aa_grid * 2;
+                    post_request(&state, VIEW_RESTART_FULL, 0);
                 }
-                else if (key_scancode == SDL_SCANCODE_3)
+                else if (key_scancode == SDL_SCANCODE_B)
                 {
-                    SDL_LockSurface(surface);
-                    render_project_depth_soft((uint8_t*)surface->pixels, surface->w, surface->h, surface->pitch);
-                    SDL_UnlockSurface(surface);
-                    SDL_UpdateWindowSurface(window);
+                    /* wavefront 渲染的反射次数在 0 ~ 3 之间循环 */
+                    state.settings.bounces = (state.settings.bounces + 1) % 4;
+                    post_request(&state, VIEW_RESTART_FULL, 0);
                 }
-                else if (key_scancode == SDL_SCANCODE_4)
+                else if (key_scancode == SDL_SCANCODE_M)
                 {
-                    SDL_LockSurface(surface);
-                    render_ok = render_project_depth_opencl((uint8_t*)surface->pixels, surface->w, surface->h, surface->pitch) == 0;
-                    SDL_UnlockSurface(surface);
-                    if (render_ok)
+                    /* 编辑演示移动 sphere，只有使用摄像机的渲染方式才有意义 */
+                    if (state.settings.animate || g_view_backends[state.settings.backend].use_camera)
+                    {
+                        state.settings.animate = !state.settings.animate;
+                        post_request(&state, VIEW_RESTART_NONE, 0);
+                    }
+                    else
                     {
-                        SDL_UpdateWindowSurface(window);
+                        printf("%s does not support animation\n", g_view_backends[state.settings.backend].name);
                     }
                 }
+                else if (key_scancode == SDL_SCANCODE_P)
+                {
+                    if (g_profiler_enabled)
+                    {
+                        profiler_print_stats();
+                    }
+                    else
+                    {
+                        printf("profiler disabled, set RAY_TRACE_PROFILE=<trace.json> to enable\n");
+                    }
+                }
+                else if (key_scancode == SDL_SCANCODE_R)
+                {
+                    state.settings.camera = state.home_camera;
+                    post_request(&state, VIEW_RESTART_PREVIEW, 0);
+                }
+                else if (key_scancode == SDL_SCANCODE_ESCAPE)
+                {
+                    quit = 1;
+                }
             }
-            else if (event.type == SDL_QUIT)
+            else if (event.type == SDL_MOUSEMOTION && (event.motion.state & SDL_BUTTON_LMASK))
             {
-                break;
+                /* 拖动时画面跟随鼠标 */
+                move_x -= event.motion.xrel;
+                move_y += event.motion.yrel;
             }
+            else if (event.type == SDL_MOUSEWHEEL)
+            {
+                move_z -= event.wheel.y * VIEW_WHEEL_STEP;
+            }
+        }
+
+        uint64_t frame_ns = now_ns();
+        float dt = (frame_ns - last_frame_ns) / 1e9f;
+        last_frame_ns = frame_ns;
+        /* 长时间阻塞之后不按等待的时长移动 */
+        if (dt > 0.1f)
+        {
+            dt = 0.1f;
         }
+
+        float speed = VIEW_MOVE_SPEED * dt * (keys[SDL_SCANCODE_LSHIFT] ? 4.0f : 1.0f);
+        move_x += (keys[SDL_SCANCODE_D] - keys[SDL_SCANCODE_A]) * speed;
+        move_y += (keys[SDL_SCANCODE_E] - keys[SDL_SCANCODE_Q]) * speed;
+        move_z += (keys[SDL_SCANCODE_S] - keys[SDL_SCANCODE_W]) * speed;
+
+        /* 摄像机在窗口线程一侧立即更新，渲染线程开始下一帧时取最新的位置 */
+        int moving = move_x != 0 || move_y != 0 || move_z != 0;
+        if (moving && g_view_backends[state.settings.backend].use_camera)
+        {
+            project_camera_t *view_camera = &state.settings.camera;
+            view_camera->eye.x += move_x;
+            view_camera->eye.y += move_y;
+            view_camera->eye.z += move_z;
+            if (view_camera->eye.z < VIEW_MIN_EYE_Z)
+            {
+                view_camera->eye.z = VIEW_MIN_EYE_Z;
+            }
+            post_request(&state, VIEW_RESTART_PREVIEW, 1);
+        }
+
+        present_frame(&state);
     }
 
-    SDL_DestroyWindow(window);
+    view_renderer_stop(renderer);
+    SDL_DestroyTexture(state.texture);
+    SDL_DestroyRenderer(state.sdl_renderer);
+    SDL_DestroyWindow(state.window);
     SDL_Quit();
 
+    thread_pool_uninit();
     uninit_cl_render();
+    uninit_cl_multi_render();
+    if (trace_file != NULL)
+    {
+        profiler_write_trace(trace_file);
+        profiler_uninit();
+    }
+    scene_uninit(&scene);
 
     return 0;
 }
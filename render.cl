@@ -1,11 +1,29 @@
 
+/* 由 cl_render.c 以 -D 编译选项指定，每种组合编译为单独的 program，以下为缺省值 */
+#define SHADE_DEPTH 0
+#define SHADE_NORMAL 1
+#ifndef SHADE_MODE
+#define SHADE_MODE SHADE_DEPTH
+#endif
+#ifndef CHECKER_SIZE
+#define CHECKER_SIZE 40
+#endif
+#ifndef DEPTH_SCALE
+#define DEPTH_SCALE 200.0f
+#endif
+
 __kernel
 void render_gradient(__write_only image2d_t out_image)
 {
-    size_t width = get_global_size(0);
-    size_t height = get_global_size(1);
+    /* global size 按 work-group 大小向上取整，超出画面的 work-item 直接返回 */
+    size_t width = get_image_width(out_image);
+    size_t height = get_image_height(out_image);
     size_t x = get_global_id(0);
     size_t y = get_global_id(1);
+    if (x >= width || y >= height)
+    {
+        return;
+    }
 
     int2 cord = (int2)(x, y);
     /* RGBA */
@@ -27,16 +45,21 @@ typedef struct ray
     float3 direction;
 } ray_t;
 
+/* 与 common.h 中的定义一致 */
 typedef struct project_camera
 {
     /* 基础字面属性 */
     float3 eye;
     float3 front;
+    float3 up;
     /* 视角单位为度 */
     float left_fov;
     float right_fov;
     float top_fov;
     float bottom_fov;
+    int width;
+    int height;
+    int pad_for_resolution[2];
 
     /* 计算属性 */
 
@@ -45,54 +68,37 @@ typedef struct project_camera
     float right_angle_tan;
     float top_angle_tan;
     float bottom_angle_tan;
+
+    float3 basis_right;
+    float3 basis_up;
+    float3 basis_front;
+
+    float pixel_size;
+    float plane_left;
+    float plane_top;
+    float pad_for_plane;
+    /* 像素 (x, y) 的光线方向为 pixel_origin + y * pixel_dy + x * pixel_dx */
+    float3 pixel_origin;
+    float3 pixel_dx;
+    float3 pixel_dy;
 } project_camera_t;
 
+/* 获取摄像机经过窗口坐标 (x, y) 的光线，增量由 host 按画面尺寸预先计算
+ *
+ * 早先的版本按视角判断目标点是否在视野范围内时，曾经全部认为不在视野范围内，和 soft render 版本不同:
+ * project_camera 定义拷贝到 GPU 内存之后，其成员值已经错动。
+ * result: this bug caused by type bytes alignment. See C6.1.5 in OpenCL Spec
+ * 因此 host 端的定义在每个 float3 之后都有填充成员
+ */
 static
 void project_camera_generateRay
 (
     ray_t *ray, 
     __global const project_camera_t* camera, 
-    float3 dest_point
+    float x, float y
 )
 {
-    float3 delta = dest_point - camera->eye;
-    ray->direction = (float3)(0.0, 0.0, 0.0);
-
-    /* 为简化计算，下面的计算有一个假设： 摄像机的观察方向与z轴平行
-     * 严格的讲，需要根据观察点的位置和方向来具体计算
-     */
-
-    /* 要求目标点必须在 camera 前方, 即z轴坐标小于 eye.z */
-    if (delta.z >= 0)
-    {
-        return;
-    }
-
-    /* 根据角度判断是否在视野范围内 */
-    /* BUG: 此处和预期不同，会全部认为不在视野范围内，和soft render版本不同！
-     * 经进一步定位之后发现，project_camera定义拷贝到GPU内存之后，其成员值已经错动，如下
-     * camera->left_fov == 80.0， 预期为 80.0
-     * camera->right_fov == 80.0， 预期为 80.0
-     * camera->top_fov < 0， 预期为 80.0
-     * 0 < camera->bottom_fov < 80.0， 预期为 80.0
-     * camera->left_angle_tan > 0， 预期为 -tan((80.0 / 180) * M_PI)
-     * camera->right_angle_tan < 0， 预期为 tan((80.0 / 180) * M_PI)
-     * camera->bottom_angle_tan < 0， 预期为 -tan((80.0 / 180) * M_PI)
-     * camera->top_angle_tan < 0， 预期为 tan((80.0 / 180) * M_PI)
-     *
-     * 目前看数据拷贝到 GPU 内存来传递常量的方式存在一些未知的坑，尚不清楚具体为何！
-     *
-     * result: this bug caused by type bytes alignment. See C6.1.5 in OpenCL Spec
-     */
-
-    float h_tan = delta.x / (-delta.z);
-    float v_tan = delta.y / (-delta.z);
-    if (h_tan < camera->left_angle_tan || h_tan > camera->right_angle_tan || 
-        v_tan < camera->bottom_angle_tan || v_tan > camera->top_angle_tan)
-    {
-        return;
-    }
-
+    float3 delta = (camera->pixel_origin + y * camera->pixel_dy) + x * camera->pixel_dx;
     ray->origin = camera->eye;
     ray->direction = normalize(delta);
 
@@ -119,6 +125,8 @@ typedef struct sphere
 typedef struct intersect_result
 {
     bool hit;
+    /* 命中的 sphere 下标，由 scene_intersect 设置 */
+    int id;
     float distance;
     float3 position;
     float3 normal;
@@ -164,91 +172,929 @@ void sphere_intersect
 
 /****************************************************************************************************/
 
-__kernel
-void render_project_depth
+/* 与 common.h 中的定义保持一致，只使用标量成员以保证两侧内存布局相同 */
+typedef struct bvh_node
+{
+    float min_x;
+    float min_y;
+    float min_z;
+    /* 内部节点: 左子节点下标，右子节点紧随其后; 叶节点: 第一个 sphere 的下标 */
+    int left_first;
+
+    float max_x;
+    float max_y;
+    float max_z;
+    /* 叶节点包含的 sphere 个数，0 表示内部节点 */
+    int count;
+} bvh_node_t;
+
+#define BVH_STACK_SIZE 64
+
+/* 光线与 BVH 节点包围盒的 slab 测试，t_near 为进入包围盒的距离 */
+static
+bool bvh_node_intersect
 (
-    __global project_camera_t *project_camera,
-    __global sphere_t *sphere,
-    __write_only image2d_t out_image
+    __global const bvh_node_t *node,
+    float3 origin,
+    float3 inv_dir,
+    float max_distance,
+    float *t_near
 )
 {
-    size_t width = get_global_size(0);
-    size_t height = get_global_size(1);
-    size_t x = get_global_id(0);
-    size_t y = get_global_id(1);
+    float3 t1 = ((float3)(node->min_x, node->min_y, node->min_z) - origin) * inv_dir;
+    float3 t2 = ((float3)(node->max_x, node->max_y, node->max_z) - origin) * inv_dir;
+    float3 t_lo = fmin(t1, t2);
+    float3 t_hi = fmax(t1, t2);
+    float t_min = fmax(fmax(t_lo.x, t_lo.y), t_lo.z);
+    float t_max = fmin(fmin(t_hi.x, t_hi.y), t_hi.z);
 
-    int2 cord = (int2)(x, y);
-    uint4 pixel;
+    *t_near = t_min;
+    return t_max >= t_min && t_max >= 0 && t_min < max_distance;
+}
 
-    /* 国际象棋棋盘背景色 */
-    int x_block_idx = x / 40;
-    int y_block_idx = y / 40;
-    int result = (x_block_idx - y_block_idx) & 0x01;
-    if (result)
+/* 沿以 root 为根的子树由近及远遍历，更新最近交点的 sphere 下标和距离 */
+static
+void subtree_intersect
+(
+    __global sphere_t *spheres,
+    __global const bvh_node_t *nodes,
+    const ray_t* ray,
+    float3 inv_dir,
+    int root,
+    int *nearest,
+    float *nearest_distance
+)
+{
+    /* 栈中保存节点下标及其包围盒的进入距离，出栈时若已远于当前最近交点则跳过 */
+    int stack[BVH_STACK_SIZE];
+    float stack_t[BVH_STACK_SIZE];
+    int stack_size = 0;
+
+    float t_near;
+    if (bvh_node_intersect(&nodes[root], ray->origin, inv_dir, *nearest_distance, &t_near))
     {
-        pixel.x = 255;
-        pixel.y = 255;
-        pixel.z = 255;
-        pixel.w = 255;
+        stack[stack_size] = root;
+        stack_t[stack_size] = t_near;
+        stack_size++;
+    }
+
+    while (stack_size > 0)
+    {
+        stack_size--;
+        if (stack_t[stack_size] >= *nearest_distance)
+        {
+            continue;
+        }
+        __global const bvh_node_t *node = &nodes[stack[stack_size]];
+
+        if (node->count > 0)
+        {
+            for (int i = 0; i < node->count; ++i)
+            {
+                intersect_result_t result;
+                sphere_intersect(&result, &spheres[node->left_first + i], ray);
+                if (result.hit && result.distance < *nearest_distance)
+                {
+                    *nearest = node->left_first + i;
+                    *nearest_distance = result.distance;
+                }
+            }
+            continue;
+        }
+
+        int left = node->left_first;
+        int right = left + 1;
+        float t_left, t_right;
+        bool hit_left = bvh_node_intersect(&nodes[left], ray->origin, inv_dir, *nearest_distance, &t_left);
+        bool hit_right = bvh_node_intersect(&nodes[right], ray->origin, inv_dir, *nearest_distance, &t_right);
+        if (hit_left && hit_right)
+        {
+            /* 远的子节点先入栈，近的先出栈 */
+            bool left_near = t_left <= t_right;
+            stack[stack_size] = left_near ? right : left;
+            stack_t[stack_size] = left_near ? t_right : t_left;
+            stack_size++;
+            stack[stack_size] = left_near ? left : right;
+            stack_t[stack_size] = left_near ? t_left : t_right;
+            stack_size++;
+        }
+        else if (hit_left || hit_right)
+        {
+            stack[stack_size] = hit_left ? left : right;
+            stack_t[stack_size] = hit_left ? t_left : t_right;
+            stack_size++;
+        }
+    }
+
+    return;
+}
+
+/* 由最近交点的 sphere 下标计算交点，未命中时 nearest 为 -1 */
+static
+void nearest_intersect
+(
+    intersect_result_t* intersect_result,
+    __global sphere_t *spheres,
+    int nearest,
+    const ray_t* ray
+)
+{
+    if (nearest >= 0)
+    {
+        sphere_intersect(intersect_result, &spheres[nearest], ray);
+        intersect_result->id = nearest;
     }
     else
     {
-        pixel.x = 0;
-        pixel.y = 0;
-        pixel.z = 0;
-        pixel.w = 255;
+        intersect_result->hit = false;
+    }
+}
+
+/* 沿 BVH 由近及远遍历场景，得出离光线原点最近的交点 */
+static
+void scene_intersect
+(
+    intersect_result_t* intersect_result,
+    __global sphere_t *spheres,
+    __global const bvh_node_t *nodes,
+    const ray_t* ray
+)
+{
+    int nearest = -1;
+    float nearest_distance = MAXFLOAT;
+    subtree_intersect(spheres, nodes, ray, 1.0f / ray->direction, 0, &nearest, &nearest_distance);
+    nearest_intersect(intersect_result, spheres, nearest, ray);
+
+    return;
+}
+
+/* 只遍历以 roots 中各节点为根的子树，按顺序逐棵遍历，共用当前最近交点的距离 */
+static
+void scene_intersect_roots
+(
+    intersect_result_t* intersect_result,
+    __global sphere_t *spheres,
+    __global const bvh_node_t *nodes,
+    const ray_t* ray,
+    __global const int *roots,
+    int root_count
+)
+{
+    float3 inv_dir = 1.0f / ray->direction;
+    int nearest = -1;
+    float nearest_distance = MAXFLOAT;
+    for (int r = 0; r < root_count; ++r)
+    {
+        subtree_intersect(spheres, nodes, ray, inv_dir, roots[r], &nearest, &nearest_distance);
+    }
+    nearest_intersect(intersect_result, spheres, nearest, ray);
+
+    return;
+}
+
+/****************************************************************************************************/
+
+/* 国际象棋棋盘背景色 */
+static
+uint4 checker_color(int x, int y)
+{
+    int x_block_idx = x / CHECKER_SIZE;
+    int y_block_idx = y / CHECKER_SIZE;
+    if ((x_block_idx - y_block_idx) & 0x01)
+    {
+        return (uint4)(255, 255, 255, 255);
+    }
+
+    return (uint4)(0, 0, 0, 255);
+}
+
+/* 交点的颜色，alpha 保持 pixel 原来的值 */
+static
+uint4 shade_hit(const intersect_result_t *intersect_result, uint4 pixel)
+{
+  #if SHADE_MODE == SHADE_DEPTH
+    float value = (intersect_result->distance / DEPTH_SCALE) * 255;
+    if (value > 255)
+    {
+        value = 255;
+    }
+    value = 255 - value;
+    pixel.x = value;
+    pixel.y = value;
+    pixel.z = value;
+  #else
+    pixel.x = (intersect_result->normal.x + 1) * 128;
+    pixel.y = (intersect_result->normal.y + 1) * 128;
+    pixel.z = (intersect_result->normal.z + 1) * 128;
+  #endif
+
+    return pixel;
+}
+
+/********************************************************************************/
+
+/* 屏幕空间分箱，见 tile_bin.h 的说明，两个常量须与 tile_bin.h 一致 */
+#define TILE_BIN_SIZE 32
+#define TILE_BIN_SPLIT_TILES 16
+/* 投影范围向外扩展的像素数，与 dirty_region.c 一致 */
+#define TILE_BIN_MARGIN 2
+/* tile_bin_scan 的 work-group 大小 */
+#define TILE_BIN_SCAN_GROUP 256
+
+/* 节点包围盒在画面上覆盖的 tile 范围 [x, z) x [y, w)，不在画面上时返回 false。
+ * 与 dirty_region.c 的 render_box_window_rect() 相同: 取 8 个顶点投影的外接矩形，有顶点不在摄像机前方时为整个画面
+ */
+static
+bool node_tile_rect
+(
+    __global const bvh_node_t *node,
+    __global const project_camera_t *camera,
+    int width,
+    int height,
+    int4 *rect
+)
+{
+    int tiles_x = (width + TILE_BIN_SIZE - 1) / TILE_BIN_SIZE;
+    int tiles_y = (height + TILE_BIN_SIZE - 1) / TILE_BIN_SIZE;
+    float min_x = MAXFLOAT, min_y = MAXFLOAT;
+    float max_x = -MAXFLOAT, max_y = -MAXFLOAT;
+    for (int k = 0; k < 8; ++k)
+    {
+        float3 corner = (float3)((k & 1) ? node->max_x : node->min_x, (k & 2) ? node->max_y : node->min_y,
+            (k & 4) ? node->max_z : node->min_z);
+        float3 delta = corner - camera->eye;
+        float depth = dot(delta, camera->basis_front);
+        if (depth <= 0 || camera->pixel_size <= 0)
+        {
+            *rect = (int4)(0, 0, tiles_x, tiles_y);
+            return true;
+        }
+
+        /* 影像平面上的坐标换算为窗口坐标，窗口的 y 向下 */
+        float u = dot(delta, camera->basis_right) / depth;
+        float v = dot(delta, camera->basis_up) / depth;
+        float x = (u - camera->plane_left) / camera->pixel_size;
+        float y = (camera->plane_top - v) / camera->pixel_size;
+        min_x = fmin(min_x, x);
+        max_x = fmax(max_x, x);
+        min_y = fmin(min_y, y);
+        max_y = fmax(max_y, y);
+    }
+
+    float x0 = floor(min_x) - TILE_BIN_MARGIN;
+    float x1 = ceil(max_x) + 1 + TILE_BIN_MARGIN;
+    float y0 = floor(min_y) - TILE_BIN_MARGIN;
+    float y1 = ceil(max_y) + 1 + TILE_BIN_MARGIN;
+    if (x1 <= 0 || y1 <= 0 || x0 >= width || y0 >= height)
+    {
+        return false;
+    }
+    int px0 = x0 > 0 ? (int)x0 : 0;
+    int py0 = y0 > 0 ? (int)y0 : 0;
+    int px1 = x1 < width ? (int)x1 : width;
+    int py1 = y1 < height ? (int)y1 : height;
+    *rect = (int4)(px0 / TILE_BIN_SIZE, py0 / TILE_BIN_SIZE,
+        (px1 + TILE_BIN_SIZE - 1) / TILE_BIN_SIZE, (py1 + TILE_BIN_SIZE - 1) / TILE_BIN_SIZE);
+
+    return true;
+}
+
+static
+float node_sqr_distance(__global const bvh_node_t *node, float3 eye)
+{
+    float3 center = (float3)(node->min_x + node->max_x, node->min_y + node->max_y, node->min_z + node->max_z) * 0.5f;
+    float3 delta = center - eye;
+    return dot(delta, delta);
+}
+
+/* 按 tile_bin.c 的规则自根节点向下选出 tile (tx, ty) 列表中的节点，list 非空时依次写入，返回个数 */
+static
+int tile_bin_walk
+(
+    __global const project_camera_t *camera,
+    __global const bvh_node_t *nodes,
+    int width,
+    int height,
+    int tx,
+    int ty,
+    __global int *list
+)
+{
+    int stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    int count = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0)
+    {
+        int idx = stack[--stack_size];
+        __global const bvh_node_t *node = &nodes[idx];
+        int4 rect;
+        if (!node_tile_rect(node, camera, width, height, &rect) ||
+            tx < rect.x || tx >= rect.z || ty < rect.y || ty >= rect.w)
+        {
+            continue;
+        }
+
+        if (node->count == 0 && (rect.z - rect.x) * (rect.w - rect.y) > TILE_BIN_SPLIT_TILES)
+        {
+            /* 近的子节点后入栈、先出栈，在列表中排在前面 */
+            int left = node->left_first;
+            bool left_near = node_sqr_distance(&nodes[left], camera->eye) <= node_sqr_distance(&nodes[left + 1], camera->eye);
+            stack[stack_size++] = left_near ? left + 1 : left;
+            stack[stack_size++] = left_near ? left : left + 1;
+            continue;
+        }
+
+        if (list != 0)
+        {
+            list[count] = idx;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+/* 分箱第一步: 每个 work-item 负责一个 tile，把列表长度写入 offsets[tile] */
+__kernel
+void tile_bin_count
+(
+    __global const project_camera_t *project_camera,
+    __global const bvh_node_t *nodes,
+    int width,
+    int height,
+    __global int *offsets
+)
+{
+    int tiles_x = (width + TILE_BIN_SIZE - 1) / TILE_BIN_SIZE;
+    int tiles_y = (height + TILE_BIN_SIZE - 1) / TILE_BIN_SIZE;
+    int tx = get_global_id(0);
+    int ty = get_global_id(1);
+    if (tx >= tiles_x || ty >= tiles_y)
+    {
+        return;
+    }
+
+    offsets[ty * tiles_x + tx] = tile_bin_walk(project_camera, nodes, width, height, tx, ty, 0);
+}
+
+/* 分箱第二步: 由一个 work-group 把 offsets 中的长度原地改为排他前缀和，offsets[tile_count] 为总长度。
+ * 每个 work-item 先累加连续的一段，段的起始位置由 work-item 0 在局部内存中求出。
+ * 总长度超过 capacity 时各 tile 的起始位置记为 -1，render_project_depth 对这些 tile 遍历整个场景
+ */
+__kernel __attribute__((reqd_work_group_size(TILE_BIN_SCAN_GROUP, 1, 1)))
+void tile_bin_scan(__global int *offsets, int tile_count, int capacity)
+{
+    __local int sums[TILE_BIN_SCAN_GROUP];
+    __local int total;
+
+    int lid = get_local_id(0);
+    int chunk = (tile_count + TILE_BIN_SCAN_GROUP - 1) / TILE_BIN_SCAN_GROUP;
+    int begin = min(lid * chunk, tile_count);
+    int end = min(begin + chunk, tile_count);
+    int sum = 0;
+    for (int t = begin; t < end; ++t)
+    {
+        sum += offsets[t];
+    }
+    sums[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (lid == 0)
+    {
+        int acc = 0;
+        for (int i = 0; i < TILE_BIN_SCAN_GROUP; ++i)
+        {
+            int count = sums[i];
+            sums[i] = acc;
+            acc += count;
+        }
+        total = acc;
+        offsets[tile_count] = acc;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    bool overflow = total > capacity;
+    int start = sums[lid];
+    for (int t = begin; t < end; ++t)
+    {
+        int count = offsets[t];
+        offsets[t] = overflow ? -1 : start;
+        start += count;
     }
+}
+
+/* 分箱第三步: 每个 work-item 把所在 tile 的列表写入 nodes_list 中 offsets 给出的位置 */
+__kernel
+void tile_bin_fill
+(
+    __global const project_camera_t *project_camera,
+    __global const bvh_node_t *nodes,
+    int width,
+    int height,
+    __global const int *offsets,
+    __global int *nodes_list
+)
+{
+    int tiles_x = (width + TILE_BIN_SIZE - 1) / TILE_BIN_SIZE;
+    int tiles_y = (height + TILE_BIN_SIZE - 1) / TILE_BIN_SIZE;
+    int tx = get_global_id(0);
+    int ty = get_global_id(1);
+    if (tx >= tiles_x || ty >= tiles_y)
+    {
+        return;
+    }
+
+    int begin = offsets[ty * tiles_x + tx];
+    if (begin >= 0)
+    {
+        tile_bin_walk(project_camera, nodes, width, height, tx, ty, nodes_list + begin);
+    }
+}
+
+/********************************************************************************/
+
+/* 每个 work-item 负责一个 pixel_step x pixel_step 的像素块，只对块左上角的像素求交，
+ * 命中时整块使用交点的颜色，否则逐像素填充背景。pixel_step 为 1 时即逐像素渲染。
+ * ids 非空时写入每个像素命中的 sphere 下标，未命中为 -1，供抗锯齿的边缘检测使用。
+ * bin_offsets 非空时为 tile_bin_* 建立的各 tile 的节点列表，为空时遍历整个场景
+ */
+__kernel
+void render_project_depth
+(
+    __global project_camera_t *project_camera,
+    __global sphere_t *spheres,
+    __global const bvh_node_t *nodes,
+    __write_only image2d_t out_image,
+    int pixel_step,
+    __global int *ids,
+    __global const int *bin_offsets,
+    __global const int *bin_nodes
+)
+{
+    int width = get_image_width(out_image);
+    int height = get_image_height(out_image);
+    int x0 = get_global_id(0) * pixel_step;
+    int y0 = get_global_id(1) * pixel_step;
+    if (x0 >= width || y0 >= height)
+    {
+        return;
+    }
+
+    /* 有分箱结果时只遍历所在 tile 的节点列表 */
+    __global const int *roots = 0;
+    int root_count = 1;
+    if (bin_offsets != 0)
+    {
+        int tile = (y0 / TILE_BIN_SIZE) * ((width + TILE_BIN_SIZE - 1) / TILE_BIN_SIZE) + x0 / TILE_BIN_SIZE;
+        int begin = bin_offsets[tile];
+        if (begin >= 0)
+        {
+            roots = bin_nodes + begin;
+            root_count = bin_offsets[tile + 1] - begin;
+        }
+    }
+
+    uint4 pixel = checker_color(x0, y0);
+    /* 块内所有像素是否都使用 pixel 的颜色 */
+    bool fill = false;
+    int id = -1;
 
-    /* 将窗口坐标转换到影像平面坐标 */
-    float3 point = (float3)(x, (height - y), 0.0);
     ray_t ray;
     intersect_result_t intersect_result;
-    project_camera_generateRay(&ray, project_camera, point);
-    if (ray.direction.x != 0.0 || ray.direction.y != 0.0 || ray.direction.z != 0.0)
+    intersect_result.hit = false;
+    /* 列表为空的 tile 不生成光线，只填充背景 */
+    if (root_count > 0)
     {
-        sphere_intersect(&intersect_result, sphere, &ray);
-        if (intersect_result.hit)
+        project_camera_generateRay(&ray, project_camera, x0, y0);
+        if (roots != 0)
         {
-          #if 1
-            float value = (intersect_result.distance / 200) * 255;
-            if (value > 255)
-            {
-                value = 255;
-            }
-            value = 255 - value;
-            pixel.x = value;
-            pixel.y = value;
-            pixel.z = value;
-          #else
-            pixel.x = (result.normal.x + 1) * 128;
-            pixel.y = (result.normal.y + 1) * 128;
-            pixel.z = (result.normal.z + 1) * 128;
-          #endif
+            scene_intersect_roots(&intersect_result, spheres, nodes, &ray, roots, root_count);
         }
         else
         {
-            /* 未相交时，保持原来的背景色 */
-          #if 0
-            /* 调试，写入红色 */
-            pixel.x = 0;
-            pixel.y = 0;
-            pixel.z = 255;
-          #endif
+            scene_intersect(&intersect_result, spheres, nodes, &ray);
         }
     }
+    if (intersect_result.hit)
+    {
+        fill = true;
+        id = intersect_result.id;
+        pixel = shade_hit(&intersect_result, pixel);
+    }
     else
     {
-        /* 影像平面上的点，不在摄像机视角范围内, 保持原来的背景色 */
-
+        /* 未相交时，保持原来的背景色 */
       #if 0
-        /* 调试，写入蓝色 */
-        pixel.x = 255;
+        /* 调试，写入红色 */
+        fill = true;
+        pixel.x = 0;
         pixel.y = 0;
-        pixel.z = 0;
+        pixel.z = 255;
       #endif
     }
-    
-    write_imageui(out_image, cord, pixel);
+
+    int x1 = min(x0 + pixel_step, width);
+    int y1 = min(y0 + pixel_step, height);
+    for (int y = y0; y < y1; ++y)
+    {
+        for (int x = x0; x < x1; ++x)
+        {
+            write_imageui(out_image, (int2)(x, y), fill ? pixel : checker_color(x, y));
+            if (ids != 0)
+            {
+                ids[y * width + x] = id;
+            }
+        }
+    }
+
+    return;
+}
+
+/********************************************************************************/
+
+/* 多视角批量渲染: 第三维为视角，每个 work-item 渲染一个视角中的一个像素，结果与 pixel_step 为 1 的
+ * render_project_depth 相同。cameras 为各视角已设置画面尺寸的摄像机，本次入队的第 k 个视角为 view_base + k，
+ * 其画面紧密排列在 out 中的第 k 幅，每像素 4 字节，字节顺序与 canvas 图像相同
+ */
+__kernel
+void render_project_depth_batch
+(
+    __global const project_camera_t *cameras,
+    __global sphere_t *spheres,
+    __global const bvh_node_t *nodes,
+    __global uchar *out,
+    int width,
+    int height,
+    int view_base
+)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int k = get_global_id(2);
+    if (x >= width || y >= height)
+    {
+        return;
+    }
+
+    ray_t ray;
+    intersect_result_t intersect_result;
+    project_camera_generateRay(&ray, &cameras[view_base + k], x, y);
+    scene_intersect(&intersect_result, spheres, nodes, &ray);
+
+    uint4 pixel = checker_color(x, y);
+    if (intersect_result.hit)
+    {
+        pixel = shade_hit(&intersect_result, pixel);
+    }
+    vstore4(convert_uchar4(pixel), ((size_t)k * height + y) * width + x, out);
+
+    return;
+}
+
+/********************************************************************************/
+
+/* 自适应抗锯齿，见 render.h 中 RENDER_AA_CONTRAST 的说明，两个常量须与 render.h 一致 */
+#define AA_CONTRAST 24
+#define AA_MAX_GRID 4
+
+__constant sampler_t aa_sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+static
+bool aa_differ(uint4 a, int id_a, uint4 b, int id_b)
+{
+    uint4 d = abs_diff(a, b);
+    return id_a != id_b || max(max(d.x, d.y), d.z) > AA_CONTRAST;
+}
+
+/* 与任一相邻像素命中的 sphere 不同或颜色差异过大的像素加入 edge_list，edge_count 须预先清零 */
+__kernel
+void render_aa_edges
+(
+    __read_only image2d_t in_image,
+    __global const int *ids,
+    __global int *edge_list,
+    __global int *edge_count
+)
+{
+    int width = get_image_width(in_image);
+    int height = get_image_height(in_image);
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= width || y >= height)
+    {
+        return;
+    }
+
+    int idx = y * width + x;
+    int id = ids[idx];
+    uint4 pixel = read_imageui(in_image, aa_sampler, (int2)(x, y));
+    bool edge = (x > 0 && aa_differ(pixel, id, read_imageui(in_image, aa_sampler, (int2)(x - 1, y)), ids[idx - 1])) ||
+        (x + 1 < width && aa_differ(pixel, id, read_imageui(in_image, aa_sampler, (int2)(x + 1, y)), ids[idx + 1])) ||
+        (y > 0 && aa_differ(pixel, id, read_imageui(in_image, aa_sampler, (int2)(x, y - 1)), ids[idx - width])) ||
+        (y + 1 < height && aa_differ(pixel, id, read_imageui(in_image, aa_sampler, (int2)(x, y + 1)), ids[idx + width]));
+    if (edge)
+    {
+        edge_list[atomic_inc(edge_count)] = idx;
+    }
 
     return;
 }
+
+/* 与 soft_render.h 中的 aa_hash 一致 */
+static
+uint aa_hash(uint x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+/* 窗口坐标 (wx, wy) 处一个采样的颜色，背景按采样位置所在的格子计算 */
+static
+uint4 trace_aa_sample
+(
+    __global project_camera_t *project_camera,
+    __global sphere_t *spheres,
+    __global const bvh_node_t *nodes,
+    float wx, float wy
+)
+{
+    int block_x = (int)floor(wx / CHECKER_SIZE);
+    int block_y = (int)floor(wy / CHECKER_SIZE);
+    uint4 pixel = ((block_x - block_y) & 0x01) ? (uint4)(255, 255, 255, 255) : (uint4)(0, 0, 0, 255);
+
+    ray_t ray;
+    intersect_result_t intersect_result;
+    project_camera_generateRay(&ray, project_camera, wx, wy);
+    scene_intersect(&intersect_result, spheres, nodes, &ray);
+    if (intersect_result.hit)
+    {
+        pixel = shade_hit(&intersect_result, pixel);
+    }
+
+    return pixel;
+}
+
+/* 对 edge_list 中的像素做 grid x grid 分层抖动采样，以平均值覆盖原来的颜色。
+ * work-item 个数固定，按 global size 为步长遍历 edge_list，host 不需要先取回边缘像素的个数
+ */
+__kernel
+void render_aa_resample
+(
+    __global project_camera_t *project_camera,
+    __global sphere_t *spheres,
+    __global const bvh_node_t *nodes,
+    __global const int *edge_list,
+    __global const int *edge_count,
+    __write_only image2d_t out_image,
+    int grid
+)
+{
+    int width = get_image_width(out_image);
+    int count = *edge_count;
+    int sample_count = grid * grid;
+    for (int k = get_global_id(0); k < count; k += get_global_size(0))
+    {
+        int idx = edge_list[k];
+        int x = idx % width;
+        int y = idx / width;
+
+        uint4 sum = (uint4)(0, 0, 0, 0);
+        uint seed = (uint)idx * (AA_MAX_GRID * AA_MAX_GRID);
+        for (int sy = 0; sy < grid; ++sy)
+        {
+            for (int sx = 0; sx < grid; ++sx)
+            {
+                uint jitter = aa_hash(seed + sy * grid + sx);
+                float wx = x - 0.5f + (sx + (jitter & 0xffff) / 65536.0f) / grid;
+                float wy = y - 0.5f + (sy + (jitter >> 16) / 65536.0f) / grid;
+                sum += trace_aa_sample(project_camera, spheres, nodes, wx, wy);
+            }
+        }
+        uint4 pixel = (sum + (uint)(sample_count / 2)) / (uint)sample_count;
+        pixel.w = 255;
+        write_imageui(out_image, (int2)(x, y), pixel);
+    }
+
+    return;
+}
+
+/********************************************************************************/
+
+/* wavefront 渲染，见 render.h 中 RENDER_REFLECTANCE 的说明，常量须与 render.h 一致 */
+#define WAVEFRONT_REFLECTANCE 0.3f
+
+/* 队列中的一条光线，只使用标量成员，weight 为其颜色对像素的贡献比例，pixel 为所属像素的下标 */
+typedef struct wavefront_ray
+{
+    float origin_x;
+    float origin_y;
+    float origin_z;
+    float direction_x;
+    float direction_y;
+    float direction_z;
+    float weight;
+    int pixel;
+} wavefront_ray_t;
+
+/* 求交的结果，id 为 -1 表示未命中 */
+typedef struct wavefront_hit
+{
+    int id;
+    float distance;
+} wavefront_hit_t;
+
+/* 在队列中为本 work-item 预留一个位置: 先在 work-group 内用 local 原子操作计数，
+ * 再由第一个 work-item 对全局计数做一次原子加，所有 work-item 都必须调用以满足 barrier 的要求
+ */
+static
+int wavefront_reserve
+(
+    bool push,
+    __local int *group_count,
+    __local int *group_base,
+    __global int *queue_count
+)
+{
+    bool first = get_local_id(0) == 0 && get_local_id(1) == 0;
+    if (first)
+    {
+        *group_count = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    int slot = push ? atomic_inc(group_count) : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (first)
+    {
+        *group_base = atomic_add(queue_count, *group_count);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    return *group_base + slot;
+}
+
+/* 生成阶段: 画面内的每个像素生成一条主光线加入队列。ray_count 须预先清零 */
+__kernel
+void wavefront_raygen
+(
+    __global project_camera_t *project_camera,
+    __global wavefront_ray_t *rays,
+    __global int *ray_count,
+    __global float4 *accum,
+    int width,
+    int height
+)
+{
+    __local int group_count;
+    __local int group_base;
+
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    bool inside = x < width && y < height;
+
+    /* 画面内的每个像素生成一条主光线，整个 work-group 都须参与 wavefront_reserve() */
+    int slot = wavefront_reserve(inside, &group_count, &group_base, ray_count);
+    if (!inside)
+    {
+        return;
+    }
+    ray_t ray;
+    project_camera_generateRay(&ray, project_camera, x, y);
+    int idx = y * width + x;
+    accum[idx] = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+    __global wavefront_ray_t *out = &rays[slot];
+    out->origin_x = ray.origin.x;
+    out->origin_y = ray.origin.y;
+    out->origin_z = ray.origin.z;
+    out->direction_x = ray.direction.x;
+    out->direction_y = ray.direction.y;
+    out->direction_z = ray.direction.z;
+    out->weight = 1.0f;
+    out->pixel = idx;
+}
+
+static
+ray_t wavefront_load_ray(__global const wavefront_ray_t *in)
+{
+    ray_t ray;
+    ray.origin = (float3)(in->origin_x, in->origin_y, in->origin_z);
+    ray.direction = (float3)(in->direction_x, in->direction_y, in->direction_z);
+    return ray;
+}
+
+/* 求交阶段: 队列中的前 count 条光线与场景求交 */
+__kernel
+void wavefront_intersect
+(
+    __global sphere_t *spheres,
+    __global const bvh_node_t *nodes,
+    __global const wavefront_ray_t *rays,
+    int count,
+    __global wavefront_hit_t *hits
+)
+{
+    int k = get_global_id(0);
+    if (k >= count)
+    {
+        return;
+    }
+
+    ray_t ray = wavefront_load_ray(&rays[k]);
+    intersect_result_t intersect_result;
+    scene_intersect(&intersect_result, spheres, nodes, &ray);
+    hits[k].id = intersect_result.hit ? intersect_result.id : -1;
+    hits[k].distance = intersect_result.distance;
+}
+
+/* 着色阶段: 按求交结果累加颜色，spawn 非 0 时命中的光线发射镜面反射光线加入 next_rays。
+ * 每个像素同时最多只有一条光线，累加不需要原子操作。next_count 须预先清零
+ */
+__kernel
+void wavefront_shade
+(
+    __global sphere_t *spheres,
+    __global const wavefront_ray_t *rays,
+    int count,
+    __global const wavefront_hit_t *hits,
+    __global float4 *accum,
+    int width,
+    int spawn,
+    __global wavefront_ray_t *next_rays,
+    __global int *next_count
+)
+{
+    __local int group_count;
+    __local int group_base;
+
+    int k = get_global_id(0);
+    bool active = k < count;
+    bool hit = active && hits[k].id >= 0;
+    int slot = wavefront_reserve(hit && spawn, &group_count, &group_base, next_count);
+    if (!active)
+    {
+        return;
+    }
+
+    ray_t ray = wavefront_load_ray(&rays[k]);
+    float weight = rays[k].weight;
+    int idx = rays[k].pixel;
+    /* 未命中时取该像素的背景色，反射光线同样如此 */
+    uint4 pixel = checker_color(idx % width, idx / width);
+    if (!hit)
+    {
+        accum[idx] += convert_float4(pixel) * weight;
+        return;
+    }
+
+    intersect_result_t intersect_result;
+    intersect_result.distance = hits[k].distance;
+    intersect_result.position = ray_getpoint(&ray, intersect_result.distance);
+    intersect_result.normal = normalize(intersect_result.position - spheres[hits[k].id].center);
+    pixel = shade_hit(&intersect_result, pixel);
+    if (!spawn)
+    {
+        accum[idx] += convert_float4(pixel) * weight;
+        return;
+    }
+    accum[idx] += convert_float4(pixel) * (weight * (1.0f - WAVEFRONT_REFLECTANCE));
+
+    /* 镜面反射，起点沿法线稍作偏移以免与自身相交 */
+    float3 normal = intersect_result.normal;
+    float3 origin = intersect_result.position + normal * 1e-3f;
+    float3 direction = ray.direction - normal * (2.0f * dot(ray.direction, normal));
+    __global wavefront_ray_t *out = &next_rays[slot];
+    out->origin_x = origin.x;
+    out->origin_y = origin.y;
+    out->origin_z = origin.z;
+    out->direction_x = direction.x;
+    out->direction_y = direction.y;
+    out->direction_z = direction.z;
+    out->weight = weight * WAVEFRONT_REFLECTANCE;
+    out->pixel = idx;
+}
+
+/* 累加的颜色四舍五入写入画布 */
+__kernel
+void wavefront_resolve
+(
+    __global const float4 *accum,
+    __write_only image2d_t out_image
+)
+{
+    int width = get_image_width(out_image);
+    int height = get_image_height(out_image);
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= width || y >= height)
+    {
+        return;
+    }
+
+    uint4 pixel = convert_uint4_sat(accum[y * width + x] + 0.5f);
+    pixel.w = 255;
+    write_imageui(out_image, (int2)(x, y), pixel);
+}
@@ -0,0 +1,211 @@
+
+#ifndef RENDER_H
+#define RENDER_H
+
+/* 各渲染实现对外的接口，pixel 为 BGRA 格式、行跨度为 pitch 字节的画布 */
+
+#include "common.h"
+
+#include <stdint.h>
+
+/* host 端修改过、需要在下一帧之前重新上传的数据 */
+#define RENDER_DIRTY_CAMERA  0x01
+#define RENDER_DIRTY_SPHERES 0x02
+#define RENDER_DIRTY_NODES   0x04
+#define RENDER_DIRTY_SCENE   (RENDER_DIRTY_SPHERES | RENDER_DIRTY_NODES)
+
+/* 预览渲染时每个像素块的边长上限，pixel_step 须为不超过该值的 2 的幂 */
+#define RENDER_MAX_PIXEL_STEP 16
+
+/* 自适应抗锯齿: 每像素一条光线渲染之后，与相邻像素命中的 sphere 不同、或任一颜色分量之差超过
+ * RENDER_AA_CONTRAST 的像素被视为边缘，只对边缘像素按 grid x grid 分层抖动采样并取平均。
+ * grid 取 2 ~ RENDER_AA_MAX_GRID，为 1 时关闭; 预览 (pixel_step > 1) 时不做抗锯齿
+ */
+#define RENDER_AA_CONTRAST 24
+#define RENDER_AA_MAX_GRID 4
+
+/* 最近一帧的采样统计 */
+typedef struct render_aa_stats
+{
+    uint64_t pixel_count;
+    /* 被标记为边缘、重新采样的像素数 */
+    uint64_t edge_pixel_count;
+    /* 发射的主光线总数 */
+    uint64_t sample_count;
+} render_aa_stats_t;
+
+/* wavefront 渲染: 光线生成、求交、着色为独立的阶段，阶段之间以紧凑的光线队列连接。
+ * 着色时命中的光线保留 1 - RENDER_REFLECTANCE 的颜色，其余由镜面反射光线在下一轮求交和着色中贡献，
+ * 直到队列为空或达到 bounces 次反射，未命中的光线取所属像素的背景色。bounces 为 0 时输出与逐像素渲染相同
+ */
+#define RENDER_MAX_BOUNCES 8
+#define RENDER_REFLECTANCE 0.3f
+
+typedef struct render_wavefront_stats
+{
+    uint64_t pixel_count;
+    /* 求交的轮数和每一轮的光线个数 */
+    int pass_count;
+    uint64_t ray_counts[RENDER_MAX_BOUNCES + 1];
+    uint64_t ray_count;
+} render_wavefront_stats_t;
+
+/* 增量渲染: 场景中部分物体变化之后调用 *_render_scene_changed() 提交变化，下一帧只重新渲染变化前后的包围球
+ * 在屏幕上覆盖的 RENDER_DIRTY_TILE_SIZE 大小的 tile，其余像素保留上一帧的结果。
+ * 移动时 old 和 new 均有效，新增的 old_radius 为 0，删除的 new_radius 为 0; 提交之前须更新场景和 BVH。
+ * 只考虑主光线: 摄像机、画面尺寸、渲染参数与上一帧不同，预览，变化超过 RENDER_MAX_CHANGES 个，
+ * 或开启抗锯齿时新增、删除了物体，都整帧重新渲染; wavefront 渲染总是整帧渲染
+ */
+#define RENDER_DIRTY_TILE_SIZE 32
+#define RENDER_MAX_CHANGES 4096
+
+typedef struct render_change
+{
+    point_t old_center;
+    float old_radius;
+    point_t new_center;
+    float new_radius;
+} render_change_t;
+
+/* 多视角批量渲染: 同一场景按 cameras 中 view_count 个摄像机各渲染一幅 w x h 的画面，依次紧密排列在 pixel 中，
+ * 第 v 幅从 pixel + v * w * h * 4 开始，行跨度为 w * 4 字节; 摄像机不必预先设置画面尺寸。
+ * 结果与 pixel_step 为 1、不做抗锯齿时逐个视角渲染相同，不改变 *_set_camera() 设置的摄像机和增量渲染的状态
+ */
+
+/* 渲染设备的公共接口，soft_render.c 和 cl_render.c 各实现一个。
+ * render_region 渲染 w x h 画面中 [y0, y1) 的行并写入 pixel 中对应的行，y0 须为 RENDER_MAX_PIXEL_STEP 的整数倍;
+ * 可以异步执行，wait 返回之后输出才完整，elapsed_ns 为从提交到完成的耗时。
+ * 摄像机、渲染选项和 pixel_step 对整个画面有效，render_region 之后、wait 之前不能修改; 不做抗锯齿
+ */
+typedef struct render_backend
+{
+    const char *name;
+    int (*init)(const char *ocl_source_file, int w, int h);
+    void (*uninit)(void);
+    void (*set_scene)(const scene_t *scene);
+    int (*set_options)(const render_options_t *options);
+    void (*set_camera)(const project_camera_t *camera);
+    int (*set_pixel_step)(int pixel_step);
+    int (*render_region)(uint8_t* pixel, int w, int h, int pitch, int y0, int y1);
+    int (*wait)(uint64_t *elapsed_ns);
+} render_backend_t;
+
+extern const render_backend_t g_soft_render_backend;
+extern const render_backend_t g_cl_render_backend;
+
+/* 混合渲染: 每帧按行把画面分给 OpenCL 设备 (上部) 和 CPU 线程池 (下部)，两者同时渲染，
+ * 按各自实测的每行耗时重新计算下一帧的分割位置，使两者尽量同时完成
+ */
+typedef struct render_hybrid_stats
+{
+    /* 本帧的分割行，[0, split_row) 由设备渲染 */
+    int split_row;
+    double device_ms;
+    double host_ms;
+    /* 下一帧分给设备的行的比例 */
+    double device_share;
+} render_hybrid_stats_t;
+
+/* hybrid_render.c */
+/* 分割比例回到初始值，画面尺寸或场景大幅变化时调用 */
+extern void hybrid_render_reset(void);
+extern int render_project_depth_hybrid(uint8_t* pixel, int w, int h, int pitch);
+extern void hybrid_render_stats(render_hybrid_stats_t *stats);
+
+/* 多设备渲染的设备数上限 */
+#define RENDER_MAX_CL_DEVICES 8
+
+typedef struct render_device_stats
+{
+    char name[64];
+    int tile_count;
+    double busy_ms;
+} render_device_stats_t;
+
+typedef struct render_multi_stats
+{
+    int device_count;
+    int tile_count;
+    double frame_ms;
+    render_device_stats_t devices[RENDER_MAX_CL_DEVICES];
+} render_multi_stats_t;
+
+/* cl_multi_render.c */
+/* 使用所有平台上全部可用的设备 (RAY_TRACE_CL_DEVICE 可限定类型)，每个设备一个 context 和队列，
+ * 各设备动态领取 tile。只渲染主光线，不做抗锯齿和增量渲染
+ */
+extern int init_cl_multi_render(const char *ocl_source_file);
+extern void uninit_cl_multi_render(void);
+extern int cl_multi_render_device_count(void);
+/* 只使用前 count 个设备，用于比较不同设备数的吞吐 */
+extern int cl_multi_render_set_active_devices(int count);
+extern void cl_multi_render_set_scene(const scene_t *scene);
+/* 场景数据在 host 端修改之后调用，下一帧重新上传到各设备 */
+extern void cl_multi_render_scene_changed(void);
+extern int cl_multi_render_set_options(const render_options_t *options);
+extern void cl_multi_render_set_camera(const project_camera_t *camera);
+extern int cl_multi_render_set_pixel_step(int pixel_step);
+extern void cl_multi_render_stats(render_multi_stats_t *stats);
+extern int render_project_depth_opencl_multi(uint8_t* pixel, int w, int h, int pitch);
+
+/* cl_render.c */
+extern int init_cl_rendler(const char *ocl_source_file, int w, int h);
+extern void uninit_cl_render(void);
+extern int cl_render_resize(int w, int h);
+/* program 是否从磁盘缓存加载，以及读取源码到编译完成的耗时 */
+extern void cl_render_program_info(int *from_cache, uint64_t *load_ns);
+extern void cl_render_set_scene(const scene_t *scene);
+/* 切换到 options 对应的 kernel 变体，首次使用的组合会先编译 */
+extern int cl_render_set_options(const render_options_t *options);
+/* options 对应的 -D 编译选项，cl_multi_render.c 以同样的选项编译，两者共用磁盘缓存 */
+#define CL_RENDER_BUILD_OPTIONS_SIZE 128
+extern void cl_render_build_options(char *build_options, int size, const render_options_t *options);
+extern void cl_render_set_camera(const project_camera_t *camera);
+extern void cl_render_mark_dirty(unsigned int flags);
+/* 大于 1 时每 pixel_step x pixel_step 的像素块只发射一条光线，供交互时快速预览，默认为 1 */
+extern int cl_render_set_pixel_step(int pixel_step);
+extern int cl_render_set_antialias(int grid);
+/* 流水线渲染时为最近一次取回的帧的统计 */
+extern void cl_render_antialias_stats(render_aa_stats_t *stats);
+extern int render_gradient_opencl(uint8_t* pixel, int w, int h, int pitch);
+extern int render_project_depth_opencl(uint8_t* pixel, int w, int h, int pitch);
+extern int cl_render_set_pipeline_depth(int depth);
+extern int render_project_depth_opencl_pipelined(uint8_t* pixel, int w, int h, int pitch);
+extern int cl_render_pipeline_flush(uint8_t* pixel, int pitch);
+extern int cl_render_set_bounces(int bounces);
+extern void cl_render_wavefront_stats(render_wavefront_stats_t *stats);
+extern int render_project_depth_opencl_wavefront(uint8_t* pixel, int w, int h, int pitch);
+/* 以 (x, y, 视角) 的 3D NDRange 一次入队多个视角，视角过多时分批入队并与读回重叠 */
+extern int render_project_depth_opencl_batch(uint8_t* pixel, int w, int h, const project_camera_t *cameras, int view_count);
+/* 同时标记场景数据需要重新上传，增量渲染只对 render_project_depth_opencl() 有效，
+ * 上一帧保留在设备上的画布中，每帧仍读回整个画面
+ */
+extern void cl_render_scene_changed(const render_change_t *changes, int count);
+/* 下一帧整帧渲染 */
+extern void cl_render_invalidate_frame(void);
+
+/* soft_render.c */
+extern void soft_render_set_scene(const scene_t *scene);
+extern void soft_render_set_options(const render_options_t *options);
+extern void soft_render_set_camera(const project_camera_t *camera);
+extern int soft_render_set_pixel_step(int pixel_step);
+extern int soft_render_set_antialias(int grid);
+extern void soft_render_antialias_stats(render_aa_stats_t *stats);
+extern void render_gradient_soft(uint8_t* pixel, int w, int h, int pitch);
+extern void render_project_depth_soft(uint8_t* pixel, int w, int h, int pitch);
+extern void render_project_depth_soft_mt(uint8_t* pixel, int w, int h, int pitch);
+extern void render_project_depth_soft_simd(uint8_t* pixel, int w, int h, int pitch);
+extern int soft_render_set_bounces(int bounces);
+extern void soft_render_wavefront_stats(render_wavefront_stats_t *stats);
+extern void render_project_depth_soft_wavefront(uint8_t* pixel, int w, int h, int pitch);
+/* 各视角先并行建立分箱，再由线程池按视角依次排列的 tile 渲染 */
+extern int render_project_depth_soft_batch(uint8_t* pixel, int w, int h, const project_camera_t *cameras, int view_count);
+/* 增量渲染对 soft、soft_simd、soft_mt 有效，pixel 中须保留上一帧的结果 */
+extern void soft_render_scene_changed(const render_change_t *changes, int count);
+/* pixel 中不再是上一帧的结果时调用，下一帧整帧渲染 */
+extern void soft_render_invalidate_frame(void);
+
+/* soft_render_simd.c */
+extern const char* soft_simd_init(void);
+
+#endif
@@ -0,0 +1,461 @@
+
+#include "common.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+/* 叶节点最多包含的 sphere 数，超过时即使 SAH 代价不划算也继续划分 */
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_BIN_COUNT 16
+/* 遍历一个内部节点相对于求交一个 sphere 的代价 */
+#define BVH_TRAVERSAL_COST 1.0f
+
+typedef struct aabb
+{
+    float min[3];
+    float max[3];
+} aabb_t;
+
+static
+void aabb_reset(aabb_t *box)
+{
+    box->min[0] = box->min[1] = box->min[2] = FLT_MAX;
+    box->max[0] = box->max[1] = box->max[2] = -FLT_MAX;
+}
+
+static
+void aabb_grow(aabb_t *box, const aabb_t *other)
+{
+    for (int k = 0; k < 3; ++k)
+    {
+        if (other->min[k] < box->min[k])
+        {
+            box->min[k] = other->min[k];
+        }
+        if (other->max[k] > box->max[k])
+        {
+            box->max[k] = other->max[k];
+        }
+    }
+}
+
+static
+void aabb_grow_point(aabb_t *box, const float p[3])
+{
+    for (int k = 0; k < 3; ++k)
+    {
+        if (p[k] < box->min[k])
+        {
+            box->min[k] = p[k];
+        }
+        if (p[k] > box->max[k])
+        {
+            box->max[k] = p[k];
+        }
+    }
+}
+
+/* 包围盒略微放大，避免 slab 测试的舍入误差漏掉球面边缘的切线 */
+static
+void sphere_bounds(aabb_t *box, const sphere_t *sphere)
+{
+    float r = sphere->radius * 1.0001f + 1e-4f;
+    box->min[0] = sphere->center.x - r;
+    box->min[1] = sphere->center.y - r;
+    box->min[2] = sphere->center.z - r;
+    box->max[0] = sphere->center.x + r;
+    box->max[1] = sphere->center.y + r;
+    box->max[2] = sphere->center.z + r;
+}
+
+static
+void set_node_bounds(bvh_node_t *node, const aabb_t *box)
+{
+    node->min_x = box->min[0];
+    node->min_y = box->min[1];
+    node->min_z = box->min[2];
+    node->max_x = box->max[0];
+    node->max_y = box->max[1];
+    node->max_z = box->max[2];
+}
+
+static
+float aabb_area(const aabb_t *box)
+{
+    float dx = box->max[0] - box->min[0];
+    float dy = box->max[1] - box->min[1];
+    float dz = box->max[2] - box->min[2];
+    if (dx < 0 || dy < 0 || dz < 0)
+    {
+        return 0;
+    }
+    return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+/* 构建过程中使用的临时数据 */
+typedef struct bvh_builder
+{
+    const sphere_t *spheres;
+    aabb_t *bounds;
+    float (*centroids)[3];
+    int *indices;
+
+    bvh_node_t *nodes;
+    int node_count;
+} bvh_builder_t;
+
+static
+void make_leaf(bvh_node_t *node, int first, int count)
+{
+    node->left_first = first;
+    node->count = count;
+}
+
+static
+void build_node(bvh_builder_t *builder, int node_idx, int first, int count, int depth)
+{
+    bvh_node_t *node = &builder->nodes[node_idx];
+    int *indices = builder->indices + first;
+
+    aabb_t node_box, centroid_box;
+    aabb_reset(&node_box);
+    aabb_reset(&centroid_box);
+    for (int i = 0; i < count; ++i)
+    {
+        aabb_grow(&node_box, &builder->bounds[indices[i]]);
+        aabb_grow_point(&centroid_box, builder->centroids[indices[i]]);
+    }
+    set_node_bounds(node, &node_box);
+
+    /* 剩余深度需要留给遍历栈，到达上限后直接做成叶节点 */
+    if (count <= 2 || depth >= BVH_STACK_SIZE - 2)
+    {
+        make_leaf(node, first, count);
+        return;
+    }
+
+    /* 在三个轴上分桶，计算每个桶边界作为划分面的 SAH 代价 */
+    int best_axis = -1;
+    int best_split = 0;
+    float best_cost = FLT_MAX;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float extent = centroid_box.max[axis] - centroid_box.min[axis];
+        if (extent <= 0)
+        {
+            continue;
+        }
+
+        aabb_t bin_box[BVH_BIN_COUNT];
+        int bin_count[BVH_BIN_COUNT];
+        for (int b = 0; b < BVH_BIN_COUNT; ++b)
+        {
+            aabb_reset(&bin_box[b]);
+            bin_count[b] = 0;
+        }
+
+        float scale = BVH_BIN_COUNT / extent;
+        for (int i = 0; i < count; ++i)
+        {
+            int b = (int)((builder->centroids[indices[i]][axis] - centroid_box.min[axis]) * scale);
+            if (b >= BVH_BIN_COUNT)
+            {
+                b = BVH_BIN_COUNT - 1;
+            }
+            bin_count[b]++;
+            aabb_grow(&bin_box[b], &builder->bounds[indices[i]]);
+        }
+
+        /* 从右向左累积，得到每个划分面右侧的面积和数量 */
+        float right_area[BVH_BIN_COUNT];
+        int right_count[BVH_BIN_COUNT];
+        aabb_t acc_box;
+        int acc_count = 0;
+        aabb_reset(&acc_box);
+        for (int b = BVH_BIN_COUNT - 1; b > 0; --b)
+        {
+            aabb_grow(&acc_box, &bin_box[b]);
+            acc_count += bin_count[b];
+            right_area[b] = aabb_area(&acc_box);
+            right_count[b] = acc_count;
+        }
+
+        aabb_reset(&acc_box);
+        acc_count = 0;
+        for (int b = 1; b < BVH_BIN_COUNT; ++b)
+        {
+            aabb_grow(&acc_box, &bin_box[b - 1]);
+            acc_count += bin_count[b - 1];
+            if (acc_count == 0 || right_count[b] == 0)
+            {
+                continue;
+            }
+            float cost = aabb_area(&acc_box) * acc_count + right_area[b] * right_count[b];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+            }
+        }
+    }
+
+    if (best_axis < 0)
+    {
+        /* 所有中心点重合时无法按空间划分，数量过多则按下标对半分 */
+        if (count <= BVH_MAX_LEAF_SIZE)
+        {
+            make_leaf(node, first, count);
+            return;
+        }
+
+        int left_count = count / 2;
+        int left_idx = builder->node_count;
+        builder->node_count += 2;
+        node->left_first = left_idx;
+        node->count = 0;
+        build_node(builder, left_idx, first, left_count, depth + 1);
+        build_node(builder, left_idx + 1, first + left_count, count - left_count, depth + 1);
+        return;
+    }
+
+    float node_area = aabb_area(&node_box);
+    float split_cost = BVH_TRAVERSAL_COST + (node_area > 0 ? best_cost / node_area : 0);
+    if (split_cost >= (float)count && count <= BVH_MAX_LEAF_SIZE)
+    {
+        make_leaf(node, first, count);
+        return;
+    }
+
+    /* 按选中的桶边界原地划分 */
+    float scale = BVH_BIN_COUNT / (centroid_box.max[best_axis] - centroid_box.min[best_axis]);
+    int i = 0;
+    int j = count - 1;
+    while (i <= j)
+    {
+        int b = (int)((builder->centroids[indices[i]][best_axis] - centroid_box.min[best_axis]) * scale);
+        if (b >= BVH_BIN_COUNT)
+        {
+            b = BVH_BIN_COUNT - 1;
+        }
+        if (b < best_split)
+        {
+            i++;
+        }
+        else
+        {
+            int tmp = indices[i];
+            indices[i] = indices[j];
+            indices[j] = tmp;
+            j--;
+        }
+    }
+
+    int left_count = i;
+    int left_idx = builder->node_count;
+    builder->node_count += 2;
+    node->left_first = left_idx;
+    node->count = 0;
+    build_node(builder, left_idx, first, left_count, depth + 1);
+    build_node(builder, left_idx + 1, first + left_count, count - left_count, depth + 1);
+
+    return;
+}
+
+int scene_init(scene_t *scene)
+{
+    memset(scene, 0, sizeof(*scene));
+    return 0;
+}
+
+void scene_uninit(scene_t *scene)
+{
+    if (scene->mapping != NULL)
+    {
+        scene_unmap_file(scene);
+    }
+    else
+    {
+        free(scene->spheres);
+        free(scene->nodes);
+    }
+    memset(scene, 0, sizeof(*scene));
+}
+
+int scene_add_sphere(scene_t *scene, const point_t *center, float radius)
+{
+    /* 映射的场景大小固定，只能原地修改 */
+    if (scene->mapping != NULL)
+    {
+        printf("scene_add_sphere, scene is mapped from file\n");
+        return -1;
+    }
+
+    if (scene->sphere_count == scene->sphere_capacity)
+    {
+        int capacity = scene->sphere_capacity > 0 ? scene->sphere_capacity * 2 : 16;
+        sphere_t *spheres = (sphere_t*)realloc(scene->spheres, sizeof(sphere_t) * capacity);
+        if (spheres == NULL)
+        {
+            return -1;
+        }
+        scene->spheres = spheres;
+        scene->sphere_capacity = capacity;
+    }
+
+    sphere_t *sphere = &scene->spheres[scene->sphere_count++];
+    memset(sphere, 0, sizeof(*sphere));
+    sphere->center = *center;
+    sphere->radius = radius;
+    sphere->sqr_radius = radius * radius;
+
+    return 0;
+}
+
+int scene_build_bvh(scene_t *scene)
+{
+    int count = scene->sphere_count;
+    if (count == 0 || scene->mapping != NULL)
+    {
+        return -1;
+    }
+
+    bvh_builder_t builder;
+    memset(&builder, 0, sizeof(builder));
+    builder.spheres = scene->spheres;
+    builder.bounds = (aabb_t*)malloc(sizeof(aabb_t) * count);
+    builder.centroids = (float(*)[3])malloc(sizeof(float[3]) * count);
+    builder.indices = (int*)malloc(sizeof(int) * count);
+    /* 每个叶节点至少一个 sphere, 二叉树节点数不超过 2N - 1 */
+    builder.nodes = (bvh_node_t*)malloc(sizeof(bvh_node_t) * (2 * count - 1));
+    sphere_t *sorted = (sphere_t*)malloc(sizeof(sphere_t) * scene->sphere_capacity);
+    if (builder.bounds == NULL || builder.centroids == NULL || builder.indices == NULL ||
+        builder.nodes == NULL || sorted == NULL)
+    {
+        free(builder.bounds);
+        free(builder.centroids);
+        free(builder.indices);
+        free(builder.nodes);
+        free(sorted);
+        return -1;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        const sphere_t *sphere = &scene->spheres[i];
+        sphere_bounds(&builder.bounds[i], sphere);
+        builder.centroids[i][0] = sphere->center.x;
+        builder.centroids[i][1] = sphere->center.y;
+        builder.centroids[i][2] = sphere->center.z;
+        builder.indices[i] = i;
+    }
+
+    builder.node_count = 1;
+    build_node(&builder, 0, 0, count, 0);
+
+    /* 按叶节点顺序重排 spheres, 叶节点直接引用连续的区间 */
+    for (int i = 0; i < count; ++i)
+    {
+        sorted[i] = scene->spheres[builder.indices[i]];
+    }
+    free(scene->spheres);
+    scene->spheres = sorted;
+
+    free(scene->nodes);
+    scene->nodes = (bvh_node_t*)realloc(builder.nodes, sizeof(bvh_node_t) * builder.node_count);
+    if (scene->nodes == NULL)
+    {
+        scene->nodes = builder.nodes;
+    }
+    scene->node_count = builder.node_count;
+
+    free(builder.bounds);
+    free(builder.centroids);
+    free(builder.indices);
+
+    return 0;
+}
+
+int scene_refit_bvh(scene_t *scene)
+{
+    if (scene->node_count == 0)
+    {
+        return -1;
+    }
+
+    /* 构建时子节点总是排在父节点之后，倒序遍历即可先得到子节点的包围盒 */
+    for (int i = scene->node_count - 1; i >= 0; --i)
+    {
+        bvh_node_t *node = &scene->nodes[i];
+        aabb_t node_box;
+        aabb_reset(&node_box);
+        if (node->count > 0)
+        {
+            for (int k = node->left_first; k < node->left_first + node->count; ++k)
+            {
+                aabb_t box;
+                sphere_bounds(&box, &scene->spheres[k]);
+                aabb_grow(&node_box, &box);
+            }
+        }
+        else
+        {
+            for (int k = node->left_first; k < node->left_first + 2; ++k)
+            {
+                const bvh_node_t *child = &scene->nodes[k];
+                aabb_t box = {{child->min_x, child->min_y, child->min_z}, {child->max_x, child->max_y, child->max_z}};
+                aabb_grow(&node_box, &box);
+            }
+        }
+        set_node_bounds(node, &node_box);
+    }
+
+    return 0;
+}
+
+/* 固定种子的线性同余随机数，保证各平台生成的场景一致 */
+static
+float scene_random(uint32_t *seed)
+{
+    *seed = *seed * 1664525u + 1013904223u;
+    return (*seed >> 8) * (1.0f / 16777216.0f);
+}
+
+int setup_scene(scene_t *scene, int random_sphere_count)
+{
+    scene_init(scene);
+
+    sphere_t sphere;
+    setup_sphere(&sphere);
+    if (scene_add_sphere(scene, &sphere.center, sphere.radius) != 0)
+    {
+        return -1;
+    }
+
+    /* 小球分布在摄像机前方、影像平面之后的区域 */
+    uint32_t seed = 20180816;
+    for (int i = 0; i < random_sphere_count; ++i)
+    {
+        point_t center;
+        center.x = -400 + scene_random(&seed) * 1440;
+        center.y = -300 + scene_random(&seed) * 1080;
+        center.z = -800 + scene_random(&seed) * 780;
+        float radius = 2 + scene_random(&seed) * 10;
+        if (scene_add_sphere(scene, &center, radius) != 0)
+        {
+            scene_uninit(scene);
+            return -1;
+        }
+    }
+
+    if (scene_build_bvh(scene) != 0)
+    {
+        scene_uninit(scene);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,169 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* 将文本场景转换为 scene_load_file() 使用的二进制场景文件，转换时构建 BVH。
+ * 文本格式每行一条记录，# 之后为注释:
+ *   sphere <x> <y> <z> <radius>
+ *   camera <eye x> <eye y> <eye z> <left fov> <right fov> <top fov> <bottom fov> [<front x> <front y> <front z> [<up x> <up y> <up z>]]
+ * 视角为视线与视野各边界的夹角，单位为度，须在 (0, 90) 之内; 观察方向默认为 -z，上方默认为 +y
+ * 也可以用 --default <n> 输出默认场景加上 n 个随机小球，用于生成大场景
+ */
+
+static
+void print_usage(const char *program)
+{
+    printf("usage: %s <input.txt> <output.rtscene>\n", program);
+    printf("       %s --default <random sphere count> <output.rtscene>\n", program);
+}
+
+static
+int parse_text_scene(scene_t *scene, project_camera_t *camera, int *has_camera, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        printf("failed to open %s\n", path);
+        return -1;
+    }
+
+    scene_init(scene);
+    *has_camera = 0;
+
+    char line[512];
+    int line_no = 0;
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), fp) != NULL)
+    {
+        line_no++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+        {
+            *comment = '\0';
+        }
+
+        char keyword[16];
+        int consumed = 0;
+        if (sscanf(line, "%15s%n", keyword, &consumed) != 1)
+        {
+            continue;
+        }
+
+        const char *args = line + consumed;
+        if (strcmp(keyword, "sphere") == 0)
+        {
+            point_t center;
+            float radius;
+            if (sscanf(args, "%f %f %f %f", &center.x, &center.y, &center.z, &radius) != 4 || radius <= 0)
+            {
+                printf("%s:%d: invalid sphere\n", path, line_no);
+                ret = -1;
+            }
+            else if (scene_add_sphere(scene, &center, radius) != 0)
+            {
+                printf("%s:%d: out of memory\n", path, line_no);
+                ret = -1;
+            }
+        }
+        else if (strcmp(keyword, "camera") == 0)
+        {
+            point_t eye;
+            float fov[4];
+            direction_t front = {0.0f, 0.0f, -1.0f};
+            direction_t up = {0.0f, 1.0f, 0.0f};
+            int n = sscanf(args, "%f %f %f %f %f %f %f %f %f %f %f %f %f", &eye.x, &eye.y, &eye.z,
+                &fov[0], &fov[1], &fov[2], &fov[3], &front.x, &front.y, &front.z, &up.x, &up.y, &up.z);
+            int valid = n == 7 || n == 10 || n == 13;
+            for (int k = 0; k < 4; ++k)
+            {
+                valid = valid && fov[k] > 0 && fov[k] < 90;
+            }
+            valid = valid && (front.x != 0 || front.y != 0 || front.z != 0);
+            if (!valid)
+            {
+                printf("%s:%d: invalid camera\n", path, line_no);
+                ret = -1;
+            }
+            else
+            {
+                project_camera_init(camera, &eye, &front, fov[0], fov[1], fov[2], fov[3]);
+                project_camera_set_up(camera, &up);
+                *has_camera = 1;
+            }
+        }
+        else
+        {
+            printf("%s:%d: unknown record: %s\n", path, line_no, keyword);
+            ret = -1;
+        }
+    }
+    fclose(fp);
+
+    if (ret == 0 && scene->sphere_count == 0)
+    {
+        printf("%s: no sphere\n", path);
+        ret = -1;
+    }
+    if (ret == 0 && scene_build_bvh(scene) != 0)
+    {
+        printf("%s: failed to build bvh\n", path);
+        ret = -1;
+    }
+    if (ret != 0)
+    {
+        scene_uninit(scene);
+    }
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    scene_t scene;
+    project_camera_t camera;
+    int has_camera = 0;
+    const char *output;
+
+    uint64_t ts1 = now_ns();
+    if (argc == 4 && strcmp(argv[1], "--default") == 0)
+    {
+        int random_sphere_count = atoi(argv[2]);
+        if (random_sphere_count < 0 || setup_scene(&scene, random_sphere_count) != 0)
+        {
+            printf("setup_scene() failed, sphere count: %d\n", random_sphere_count + 1);
+            return -1;
+        }
+        setup_project_camera(&camera);
+        has_camera = 1;
+        output = argv[3];
+    }
+    else if (argc == 3)
+    {
+        if (parse_text_scene(&scene, &camera, &has_camera, argv[1]) != 0)
+        {
+            return -1;
+        }
+        output = argv[2];
+    }
+    else
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+    uint64_t ts2 = now_ns();
+
+    int ret = scene_save_file(&scene, has_camera ? &camera : NULL, output);
+    uint64_t ts3 = now_ns();
+    if (ret == 0)
+    {
+        printf("%s, spheres: %d, bvh nodes: %d, build %.3fms, write %.3fms\n", output,
+            scene.sphere_count, scene.node_count, (ts2 - ts1) / 1e6, (ts3 - ts2) / 1e6);
+    }
+    scene_uninit(&scene);
+
+    return ret == 0 ? 0 : -1;
+}
@@ -0,0 +1,378 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* 文件布局: 文件头 | spheres | nodes，各段的起始位置和文件末尾按 SCENE_FILE_ALIGN 对齐，不足部分补 0。
+ * 所有数值按写入机器的字节序保存，byte_order 不一致时拒绝加载
+ */
+#define SCENE_FILE_MAGIC "RTSCENE"
+#define SCENE_FILE_BYTE_ORDER 0x01020304u
+#define SCENE_FILE_HAS_CAMERA 0x01u
+
+/* 文件中只保存摄像机的字面属性，加载时由 project_camera_init() 重新计算其余属性; 大小固定为 64 字节 */
+typedef struct scene_file_camera
+{
+    float eye[3];
+    float front[3];
+    float up[3];
+    /* left, right, top, bottom，单位为度 */
+    float fov[4];
+    uint32_t reserved[3];
+} scene_file_camera_t;
+
+typedef struct scene_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t byte_order;
+    uint32_t flags;
+    uint64_t file_size;
+
+    uint32_t sphere_count;
+    /* 写入时的 sizeof(sphere_t) 和 sizeof(bvh_node_t)，用于检查内存布局是否一致 */
+    uint32_t sphere_size;
+    uint64_t spheres_offset;
+    uint32_t node_count;
+    uint32_t node_size;
+    uint64_t nodes_offset;
+
+    scene_file_camera_t camera;
+
+    /* 文件头的 FNV-1a 校验值，计算时该字段为 0。数组内容不做校验，加载时不需要读取整个文件 */
+    uint32_t checksum;
+    uint32_t reserved[31];
+} scene_file_header_t;
+
+/* 文件头大小固定为 256 字节 */
+typedef char scene_file_camera_size_check[sizeof(scene_file_camera_t) == 64 ? 1 : -1];
+typedef char scene_file_header_size_check[sizeof(scene_file_header_t) == 256 ? 1 : -1];
+
+static
+uint32_t header_checksum(const scene_file_header_t *header)
+{
+    scene_file_header_t copy = *header;
+    copy.checksum = 0;
+
+    const uint8_t *p = (const uint8_t*)&copy;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(copy); ++i)
+    {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static
+uint64_t align_up(uint64_t value)
+{
+    return (value + SCENE_FILE_ALIGN - 1) / SCENE_FILE_ALIGN * SCENE_FILE_ALIGN;
+}
+
+static
+int write_padding(FILE *fp, uint64_t from, uint64_t to)
+{
+    static const uint8_t zeros[SCENE_FILE_ALIGN];
+    while (from < to)
+    {
+        size_t n = (size_t)(to - from < sizeof(zeros) ? to - from : sizeof(zeros));
+        if (fwrite(zeros, 1, n, fp) != n)
+        {
+            return -1;
+        }
+        from += n;
+    }
+    return 0;
+}
+
+int scene_save_file(const scene_t *scene, const project_camera_t *camera, const char *path)
+{
+    if (scene->sphere_count <= 0 || scene->node_count <= 0)
+    {
+        printf("scene_save_file, scene has no bvh\n");
+        return -1;
+    }
+
+    scene_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC));
+    header.version = SCENE_FILE_VERSION;
+    header.header_size = sizeof(header);
+    header.byte_order = SCENE_FILE_BYTE_ORDER;
+    header.sphere_count = scene->sphere_count;
+    header.sphere_size = sizeof(sphere_t);
+    header.node_count = scene->node_count;
+    header.node_size = sizeof(bvh_node_t);
+    if (camera != NULL)
+    {
+        header.flags |= SCENE_FILE_HAS_CAMERA;
+        const float values[13] =
+        {
+            camera->eye.x, camera->eye.y, camera->eye.z,
+            camera->front.x, camera->front.y, camera->front.z,
+            camera->up.x, camera->up.y, camera->up.z,
+            camera->left_fov, camera->right_fov, camera->top_fov, camera->bottom_fov,
+        };
+        memcpy(&header.camera, values, sizeof(values));
+    }
+
+    uint64_t spheres_size = (uint64_t)sizeof(sphere_t) * scene->sphere_count;
+    uint64_t nodes_size = (uint64_t)sizeof(bvh_node_t) * scene->node_count;
+    header.spheres_offset = align_up(sizeof(header));
+    header.nodes_offset = align_up(header.spheres_offset + spheres_size);
+    header.file_size = align_up(header.nodes_offset + nodes_size);
+    header.checksum = header_checksum(&header);
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        printf("scene_save_file, failed to open %s\n", path);
+        return -1;
+    }
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+        write_padding(fp, sizeof(header), header.spheres_offset) == 0 &&
+        fwrite(scene->spheres, sizeof(sphere_t), scene->sphere_count, fp) == (size_t)scene->sphere_count &&
+        write_padding(fp, header.spheres_offset + spheres_size, header.nodes_offset) == 0 &&
+        fwrite(scene->nodes, sizeof(bvh_node_t), scene->node_count, fp) == (size_t)scene->node_count &&
+        write_padding(fp, header.nodes_offset + nodes_size, header.file_size) == 0;
+    if (fclose(fp) != 0)
+    {
+        ok = 0;
+    }
+    if (!ok)
+    {
+        printf("scene_save_file, failed to write %s\n", path);
+        remove(path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* 检查文件头，各数组的内容由 check_bvh() 检查 */
+static
+int check_header(const scene_file_header_t *header, uint64_t file_size, const char *path)
+{
+    const char *error = NULL;
+    if (memcmp(header->magic, SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC)) != 0)
+    {
+        error = "not a scene file";
+    }
+    else if (header->version != SCENE_FILE_VERSION)
+    {
+        error = "unsupported version";
+    }
+    else if (header->byte_order != SCENE_FILE_BYTE_ORDER)
+    {
+        error = "byte order mismatch";
+    }
+    else if (header->header_size != sizeof(*header) || header->checksum != header_checksum(header))
+    {
+        error = "corrupted header";
+    }
+    else if (header->sphere_size != sizeof(sphere_t) || header->node_size != sizeof(bvh_node_t))
+    {
+        error = "layout mismatch";
+    }
+    else if (header->file_size != file_size)
+    {
+        error = "truncated file";
+    }
+    else if (header->sphere_count == 0 || header->sphere_count > INT_MAX ||
+        header->node_count == 0 || header->node_count > 2 * (uint64_t)header->sphere_count - 1)
+    {
+        error = "invalid counts";
+    }
+    else if (header->spheres_offset % SCENE_FILE_ALIGN != 0 || header->nodes_offset % SCENE_FILE_ALIGN != 0 ||
+        header->spheres_offset < sizeof(*header) ||
+        header->spheres_offset + (uint64_t)header->sphere_size * header->sphere_count > header->nodes_offset ||
+        header->nodes_offset + (uint64_t)header->node_size * header->node_count > file_size)
+    {
+        error = "invalid section offsets";
+    }
+
+    if (error != NULL)
+    {
+        printf("scene_load_file, %s: %s\n", path, error);
+        return -1;
+    }
+    return 0;
+}
+
+/* 文件中的 BVH 直接用于 soft render 和 OpenCL 的遍历，逐个节点检查一遍: 内部节点的子节点位于其后且不越界 (因此不会成环)，
+ * 叶节点引用的 sphere 不越界，树深不超过构建时的上限，遍历栈不会溢出
+ */
+static
+int check_bvh(const bvh_node_t *nodes, int node_count, int sphere_count, const char *path)
+{
+    uint8_t *depths = (uint8_t*)calloc(node_count, 1);
+    if (depths == NULL)
+    {
+        printf("scene_load_file, alloc failed, nodes: %d\n", node_count);
+        return -1;
+    }
+
+    int ok = 1;
+    for (int i = 0; i < node_count && ok; ++i)
+    {
+        const bvh_node_t *node = &nodes[i];
+        if (node->count > 0)
+        {
+            ok = node->left_first >= 0 && node->count <= sphere_count - node->left_first;
+        }
+        else
+        {
+            int left = node->left_first;
+            ok = node->count == 0 && left > i && left <= node_count - 2 && depths[i] < BVH_STACK_SIZE - 2;
+            if (ok)
+            {
+                depths[left] = depths[i] + 1;
+                depths[left + 1] = depths[i] + 1;
+            }
+        }
+    }
+    free(depths);
+
+    if (!ok)
+    {
+        printf("scene_load_file, %s: invalid bvh\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* 以写时复制方式映射整个文件，之后对场景的原地修改不会写回文件 */
+static
+void* map_file(const char *path, uint64_t *size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        printf("scene_load_file, failed to open %s\n", path);
+        return NULL;
+    }
+    LARGE_INTEGER file_size;
+    void *base = NULL;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart >= (LONGLONG)sizeof(scene_file_header_t))
+    {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        if (mapping != NULL)
+        {
+            base = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        *size = file_size.QuadPart;
+    }
+    CloseHandle(file);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("scene_load_file, failed to open %s\n", path);
+        return NULL;
+    }
+    struct stat st;
+    void *base = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(scene_file_header_t))
+    {
+        base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED)
+        {
+            base = NULL;
+        }
+        *size = st.st_size;
+    }
+    close(fd);
+#endif
+
+    if (base == NULL)
+    {
+        printf("scene_load_file, failed to map %s\n", path);
+    }
+    return base;
+}
+
+static
+void unmap_file(void *base, uint64_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(base);
+#else
+    munmap(base, size);
+#endif
+}
+
+int scene_load_file(scene_t *scene, project_camera_t *camera, const char *path)
+{
+    scene_init(scene);
+
+    uint64_t ts1 = now_ns();
+    uint64_t size = 0;
+    uint8_t *base = (uint8_t*)map_file(path, &size);
+    if (base == NULL)
+    {
+        return -1;
+    }
+    const scene_file_header_t *header = (const scene_file_header_t*)base;
+    if (check_header(header, size, path) != 0 ||
+        check_bvh((const bvh_node_t*)(base + header->nodes_offset), (int)header->node_count, (int)header->sphere_count, path) != 0)
+    {
+        unmap_file(base, size);
+        return -1;
+    }
+
+#ifndef _WIN32
+    /* 提前异步读入，首次访问时少阻塞在缺页上 */
+    madvise(base, size, MADV_WILLNEED);
+#endif
+
+    scene->spheres = (sphere_t*)(base + header->spheres_offset);
+    scene->sphere_count = header->sphere_count;
+    scene->nodes = (bvh_node_t*)(base + header->nodes_offset);
+    scene->node_count = header->node_count;
+    scene->mapping = base;
+    scene->mapping_size = size;
+
+    int has_camera = (header->flags & SCENE_FILE_HAS_CAMERA) != 0;
+    if (has_camera && camera != NULL)
+    {
+        const scene_file_camera_t *file_camera = &header->camera;
+        point_t eye = {file_camera->eye[0], file_camera->eye[1], file_camera->eye[2]};
+        direction_t front = {file_camera->front[0], file_camera->front[1], file_camera->front[2]};
+        direction_t up = {file_camera->up[0], file_camera->up[1], file_camera->up[2]};
+        project_camera_init(camera, &eye, &front, file_camera->fov[0], file_camera->fov[1], file_camera->fov[2], file_camera->fov[3]);
+        project_camera_set_up(camera, &up);
+    }
+    uint64_t ts2 = now_ns();
+    printf("scene_load_file, %s, spheres: %d, bvh nodes: %d, size: %" PRIu64 " bytes, time elapsed: %.3fms\n",
+        path, scene->sphere_count, scene->node_count, size, (ts2 - ts1) / 1e6);
+
+    return has_camera;
+}
+
+void scene_unmap_file(scene_t *scene)
+{
+    unmap_file(scene->mapping, scene->mapping_size);
+    scene->mapping = NULL;
+    scene->mapping_size = 0;
+    scene->spheres = NULL;
+    scene->nodes = NULL;
+}
@@ -1,98 +1,18 @@
 
 #include "common.h"
+#include "render.h"
+#include "soft_render.h"
+#include "thread_pool.h"
+#include "dirty_region.h"
+#include "tile_bin.h"
+#include "profiler.h"
 
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
-
-#define _USE_MATH_DEFINES
-#include <math.h>
-
-/* 基础的几何向量运算 */
-
-static inline
-void float3_add(float3_t *v, const float3_t* delta)
-{
-  v->x += delta->x;
-  v->y += delta->y;
-  v->z += delta->z;
-}
-
-static inline
-void float3_subtract(float3_t *v, const float3_t* delta)
-{
-  v->x -= delta->x;
-  v->y -= delta->y;
-  v->z -= delta->z;
-}
-
-static inline
-void float3_multiply(float3_t* v, float f)
-{
-    v->x *= f;
-    v->y *= f;
-    v->z *= f;
-}
-
-static inline
-void float3_div(float3_t* v, float f)
-{
-    v->x /= f;
-    v->y /= f;
-    v->z /= f;
-}
-
-static inline
-float float3_length(const float3_t *v)
-{
-    float f = sqrtf((v->x * v->x) + v->y * v->y + (v->z * v->z));
-    return f;
-}
-
-static inline
-float float3_sqrlength(const float3_t *v)
-{
-    float f = (v->x * v->x) + (v->y * v->y) + (v->z * v->z);
-    return f;
-}
-
-static inline
-void float3_normalize(float3_t *n, const float3_t *v)
-{
-    *n = *v;
-    float length = float3_length(v);
-    float3_div(n, length);
-}
-
-static inline
-float float3_dot(const float3_t* v1, const float3_t* v2)
-{
-    return (v1->x * v2->x + v1->y * v2->y + v1->z * v2->z);
-}
-
-static inline
-void float3_cross(float3_t *vo, const float3_t* v1, const float3_t* v2)
-{
-    float x = v1->y * v2->z - v1->z * v2->y;
-    float y = v1->z * v2->x - v1->x * v2->z;
-    float z = v1->x * v2->y - v1->y * v2->x;
-    vo->x = x;
-    vo->y = y;
-    vo->z = z;
-}
-
-/********************************************************************************/
-
-static inline
-int same_direction(const direction_t* d1, const direction_t* d2)
-{
-    if (d1->x != d2->x || d1->y != d2->y || d1->z != d2->z)
-    {
-        return 0;
-    }
-
-    return 1;
-}
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
 
 static
 void ray_getpoint(point_t* point, const ray_t *ray, double t)
@@ -103,61 +23,30 @@ void ray_getpoint(point_t* point, const ray_t *ray, double t)
     float3_add((float3_t*)point, (float3_t*)&delta);
 }
 
-/* 获取一条从摄像机到目标点的光线，如果结果为无效光线，说明目标点，不在摄像机的视野范围内 */
+/* 获取摄像机经过窗口坐标 (x, y) 的光线，摄像机须已按画面尺寸调用 project_camera_set_resolution() */
 static
 void project_camera_generateRay
 (
     ray_t *ray, 
     const project_camera_t* camera, 
-    const point_t* dest
+    float x, float y
 )
 {
-    point_t delta = *dest;
-    float3_subtract((float3_t*)&delta, (float3_t*)&camera->eye);
-
-    ray->direction = direction_none;
-
-    /* 为简化计算，下面的计算有一个假设： 摄像机的观察方向与z轴平行
-    * 严格的讲，需要根据观察点的位置和方向来具体计算
-    */
-
-    /* 要求目标点必须在 camera 前方, 即z轴坐标小于 eye.z */
-    if (delta.z >= 0)
-    {
-        return;
-    }
-
-    /* 根据角度判断是否在视野范围内 */
-    float h_tan = delta.x / (-delta.z);
-    float v_tan = delta.y / (-delta.z);
-    if (h_tan < camera->left_angle_tan || h_tan > camera->right_angle_tan || 
-        v_tan < camera->bottom_angle_tan || v_tan > camera->top_angle_tan)
-    {
-        return;
-    }
-
     ray->origin = camera->eye;
-    float3_normalize(&ray->direction, &delta);
+    project_camera_pixel_direction(&ray->direction, camera, x, y);
 
     return;
 }
 
 /********************************************************************************/
 
-typedef struct intersect_result
-{
-    const void* geometry;
-    float distance;
-    point_t position;
-    float3_t normal;
-} intersect_result_t;
 const intersect_result_t intersect_nohit = {NULL, 0, {0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}};
 
 /********************************************************************************/
 
-/* 光线与球面的相交计算，得出离光线原点最近的交点坐标 */
-static
-void sphere_intersect(intersect_result_t* result, const sphere_t* sphere, const ray_t* ray)
+/* 光线与球面的相交计算，只求离光线原点最近的交点距离，未相交时返回 0 */
+static inline
+int sphere_intersect_distance(const sphere_t* sphere, const ray_t* ray, float *distance)
 {
     float3_t delta = *(const float3_t*)&ray->origin;
     float3_subtract((float3_t*)&delta, (const float3_t*)&sphere->center);
@@ -165,41 +54,180 @@ void sphere_intersect(intersect_result_t* result, const sphere_t* sphere, const
     float DdotV = float3_dot((const float3_t*)&ray->direction, &delta);
     if (DdotV > 0)
     {
-        *result = intersect_nohit;
+        return 0;
+    }
+
+    float a0 = float3_sqrlength(&delta) - sphere->sqr_radius;
+    float discr = DdotV * DdotV - a0;
+    if (discr >= 0)
+    {
+        *distance = -DdotV - sqrtf(discr);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* 光线与球面的相交计算，得出离光线原点最近的交点坐标 */
+static
+void sphere_intersect(intersect_result_t* result, const sphere_t* sphere, const ray_t* ray)
+{
+    float distance;
+    if (sphere_intersect_distance(sphere, ray, &distance))
+    {
+        float3_t delta;
+        result->geometry = sphere;
+        result->distance = distance;
+        ray_getpoint(&result->position, ray, result->distance);
+        delta = result->position;
+        float3_subtract(&delta, (const float3_t*)&sphere->center);
+        float3_normalize(&result->normal, &delta);
     }
     else
     {
-        float a0 = float3_sqrlength(&delta) - sphere->sqr_radius;
-        float discr = DdotV * DdotV - a0;
-        if (discr >= 0)
+        *result = intersect_nohit;
+    }
+
+    return;
+}
+
+/* 光线与 BVH 节点包围盒的 slab 测试，t_near 为进入包围盒的距离 */
+static inline
+int bvh_node_intersect(const bvh_node_t* node, const point_t* origin, const float3_t* inv_dir, float max_distance, float *t_near)
+{
+    float tx1 = (node->min_x - origin->x) * inv_dir->x;
+    float tx2 = (node->max_x - origin->x) * inv_dir->x;
+    float t_min = float_min(tx1, tx2);
+    float t_max = float_max(tx1, tx2);
+
+    float ty1 = (node->min_y - origin->y) * inv_dir->y;
+    float ty2 = (node->max_y - origin->y) * inv_dir->y;
+    t_min = float_max(t_min, float_min(ty1, ty2));
+    t_max = float_min(t_max, float_max(ty1, ty2));
+
+    float tz1 = (node->min_z - origin->z) * inv_dir->z;
+    float tz2 = (node->max_z - origin->z) * inv_dir->z;
+    t_min = float_max(t_min, float_min(tz1, tz2));
+    t_max = float_min(t_max, float_max(tz1, tz2));
+
+    *t_near = t_min;
+    return t_max >= t_min && t_max >= 0 && t_min < max_distance;
+}
+
+/* 沿 BVH 由近及远遍历场景，得出离光线原点最近的交点。
+ * 只遍历以 roots 中各节点为根的子树，按顺序逐棵遍历，共用当前最近交点的距离
+ */
+static
+void scene_intersect_roots(intersect_result_t* result, const scene_t* scene, const ray_t* ray, const int *roots, int root_count)
+{
+    const bvh_node_t *nodes = scene->nodes;
+    const sphere_t *nearest = NULL;
+    float nearest_distance = FLT_MAX;
+
+    float3_t inv_dir;
+    inv_dir.x = 1.0f / ray->direction.x;
+    inv_dir.y = 1.0f / ray->direction.y;
+    inv_dir.z = 1.0f / ray->direction.z;
+
+    /* 栈中保存节点下标及其包围盒的进入距离，出栈时若已远于当前最近交点则跳过 */
+    int stack[BVH_STACK_SIZE];
+    float stack_t[BVH_STACK_SIZE];
+
+    for (int r = 0; r < root_count; ++r)
+    {
+        int stack_size = 0;
+        float t_near;
+        if (bvh_node_intersect(&nodes[roots[r]], &ray->origin, &inv_dir, nearest_distance, &t_near))
         {
-            result->geometry = sphere;
-            result->distance = -DdotV - sqrtf(discr);
-            ray_getpoint(&result->position, ray, result->distance);
-            delta = result->position;
-            float3_subtract(&delta, (const float3_t*)&sphere->center);
-            float3_normalize(&result->normal, &delta);
+            stack[stack_size] = roots[r];
+            stack_t[stack_size] = t_near;
+            stack_size++;
         }
-        else
+
+        while (stack_size > 0)
         {
-            *result = intersect_nohit;
+            stack_size--;
+            if (stack_t[stack_size] >= nearest_distance)
+            {
+                continue;
+            }
+            const bvh_node_t *node = &nodes[stack[stack_size]];
+
+            if (node->count > 0)
+            {
+                for (int i = 0; i < node->count; ++i)
+                {
+                    const sphere_t *sphere = &scene->spheres[node->left_first + i];
+                    float distance;
+                    if (sphere_intersect_distance(sphere, ray, &distance) && distance < nearest_distance)
+                    {
+                        nearest = sphere;
+                        nearest_distance = distance;
+                    }
+                }
+                continue;
+            }
+
+            int left = node->left_first;
+            int right = left + 1;
+            float t_left, t_right;
+            int hit_left = bvh_node_intersect(&nodes[left], &ray->origin, &inv_dir, nearest_distance, &t_left);
+            int hit_right = bvh_node_intersect(&nodes[right], &ray->origin, &inv_dir, nearest_distance, &t_right);
+            if (hit_left && hit_right)
+            {
+                /* 远的子节点先入栈，近的先出栈 */
+                int near_idx = t_left <= t_right ? left : right;
+                stack[stack_size] = near_idx == left ? right : left;
+                stack_t[stack_size] = near_idx == left ? t_right : t_left;
+                stack_size++;
+                stack[stack_size] = near_idx;
+                stack_t[stack_size] = near_idx == left ? t_left : t_right;
+                stack_size++;
+            }
+            else if (hit_left || hit_right)
+            {
+                stack[stack_size] = hit_left ? left : right;
+                stack_t[stack_size] = hit_left ? t_left : t_right;
+                stack_size++;
+            }
         }
     }
 
+    if (nearest != NULL)
+    {
+        sphere_intersect(result, nearest, ray);
+    }
+    else
+    {
+        *result = intersect_nohit;
+    }
+
     return;
 }
 
+/* 以根节点遍历整个场景 */
+static const int g_bvh_root = 0;
+
+static
+void scene_intersect(intersect_result_t* result, const scene_t* scene, const ray_t* ray)
+{
+    scene_intersect_roots(result, scene, ray, &g_bvh_root, 1);
+}
+
 /********************************************************************************/
 
-typedef struct pixel_color {uint8_t b; uint8_t g; uint8_t r; uint8_t a;} pixel_color_t;
 pixel_color_t color_black = {0, 0, 0, 255};
 pixel_color_t color_white = {255, 255, 255, 255};
 
+/* 由 soft_render_scene_changed() 提交的变化和上一帧的参数，其他方式的渲染覆盖画布时作废 */
+static render_dirty_region_t g_soft_dirty;
+
 void render_gradient_soft(uint8_t* pixel, int w, int h, int pitch)
 {
     int i, j;
     uint8_t *line;
 
+    render_dirty_invalidate(&g_soft_dirty);
     uint64_t ts1 = now_ms();
     line = pixel;
     for (j = 0; j < h; ++j)
@@ -218,92 +246,1439 @@ void render_gradient_soft(uint8_t* pixel, int w, int h, int pitch)
     }
     uint64_t ts2 = now_ms();
 
-    printf("render_gradient_soft, width: %d, height: %d, time elapsed: %" PRIu64 "ms\n", w, h, (ts2-ts1));
+    if (g_render_verbose)
+    {
+        printf("render_gradient_soft, width: %d, height: %d, time elapsed: %" PRIu64 "ms\n", w, h, (ts2-ts1));
+    }
 
     return;
 }
 
-void render_project_depth_soft(uint8_t* pixel, int w, int h, int pitch)
+/* 渲染窗口坐标 [x0, x1) x [y0, y1) 范围内的像素，pixel 为整帧画布的起始地址
+ * shade_mode 须为常量，由下面的包装函数分别特化
+ */
+SOFT_FORCE_INLINE
+void render_project_depth_region
+(
+    uint8_t* pixel, int w, int h, int pitch,
+    int x0, int y0, int x1, int y1,
+    const project_camera_t *camera,
+    const scene_t *scene,
+    const int *roots, int root_count,
+    const render_options_t *options,
+    int *ids,
+    const int shade_mode
+)
 {
-    project_camera_t camera;
-    setup_project_camera(&camera);
-
-    sphere_t sphere;
-    setup_sphere(&sphere);
+    /* 签名与 depth_region_func 一致，逐行访问不需要画面高度 */
+    (void)h;
+    const int checker_size = options->checker_size;
+    const float depth_scale = options->depth_scale;
 
     int i, j;
     uint8_t *line;
 
-    point_t point;
     ray_t ray;
     intersect_result_t intersect_result;
 
-    /* 影像平面为 {0 <= x < 640, 0 <= y < 480, z = 0} */
-
-    uint64_t ts1 = now_ms();
-    line = pixel;
-    for (j = 0; j < h; ++j)
+    line = pixel + y0 * pitch;
+    for (j = y0; j < y1; ++j)
     {
-        pixel_color_t *pixel_color = (pixel_color_t*)line;
-        for (i = 0; i < w; ++i)
+        pixel_color_t *pixel_color = (pixel_color_t*)line + x0;
+        for (i = x0; i < x1; ++i)
         {
-            int x_block_count = i / 40;
-            int y_block_count = j / 40;
-            if ((x_block_count - y_block_count) & 0x01)
+            shade_background(pixel_color, i, j, checker_size);
+            int id = -1;
+
+            project_camera_generateRay(&ray, camera, (float)i, (float)j);
+            scene_intersect_roots(&intersect_result, scene, &ray, roots, root_count);
+            if (intersect_result.geometry)
             {
-                *pixel_color = color_white;
+                id = (int)((const sphere_t*)intersect_result.geometry - scene->spheres);
+                if (shade_mode == RENDER_SHADE_DEPTH)
+                {
+                    shade_depth(pixel_color, intersect_result.distance, depth_scale);
+                }
+                else
+                {
+                    shade_normal(pixel_color, &intersect_result.normal);
+                }
             }
             else
             {
-                *pixel_color = color_black;
+                /* 未相交时，保持原来的背景色 */
+            }
+            if (ids != NULL)
+            {
+                ids[j * w + i] = id;
             }
+            pixel_color++;
+        }
+        line += pitch;
+    }
+
+    return;
+}
+
+static
+void render_project_depth_region_depth
+(
+    uint8_t* pixel, int w, int h, int pitch,
+    int x0, int y0, int x1, int y1,
+    const project_camera_t *camera,
+    const scene_t *scene,
+    const int *roots, int root_count,
+    const render_options_t *options,
+    int *ids
+)
+{
+    render_project_depth_region(pixel, w, h, pitch, x0, y0, x1, y1, camera, scene, roots, root_count, options, ids, RENDER_SHADE_DEPTH);
+}
+
+static
+void render_project_depth_region_normal
+(
+    uint8_t* pixel, int w, int h, int pitch,
+    int x0, int y0, int x1, int y1,
+    const project_camera_t *camera,
+    const scene_t *scene,
+    const int *roots, int root_count,
+    const render_options_t *options,
+    int *ids
+)
+{
+    render_project_depth_region(pixel, w, h, pitch, x0, y0, x1, y1, camera, scene, roots, root_count, options, ids, RENDER_SHADE_NORMAL);
+}
 
-            /* 此处将窗口平面的坐标映射到影像平面 */
-            point.x = i;
-            point.y = h - j;
-            point.z = 0.0;
+/* 预览渲染: 每个 pixel_step x pixel_step 的像素块只对左上角的像素求交，命中时整块使用交点的颜色，
+ * 否则逐像素填充背景。块以窗口原点对齐，x0、y0 须为 pixel_step 的整数倍
+ */
+static
+void render_project_depth_region_preview
+(
+    uint8_t* pixel, int pitch,
+    int x0, int y0, int x1, int y1,
+    const project_camera_t *camera,
+    const scene_t *scene,
+    const int *roots, int root_count,
+    const render_options_t *options,
+    int pixel_step
+)
+{
+    ray_t ray;
+    intersect_result_t intersect_result;
+
+    for (int by = y0; by < y1; by += pixel_step)
+    {
+        int ey = by + pixel_step < y1 ? by + pixel_step : y1;
+        for (int bx = x0; bx < x1; bx += pixel_step)
+        {
+            int ex = bx + pixel_step < x1 ? bx + pixel_step : x1;
 
-            project_camera_generateRay(&ray, &camera, &point);
-            if (!same_direction(&ray.direction, &direction_none))
+            pixel_color_t color;
+            int hit = 0;
+            project_camera_generateRay(&ray, camera, (float)bx, (float)by);
+            scene_intersect_roots(&intersect_result, scene, &ray, roots, root_count);
+            if (intersect_result.geometry)
             {
-                sphere_intersect(&intersect_result, &sphere, &ray);
-                if (intersect_result.geometry)
+                hit = 1;
+                shade_background(&color, bx, by, options->checker_size);
+                if (options->shade_mode == RENDER_SHADE_DEPTH)
                 {
-                 #if 1
-                    /* 相切点的距离最大，当前坐标和尺寸时，最大距离约为
-                     * sqrtf(300^2 - 210^2) = 214.24
-                     */
-                    float value = (intersect_result.distance / 200) * 255;
-                    if (value > 255)
-                    {
-                        value = 255;
-                    }
-                    value = 255 - value;
-                    pixel_color->r = value;
-                    pixel_color->g = value;
-                    pixel_color->b = value;
-                 #else
-                    pixel_color->r = (intersect_result.normal.x + 1) * 128;
-                    pixel_color->g = (intersect_result.normal.y + 1) * 128;
-                    pixel_color->b = (intersect_result.normal.z + 1) * 128;
-                 #endif
+                    shade_depth(&color, intersect_result.distance, options->depth_scale);
                 }
                 else
                 {
-                    /* 未相交时，保持原来的背景色 */
+                    shade_normal(&color, &intersect_result.normal);
                 }
             }
-            else
+
+            for (int j = by; j < ey; ++j)
             {
-                // 影像平面上的点，不在摄像机视角范围内
+                pixel_color_t *pixel_color = (pixel_color_t*)(pixel + j * pitch) + bx;
+                for (int i = bx; i < ex; ++i)
+                {
+                    if (hit)
+                    {
+                        *pixel_color = color;
+                    }
+                    else
+                    {
+                        shade_background(pixel_color, i, j, options->checker_size);
+                    }
+                    pixel_color++;
+                }
             }
-            pixel_color++;
         }
-        line += pitch;
     }
-    uint64_t ts2 = now_ms();
 
-    printf("render_project_depth_soft, width: %d, height: %d, time elapsed: %" PRIu64 "ms\n", w, h, (ts2-ts1));
+    return;
+}
+
+/* 由 soft_render_set_scene() 设置，render 过程中只读 */
+static const scene_t *g_soft_scene = NULL;
+
+/* 由 soft_render_set_camera() 设置，未设置时使用 setup_project_camera() 的默认摄像机 */
+static project_camera_t g_soft_camera;
+static int g_soft_camera_set = 0;
+
+/* 由 soft_render_set_pixel_step() 设置，大于 1 时以预览方式渲染 */
+static int g_soft_pixel_step = 1;
+
+/* 由 soft_render_set_options() 设置，默认值与 setup_render_options() 一致 */
+static render_options_t g_soft_options = {RENDER_SHADE_DEPTH, 40, 200};
+
+void soft_render_set_scene(const scene_t *scene)
+{
+    g_soft_scene = scene;
+}
+
+void soft_render_set_options(const render_options_t *options)
+{
+    g_soft_options = *options;
+}
+
+void soft_render_set_camera(const project_camera_t *camera)
+{
+    g_soft_camera = *camera;
+    g_soft_camera_set = 1;
+}
+
+int soft_render_set_pixel_step(int pixel_step)
+{
+    if (pixel_step < 1 || pixel_step > RENDER_MAX_PIXEL_STEP || (pixel_step & (pixel_step - 1)) != 0)
+    {
+        printf("soft_render_set_pixel_step, invalid pixel step: %d\n", pixel_step);
+        return -1;
+    }
+    g_soft_pixel_step = pixel_step;
+
+    return 0;
+}
+
+/* 本帧使用的摄像机，按画面尺寸计算像素光线的增量 */
+static
+void current_camera(project_camera_t *camera, int w, int h)
+{
+    if (g_soft_camera_set)
+    {
+        *camera = g_soft_camera;
+    }
+    else
+    {
+        setup_project_camera(camera);
+    }
+    if (camera->width != w || camera->height != h)
+    {
+        project_camera_set_resolution(camera, w, h);
+    }
+}
+
+/********************************************************************************/
+
+/* 自适应抗锯齿的状态，缓冲区按最大的画面尺寸保留 */
+typedef struct soft_antialias
+{
+    /* 每边的采样数，为 1 时关闭 */
+    int grid;
+    /* 每像素命中的 sphere 下标和边缘标记，每行 w 个 */
+    int *ids;
+    uint8_t *edge_mask;
+    int capacity;
+    /* 多线程时各 tile 的边缘像素个数，按 tile 下标存放 */
+    int *tile_edge_counts;
+    int tile_capacity;
+    render_aa_stats_t stats;
+} soft_antialias_t;
+
+static soft_antialias_t g_soft_aa = {1, NULL, NULL, 0, NULL, 0, {0, 0, 0}};
+
+int soft_render_set_antialias(int grid)
+{
+    if (grid < 1 || grid > RENDER_AA_MAX_GRID)
+    {
+        printf("soft_render_set_antialias, invalid grid: %d\n", grid);
+        return -1;
+    }
+    g_soft_aa.grid = grid;
+
+    return 0;
+}
+
+void soft_render_antialias_stats(render_aa_stats_t *stats)
+{
+    *stats = g_soft_aa.stats;
+}
+
+/* 需要做抗锯齿时返回 ids 缓冲区，供第一遍渲染写入，否则返回 NULL */
+static
+int* antialias_begin(int w, int h, int tile_count)
+{
+    int pixel_count = w * h;
+    g_soft_aa.stats.pixel_count = pixel_count;
+    g_soft_aa.stats.edge_pixel_count = 0;
+    if (g_soft_pixel_step > 1)
+    {
+        int step = g_soft_pixel_step;
+        g_soft_aa.stats.sample_count = (uint64_t)((w + step - 1) / step) * ((h + step - 1) / step);
+        return NULL;
+    }
+    g_soft_aa.stats.sample_count = pixel_count;
+    if (g_soft_aa.grid < 2)
+    {
+        return NULL;
+    }
+
+    if (g_soft_aa.capacity < pixel_count)
+    {
+        int *ids = (int*)realloc(g_soft_aa.ids, sizeof(int) * pixel_count);
+        if (ids == NULL)
+        {
+            printf("antialias_begin, alloc ids failed, pixels: %d\n", pixel_count);
+            return NULL;
+        }
+        g_soft_aa.ids = ids;
+        uint8_t *edge_mask = (uint8_t*)realloc(g_soft_aa.edge_mask, pixel_count);
+        if (edge_mask == NULL)
+        {
+            printf("antialias_begin, alloc edge mask failed, pixels: %d\n", pixel_count);
+            return NULL;
+        }
+        g_soft_aa.edge_mask = edge_mask;
+        g_soft_aa.capacity = pixel_count;
+    }
+    if (g_soft_aa.tile_capacity < tile_count)
+    {
+        int *tile_edge_counts = (int*)realloc(g_soft_aa.tile_edge_counts, sizeof(int) * tile_count);
+        if (tile_edge_counts == NULL)
+        {
+            printf("antialias_begin, alloc tile counts failed, tiles: %d\n", tile_count);
+            return NULL;
+        }
+        g_soft_aa.tile_edge_counts = tile_edge_counts;
+        g_soft_aa.tile_capacity = tile_count;
+    }
+    /* 线程池只有一个线程时整个画面作为一个区域处理，计数只写入第一个 tile */
+    memset(g_soft_aa.tile_edge_counts, 0, sizeof(int) * tile_count);
+
+    return g_soft_aa.ids;
+}
+
+static
+void antialias_end(int edge_count)
+{
+    int grid = g_soft_aa.grid;
+    g_soft_aa.stats.edge_pixel_count = edge_count;
+    g_soft_aa.stats.sample_count += (uint64_t)edge_count * grid * grid;
+}
+
+static inline
+int color_contrast(const pixel_color_t *a, const pixel_color_t *b)
+{
+    int dr = abs((int)a->r - (int)b->r);
+    int dg = abs((int)a->g - (int)b->g);
+    int db = abs((int)a->b - (int)b->b);
+    int d = dr > dg ? dr : dg;
+    return d > db ? d : db;
+}
+
+/* 标记 [x0, x1) x [y0, y1) 范围内的边缘像素，只读取 pixel 和 ids，返回边缘像素的个数 */
+static
+int detect_edge_region(const uint8_t *pixel, int w, int h, int pitch, const int *ids, uint8_t *edge_mask,
+    int x0, int y0, int x1, int y1)
+{
+    int edge_count = 0;
+    for (int j = y0; j < y1; ++j)
+    {
+        const pixel_color_t *line = (const pixel_color_t*)(pixel + j * pitch);
+        const pixel_color_t *up = j > 0 ? (const pixel_color_t*)(pixel + (j - 1) * pitch) : NULL;
+        const pixel_color_t *down = j + 1 < h ? (const pixel_color_t*)(pixel + (j + 1) * pitch) : NULL;
+        const int *id_line = ids + j * w;
+        for (int i = x0; i < x1; ++i)
+        {
+            int id = id_line[i];
+            const pixel_color_t *color = &line[i];
+            int edge = 0;
+            if (i > 0 && (id_line[i - 1] != id || color_contrast(color, &line[i - 1]) > RENDER_AA_CONTRAST))
+            {
+                edge = 1;
+            }
+            else if (i + 1 < w && (id_line[i + 1] != id || color_contrast(color, &line[i + 1]) > RENDER_AA_CONTRAST))
+            {
+                edge = 1;
+            }
+            else if (up != NULL && (id_line[i - w] != id || color_contrast(color, &up[i]) > RENDER_AA_CONTRAST))
+            {
+                edge = 1;
+            }
+            else if (down != NULL && (id_line[i + w] != id || color_contrast(color, &down[i]) > RENDER_AA_CONTRAST))
+            {
+                edge = 1;
+            }
+            edge_mask[j * w + i] = edge;
+            edge_count += edge;
+        }
+    }
+
+    return edge_count;
+}
+
+/* 窗口坐标 (wx, wy) 处一个采样的颜色，背景按采样位置所在的格子计算。
+ * 采样与像素中心的距离不超过半个像素，分箱的投影范围向外扩展了几个像素，可以使用像素所在 tile 的节点列表
+ */
+static
+void trace_aa_sample(pixel_color_t *color, float wx, float wy,
+    const project_camera_t *camera, const scene_t *scene, const int *roots, int root_count, const render_options_t *options)
+{
+    int block_x = (int)floorf(wx / options->checker_size);
+    int block_y = (int)floorf(wy / options->checker_size);
+    *color = ((block_x - block_y) & 0x01) ? color_white : color_black;
+
+    ray_t ray;
+    project_camera_generateRay(&ray, camera, wx, wy);
+
+    intersect_result_t intersect_result;
+    scene_intersect_roots(&intersect_result, scene, &ray, roots, root_count);
+    if (intersect_result.geometry)
+    {
+        if (options->shade_mode == RENDER_SHADE_DEPTH)
+        {
+            shade_depth(color, intersect_result.distance, options->depth_scale);
+        }
+        else
+        {
+            shade_normal(color, &intersect_result.normal);
+        }
+    }
+}
+
+/* 对 [x0, x1) x [y0, y1) 范围内的边缘像素做 grid x grid 分层抖动采样，以平均值覆盖原来的颜色 */
+static
+void resample_edge_region(uint8_t *pixel, int w, int pitch, const uint8_t *edge_mask,
+    int x0, int y0, int x1, int y1,
+    const project_camera_t *camera, const scene_t *scene, const int *roots, int root_count, const render_options_t *options, int grid)
+{
+    int sample_count = grid * grid;
+    for (int j = y0; j < y1; ++j)
+    {
+        pixel_color_t *line = (pixel_color_t*)(pixel + j * pitch);
+        for (int i = x0; i < x1; ++i)
+        {
+            if (!edge_mask[j * w + i])
+            {
+                continue;
+            }
+
+            int sum_r = 0, sum_g = 0, sum_b = 0;
+            uint32_t seed = (uint32_t)(j * w + i) * (RENDER_AA_MAX_GRID * RENDER_AA_MAX_GRID);
+            for (int sy = 0; sy < grid; ++sy)
+            {
+                for (int sx = 0; sx < grid; ++sx)
+                {
+                    uint32_t jitter = aa_hash(seed + sy * grid + sx);
+                    float wx = i - 0.5f + (sx + (jitter & 0xffff) / 65536.0f) / grid;
+                    float wy = j - 0.5f + (sy + (jitter >> 16) / 65536.0f) / grid;
+                    pixel_color_t color;
+                    trace_aa_sample(&color, wx, wy, camera, scene, roots, root_count, options);
+                    sum_r += color.r;
+                    sum_g += color.g;
+                    sum_b += color.b;
+                }
+            }
+            line[i].r = (sum_r + sample_count / 2) / sample_count;
+            line[i].g = (sum_g + sample_count / 2) / sample_count;
+            line[i].b = (sum_b + sample_count / 2) / sample_count;
+            line[i].a = 255;
+        }
+    }
+}
+
+/********************************************************************************/
+
+static
+depth_region_func scalar_depth_region_func(void)
+{
+    return g_soft_options.shade_mode == RENDER_SHADE_NORMAL ? render_project_depth_region_normal : render_project_depth_region_depth;
+}
+
+/* 使用 soft_simd_init() 选定的指令集按 packet 渲染，CPU 不支持 SIMD 时退回标量版本 */
+static
+depth_region_func select_depth_region_func(void)
+{
+    depth_region_func region_func = soft_simd_region_func(g_soft_options.shade_mode);
+    return region_func != NULL ? region_func : scalar_depth_region_func();
+}
+
+/* 按 tile 渲染时各 tile 共享的渲染参数 */
+typedef struct depth_tile_context
+{
+    uint8_t* pixel;
+    int w;
+    int h;
+    int pitch;
+    project_camera_t camera;
+    const scene_t *scene;
+    render_options_t options;
+    depth_region_func region_func;
+    int pixel_step;
+    /* 抗锯齿: ids 为 NULL 时不做 */
+    int *ids;
+    int tiles_x;
+    /* 各 tile 的 BVH 节点列表，为 NULL 时从根节点遍历整个场景 */
+    const tile_bin_t *bin;
+} depth_tile_context_t;
+
+/* 须为 RENDER_MAX_PIXEL_STEP 的整数倍，预览的像素块不跨越 tile; 与增量渲染和分箱的 tile 一致 */
+#define SOFT_RENDER_TILE_SIZE RENDER_DIRTY_TILE_SIZE
+
+typedef char soft_render_tile_size_check[SOFT_RENDER_TILE_SIZE == TILE_BIN_SIZE ? 1 : -1];
+
+/* 分箱之后没有任何节点的 tile 不生成光线，只填充背景 */
+static
+void fill_background_region(uint8_t* pixel, int w, int pitch, int x0, int y0, int x1, int y1, int checker_size, int *ids)
+{
+    for (int j = y0; j < y1; ++j)
+    {
+        pixel_color_t *pixel_color = (pixel_color_t*)(pixel + j * pitch) + x0;
+        for (int i = x0; i < x1; ++i)
+        {
+            shade_background(pixel_color, i, j, checker_size);
+            pixel_color++;
+        }
+        if (ids != NULL)
+        {
+            for (int i = x0; i < x1; ++i)
+            {
+                ids[j * w + i] = -1;
+            }
+        }
+    }
+}
+
+/* 在一个分箱的 tile 之内执行的步骤，roots 为该 tile 的节点列表 */
+typedef void (*bin_region_func)(depth_tile_context_t *tile_ctx, int x0, int y0, int x1, int y1, const int *roots, int root_count);
+
+/* 范围按分箱的 tile 切分，各部分只使用所在 tile 的节点列表; 线程池的 tile 可能不与分箱对齐，也可能是整个画面 */
+static
+void run_bin_regions(depth_tile_context_t *tile_ctx, int x0, int y0, int x1, int y1, bin_region_func func)
+{
+    const tile_bin_t *bin = tile_ctx->bin;
+    if (bin == NULL)
+    {
+        func(tile_ctx, x0, y0, x1, y1, &g_bvh_root, 1);
+        return;
+    }
+
+    for (int by = y0; by < y1; )
+    {
+        int ty = by / TILE_BIN_SIZE;
+        int ey = (ty + 1) * TILE_BIN_SIZE < y1 ? (ty + 1) * TILE_BIN_SIZE : y1;
+        for (int bx = x0; bx < x1; )
+        {
+            int tx = bx / TILE_BIN_SIZE;
+            int ex = (tx + 1) * TILE_BIN_SIZE < x1 ? (tx + 1) * TILE_BIN_SIZE : x1;
+            int root_count;
+            const int *roots = tile_bin_list(bin, tx, ty, &root_count);
+            func(tile_ctx, bx, by, ex, ey, roots, root_count);
+            bx = ex;
+        }
+        by = ey;
+    }
+}
+
+static
+void render_project_depth_bin_region(depth_tile_context_t *tile_ctx, int x0, int y0, int x1, int y1,
+    const int *roots, int root_count)
+{
+    if (root_count == 0)
+    {
+        fill_background_region(tile_ctx->pixel, tile_ctx->w, tile_ctx->pitch, x0, y0, x1, y1,
+            tile_ctx->options.checker_size, tile_ctx->pixel_step > 1 ? NULL : tile_ctx->ids);
+        return;
+    }
+    if (tile_ctx->pixel_step > 1)
+    {
+        render_project_depth_region_preview(tile_ctx->pixel, tile_ctx->pitch,
+            x0, y0, x1, y1, &tile_ctx->camera, tile_ctx->scene, roots, root_count, &tile_ctx->options, tile_ctx->pixel_step);
+        return;
+    }
+    tile_ctx->region_func(tile_ctx->pixel, tile_ctx->w, tile_ctx->h, tile_ctx->pitch,
+        x0, y0, x1, y1, &tile_ctx->camera, tile_ctx->scene, roots, root_count, &tile_ctx->options, tile_ctx->ids);
+}
+
+static
+void render_project_depth_tile(void *ctx, int x0, int y0, int x1, int y1)
+{
+    run_bin_regions((depth_tile_context_t*)ctx, x0, y0, x1, y1, render_project_depth_bin_region);
+}
+
+/* 边缘检测要读取相邻 tile 的像素，须等全部 tile 完成第一遍渲染之后进行，重新采样再等边缘检测全部完成 */
+static
+void detect_edge_tile(void *ctx, int x0, int y0, int x1, int y1)
+{
+    depth_tile_context_t *tile_ctx = (depth_tile_context_t*)ctx;
+    int tile_idx = (y0 / SOFT_RENDER_TILE_SIZE) * tile_ctx->tiles_x + x0 / SOFT_RENDER_TILE_SIZE;
+    g_soft_aa.tile_edge_counts[tile_idx] = detect_edge_region(tile_ctx->pixel, tile_ctx->w, tile_ctx->h, tile_ctx->pitch,
+        tile_ctx->ids, g_soft_aa.edge_mask, x0, y0, x1, y1);
+}
+
+static
+void resample_edge_bin_region(depth_tile_context_t *tile_ctx, int x0, int y0, int x1, int y1,
+    const int *roots, int root_count)
+{
+    resample_edge_region(tile_ctx->pixel, tile_ctx->w, tile_ctx->pitch, g_soft_aa.edge_mask,
+        x0, y0, x1, y1, &tile_ctx->camera, tile_ctx->scene, roots, root_count, &tile_ctx->options, g_soft_aa.grid);
+}
+
+static
+void resample_edge_tile(void *ctx, int x0, int y0, int x1, int y1)
+{
+    run_bin_regions((depth_tile_context_t*)ctx, x0, y0, x1, y1, resample_edge_bin_region);
+}
+
+/********************************************************************************/
+
+void soft_render_scene_changed(const render_change_t *changes, int count)
+{
+    render_dirty_add_changes(&g_soft_dirty, changes, count);
+}
+
+void soft_render_invalidate_frame(void)
+{
+    render_dirty_invalidate(&g_soft_dirty);
+}
+
+/* 增量渲染时依次处理 g_soft_dirty.tiles 中 [x0, x1) 范围内的 tile */
+typedef struct dirty_tile_job
+{
+    depth_tile_context_t *tile_ctx;
+    tile_render_func func;
+} dirty_tile_job_t;
+
+static
+void render_dirty_tile_range(void *ctx, int x0, int y0, int x1, int y1)
+{
+    (void)y0;
+    (void)y1;
+    dirty_tile_job_t *job = (dirty_tile_job_t*)ctx;
+    depth_tile_context_t *tile_ctx = job->tile_ctx;
+    for (int k = x0; k < x1; ++k)
+    {
+        int tile_idx = g_soft_dirty.tiles[k];
+        int tx0 = (tile_idx % tile_ctx->tiles_x) * SOFT_RENDER_TILE_SIZE;
+        int ty0 = (tile_idx / tile_ctx->tiles_x) * SOFT_RENDER_TILE_SIZE;
+        int tx1 = tx0 + SOFT_RENDER_TILE_SIZE < tile_ctx->w ? tx0 + SOFT_RENDER_TILE_SIZE : tile_ctx->w;
+        int ty1 = ty0 + SOFT_RENDER_TILE_SIZE < tile_ctx->h ? ty0 + SOFT_RENDER_TILE_SIZE : tile_ctx->h;
+        job->func(tile_ctx, tx0, ty0, tx1, ty1);
+    }
+}
+
+/* dirty_count 小于 0 时对整个画面执行 func，否则只对 dirty tile 执行; parallel 为 0 时在调用线程中执行 */
+static
+void run_depth_tiles(depth_tile_context_t *tile_ctx, int dirty_count, tile_render_func func, int parallel)
+{
+    if (dirty_count < 0)
+    {
+        if (parallel)
+        {
+            thread_pool_render_tiles(tile_ctx->w, tile_ctx->h, SOFT_RENDER_TILE_SIZE, func, tile_ctx);
+        }
+        else
+        {
+            func(tile_ctx, 0, 0, tile_ctx->w, tile_ctx->h);
+        }
+        return;
+    }
+
+    dirty_tile_job_t job = {tile_ctx, func};
+    if (parallel)
+    {
+        thread_pool_render_tiles(dirty_count, 1, 1, render_dirty_tile_range, &job);
+    }
+    else
+    {
+        render_dirty_tile_range(&job, 0, 0, dirty_count, 1);
+    }
+}
+
+/* 各 tile 的节点列表，每帧按摄像机和场景重新建立，渲染过程中只读 */
+static tile_bin_t g_soft_bin;
+
+/* 内存不足时返回 NULL，本帧遍历整个场景 */
+static
+const tile_bin_t* build_tile_bin(const project_camera_t *camera, int w, int h)
+{
+    uint64_t span = profiler_begin();
+    int ret = tile_bin_build(&g_soft_bin, g_soft_scene, camera, w, h);
+    profiler_end("soft tile bin", "soft", span);
+    return ret == 0 ? &g_soft_bin : NULL;
+}
+
+/* soft、soft_simd、soft_mt 共用: 渲染整帧，或在提交过变化且参数与上一帧相同时只渲染 dirty tile。
+ * 返回 dirty tile 的个数，整帧渲染时返回 -1
+ */
+static
+int render_depth_frame(uint8_t* pixel, int w, int h, int pitch, depth_region_func region_func, int parallel)
+{
+    depth_tile_context_t tile_ctx;
+    tile_ctx.pixel = pixel;
+    tile_ctx.w = w;
+    tile_ctx.h = h;
+    tile_ctx.pitch = pitch;
+    current_camera(&tile_ctx.camera, w, h);
+    tile_ctx.scene = g_soft_scene;
+    tile_ctx.options = g_soft_options;
+    tile_ctx.region_func = region_func;
+    tile_ctx.pixel_step = g_soft_pixel_step;
+    tile_ctx.tiles_x = (w + SOFT_RENDER_TILE_SIZE - 1) / SOFT_RENDER_TILE_SIZE;
+    int tile_count = tile_ctx.tiles_x * ((h + SOFT_RENDER_TILE_SIZE - 1) / SOFT_RENDER_TILE_SIZE);
+
+    render_frame_key_t key;
+    render_frame_key_init(&key, w, h, &tile_ctx.camera, &g_soft_options, g_soft_pixel_step, g_soft_aa.grid);
+    int dirty_count = render_dirty_begin(&g_soft_dirty, &key);
+    tile_ctx.bin = dirty_count != 0 ? build_tile_bin(&tile_ctx.camera, w, h) : NULL;
+
+    tile_ctx.ids = antialias_begin(w, h, tile_count);
+    if (dirty_count >= 0)
+    {
+        g_soft_aa.stats.sample_count = g_soft_dirty.pixel_count;
+    }
+
+    /* 逐像素的渲染中光线生成、求交和着色在同一个循环中完成，性能分析按遍记录 */
+    uint64_t span = profiler_begin();
+    run_depth_tiles(&tile_ctx, dirty_count, render_project_depth_tile, parallel);
+    profiler_end("soft primary", "soft", span);
+    /* 抗锯齿时 render_dirty_begin() 总是返回整帧渲染 */
+    if (tile_ctx.ids != NULL)
+    {
+        span = profiler_begin();
+        run_depth_tiles(&tile_ctx, -1, detect_edge_tile, parallel);
+        profiler_end("soft aa edges", "soft", span);
+        span = profiler_begin();
+        run_depth_tiles(&tile_ctx, -1, resample_edge_tile, parallel);
+        profiler_end("soft aa resample", "soft", span);
+        int edge_count = 0;
+        for (int i = 0; i < tile_count; ++i)
+        {
+            edge_count += g_soft_aa.tile_edge_counts[i];
+        }
+        antialias_end(edge_count);
+    }
+
+    return dirty_count;
+}
+
+void render_project_depth_soft(uint8_t* pixel, int w, int h, int pitch)
+{
+    if (g_soft_scene == NULL)
+    {
+        printf("render_project_depth_soft, no scene was set\n");
+        return;
+    }
+
+    uint64_t ts1 = now_ms();
+    int dirty_count = render_depth_frame(pixel, w, h, pitch, scalar_depth_region_func(), 0);
+    uint64_t ts2 = now_ms();
+
+    if (g_render_verbose)
+    {
+        printf("render_project_depth_soft, width: %d, height: %d, dirty tiles: %d, time elapsed: %" PRIu64 "ms\n",
+            w, h, dirty_count, (ts2-ts1));
+    }
+
+    return;
+}
+
+void render_project_depth_soft_simd(uint8_t* pixel, int w, int h, int pitch)
+{
+    if (g_soft_scene == NULL)
+    {
+        printf("render_project_depth_soft_simd, no scene was set\n");
+        return;
+    }
+
+    uint64_t ts1 = now_ms();
+    int dirty_count = render_depth_frame(pixel, w, h, pitch, select_depth_region_func(), 0);
+    uint64_t ts2 = now_ms();
+
+    if (g_render_verbose)
+    {
+        printf("render_project_depth_soft_simd, width: %d, height: %d, dirty tiles: %d, time elapsed: %" PRIu64 "ms\n",
+            w, h, dirty_count, (ts2-ts1));
+    }
+
+    return;
+}
+
+/* 由线程池按 tile 并行渲染，各 tile 直接写入 pixel，每个 tile 内部使用 packet 渲染 */
+void render_project_depth_soft_mt(uint8_t* pixel, int w, int h, int pitch)
+{
+    if (g_soft_scene == NULL)
+    {
+        printf("render_project_depth_soft_mt, no scene was set\n");
+        return;
+    }
+
+    uint64_t ts1 = now_ms();
+    int dirty_count = render_depth_frame(pixel, w, h, pitch, select_depth_region_func(), 1);
+    uint64_t ts2 = now_ms();
+
+    if (g_render_verbose)
+    {
+        printf("render_project_depth_soft_mt, width: %d, height: %d, threads: %d, dirty tiles: %d, time elapsed: %" PRIu64 "ms\n",
+            w, h, thread_pool_thread_count(), dirty_count, (ts2-ts1));
+    }
+
+    return;
+}
+
+/********************************************************************************/
+
+/* 多视角批量渲染: 各视角的 tile 参数和分箱，按视角个数保留 */
+typedef struct soft_batch
+{
+    depth_tile_context_t *contexts;
+    tile_bin_t *bins;
+    int capacity;
+    int h;
+} soft_batch_t;
+
+static soft_batch_t g_soft_batch;
+
+static
+int reserve_batch(int view_count)
+{
+    if (g_soft_batch.capacity >= view_count)
+    {
+        return 0;
+    }
+
+    depth_tile_context_t *contexts = (depth_tile_context_t*)malloc(sizeof(depth_tile_context_t) * view_count);
+    tile_bin_t *bins = (tile_bin_t*)malloc(sizeof(tile_bin_t) * view_count);
+    if (contexts == NULL || bins == NULL)
+    {
+        printf("render_project_depth_soft_batch, alloc failed, views: %d\n", view_count);
+        free(contexts);
+        free(bins);
+        return -1;
+    }
+    /* 已有的分箱保留其缓冲区 */
+    if (g_soft_batch.capacity > 0)
+    {
+        memcpy(bins, g_soft_batch.bins, sizeof(tile_bin_t) * g_soft_batch.capacity);
+    }
+    memset(bins + g_soft_batch.capacity, 0, sizeof(tile_bin_t) * (view_count - g_soft_batch.capacity));
+    free(g_soft_batch.contexts);
+    free(g_soft_batch.bins);
+    g_soft_batch.contexts = contexts;
+    g_soft_batch.bins = bins;
+    g_soft_batch.capacity = view_count;
+
+    return 0;
+}
+
+static
+void release_batch(void)
+{
+    for (int i = 0; i < g_soft_batch.capacity; ++i)
+    {
+        tile_bin_release(&g_soft_batch.bins[i]);
+    }
+    free(g_soft_batch.contexts);
+    free(g_soft_batch.bins);
+    memset(&g_soft_batch, 0, sizeof(g_soft_batch));
+}
+
+/* 线程池按 view_count x 1 划分，每个 tile 为一个视角，建立该视角的分箱 */
+static
+void build_batch_bins(void *ctx, int x0, int y0, int x1, int y1)
+{
+    (void)ctx;
+    (void)y0;
+    (void)y1;
+    for (int view = x0; view < x1; ++view)
+    {
+        depth_tile_context_t *tile_ctx = &g_soft_batch.contexts[view];
+        tile_bin_t *bin = &g_soft_batch.bins[view];
+        tile_ctx->bin = tile_bin_build(bin, tile_ctx->scene, &tile_ctx->camera, tile_ctx->w, tile_ctx->h) == 0 ? bin : NULL;
+    }
+}
+
+/* 各视角的画面上下相接为 w x (h * view_count) 的画面，线程池的 tile 按视角依次排列;
+ * h 不是 tile 边长的整数倍时，跨越两个视角的 tile 在视角的边界处切开
+ */
+static
+void render_batch_tile(void *ctx, int x0, int y0, int x1, int y1)
+{
+    (void)ctx;
+    int h = g_soft_batch.h;
+    while (y0 < y1)
+    {
+        int view = y0 / h;
+        int view_y = view * h;
+        int ey = view_y + h < y1 ? view_y + h : y1;
+        render_project_depth_tile(&g_soft_batch.contexts[view], x0, y0 - view_y, x1, ey - view_y);
+        y0 = ey;
+    }
+}
+
+int render_project_depth_soft_batch(uint8_t* pixel, int w, int h, const project_camera_t *cameras, int view_count)
+{
+    if (g_soft_scene == NULL)
+    {
+        printf("render_project_depth_soft_batch, no scene was set\n");
+        return -1;
+    }
+    if (view_count <= 0 || reserve_batch(view_count) != 0)
+    {
+        return -1;
+    }
+
+    uint64_t ts1 = now_ms();
+    uint64_t span = profiler_begin();
+    depth_region_func region_func = select_depth_region_func();
+    size_t view_size = (size_t)w * h * 4;
+    for (int view = 0; view < view_count; ++view)
+    {
+        depth_tile_context_t *tile_ctx = &g_soft_batch.contexts[view];
+        tile_ctx->pixel = pixel + view_size * view;
+        tile_ctx->w = w;
+        tile_ctx->h = h;
+        tile_ctx->pitch = w * 4;
+        tile_ctx->camera = cameras[view];
+        if (tile_ctx->camera.width != w || tile_ctx->camera.height != h)
+        {
+            project_camera_set_resolution(&tile_ctx->camera, w, h);
+        }
+        tile_ctx->scene = g_soft_scene;
+        tile_ctx->options = g_soft_options;
+        tile_ctx->region_func = region_func;
+        tile_ctx->pixel_step = 1;
+        tile_ctx->ids = NULL;
+        tile_ctx->tiles_x = (w + SOFT_RENDER_TILE_SIZE - 1) / SOFT_RENDER_TILE_SIZE;
+        tile_ctx->bin = NULL;
+    }
+    g_soft_batch.h = h;
+
+    uint64_t bin_span = profiler_begin();
+    thread_pool_render_tiles(view_count, 1, 1, build_batch_bins, NULL);
+    profiler_end("soft batch bins", "soft", bin_span);
+    thread_pool_render_tiles(w, h * view_count, SOFT_RENDER_TILE_SIZE, render_batch_tile, NULL);
+    profiler_end("soft batch", "soft", span);
+    uint64_t ts2 = now_ms();
+
+    if (g_render_verbose)
+    {
+        printf("render_project_depth_soft_batch, width: %d, height: %d, views: %d, threads: %d, time elapsed: %" PRIu64 "ms\n",
+            w, h, view_count, thread_pool_thread_count(), (ts2-ts1));
+    }
+
+    return 0;
+}
+
+/********************************************************************************/
+
+/* render_backend_t 接口: 按行渲染画面的一部分，在调用线程中使用线程池同步完成 */
+
+typedef struct region_tile_context
+{
+    depth_tile_context_t *tile_ctx;
+    int y_offset;
+} region_tile_context_t;
+
+/* 线程池按 w x (y1 - y0) 划分 tile，换算为画面中的行 */
+static
+void render_region_tile(void *ctx, int x0, int y0, int x1, int y1)
+{
+    region_tile_context_t *region_ctx = (region_tile_context_t*)ctx;
+    render_project_depth_tile(region_ctx->tile_ctx, x0, y0 + region_ctx->y_offset, x1, y1 + region_ctx->y_offset);
+}
+
+static uint64_t g_soft_region_ns;
+
+static
+int soft_backend_init(const char *ocl_source_file, int w, int h)
+{
+    (void)ocl_source_file;
+    (void)w;
+    (void)h;
+    return 0;
+}
+
+static
+void soft_backend_uninit(void)
+{
+    tile_bin_release(&g_soft_bin);
+    release_batch();
+}
+
+static
+int soft_backend_set_options(const render_options_t *options)
+{
+    soft_render_set_options(options);
+    return 0;
+}
+
+static
+int soft_backend_render_region(uint8_t* pixel, int w, int h, int pitch, int y0, int y1)
+{
+    if (g_soft_scene == NULL)
+    {
+        printf("soft_backend_render_region, no scene was set\n");
+        return -1;
+    }
+
+    uint64_t ts1 = now_ns();
+    uint64_t span = profiler_begin();
+    depth_tile_context_t tile_ctx;
+    tile_ctx.pixel = pixel;
+    tile_ctx.w = w;
+    tile_ctx.h = h;
+    tile_ctx.pitch = pitch;
+    current_camera(&tile_ctx.camera, w, h);
+    tile_ctx.scene = g_soft_scene;
+    tile_ctx.options = g_soft_options;
+    tile_ctx.region_func = select_depth_region_func();
+    tile_ctx.pixel_step = g_soft_pixel_step;
+    tile_ctx.tiles_x = (w + SOFT_RENDER_TILE_SIZE - 1) / SOFT_RENDER_TILE_SIZE;
+    tile_ctx.ids = NULL;
+    tile_ctx.bin = build_tile_bin(&tile_ctx.camera, w, h);
+    /* pixel 中其余的行不是上一帧的结果 */
+    render_dirty_invalidate(&g_soft_dirty);
+
+    if (y1 > y0)
+    {
+        region_tile_context_t region_ctx = {&tile_ctx, y0};
+        thread_pool_render_tiles(w, y1 - y0, SOFT_RENDER_TILE_SIZE, render_region_tile, &region_ctx);
+    }
+    profiler_end("soft region", "soft", span);
+    g_soft_region_ns = now_ns() - ts1;
+
+    return 0;
+}
+
+static
+int soft_backend_wait(uint64_t *elapsed_ns)
+{
+    *elapsed_ns = g_soft_region_ns;
+    return 0;
+}
+
+const render_backend_t g_soft_render_backend =
+{
+    "soft",
+    soft_backend_init,
+    soft_backend_uninit,
+    soft_render_set_scene,
+    soft_backend_set_options,
+    soft_render_set_camera,
+    soft_render_set_pixel_step,
+    soft_backend_render_region,
+    soft_backend_wait,
+};
+
+/********************************************************************************/
+
+/* 每个像素累加的颜色 */
+typedef struct wavefront_color
+{
+    float b;
+    float g;
+    float r;
+    float pad;
+} wavefront_color_t;
+
+/* 求交、着色阶段每个任务处理的光线个数 */
+#define SOFT_WAVEFRONT_CHUNK 1024
+/* 压缩队列时每个任务拷贝的分段个数 */
+#define SOFT_WAVEFRONT_COMPACT_SEGMENTS 64
+
+/* wavefront 渲染的状态，缓冲区按最大的画面尺寸保留。
+ * 主光线由生成阶段直接写入 queue; 着色阶段的各任务把反射光线连续写入 staging 中各自的分段并记录个数，
+ * 阶段结束后按各分段个数的前缀和把分段拷贝到 queue，得到紧凑的队列
+ */
+typedef struct soft_wavefront
+{
+    int bounces;
+    /* queue、hits、accum 按像素个数分配 */
+    wavefront_ray_t *queue;
+    wavefront_hit_t *hits;
+    wavefront_color_t *accum;
+    int capacity;
+    wavefront_ray_t *staging;
+    int staging_capacity;
+    int *segment_counts;
+    int *segment_offsets;
+    int segment_capacity;
+    render_wavefront_stats_t stats;
+} soft_wavefront_t;
+
+static soft_wavefront_t g_soft_wavefront;
+
+int soft_render_set_bounces(int bounces)
+{
+    if (bounces < 0 || bounces > RENDER_MAX_BOUNCES)
+    {
+        printf("soft_render_set_bounces, invalid bounces: %d\n", bounces);
+        return -1;
+    }
+    g_soft_wavefront.bounces = bounces;
+
+    return 0;
+}
+
+void soft_render_wavefront_stats(render_wavefront_stats_t *stats)
+{
+    *stats = g_soft_wavefront.stats;
+}
+
+static
+int wavefront_reserve(int pixel_count, int staging_count, int segment_count)
+{
+    soft_wavefront_t *wf = &g_soft_wavefront;
+    if (wf->capacity < pixel_count)
+    {
+        free(wf->queue);
+        free(wf->hits);
+        free(wf->accum);
+        wf->queue = (wavefront_ray_t*)malloc(sizeof(wavefront_ray_t) * pixel_count);
+        wf->hits = (wavefront_hit_t*)malloc(sizeof(wavefront_hit_t) * pixel_count);
+        wf->accum = (wavefront_color_t*)malloc(sizeof(wavefront_color_t) * pixel_count);
+        wf->capacity = pixel_count;
+        if (wf->queue == NULL || wf->hits == NULL || wf->accum == NULL)
+        {
+            printf("wavefront_reserve, alloc queue failed, pixels: %d\n", pixel_count);
+            wf->capacity = 0;
+            return -1;
+        }
+    }
+    if (wf->staging_capacity < staging_count)
+    {
+        free(wf->staging);
+        wf->staging = (wavefront_ray_t*)malloc(sizeof(wavefront_ray_t) * staging_count);
+        wf->staging_capacity = wf->staging != NULL ? staging_count : 0;
+        if (wf->staging == NULL)
+        {
+            printf("wavefront_reserve, alloc staging failed, rays: %d\n", staging_count);
+            return -1;
+        }
+    }
+    if (wf->segment_capacity < segment_count)
+    {
+        free(wf->segment_counts);
+        free(wf->segment_offsets);
+        wf->segment_counts = (int*)malloc(sizeof(int) * segment_count);
+        wf->segment_offsets = (int*)malloc(sizeof(int) * segment_count);
+        wf->segment_capacity = segment_count;
+        if (wf->segment_counts == NULL || wf->segment_offsets == NULL)
+        {
+            printf("wavefront_reserve, alloc segments failed, segments: %d\n", segment_count);
+            wf->segment_capacity = 0;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* 各阶段共享的参数。staging 中第 i 个分段从 i * segment_stride 开始 */
+typedef struct wavefront_context
+{
+    uint8_t* pixel;
+    int pitch;
+    int w;
+    int h;
+    project_camera_t camera;
+    const scene_t *scene;
+    render_options_t options;
+    /* 当前队列中的光线个数，以及着色阶段是否发射反射光线 */
+    int ray_count;
+    int spawn;
+    int segment_stride;
+    int segment_count;
+    /* 指令集为 scalar 时为 NULL，逐条光线求交 */
+    wavefront_intersect_func intersect_func;
+} wavefront_context_t;
+
+static inline
+void accumulate_color(wavefront_color_t *accum, const pixel_color_t *color, float weight)
+{
+    accum->b += color->b * weight;
+    accum->g += color->g * weight;
+    accum->r += color->r * weight;
+}
+
+/* 生成阶段: 每个像素生成一条主光线。每个像素恰好一条，各 tile 在队列中的位置可以直接算出，
+ * 按 tile 的先后、tile 内逐行排列，不经过 staging 和压缩。单线程时线程池以整帧为一个区域调用，区域内逐个 tile 生成
+ */
+static
+void wavefront_raygen_tile(void *ctx, int x0, int y0, int x1, int y1)
+{
+    wavefront_context_t *wf_ctx = (wavefront_context_t*)ctx;
+    int w = wf_ctx->w;
+
+    for (int ty = y0; ty < y1; ty += SOFT_RENDER_TILE_SIZE)
+    {
+        int ey = ty + SOFT_RENDER_TILE_SIZE < y1 ? ty + SOFT_RENDER_TILE_SIZE : y1;
+        for (int tx = x0; tx < x1; tx += SOFT_RENDER_TILE_SIZE)
+        {
+            int ex = tx + SOFT_RENDER_TILE_SIZE < x1 ? tx + SOFT_RENDER_TILE_SIZE : x1;
+            /* 上方各行 tile 的光线，加上同一行中左侧各 tile 的光线 */
+            wavefront_ray_t *out = g_soft_wavefront.queue + ty * w + (ey - ty) * tx;
+            for (int j = ty; j < ey; ++j)
+            {
+                for (int i = tx; i < ex; ++i)
+                {
+                    int idx = j * w + i;
+                    wavefront_color_t *accum = &g_soft_wavefront.accum[idx];
+                    project_camera_generateRay(&out->ray, &wf_ctx->camera, (float)i, (float)j);
+                    accum->b = 0;
+                    accum->g = 0;
+                    accum->r = 0;
+                    out->weight = 1.0f;
+                    out->pixel = idx;
+                    out++;
+                }
+            }
+        }
+    }
+}
+
+/* 求交阶段: 队列中 [x0, x1) 的光线与场景求交，CPU 支持时以 packet 求交 */
+static
+void wavefront_intersect_chunk(void *ctx, int x0, int y0, int x1, int y1)
+{
+    wavefront_context_t *wf_ctx = (wavefront_context_t*)ctx;
+    const scene_t *scene = wf_ctx->scene;
+    (void)y0;
+    (void)y1;
+
+    if (wf_ctx->intersect_func != NULL)
+    {
+        wf_ctx->intersect_func(scene, g_soft_wavefront.queue + x0, x1 - x0, g_soft_wavefront.hits + x0);
+        return;
+    }
+    for (int k = x0; k < x1; ++k)
+    {
+        intersect_result_t intersect_result;
+        wavefront_hit_t *hit = &g_soft_wavefront.hits[k];
+        scene_intersect(&intersect_result, scene, &g_soft_wavefront.queue[k].ray);
+        if (intersect_result.geometry)
+        {
+            hit->id = (int)((const sphere_t*)intersect_result.geometry - scene->spheres);
+            hit->distance = intersect_result.distance;
+        }
+        else
+        {
+            hit->id = -1;
+        }
+    }
+}
+
+/* 着色阶段: 按求交结果累加颜色，需要继续反射时把反射光线写入分段 x0 / SOFT_WAVEFRONT_CHUNK */
+static
+void wavefront_shade_chunk(void *ctx, int x0, int y0, int x1, int y1)
+{
+    wavefront_context_t *wf_ctx = (wavefront_context_t*)ctx;
+    const scene_t *scene = wf_ctx->scene;
+    const render_options_t *options = &wf_ctx->options;
+    int segment = x0 / SOFT_WAVEFRONT_CHUNK;
+    wavefront_ray_t *out = g_soft_wavefront.staging + segment * wf_ctx->segment_stride;
+    int count = 0;
+    (void)y0;
+    (void)y1;
+
+    for (int k = x0; k < x1; ++k)
+    {
+        const wavefront_ray_t *ray = &g_soft_wavefront.queue[k];
+        const wavefront_hit_t *hit = &g_soft_wavefront.hits[k];
+        wavefront_color_t *accum = &g_soft_wavefront.accum[ray->pixel];
+
+        /* 未命中时取该像素的背景色，反射光线同样如此 */
+        pixel_color_t color;
+        if (hit->id < 0)
+        {
+            shade_background(&color, ray->pixel % wf_ctx->w, ray->pixel / wf_ctx->w, options->checker_size);
+            accumulate_color(accum, &color, ray->weight);
+            continue;
+        }
+
+        /* 深度着色且不再反射时不需要交点和法线 */
+        if (options->shade_mode == RENDER_SHADE_DEPTH && !wf_ctx->spawn)
+        {
+            shade_depth(&color, hit->distance, options->depth_scale);
+            accumulate_color(accum, &color, ray->weight);
+            continue;
+        }
+
+        const sphere_t *sphere = &scene->spheres[hit->id];
+        point_t position;
+        float3_t normal;
+        ray_getpoint(&position, &ray->ray, hit->distance);
+        normal = position;
+        float3_subtract(&normal, (const float3_t*)&sphere->center);
+        float3_normalize(&normal, &normal);
+        if (options->shade_mode == RENDER_SHADE_DEPTH)
+        {
+            shade_depth(&color, hit->distance, options->depth_scale);
+        }
+        else
+        {
+            shade_normal(&color, &normal);
+        }
+
+        if (!wf_ctx->spawn)
+        {
+            accumulate_color(accum, &color, ray->weight);
+            continue;
+        }
+        accumulate_color(accum, &color, ray->weight * (1.0f - RENDER_REFLECTANCE));
+
+        /* 镜面反射，起点沿法线稍作偏移以免与自身相交 */
+        wavefront_ray_t *next = &out[count++];
+        float3_t offset = normal;
+        float3_multiply(&offset, 1e-3f);
+        next->ray.origin = position;
+        float3_add(&next->ray.origin, &offset);
+        next->ray.direction = normal;
+        float3_multiply(&next->ray.direction, -2.0f * float3_dot(&ray->ray.direction, &normal));
+        float3_add(&next->ray.direction, &ray->ray.direction);
+        next->weight = ray->weight * RENDER_REFLECTANCE;
+        next->pixel = ray->pixel;
+    }
+
+    g_soft_wavefront.segment_counts[segment] = count;
+}
+
+/* 把分段 [x0, x1) 拷贝到队列中前缀和给出的位置 */
+static
+void wavefront_compact_segments(void *ctx, int x0, int y0, int x1, int y1)
+{
+    wavefront_context_t *wf_ctx = (wavefront_context_t*)ctx;
+    (void)y0;
+    (void)y1;
+
+    for (int s = x0; s < x1; ++s)
+    {
+        int count = g_soft_wavefront.segment_counts[s];
+        if (count > 0)
+        {
+            memcpy(g_soft_wavefront.queue + g_soft_wavefront.segment_offsets[s],
+                g_soft_wavefront.staging + s * wf_ctx->segment_stride, sizeof(wavefront_ray_t) * count);
+        }
+    }
+}
+
+/* 各分段的光线个数已由上一阶段写入，求前缀和并拷贝，返回新队列的光线个数 */
+static
+int wavefront_compact(wavefront_context_t *wf_ctx)
+{
+    uint64_t span = profiler_begin();
+    int total = 0;
+    for (int s = 0; s < wf_ctx->segment_count; ++s)
+    {
+        g_soft_wavefront.segment_offsets[s] = total;
+        total += g_soft_wavefront.segment_counts[s];
+    }
+    thread_pool_render_tiles(wf_ctx->segment_count, 1, SOFT_WAVEFRONT_COMPACT_SEGMENTS, wavefront_compact_segments, wf_ctx);
+    profiler_end("soft wavefront compact", "soft", span);
+
+    return total;
+}
+
+/* 累加的颜色四舍五入写入画布 */
+static
+void wavefront_resolve_tile(void *ctx, int x0, int y0, int x1, int y1)
+{
+    wavefront_context_t *wf_ctx = (wavefront_context_t*)ctx;
+
+    for (int j = y0; j < y1; ++j)
+    {
+        pixel_color_t *pixel_color = (pixel_color_t*)(wf_ctx->pixel + j * wf_ctx->pitch) + x0;
+        const wavefront_color_t *accum = g_soft_wavefront.accum + j * wf_ctx->w + x0;
+        for (int i = x0; i < x1; ++i)
+        {
+            pixel_color->b = (uint8_t)float_min(accum->b + 0.5f, 255.0f);
+            pixel_color->g = (uint8_t)float_min(accum->g + 0.5f, 255.0f);
+            pixel_color->r = (uint8_t)float_min(accum->r + 0.5f, 255.0f);
+            pixel_color->a = 255;
+            pixel_color++;
+            accum++;
+        }
+    }
+}
+
+/* wavefront 渲染: 生成、求交、着色各自作为一个阶段由线程池并行执行，阶段之间以紧凑的队列连接，
+ * 每一轮着色发射的反射光线进入下一轮求交，直到队列为空或达到 bounces 次反射。不做预览和抗锯齿
+ */
+void render_project_depth_soft_wavefront(uint8_t* pixel, int w, int h, int pitch)
+{
+    if (g_soft_scene == NULL)
+    {
+        printf("render_project_depth_soft_wavefront, no scene was set\n");
+        return;
+    }
+
+    /* 反射光线使变化影响的范围无法由投影确定，总是整帧渲染 */
+    render_dirty_invalidate(&g_soft_dirty);
+
+    wavefront_context_t wf_ctx;
+    wf_ctx.pixel = pixel;
+    wf_ctx.pitch = pitch;
+    wf_ctx.w = w;
+    wf_ctx.h = h;
+    current_camera(&wf_ctx.camera, w, h);
+    wf_ctx.scene = g_soft_scene;
+    wf_ctx.options = g_soft_options;
+    wf_ctx.intersect_func = soft_simd_wavefront_intersect_func();
+
+    /* 只有着色阶段经过 staging。单线程时线程池以整个队列为一个区域调用，分段 0 须能容纳所有反射光线 */
+    int pixel_count = w * h;
+    int chunk_count = (pixel_count + SOFT_WAVEFRONT_CHUNK - 1) / SOFT_WAVEFRONT_CHUNK;
+    if (wavefront_reserve(pixel_count, chunk_count * SOFT_WAVEFRONT_CHUNK, chunk_count) != 0)
+    {
+        return;
+    }
+
+    render_wavefront_stats_t *stats = &g_soft_wavefront.stats;
+    memset(stats, 0, sizeof(*stats));
+    stats->pixel_count = pixel_count;
+
+    uint64_t ts1 = now_ms();
+    uint64_t span = profiler_begin();
+    thread_pool_render_tiles(w, h, SOFT_RENDER_TILE_SIZE, wavefront_raygen_tile, &wf_ctx);
+    profiler_end("soft wavefront raygen", "soft", span);
+    wf_ctx.ray_count = pixel_count;
+
+    wf_ctx.segment_stride = SOFT_WAVEFRONT_CHUNK;
+    for (int bounce = 0; bounce <= g_soft_wavefront.bounces && wf_ctx.ray_count > 0; ++bounce)
+    {
+        stats->ray_counts[bounce] = wf_ctx.ray_count;
+        stats->ray_count += wf_ctx.ray_count;
+        stats->pass_count++;
+
+        wf_ctx.spawn = bounce < g_soft_wavefront.bounces;
+        wf_ctx.segment_count = (wf_ctx.ray_count + SOFT_WAVEFRONT_CHUNK - 1) / SOFT_WAVEFRONT_CHUNK;
+        memset(g_soft_wavefront.segment_counts, 0, sizeof(int) * wf_ctx.segment_count);
+        span = profiler_begin();
+        thread_pool_render_tiles(wf_ctx.ray_count, 1, SOFT_WAVEFRONT_CHUNK, wavefront_intersect_chunk, &wf_ctx);
+        profiler_end("soft wavefront intersect", "soft", span);
+        span = profiler_begin();
+        thread_pool_render_tiles(wf_ctx.ray_count, 1, SOFT_WAVEFRONT_CHUNK, wavefront_shade_chunk, &wf_ctx);
+        profiler_end("soft wavefront shade", "soft", span);
+        wf_ctx.ray_count = wf_ctx.spawn ? wavefront_compact(&wf_ctx) : 0;
+    }
+
+    span = profiler_begin();
+    thread_pool_render_tiles(w, h, SOFT_RENDER_TILE_SIZE, wavefront_resolve_tile, &wf_ctx);
+    profiler_end("soft wavefront resolve", "soft", span);
+    uint64_t ts2 = now_ms();
+
+    if (g_render_verbose)
+    {
+        printf("render_project_depth_soft_wavefront, width: %d, height: %d, threads: %d, passes: %d, rays: %" PRIu64 ", time elapsed: %" PRIu64 "ms\n",
+            w, h, thread_pool_thread_count(), stats->pass_count, stats->ray_count, (ts2-ts1));
+    }
 
     return;
 }
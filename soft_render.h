@@ -0,0 +1,242 @@
+
+#ifndef SOFT_RENDER_H
+#define SOFT_RENDER_H
+
+/* soft_render.c 与 soft_render_simd.c 共用的内部定义 */
+
+#include "common.h"
+
+#include <stdint.h>
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+/* 基础的几何向量运算 */
+
+static inline
+void float3_add(float3_t *v, const float3_t* delta)
+{
+  v->x += delta->x;
+  v->y += delta->y;
+  v->z += delta->z;
+}
+
+static inline
+void float3_subtract(float3_t *v, const float3_t* delta)
+{
+  v->x -= delta->x;
+  v->y -= delta->y;
+  v->z -= delta->z;
+}
+
+static inline
+void float3_multiply(float3_t* v, float f)
+{
+    v->x *= f;
+    v->y *= f;
+    v->z *= f;
+}
+
+static inline
+void float3_div(float3_t* v, float f)
+{
+    v->x /= f;
+    v->y /= f;
+    v->z /= f;
+}
+
+/* 与 SSE 的 minps/maxps 语义一致: 任一操作数为 NaN 时返回第二个操作数 */
+static inline
+float float_min(float a, float b)
+{
+    return a < b ? a : b;
+}
+
+static inline
+float float_max(float a, float b)
+{
+    return a > b ? a : b;
+}
+
+static inline
+float float3_length(const float3_t *v)
+{
+    float f = sqrtf((v->x * v->x) + v->y * v->y + (v->z * v->z));
+    return f;
+}
+
+static inline
+float float3_sqrlength(const float3_t *v)
+{
+    float f = (v->x * v->x) + (v->y * v->y) + (v->z * v->z);
+    return f;
+}
+
+static inline
+void float3_normalize(float3_t *n, const float3_t *v)
+{
+    *n = *v;
+    float length = float3_length(v);
+    float3_div(n, length);
+}
+
+static inline
+float float3_dot(const float3_t* v1, const float3_t* v2)
+{
+    return (v1->x * v2->x + v1->y * v2->y + v1->z * v2->z);
+}
+
+static inline
+void float3_cross(float3_t *vo, const float3_t* v1, const float3_t* v2)
+{
+    float x = v1->y * v2->z - v1->z * v2->y;
+    float y = v1->z * v2->x - v1->x * v2->z;
+    float z = v1->x * v2->y - v1->y * v2->x;
+    vo->x = x;
+    vo->y = y;
+    vo->z = z;
+}
+
+/* 窗口坐标 (x, y) 处光线的单位方向，见 project_camera_t 的说明。
+ * 先加行的增量再加列的增量，packet 版本按行预先计算前一半，两者逐位相同
+ */
+static inline
+void project_camera_pixel_direction(direction_t *direction, const project_camera_t *camera, float x, float y)
+{
+    float3_t delta;
+    delta.x = (camera->pixel_origin.x + y * camera->pixel_dy.x) + x * camera->pixel_dx.x;
+    delta.y = (camera->pixel_origin.y + y * camera->pixel_dy.y) + x * camera->pixel_dx.y;
+    delta.z = (camera->pixel_origin.z + y * camera->pixel_dy.z) + x * camera->pixel_dx.z;
+    float3_normalize(direction, &delta);
+}
+
+/********************************************************************************/
+
+typedef struct intersect_result
+{
+    const void* geometry;
+    float distance;
+    point_t position;
+    float3_t normal;
+} intersect_result_t;
+
+/* BVH 节点包围盒中心到某点的距离平方，用于 packet 遍历时决定子节点的先后顺序 */
+static inline
+float bvh_node_sqr_distance(const bvh_node_t *node, const point_t *point)
+{
+    float3_t delta;
+    delta.x = (node->min_x + node->max_x) * 0.5f - point->x;
+    delta.y = (node->min_y + node->max_y) * 0.5f - point->y;
+    delta.z = (node->min_z + node->max_z) * 0.5f - point->z;
+    return float3_sqrlength(&delta);
+}
+
+/********************************************************************************/
+
+typedef struct pixel_color {uint8_t b; uint8_t g; uint8_t r; uint8_t a;} pixel_color_t;
+extern pixel_color_t color_black;
+extern pixel_color_t color_white;
+
+/* 以常量实参调用强制内联的函数，由编译器按实参特化出没有多余分支的版本 */
+#if defined(_MSC_VER)
+#define SOFT_FORCE_INLINE static __forceinline
+#else
+#define SOFT_FORCE_INLINE static inline __attribute__((always_inline))
+#endif
+
+/* 国际象棋棋盘背景色 */
+static inline
+void shade_background(pixel_color_t *pixel_color, int i, int j, int checker_size)
+{
+    int x_block_count = i / checker_size;
+    int y_block_count = j / checker_size;
+    if ((x_block_count - y_block_count) & 0x01)
+    {
+        *pixel_color = color_white;
+    }
+    else
+    {
+        *pixel_color = color_black;
+    }
+}
+
+static inline
+void shade_depth(pixel_color_t *pixel_color, float distance, float depth_scale)
+{
+    float value = (distance / depth_scale) * 255;
+    if (value > 255)
+    {
+        value = 255;
+    }
+    value = 255 - value;
+    pixel_color->r = value;
+    pixel_color->g = value;
+    pixel_color->b = value;
+}
+
+static inline
+void shade_normal(pixel_color_t *pixel_color, const float3_t *normal)
+{
+    pixel_color->r = (normal->x + 1) * 128;
+    pixel_color->g = (normal->y + 1) * 128;
+    pixel_color->b = (normal->z + 1) * 128;
+}
+
+/* 抗锯齿采样位置的抖动，与 render.cl 中的 aa_hash 一致，CPU 和 OpenCL 的采样位置相同 */
+static inline
+uint32_t aa_hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+/********************************************************************************/
+
+/* 渲染窗口坐标 [x0, x1) x [y0, y1) 范围内的像素，pixel 为整帧画布的起始地址，光线只与以 roots 中各节点为根的子树求交。
+ * ids 非 NULL 时写入每个像素命中的 sphere 下标，未命中为 -1，每行 w 个，供抗锯齿的边缘检测使用
+ */
+typedef void (*depth_region_func)
+(
+    uint8_t* pixel, int w, int h, int pitch,
+    int x0, int y0, int x1, int y1,
+    const project_camera_t *camera,
+    const scene_t *scene,
+    const int *roots, int root_count,
+    const render_options_t *options,
+    int *ids
+);
+
+/* wavefront 渲染队列中的一条光线，weight 为其颜色对像素的贡献比例，pixel 为所属像素的下标 */
+typedef struct wavefront_ray
+{
+    ray_t ray;
+    float weight;
+    int pixel;
+} wavefront_ray_t;
+
+/* 求交阶段的结果，着色阶段据此重新计算交点和法线，id 为 -1 表示未命中 */
+typedef struct wavefront_hit
+{
+    int id;
+    float distance;
+} wavefront_hit_t;
+
+/* wavefront 求交阶段: rays 中 count 条原点和方向各不相同的光线与整个场景求交，结果写入 hits */
+typedef void (*wavefront_intersect_func)(const scene_t *scene, const wavefront_ray_t *rays, int count, wavefront_hit_t *hits);
+
+/* 根据 CPUID 选择 packet 渲染所用的指令集，返回所选指令集的名称
+ * 环境变量 RAY_TRACE_SIMD 可指定 scalar/sse4.2/avx2/avx512，但不会超出 CPU 实际支持的范围
+ */
+extern const char* soft_simd_init(void);
+
+/* 所选指令集对应的、按 shade_mode 特化的 packet 渲染函数，指令集为 scalar 时返回 NULL */
+extern depth_region_func soft_simd_region_func(int shade_mode);
+
+/* 所选指令集对应的 wavefront 队列 packet 求交函数，指令集为 scalar 时返回 NULL */
+extern wavefront_intersect_func soft_simd_wavefront_intersect_func(void);
+
+#endif
@@ -0,0 +1,381 @@
+
+/* packet 渲染模板，由 soft_render_simd.c 针对不同指令集多次包含，不设 include guard
+ *
+ * 包含前需要定义:
+ *   PACKET_WIDTH        每个 packet 的光线数
+ *   PACKET_FUNC(name)   生成带指令集后缀的函数名
+ *   v_float_t/v_mask_t  向量和掩码类型
+ *   V_SET1/V_LANES/V_ADD/V_SUB/V_MUL/V_DIV/V_SQRT/V_MIN/V_MAX/V_BLEND/V_STORE
+ *   V_CMP_LT/V_CMP_GT/V_CMP_GE/V_MASK_OR/V_MASK_AND/V_MASK_ANDNOT/V_MASK_BITS
+ *
+ * 渲染函数按着色方式特化为 PACKET_FUNC(render_depth_region_depth) 和 PACKET_FUNC(render_depth_region_normal)
+ *
+ * 一个 packet 为同一行上连续的 PACKET_WIDTH 个像素，光线以 SoA 形式保存在向量寄存器中。
+ * 整个 packet 一起遍历 BVH，只要有一条光线与节点包围盒相交就进入该节点。
+ * 各项运算的顺序和 soft_render.c 的标量版本完全一致，且只使用 IEEE 754 精确舍入的
+ * 加减乘除和开方，因此在编译器不做 FMA 收缩时，交点距离与标量版本逐位相同。
+ */
+
+SOFT_FORCE_INLINE
+void PACKET_FUNC(render_depth_region)
+(
+    uint8_t* pixel, int w, int h, int pitch,
+    int x0, int y0, int x1, int y1,
+    const project_camera_t *camera,
+    const scene_t *scene,
+    const int *roots, int root_count,
+    const render_options_t *options,
+    int *ids,
+    const int shade_mode
+)
+{
+    /* 与标量版本的签名一致，逐行访问不需要画面高度 */
+    (void)h;
+    const int checker_size = options->checker_size;
+
+    const v_float_t zero = V_SET1(0.0f);
+    const v_float_t one = V_SET1(1.0f);
+    const v_float_t sign = V_SET1(-0.0f);
+    const v_float_t lanes = V_LANES();
+    const v_mask_t none = V_CMP_LT(zero, zero);
+
+    /* 像素光线方向的列增量，见 project_camera_pixel_direction() */
+    const v_float_t pixel_dx_x = V_SET1(camera->pixel_dx.x);
+    const v_float_t pixel_dx_y = V_SET1(camera->pixel_dx.y);
+    const v_float_t pixel_dx_z = V_SET1(camera->pixel_dx.z);
+
+    const bvh_node_t *nodes = scene->nodes;
+    const sphere_t *spheres = scene->spheres;
+    int stack[BVH_STACK_SIZE];
+
+    float distance[PACKET_WIDTH];
+    int nearest[PACKET_WIDTH];
+
+    uint8_t *line = pixel + y0 * pitch;
+    for (int j = y0; j < y1; ++j)
+    {
+        int block_y = j / checker_size;
+        /* 行的增量对整行相同 */
+        const v_float_t row_x = V_SET1(camera->pixel_origin.x + (float)j * camera->pixel_dy.x);
+        const v_float_t row_y = V_SET1(camera->pixel_origin.y + (float)j * camera->pixel_dy.y);
+        const v_float_t row_z = V_SET1(camera->pixel_origin.z + (float)j * camera->pixel_dy.z);
+
+        pixel_color_t *pixel_color = (pixel_color_t*)line + x0;
+        for (int i = x0; i < x1; i += PACKET_WIDTH)
+        {
+            /* 生成光线 */
+            v_float_t x = V_ADD(V_SET1((float)i), lanes);
+            v_float_t delta_x = V_ADD(row_x, V_MUL(x, pixel_dx_x));
+            v_float_t delta_y = V_ADD(row_y, V_MUL(x, pixel_dx_y));
+            v_float_t delta_z = V_ADD(row_z, V_MUL(x, pixel_dx_z));
+
+            v_float_t length = V_SQRT(V_ADD(V_ADD(V_MUL(delta_x, delta_x), V_MUL(delta_y, delta_y)), V_MUL(delta_z, delta_z)));
+            v_float_t dir_x = V_DIV(delta_x, length);
+            v_float_t dir_y = V_DIV(delta_y, length);
+            v_float_t dir_z = V_DIV(delta_z, length);
+            v_float_t inv_x = V_DIV(one, dir_x);
+            v_float_t inv_y = V_DIV(one, dir_y);
+            v_float_t inv_z = V_DIV(one, dir_z);
+
+            /* 所有光线的原点都是 eye, 与场景求交 */
+            v_float_t best = V_SET1(FLT_MAX);
+            v_mask_t hit = none;
+            /* 依次遍历 roots 中的各棵子树，共用各光线当前最近交点的距离 */
+            for (int r = 0; r < root_count; ++r)
+            {
+                int stack_size = 0;
+                stack[stack_size++] = roots[r];
+                while (stack_size > 0)
+                {
+                    const bvh_node_t *node = &nodes[stack[--stack_size]];
+
+                    v_float_t tx1 = V_MUL(V_SET1(node->min_x - camera->eye.x), inv_x);
+                    v_float_t tx2 = V_MUL(V_SET1(node->max_x - camera->eye.x), inv_x);
+                    v_float_t t_min = V_MIN(tx1, tx2);
+                    v_float_t t_max = V_MAX(tx1, tx2);
+                    v_float_t ty1 = V_MUL(V_SET1(node->min_y - camera->eye.y), inv_y);
+                    v_float_t ty2 = V_MUL(V_SET1(node->max_y - camera->eye.y), inv_y);
+                    t_min = V_MAX(t_min, V_MIN(ty1, ty2));
+                    t_max = V_MIN(t_max, V_MAX(ty1, ty2));
+                    v_float_t tz1 = V_MUL(V_SET1(node->min_z - camera->eye.z), inv_z);
+                    v_float_t tz2 = V_MUL(V_SET1(node->max_z - camera->eye.z), inv_z);
+                    t_min = V_MAX(t_min, V_MIN(tz1, tz2));
+                    t_max = V_MIN(t_max, V_MAX(tz1, tz2));
+
+                    v_mask_t enter = V_MASK_AND(V_MASK_AND(V_CMP_GE(t_max, t_min), V_CMP_GE(t_max, zero)), V_CMP_LT(t_min, best));
+                    if (V_MASK_BITS(enter) == 0)
+                    {
+                        continue;
+                    }
+
+                    if (node->count == 0)
+                    {
+                        /* 所有光线都从 eye 出发，包围盒中心离 eye 较近的子节点先出栈，尽早缩短 best */
+                        int left = node->left_first;
+                        if (bvh_node_sqr_distance(&nodes[left], &camera->eye) <= bvh_node_sqr_distance(&nodes[left + 1], &camera->eye))
+                        {
+                            stack[stack_size++] = left + 1;
+                            stack[stack_size++] = left;
+                        }
+                        else
+                        {
+                            stack[stack_size++] = left;
+                            stack[stack_size++] = left + 1;
+                        }
+                        continue;
+                    }
+
+                    for (int s = node->left_first; s < node->left_first + node->count; ++s)
+                    {
+                        const sphere_t *sphere = &spheres[s];
+                        /* origin - center 及其长度平方对整个 packet 相同 */
+                        float3_t oc = camera->eye;
+                        float3_subtract(&oc, &sphere->center);
+                        v_float_t a0 = V_SET1(float3_sqrlength(&oc) - sphere->sqr_radius);
+
+                        v_float_t DdotV = V_ADD(V_ADD(V_MUL(dir_x, V_SET1(oc.x)), V_MUL(dir_y, V_SET1(oc.y))), V_MUL(dir_z, V_SET1(oc.z)));
+                        v_float_t discr = V_SUB(V_MUL(DdotV, DdotV), a0);
+                        v_float_t dist = V_SUB(V_SUB(sign, DdotV), V_SQRT(discr));
+                        v_mask_t miss = V_CMP_GT(DdotV, zero);
+                        v_mask_t nearer = V_MASK_ANDNOT(miss, V_MASK_AND(V_CMP_GE(discr, zero), V_CMP_LT(dist, best)));
+
+                        best = V_BLEND(nearer, best, dist);
+                        hit = V_MASK_OR(hit, nearer);
+                        if (shade_mode == RENDER_SHADE_NORMAL || ids != NULL)
+                        {
+                            int nearer_bits = V_MASK_BITS(nearer);
+                            for (int k = 0; nearer_bits != 0 && k < PACKET_WIDTH; ++k)
+                            {
+                                if (nearer_bits & (1 << k))
+                                {
+                                    nearest[k] = s;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+            V_STORE(distance, best);
+
+            int hit_bits = V_MASK_BITS(hit);
+            int lane_count = x1 - i < PACKET_WIDTH ? x1 - i : PACKET_WIDTH;
+
+            /* 背景色: 格子不窄于 packet 时，一个 packet 内至多跨越一次格子边界 */
+            if (checker_size >= PACKET_WIDTH)
+            {
+                int block_x = i / checker_size;
+                int boundary = (block_x + 1) * checker_size - i;
+                pixel_color_t background[2];
+                background[0] = ((block_x - block_y) & 0x01) ? color_white : color_black;
+                background[1] = ((block_x - block_y) & 0x01) ? color_black : color_white;
+                for (int k = 0; k < lane_count; ++k)
+                {
+                    pixel_color[k] = background[k >= boundary];
+                }
+            }
+            else
+            {
+                for (int k = 0; k < lane_count; ++k)
+                {
+                    shade_background(&pixel_color[k], i + k, j, checker_size);
+                }
+            }
+
+            for (int k = 0; hit_bits != 0 && k < lane_count; ++k)
+            {
+                if (!(hit_bits & (1 << k)))
+                {
+                    continue;
+                }
+                if (shade_mode == RENDER_SHADE_DEPTH)
+                {
+                    shade_depth(&pixel_color[k], distance[k], options->depth_scale);
+                }
+                else
+                {
+                    /* 法线着色只对命中的像素按标量方式补算交点和法线 */
+                    direction_t direction;
+                    float3_t normal;
+                    project_camera_pixel_direction(&direction, camera, (float)(i + k), (float)j);
+                    point_t position = direction;
+                    float3_multiply(&position, distance[k]);
+                    float3_add(&position, &camera->eye);
+                    float3_subtract(&position, &spheres[nearest[k]].center);
+                    float3_normalize(&normal, &position);
+                    shade_normal(&pixel_color[k], &normal);
+                }
+            }
+            if (ids != NULL)
+            {
+                for (int k = 0; k < lane_count; ++k)
+                {
+                    ids[j * w + i + k] = (hit_bits & (1 << k)) ? nearest[k] : -1;
+                }
+            }
+            pixel_color += lane_count;
+        }
+        line += pitch;
+    }
+
+    return;
+}
+
+static
+void PACKET_FUNC(render_depth_region_depth)
+(
+    uint8_t* pixel, int w, int h, int pitch,
+    int x0, int y0, int x1, int y1,
+    const project_camera_t *camera,
+    const scene_t *scene,
+    const int *roots, int root_count,
+    const render_options_t *options,
+    int *ids
+)
+{
+    PACKET_FUNC(render_depth_region)(pixel, w, h, pitch, x0, y0, x1, y1, camera, scene, roots, root_count, options, ids, RENDER_SHADE_DEPTH);
+}
+
+static
+void PACKET_FUNC(render_depth_region_normal)
+(
+    uint8_t* pixel, int w, int h, int pitch,
+    int x0, int y0, int x1, int y1,
+    const project_camera_t *camera,
+    const scene_t *scene,
+    const int *roots, int root_count,
+    const render_options_t *options,
+    int *ids
+)
+{
+    PACKET_FUNC(render_depth_region)(pixel, w, h, pitch, x0, y0, x1, y1, camera, scene, roots, root_count, options, ids, RENDER_SHADE_NORMAL);
+}
+
+/* wavefront 队列的 packet 求交: 队列中相邻的 PACKET_WIDTH 条光线作为一个 packet 遍历整个 BVH。
+ * 主光线按 tile 逐行入队，反射光线保持所属像素的先后，相邻光线的方向相近，多数节点对整个 packet 同时相交或不相交。
+ * 与区域渲染不同，各光线的原点不同，包围盒和球面的测试都按光线逐条取原点，运算顺序与标量版本一致
+ */
+static
+void PACKET_FUNC(wavefront_intersect)(const scene_t *scene, const wavefront_ray_t *rays, int count, wavefront_hit_t *hits)
+{
+    const v_float_t zero = V_SET1(0.0f);
+    const v_float_t one = V_SET1(1.0f);
+    const v_float_t sign = V_SET1(-0.0f);
+    const v_mask_t none = V_CMP_LT(zero, zero);
+
+    const bvh_node_t *nodes = scene->nodes;
+    const sphere_t *spheres = scene->spheres;
+    int stack[BVH_STACK_SIZE];
+
+    float lane_values[6][PACKET_WIDTH];
+    float distance[PACKET_WIDTH];
+    int nearest[PACKET_WIDTH];
+
+    for (int base = 0; base < count; base += PACKET_WIDTH)
+    {
+        /* 不足一个 packet 时重复最后一条光线，多出的结果不写回 */
+        int lane_count = count - base < PACKET_WIDTH ? count - base : PACKET_WIDTH;
+        for (int k = 0; k < PACKET_WIDTH; ++k)
+        {
+            const ray_t *ray = &rays[base + (k < lane_count ? k : lane_count - 1)].ray;
+            lane_values[0][k] = ray->origin.x;
+            lane_values[1][k] = ray->origin.y;
+            lane_values[2][k] = ray->origin.z;
+            lane_values[3][k] = ray->direction.x;
+            lane_values[4][k] = ray->direction.y;
+            lane_values[5][k] = ray->direction.z;
+        }
+        v_float_t origin_x = V_LOAD(lane_values[0]);
+        v_float_t origin_y = V_LOAD(lane_values[1]);
+        v_float_t origin_z = V_LOAD(lane_values[2]);
+        v_float_t dir_x = V_LOAD(lane_values[3]);
+        v_float_t dir_y = V_LOAD(lane_values[4]);
+        v_float_t dir_z = V_LOAD(lane_values[5]);
+        v_float_t inv_x = V_DIV(one, dir_x);
+        v_float_t inv_y = V_DIV(one, dir_y);
+        v_float_t inv_z = V_DIV(one, dir_z);
+        /* 子节点的先后按第一条光线的原点决定 */
+        const point_t *first_origin = &rays[base].ray.origin;
+
+        v_float_t best = V_SET1(FLT_MAX);
+        v_mask_t hit = none;
+        int stack_size = 0;
+        if (scene->node_count > 0)
+        {
+            stack[stack_size++] = 0;
+        }
+        while (stack_size > 0)
+        {
+            const bvh_node_t *node = &nodes[stack[--stack_size]];
+
+            v_float_t tx1 = V_MUL(V_SUB(V_SET1(node->min_x), origin_x), inv_x);
+            v_float_t tx2 = V_MUL(V_SUB(V_SET1(node->max_x), origin_x), inv_x);
+            v_float_t t_min = V_MIN(tx1, tx2);
+            v_float_t t_max = V_MAX(tx1, tx2);
+            v_float_t ty1 = V_MUL(V_SUB(V_SET1(node->min_y), origin_y), inv_y);
+            v_float_t ty2 = V_MUL(V_SUB(V_SET1(node->max_y), origin_y), inv_y);
+            t_min = V_MAX(t_min, V_MIN(ty1, ty2));
+            t_max = V_MIN(t_max, V_MAX(ty1, ty2));
+            v_float_t tz1 = V_MUL(V_SUB(V_SET1(node->min_z), origin_z), inv_z);
+            v_float_t tz2 = V_MUL(V_SUB(V_SET1(node->max_z), origin_z), inv_z);
+            t_min = V_MAX(t_min, V_MIN(tz1, tz2));
+            t_max = V_MIN(t_max, V_MAX(tz1, tz2));
+
+            v_mask_t enter = V_MASK_AND(V_MASK_AND(V_CMP_GE(t_max, t_min), V_CMP_GE(t_max, zero)), V_CMP_LT(t_min, best));
+            if (V_MASK_BITS(enter) == 0)
+            {
+                continue;
+            }
+
+            if (node->count == 0)
+            {
+                int left = node->left_first;
+                if (bvh_node_sqr_distance(&nodes[left], first_origin) <= bvh_node_sqr_distance(&nodes[left + 1], first_origin))
+                {
+                    stack[stack_size++] = left + 1;
+                    stack[stack_size++] = left;
+                }
+                else
+                {
+                    stack[stack_size++] = left;
+                    stack[stack_size++] = left + 1;
+                }
+                continue;
+            }
+
+            for (int s = node->left_first; s < node->left_first + node->count; ++s)
+            {
+                const sphere_t *sphere = &spheres[s];
+                v_float_t oc_x = V_SUB(origin_x, V_SET1(sphere->center.x));
+                v_float_t oc_y = V_SUB(origin_y, V_SET1(sphere->center.y));
+                v_float_t oc_z = V_SUB(origin_z, V_SET1(sphere->center.z));
+                v_float_t a0 = V_SUB(V_ADD(V_ADD(V_MUL(oc_x, oc_x), V_MUL(oc_y, oc_y)), V_MUL(oc_z, oc_z)), V_SET1(sphere->sqr_radius));
+
+                v_float_t DdotV = V_ADD(V_ADD(V_MUL(dir_x, oc_x), V_MUL(dir_y, oc_y)), V_MUL(dir_z, oc_z));
+                v_float_t discr = V_SUB(V_MUL(DdotV, DdotV), a0);
+                v_float_t dist = V_SUB(V_SUB(sign, DdotV), V_SQRT(discr));
+                v_mask_t miss = V_CMP_GT(DdotV, zero);
+                v_mask_t nearer = V_MASK_ANDNOT(miss, V_MASK_AND(V_CMP_GE(discr, zero), V_CMP_LT(dist, best)));
+
+                best = V_BLEND(nearer, best, dist);
+                hit = V_MASK_OR(hit, nearer);
+                int nearer_bits = V_MASK_BITS(nearer);
+                for (int k = 0; nearer_bits != 0 && k < PACKET_WIDTH; ++k)
+                {
+                    if (nearer_bits & (1 << k))
+                    {
+                        nearest[k] = s;
+                    }
+                }
+            }
+        }
+        V_STORE(distance, best);
+
+        int hit_bits = V_MASK_BITS(hit);
+        for (int k = 0; k < lane_count; ++k)
+        {
+            wavefront_hit_t *out = &hits[base + k];
+            out->id = (hit_bits & (1 << k)) ? nearest[k] : -1;
+            out->distance = distance[k];
+        }
+    }
+}
@@ -0,0 +1,359 @@
+
+/* 各指令集版本与标量版本逐位一致的前提是不把乘加收缩为 FMA (AVX-512F 隐含 FMA)
+ * 需要在包含 soft_render.h 之前设置，内联进来的向量运算函数同样受约束
+ */
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#include "common.h"
+#include "soft_render.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/* MSVC 无需额外编译选项即可使用各指令集的 intrinsic
+ * gcc/clang 需要对相应代码段开启 target，运行时由 CPUID 保证只调用 CPU 支持的版本
+ */
+#if defined(__clang__)
+#define SIMD_TARGET_BEGIN(isa) _Pragma(isa)
+#define SIMD_TARGET_END() _Pragma("clang attribute pop")
+#define SIMD_TARGET_SSE42 "clang attribute push (__attribute__((target(\"sse4.2\"))), apply_to = function)"
+#define SIMD_TARGET_AVX2 "clang attribute push (__attribute__((target(\"avx2\"))), apply_to = function)"
+#define SIMD_TARGET_AVX512 "clang attribute push (__attribute__((target(\"avx512f\"))), apply_to = function)"
+#elif defined(__GNUC__)
+#define SIMD_TARGET_BEGIN(isa) _Pragma("GCC push_options") _Pragma(isa)
+#define SIMD_TARGET_END() _Pragma("GCC pop_options")
+#define SIMD_TARGET_SSE42 "GCC target(\"sse4.2\")"
+#define SIMD_TARGET_AVX2 "GCC target(\"avx2\")"
+#define SIMD_TARGET_AVX512 "GCC target(\"avx512f\")"
+#else
+#define SIMD_TARGET_BEGIN(isa)
+#define SIMD_TARGET_END()
+#endif
+
+/********************************************************************************/
+/* SSE4.2, 4 条光线 */
+
+SIMD_TARGET_BEGIN(SIMD_TARGET_SSE42)
+
+#define PACKET_WIDTH 4
+#define PACKET_FUNC(name) name##_sse42
+#define v_float_t __m128
+#define v_mask_t __m128
+#define V_SET1(f) _mm_set1_ps(f)
+#define V_LANES() _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f)
+#define V_ADD(a, b) _mm_add_ps((a), (b))
+#define V_SUB(a, b) _mm_sub_ps((a), (b))
+#define V_MUL(a, b) _mm_mul_ps((a), (b))
+#define V_DIV(a, b) _mm_div_ps((a), (b))
+#define V_SQRT(a) _mm_sqrt_ps(a)
+#define V_MIN(a, b) _mm_min_ps((a), (b))
+#define V_MAX(a, b) _mm_max_ps((a), (b))
+#define V_BLEND(m, a, b) _mm_blendv_ps((a), (b), (m))
+#define V_LOAD(p) _mm_loadu_ps(p)
+#define V_STORE(p, a) _mm_storeu_ps((p), (a))
+#define V_CMP_LT(a, b) _mm_cmplt_ps((a), (b))
+#define V_CMP_GT(a, b) _mm_cmpgt_ps((a), (b))
+#define V_CMP_GE(a, b) _mm_cmpge_ps((a), (b))
+#define V_MASK_OR(a, b) _mm_or_ps((a), (b))
+#define V_MASK_AND(a, b) _mm_and_ps((a), (b))
+#define V_MASK_ANDNOT(a, b) _mm_andnot_ps((a), (b))
+#define V_MASK_BITS(a) _mm_movemask_ps(a)
+
+#include "soft_render_packet.h"
+
+#undef PACKET_WIDTH
+#undef PACKET_FUNC
+#undef v_float_t
+#undef v_mask_t
+#undef V_SET1
+#undef V_LANES
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV
+#undef V_SQRT
+#undef V_MIN
+#undef V_MAX
+#undef V_BLEND
+#undef V_LOAD
+#undef V_STORE
+#undef V_CMP_LT
+#undef V_CMP_GT
+#undef V_CMP_GE
+#undef V_MASK_OR
+#undef V_MASK_AND
+#undef V_MASK_ANDNOT
+#undef V_MASK_BITS
+
+SIMD_TARGET_END()
+
+/********************************************************************************/
+/* AVX2, 8 条光线 */
+
+SIMD_TARGET_BEGIN(SIMD_TARGET_AVX2)
+
+#define PACKET_WIDTH 8
+#define PACKET_FUNC(name) name##_avx2
+#define v_float_t __m256
+#define v_mask_t __m256
+#define V_SET1(f) _mm256_set1_ps(f)
+#define V_LANES() _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f)
+#define V_ADD(a, b) _mm256_add_ps((a), (b))
+#define V_SUB(a, b) _mm256_sub_ps((a), (b))
+#define V_MUL(a, b) _mm256_mul_ps((a), (b))
+#define V_DIV(a, b) _mm256_div_ps((a), (b))
+#define V_SQRT(a) _mm256_sqrt_ps(a)
+#define V_MIN(a, b) _mm256_min_ps((a), (b))
+#define V_MAX(a, b) _mm256_max_ps((a), (b))
+#define V_BLEND(m, a, b) _mm256_blendv_ps((a), (b), (m))
+#define V_LOAD(p) _mm256_loadu_ps(p)
+#define V_STORE(p, a) _mm256_storeu_ps((p), (a))
+#define V_CMP_LT(a, b) _mm256_cmp_ps((a), (b), _CMP_LT_OQ)
+#define V_CMP_GT(a, b) _mm256_cmp_ps((a), (b), _CMP_GT_OQ)
+#define V_CMP_GE(a, b) _mm256_cmp_ps((a), (b), _CMP_GE_OQ)
+#define V_MASK_OR(a, b) _mm256_or_ps((a), (b))
+#define V_MASK_AND(a, b) _mm256_and_ps((a), (b))
+#define V_MASK_ANDNOT(a, b) _mm256_andnot_ps((a), (b))
+#define V_MASK_BITS(a) _mm256_movemask_ps(a)
+
+#include "soft_render_packet.h"
+
+#undef PACKET_WIDTH
+#undef PACKET_FUNC
+#undef v_float_t
+#undef v_mask_t
+#undef V_SET1
+#undef V_LANES
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV
+#undef V_SQRT
+#undef V_MIN
+#undef V_MAX
+#undef V_BLEND
+#undef V_LOAD
+#undef V_STORE
+#undef V_CMP_LT
+#undef V_CMP_GT
+#undef V_CMP_GE
+#undef V_MASK_OR
+#undef V_MASK_AND
+#undef V_MASK_ANDNOT
+#undef V_MASK_BITS
+
+SIMD_TARGET_END()
+
+/********************************************************************************/
+/* AVX-512, 16 条光线 */
+
+SIMD_TARGET_BEGIN(SIMD_TARGET_AVX512)
+
+#define PACKET_WIDTH 16
+#define PACKET_FUNC(name) name##_avx512
+#define v_float_t __m512
+#define v_mask_t __mmask16
+#define V_SET1(f) _mm512_set1_ps(f)
+#define V_LANES() _mm512_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, \
+    8.0f, 9.0f, 10.0f, 11.0f, 12.0f, 13.0f, 14.0f, 15.0f)
+#define V_ADD(a, b) _mm512_add_ps((a), (b))
+#define V_SUB(a, b) _mm512_sub_ps((a), (b))
+#define V_MUL(a, b) _mm512_mul_ps((a), (b))
+#define V_DIV(a, b) _mm512_div_ps((a), (b))
+#define V_SQRT(a) _mm512_sqrt_ps(a)
+#define V_MIN(a, b) _mm512_min_ps((a), (b))
+#define V_MAX(a, b) _mm512_max_ps((a), (b))
+#define V_BLEND(m, a, b) _mm512_mask_blend_ps((m), (a), (b))
+#define V_LOAD(p) _mm512_loadu_ps(p)
+#define V_STORE(p, a) _mm512_storeu_ps((p), (a))
+#define V_CMP_LT(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_LT_OQ)
+#define V_CMP_GT(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_GT_OQ)
+#define V_CMP_GE(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_GE_OQ)
+#define V_MASK_OR(a, b) ((__mmask16)((a) | (b)))
+#define V_MASK_AND(a, b) ((__mmask16)((a) & (b)))
+#define V_MASK_ANDNOT(a, b) ((__mmask16)(~(a) & (b)))
+#define V_MASK_BITS(a) ((int)(a))
+
+#include "soft_render_packet.h"
+
+#undef PACKET_WIDTH
+#undef PACKET_FUNC
+#undef v_float_t
+#undef v_mask_t
+#undef V_SET1
+#undef V_LANES
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV
+#undef V_SQRT
+#undef V_MIN
+#undef V_MAX
+#undef V_BLEND
+#undef V_LOAD
+#undef V_STORE
+#undef V_CMP_LT
+#undef V_CMP_GT
+#undef V_CMP_GE
+#undef V_MASK_OR
+#undef V_MASK_AND
+#undef V_MASK_ANDNOT
+#undef V_MASK_BITS
+
+SIMD_TARGET_END()
+
+/********************************************************************************/
+
+typedef enum simd_isa
+{
+    SIMD_ISA_SCALAR = 0,
+    SIMD_ISA_SSE42,
+    SIMD_ISA_AVX2,
+    SIMD_ISA_AVX512,
+} simd_isa_t;
+
+static const char* simd_isa_names[] = {"scalar", "sse4.2", "avx2", "avx512"};
+
+/* 按 [指令集][着色方式] 索引 */
+static const depth_region_func simd_isa_funcs[][2] =
+{
+    {NULL, NULL},
+    {render_depth_region_depth_sse42, render_depth_region_normal_sse42},
+    {render_depth_region_depth_avx2, render_depth_region_normal_avx2},
+    {render_depth_region_depth_avx512, render_depth_region_normal_avx512},
+};
+
+static const wavefront_intersect_func simd_isa_wavefront_funcs[] =
+{
+    NULL,
+    wavefront_intersect_sse42,
+    wavefront_intersect_avx2,
+    wavefront_intersect_avx512,
+};
+
+static simd_isa_t g_simd_isa = SIMD_ISA_SCALAR;
+
+static
+void cpuid(int leaf, int subleaf, unsigned regs[4])
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, leaf, subleaf);
+    regs[0] = info[0];
+    regs[1] = info[1];
+    regs[2] = info[2];
+    regs[3] = info[3];
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+/* 读取 XCR0，确认操作系统会保存 AVX/AVX-512 寄存器状态 */
+static
+uint64_t xgetbv0(void)
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+static
+simd_isa_t detect_simd_isa(void)
+{
+    unsigned regs[4];
+
+    cpuid(0, 0, regs);
+    unsigned max_leaf = regs[0];
+
+    cpuid(1, 0, regs);
+    int has_sse42 = (regs[2] >> 20) & 1;
+    int has_osxsave = (regs[2] >> 27) & 1;
+    if (!has_sse42)
+    {
+        return SIMD_ISA_SCALAR;
+    }
+    if (!has_osxsave || max_leaf < 7)
+    {
+        return SIMD_ISA_SSE42;
+    }
+
+    uint64_t xcr0 = xgetbv0();
+    /* XMM 和 YMM 状态 */
+    int os_avx = (xcr0 & 0x06) == 0x06;
+    /* opmask, ZMM0-15 高半部分, ZMM16-31 状态 */
+    int os_avx512 = os_avx && (xcr0 & 0xe0) == 0xe0;
+
+    cpuid(7, 0, regs);
+    int has_avx2 = (regs[1] >> 5) & 1;
+    int has_avx512f = (regs[1] >> 16) & 1;
+
+    if (has_avx512f && os_avx512)
+    {
+        return SIMD_ISA_AVX512;
+    }
+    if (has_avx2 && os_avx)
+    {
+        return SIMD_ISA_AVX2;
+    }
+
+    return SIMD_ISA_SSE42;
+}
+
+const char* soft_simd_init(void)
+{
+    simd_isa_t isa = detect_simd_isa();
+
+    const char *request = getenv("RAY_TRACE_SIMD");
+    if (request != NULL)
+    {
+        for (int i = SIMD_ISA_SCALAR; i <= SIMD_ISA_AVX512; ++i)
+        {
+            if (strcmp(request, simd_isa_names[i]) == 0)
+            {
+                if ((simd_isa_t)i <= isa)
+                {
+                    isa = (simd_isa_t)i;
+                }
+                else
+                {
+                    printf("soft_simd_init, %s is not supported by this CPU, use %s\n", request, simd_isa_names[isa]);
+                }
+                break;
+            }
+        }
+    }
+
+    g_simd_isa = isa;
+    printf("soft_simd_init, packet isa: %s\n", simd_isa_names[isa]);
+
+    return simd_isa_names[isa];
+}
+
+depth_region_func soft_simd_region_func(int shade_mode)
+{
+    return simd_isa_funcs[g_simd_isa][shade_mode == RENDER_SHADE_NORMAL];
+}
+
+wavefront_intersect_func soft_simd_wavefront_intersect_func(void)
+{
+    return simd_isa_wavefront_funcs[g_simd_isa];
+}
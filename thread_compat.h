@@ -0,0 +1,74 @@
+#ifndef THREAD_COMPAT_H
+#define THREAD_COMPAT_H
+
+/* 线程、互斥锁、条件变量和 long 原子操作在 Win32 与 pthread 下的统一写法，
+ * 各模块共用，线程的创建和等待随线程函数的签名留在各自的文件中
+ */
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+typedef HANDLE thread_handle_t;
+typedef CRITICAL_SECTION thread_mutex_t;
+typedef CONDITION_VARIABLE thread_cond_t;
+
+#define mutex_init(m) InitializeCriticalSection(m)
+#define mutex_destroy(m) DeleteCriticalSection(m)
+#define mutex_lock(m) EnterCriticalSection(m)
+#define mutex_unlock(m) LeaveCriticalSection(m)
+#define cond_init(c) InitializeConditionVariable(c)
+#define cond_destroy(c) ((void)(c))
+#define cond_wait(c, m) SleepConditionVariableCS((c), (m), INFINITE)
+#define cond_timed_wait_ms(c, m, ms) SleepConditionVariableCS((c), (m), (DWORD)(ms))
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+
+#define atomic_load_long(p) (*(volatile long*)(p))
+#define atomic_store_long(p, v) InterlockedExchange((volatile long*)(p), (v))
+#define atomic_exchange_long(p, v) InterlockedExchange((volatile long*)(p), (v))
+#define atomic_add_long(p, v) InterlockedExchangeAdd((volatile long*)(p), (v))
+#define atomic_cas_long(p, expect, desire) (InterlockedCompareExchange((volatile long*)(p), (desire), (expect)) == (expect))
+#define atomic_fence() MemoryBarrier()
+#else
+#include <pthread.h>
+#include <time.h>
+
+typedef pthread_t thread_handle_t;
+typedef pthread_mutex_t thread_mutex_t;
+typedef pthread_cond_t thread_cond_t;
+
+#define mutex_init(m) pthread_mutex_init((m), NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(m)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+#define cond_init(c) pthread_cond_init((c), NULL)
+#define cond_destroy(c) pthread_cond_destroy(c)
+#define cond_wait(c, m) pthread_cond_wait((c), (m))
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+
+#define atomic_load_long(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_store_long(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_exchange_long(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define atomic_add_long(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define atomic_cas_long(p, expect, desire) __extension__({ long e_ = (expect); \
+    __atomic_compare_exchange_n((p), &e_, (desire), 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED); })
+#define atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* 最多等待 ms 毫秒，超时与被唤醒不作区分，调用者重新检查条件 */
+static inline
+void cond_timed_wait_ms(thread_cond_t *cond, thread_mutex_t *mutex, int ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(cond, mutex, &deadline);
+}
+#endif
+
+#endif
@@ -0,0 +1,359 @@
+
+#include "thread_pool.h"
+#include "thread_compat.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/* 每个工作线程一个 Chase-Lev work-stealing deque
+ * 一帧内的 tile 在分发前一次性压入，运行期间只有出队操作：
+ * 所属线程从 bottom 端取 (LIFO)，其他线程从 top 端窃取 (FIFO)
+ */
+typedef struct tile_deque
+{
+    int *tiles;
+    int capacity;
+    volatile long top;
+    volatile long bottom;
+    /* 避免相邻 deque 的 top/bottom 落在同一 cache line */
+    char pad[64];
+} tile_deque_t;
+
+typedef struct tile_job
+{
+    int w;
+    int h;
+    int tile_size;
+    int tile_cols;
+    tile_render_func func;
+    void *ctx;
+} tile_job_t;
+
+struct thread_pool
+{
+    int thread_count;
+    thread_handle_t *threads;
+    tile_deque_t *deques;
+
+    thread_mutex_t mutex;
+    thread_cond_t start_cond;
+    thread_cond_t done_cond;
+    unsigned frame_id;
+    int running_workers;
+    int quit;
+
+    tile_job_t job;
+} g_thread_pool;
+
+static
+int deque_pop(tile_deque_t *deque, int *tile)
+{
+    long b = atomic_load_long(&deque->bottom) - 1;
+    atomic_store_long(&deque->bottom, b);
+    atomic_fence();
+    long t = atomic_load_long(&deque->top);
+
+    if (t > b)
+    {
+        /* deque 已空 */
+        atomic_store_long(&deque->bottom, t);
+        return 0;
+    }
+
+    *tile = deque->tiles[b];
+    if (t == b)
+    {
+        /* 最后一个 tile，和窃取者竞争 */
+        int won = atomic_cas_long(&deque->top, t, t + 1);
+        atomic_store_long(&deque->bottom, t + 1);
+        return won;
+    }
+
+    return 1;
+}
+
+static
+int deque_steal(tile_deque_t *deque, int *tile)
+{
+    for (;;)
+    {
+        long t = atomic_load_long(&deque->top);
+        atomic_fence();
+        long b = atomic_load_long(&deque->bottom);
+        if (t >= b)
+        {
+            return 0;
+        }
+
+        *tile = deque->tiles[t];
+        if (atomic_cas_long(&deque->top, t, t + 1))
+        {
+            return 1;
+        }
+    }
+}
+
+static
+void run_tile(const tile_job_t *job, int tile)
+{
+    int x0 = (tile % job->tile_cols) * job->tile_size;
+    int y0 = (tile / job->tile_cols) * job->tile_size;
+    int x1 = x0 + job->tile_size;
+    int y1 = y0 + job->tile_size;
+    if (x1 > job->w)
+    {
+        x1 = job->w;
+    }
+    if (y1 > job->h)
+    {
+        y1 = job->h;
+    }
+
+    job->func(job->ctx, x0, y0, x1, y1);
+}
+
+/* 先做完自己 deque 中的 tile，再依次向其他线程窃取，直到所有 deque 都为空 */
+static
+void work_frame(int self)
+{
+    const tile_job_t *job = &g_thread_pool.job;
+    int thread_count = g_thread_pool.thread_count;
+    int tile;
+
+    while (deque_pop(&g_thread_pool.deques[self], &tile))
+    {
+        run_tile(job, tile);
+    }
+
+    int found;
+    do
+    {
+        found = 0;
+        for (int i = 1; i < thread_count; ++i)
+        {
+            tile_deque_t *victim = &g_thread_pool.deques[(self + i) % thread_count];
+            if (deque_steal(victim, &tile))
+            {
+                run_tile(job, tile);
+                found = 1;
+                break;
+            }
+        }
+    } while (found);
+
+    return;
+}
+
+#ifdef _WIN32
+static
+DWORD WINAPI worker_routine(LPVOID param)
+#else
+static
+void* worker_routine(void *param)
+#endif
+{
+    int self = (int)(intptr_t)param;
+    unsigned seen_frame = 0;
+
+    mutex_lock(&g_thread_pool.mutex);
+    for (;;)
+    {
+        while (!g_thread_pool.quit && g_thread_pool.frame_id == seen_frame)
+        {
+            cond_wait(&g_thread_pool.start_cond, &g_thread_pool.mutex);
+        }
+        if (g_thread_pool.quit)
+        {
+            break;
+        }
+        seen_frame = g_thread_pool.frame_id;
+        mutex_unlock(&g_thread_pool.mutex);
+
+        work_frame(self);
+
+        mutex_lock(&g_thread_pool.mutex);
+        g_thread_pool.running_workers--;
+        if (g_thread_pool.running_workers == 0)
+        {
+            cond_broadcast(&g_thread_pool.done_cond);
+        }
+    }
+    mutex_unlock(&g_thread_pool.mutex);
+
+    return 0;
+}
+
+static
+int cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+int thread_pool_init(int thread_count)
+{
+    memset(&g_thread_pool, 0, sizeof(g_thread_pool));
+
+    if (thread_count <= 0)
+    {
+        thread_count = cpu_count();
+    }
+
+    g_thread_pool.thread_count = thread_count;
+    g_thread_pool.deques = (tile_deque_t*)calloc(thread_count, sizeof(tile_deque_t));
+    g_thread_pool.threads = (thread_handle_t*)calloc(thread_count, sizeof(thread_handle_t));
+    if (g_thread_pool.deques == NULL || g_thread_pool.threads == NULL)
+    {
+        free(g_thread_pool.deques);
+        free(g_thread_pool.threads);
+        memset(&g_thread_pool, 0, sizeof(g_thread_pool));
+        return -1;
+    }
+
+    mutex_init(&g_thread_pool.mutex);
+    cond_init(&g_thread_pool.start_cond);
+    cond_init(&g_thread_pool.done_cond);
+
+    /* 0 号线程为调用 thread_pool_render_tiles() 的线程本身 */
+    for (int i = 1; i < thread_count; ++i)
+    {
+    #ifdef _WIN32
+        g_thread_pool.threads[i] = CreateThread(NULL, 0, worker_routine, (LPVOID)(intptr_t)i, 0, NULL);
+        if (g_thread_pool.threads[i] == NULL)
+    #else
+        if (pthread_create(&g_thread_pool.threads[i], NULL, worker_routine, (void*)(intptr_t)i) != 0)
+    #endif
+        {
+            printf("thread_pool_init, failed to create worker thread %d\n", i);
+            g_thread_pool.thread_count = i;
+            thread_pool_uninit();
+            return -1;
+        }
+    }
+
+    printf("thread_pool_init, worker threads: %d\n", thread_count);
+
+    return 0;
+}
+
+void thread_pool_uninit(void)
+{
+    if (g_thread_pool.deques == NULL)
+    {
+        return;
+    }
+
+    mutex_lock(&g_thread_pool.mutex);
+    g_thread_pool.quit = 1;
+    cond_broadcast(&g_thread_pool.start_cond);
+    mutex_unlock(&g_thread_pool.mutex);
+
+    for (int i = 1; i < g_thread_pool.thread_count; ++i)
+    {
+    #ifdef _WIN32
+        WaitForSingleObject(g_thread_pool.threads[i], INFINITE);
+        CloseHandle(g_thread_pool.threads[i]);
+    #else
+        pthread_join(g_thread_pool.threads[i], NULL);
+    #endif
+    }
+
+    cond_destroy(&g_thread_pool.done_cond);
+    cond_destroy(&g_thread_pool.start_cond);
+    mutex_destroy(&g_thread_pool.mutex);
+
+    for (int i = 0; i < g_thread_pool.thread_count; ++i)
+    {
+        free(g_thread_pool.deques[i].tiles);
+    }
+    free(g_thread_pool.deques);
+    free(g_thread_pool.threads);
+    memset(&g_thread_pool, 0, sizeof(g_thread_pool));
+
+    return;
+}
+
+int thread_pool_thread_count(void)
+{
+    return g_thread_pool.thread_count > 0 ? g_thread_pool.thread_count : 1;
+}
+
+void thread_pool_render_tiles(int w, int h, int tile_size, tile_render_func func, void *ctx)
+{
+    if (g_thread_pool.thread_count <= 1)
+    {
+        /* 未初始化线程池或只有单线程时，直接在当前线程渲染整帧 */
+        func(ctx, 0, 0, w, h);
+        return;
+    }
+
+    int thread_count = g_thread_pool.thread_count;
+    int tile_cols = (w + tile_size - 1) / tile_size;
+    int tile_rows = (h + tile_size - 1) / tile_size;
+    int tile_count = tile_cols * tile_rows;
+
+    /* 按行优先顺序将连续的 tile 分给同一线程，保证初始分配的访存局部性 */
+    for (int i = 0; i < thread_count; ++i)
+    {
+        tile_deque_t *deque = &g_thread_pool.deques[i];
+        int first = (int)((int64_t)tile_count * i / thread_count);
+        int last = (int)((int64_t)tile_count * (i + 1) / thread_count);
+        int count = last - first;
+
+        if (deque->capacity < count)
+        {
+            int *tiles = (int*)realloc(deque->tiles, sizeof(int) * count);
+            if (tiles == NULL)
+            {
+                printf("thread_pool_render_tiles, out of memory\n");
+                func(ctx, 0, 0, w, h);
+                return;
+            }
+            deque->tiles = tiles;
+            deque->capacity = count;
+        }
+
+        /* 所属线程从尾部取，因此倒序压入，使自身按行优先顺序处理 */
+        for (int j = 0; j < count; ++j)
+        {
+            deque->tiles[j] = last - 1 - j;
+        }
+        deque->top = 0;
+        deque->bottom = count;
+    }
+
+    mutex_lock(&g_thread_pool.mutex);
+    g_thread_pool.job.w = w;
+    g_thread_pool.job.h = h;
+    g_thread_pool.job.tile_size = tile_size;
+    g_thread_pool.job.tile_cols = tile_cols;
+    g_thread_pool.job.func = func;
+    g_thread_pool.job.ctx = ctx;
+    g_thread_pool.running_workers = thread_count - 1;
+    g_thread_pool.frame_id++;
+    cond_broadcast(&g_thread_pool.start_cond);
+    mutex_unlock(&g_thread_pool.mutex);
+
+    work_frame(0);
+
+    mutex_lock(&g_thread_pool.mutex);
+    while (g_thread_pool.running_workers > 0)
+    {
+        cond_wait(&g_thread_pool.done_cond, &g_thread_pool.mutex);
+    }
+    mutex_unlock(&g_thread_pool.mutex);
+
+    return;
+}
@@ -0,0 +1,20 @@
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+/* 渲染一个 tile 的回调, 负责窗口坐标 [x0, x1) x [y0, y1) 范围内的像素 */
+typedef void (*tile_render_func)(void *ctx, int x0, int y0, int x1, int y1);
+
+/* thread_count <= 0 时使用全部 CPU 核心，调用线程本身也算作其中一个工作线程 */
+extern int thread_pool_init(int thread_count);
+
+extern void thread_pool_uninit(void);
+
+extern int thread_pool_thread_count(void);
+
+/* 将 w x h 的画面切分为 tile_size x tile_size 的 tile，分发到各工作线程的 deque 中，
+ * 各线程先处理自己的 tile，做完后从其他线程的 deque 中窃取，全部 tile 完成后才返回
+ */
+extern void thread_pool_render_tiles(int w, int h, int tile_size, tile_render_func func, void *ctx);
+
+#endif
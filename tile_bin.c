@@ -0,0 +1,182 @@
+#include "tile_bin.h"
+#include "dirty_region.h"
+#include "soft_render.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* 按画面和场景的大小保留各缓冲区，内容不保留 */
+static
+int reserve_buffers(tile_bin_t *bin, int tile_total, int node_count)
+{
+    if (bin->offsets_capacity < tile_total + 1)
+    {
+        free(bin->offsets);
+        free(bin->cursor);
+        bin->offsets = (int*)malloc(sizeof(int) * (tile_total + 1));
+        bin->cursor = (int*)malloc(sizeof(int) * tile_total);
+        if (bin->offsets == NULL || bin->cursor == NULL)
+        {
+            printf("tile_bin_build, alloc failed, tiles: %d\n", tile_total);
+            free(bin->offsets);
+            free(bin->cursor);
+            bin->offsets = NULL;
+            bin->cursor = NULL;
+            bin->offsets_capacity = 0;
+            return -1;
+        }
+        bin->offsets_capacity = tile_total + 1;
+    }
+
+    /* 每个节点至多加入一次 */
+    if (bin->item_capacity < node_count)
+    {
+        free(bin->items);
+        bin->items = (tile_bin_item_t*)malloc(sizeof(tile_bin_item_t) * node_count);
+        if (bin->items == NULL)
+        {
+            printf("tile_bin_build, alloc failed, nodes: %d\n", node_count);
+            bin->item_capacity = 0;
+            return -1;
+        }
+        bin->item_capacity = node_count;
+    }
+
+    return 0;
+}
+
+/* 自根节点向下选出加入列表的节点，返回个数 */
+static
+int select_items(tile_bin_t *bin, const scene_t *scene, const project_camera_t *camera, int w, int h)
+{
+    const bvh_node_t *nodes = scene->nodes;
+    int item_count = 0;
+    int stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    if (scene->node_count > 0)
+    {
+        stack[stack_size++] = 0;
+    }
+
+    while (stack_size > 0)
+    {
+        int idx = stack[--stack_size];
+        const bvh_node_t *node = &nodes[idx];
+
+        float3_t box_min = {node->min_x, node->min_y, node->min_z};
+        float3_t box_max = {node->max_x, node->max_y, node->max_z};
+        render_dirty_rect_t rect;
+        if (!render_box_window_rect(&rect, &box_min, &box_max, camera, w, h))
+        {
+            continue;
+        }
+        int tx0 = rect.x0 / TILE_BIN_SIZE;
+        int ty0 = rect.y0 / TILE_BIN_SIZE;
+        int tx1 = (rect.x1 + TILE_BIN_SIZE - 1) / TILE_BIN_SIZE;
+        int ty1 = (rect.y1 + TILE_BIN_SIZE - 1) / TILE_BIN_SIZE;
+
+        if (node->count == 0 && (tx1 - tx0) * (ty1 - ty0) > TILE_BIN_SPLIT_TILES)
+        {
+            /* 近的子节点后入栈、先出栈，在列表中排在前面 */
+            int left = node->left_first;
+            int left_near = bvh_node_sqr_distance(&nodes[left], &camera->eye) <= bvh_node_sqr_distance(&nodes[left + 1], &camera->eye);
+            stack[stack_size++] = left_near ? left + 1 : left;
+            stack[stack_size++] = left_near ? left : left + 1;
+            continue;
+        }
+
+        tile_bin_item_t *item = &bin->items[item_count++];
+        item->node = idx;
+        item->tx0 = tx0;
+        item->ty0 = ty0;
+        item->tx1 = tx1;
+        item->ty1 = ty1;
+    }
+
+    return item_count;
+}
+
+int tile_bin_build(tile_bin_t *bin, const scene_t *scene, const project_camera_t *camera, int w, int h)
+{
+    bin->tiles_x = (w + TILE_BIN_SIZE - 1) / TILE_BIN_SIZE;
+    bin->tiles_y = (h + TILE_BIN_SIZE - 1) / TILE_BIN_SIZE;
+    bin->node_count = 0;
+    int tile_total = bin->tiles_x * bin->tiles_y;
+    if (reserve_buffers(bin, tile_total, scene->node_count) != 0)
+    {
+        return -1;
+    }
+
+    int item_count = select_items(bin, scene, camera, w, h);
+
+    /* 计数 */
+    int *offsets = bin->offsets;
+    memset(offsets, 0, sizeof(int) * (tile_total + 1));
+    for (int i = 0; i < item_count; ++i)
+    {
+        const tile_bin_item_t *item = &bin->items[i];
+        for (int ty = item->ty0; ty < item->ty1; ++ty)
+        {
+            for (int tx = item->tx0; tx < item->tx1; ++tx)
+            {
+                offsets[ty * bin->tiles_x + tx]++;
+            }
+        }
+    }
+
+    /* 前缀和，offsets[t] 改为 tile t 的列表的起始位置 */
+    int total = 0;
+    for (int t = 0; t < tile_total; ++t)
+    {
+        int count = offsets[t];
+        offsets[t] = total;
+        total += count;
+    }
+    offsets[tile_total] = total;
+
+    if (bin->nodes_capacity < total)
+    {
+        int capacity = bin->nodes_capacity > 0 ? bin->nodes_capacity : 1024;
+        while (capacity < total)
+        {
+            capacity *= 2;
+        }
+        free(bin->nodes);
+        bin->nodes = (int*)malloc(sizeof(int) * capacity);
+        if (bin->nodes == NULL)
+        {
+            printf("tile_bin_build, alloc failed, entries: %d\n", capacity);
+            bin->nodes_capacity = 0;
+            return -1;
+        }
+        bin->nodes_capacity = capacity;
+    }
+
+    /* 填充，按选出的顺序写入，各 tile 的列表保持子树的先后 */
+    memcpy(bin->cursor, offsets, sizeof(int) * tile_total);
+    for (int i = 0; i < item_count; ++i)
+    {
+        const tile_bin_item_t *item = &bin->items[i];
+        for (int ty = item->ty0; ty < item->ty1; ++ty)
+        {
+            for (int tx = item->tx0; tx < item->tx1; ++tx)
+            {
+                bin->nodes[bin->cursor[ty * bin->tiles_x + tx]++] = item->node;
+            }
+        }
+    }
+    bin->node_count = total;
+
+    return 0;
+}
+
+void tile_bin_release(tile_bin_t *bin)
+{
+    free(bin->offsets);
+    free(bin->nodes);
+    free(bin->items);
+    free(bin->cursor);
+    memset(bin, 0, sizeof(*bin));
+}
@@ -0,0 +1,68 @@
+#ifndef TILE_BIN_H
+#define TILE_BIN_H
+
+#include "common.h"
+#include "render.h"
+
+/* 屏幕空间分箱: 渲染前把 BVH 节点包围盒投影到画面上，为每个 tile 建立可能与其光线相交的节点列表，
+ * 各 tile 的光线只从列表中的节点开始遍历，列表为空的 tile 只填充背景。
+ *
+ * 自根节点向下，投影覆盖的 tile 不超过 TILE_BIN_SPLIT_TILES 个的节点或叶节点加入其覆盖的每个 tile，
+ * 更大的内部节点继续展开子节点，不在画面上的节点整棵子树丢弃。列表中的节点按子树的先后顺序排列，
+ * 子节点的先后与 packet 遍历相同，包围盒中心离 eye 较近的在前。
+ *
+ * 各 tile 的列表按 tile 下标依次连续存放: tile t 的列表为 nodes[offsets[t], offsets[t + 1])，
+ * 由计数、前缀和、填充三步得出。render.cl 中的 tile_bin_* kernel 在设备上按同样的规则建立相同布局的列表
+ */
+
+/* 与增量渲染和 soft render 的 tile 一致，render.cl 中的 TILE_BIN_SIZE 须与此相同 */
+#define TILE_BIN_SIZE RENDER_DIRTY_TILE_SIZE
+/* 覆盖更多 tile 的内部节点展开为子节点，render.cl 中的定义须与此相同。
+ * 取值过小时稠密场景中每个 tile 的列表很长，每条光线都要逐个测试列表中节点的包围盒; 过大则剔除的效果变差
+ */
+#define TILE_BIN_SPLIT_TILES 16
+
+/* 加入列表的节点及其覆盖的 tile 范围 [tx0, tx1) x [ty0, ty1) */
+typedef struct tile_bin_item
+{
+    int node;
+    int tx0;
+    int ty0;
+    int tx1;
+    int ty1;
+} tile_bin_item_t;
+
+typedef struct tile_bin
+{
+    int tiles_x;
+    int tiles_y;
+    /* tiles_x * tiles_y + 1 个 */
+    int *offsets;
+    int *nodes;
+    int node_count;
+
+    int offsets_capacity;
+    int nodes_capacity;
+    /* 建立过程中的临时数据: 加入列表的节点，以及填充时各 tile 的写入位置 */
+    tile_bin_item_t *items;
+    int item_capacity;
+    int *cursor;
+} tile_bin_t;
+
+/* 按摄像机和 w x h 的画面为 scene 建立各 tile 的节点列表，摄像机须已设置画面尺寸。
+ * 缓冲区在多次调用之间保留，内存不足时返回 -1，此时 bin 中没有可用的列表
+ */
+extern int tile_bin_build(tile_bin_t *bin, const scene_t *scene, const project_camera_t *camera, int w, int h);
+
+extern void tile_bin_release(tile_bin_t *bin);
+
+/* tile (tx, ty) 的节点列表及其长度 */
+static inline
+const int* tile_bin_list(const tile_bin_t *bin, int tx, int ty, int *count)
+{
+    int tile = ty * bin->tiles_x + tx;
+    *count = bin->offsets[tile + 1] - bin->offsets[tile];
+    return bin->nodes + bin->offsets[tile];
+}
+
+#endif